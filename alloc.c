@@ -0,0 +1,192 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Memory allocators. Each connection has a bump arena which is freed
+ * in one go when the session ends. Memory which outlives the session,
+ * like messages and their data, is taken from power of two sized
+ * pools, so that the steady state does not call malloc() at all.
+ */
+
+#include "asteriskmail.h"
+
+struct am_arena_chunk {
+	struct am_arena_chunk *next;
+	size_t	size;
+	uint8_t	data[];
+};
+
+struct am_pool_entry {
+	struct am_pool_entry *next;
+};
+
+struct am_pool {
+	struct am_pool_entry *head;
+	int	count;
+};
+
+static struct am_pool am_pool[AM_POOL_CLASSES];
+static pthread_mutex_t am_pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+#define	AM_ARENA_ALIGN(n) (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+void
+am_arena_init(struct am_arena *pa)
+{
+	pa->chunk = NULL;
+	pa->offset = 0;
+}
+
+void *
+am_arena_alloc(struct am_arena *pa, size_t size)
+{
+	struct am_arena_chunk *pc;
+	size_t max;
+	void *ptr;
+
+	size = AM_ARENA_ALIGN(size);
+
+	/* try the built-in buffer first */
+	if (pa->chunk == NULL) {
+		if (pa->offset + size <= sizeof(pa->buffer)) {
+			ptr = pa->buffer + pa->offset;
+			pa->offset += size;
+			return (ptr);
+		}
+	} else if (pa->offset + size <= pa->chunk->size) {
+		ptr = pa->chunk->data + pa->offset;
+		pa->offset += size;
+		return (ptr);
+	}
+
+	max = (pa->chunk == NULL) ? sizeof(pa->buffer) : pa->chunk->size;
+	max *= 2;
+	while (max < size)
+		max *= 2;
+
+	pc = malloc(sizeof(*pc) + max);
+	if (pc == NULL)
+		return (NULL);
+	pc->next = pa->chunk;
+	pc->size = max;
+	pa->chunk = pc;
+	pa->offset = size;
+	return (pc->data);
+}
+
+char *
+am_arena_strdup(struct am_arena *pa, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *ptr;
+
+	ptr = am_arena_alloc(pa, len);
+	if (ptr != NULL)
+		memcpy(ptr, str, len);
+	return (ptr);
+}
+
+void
+am_arena_free(struct am_arena *pa)
+{
+	struct am_arena_chunk *pc;
+
+	while ((pc = pa->chunk) != NULL) {
+		pa->chunk = pc->next;
+		free(pc);
+	}
+	pa->offset = 0;
+}
+
+static int
+am_pool_class(size_t size)
+{
+	int x;
+
+	if (size <= AM_POOL_MIN)
+		return (0);
+	x = 64 - __builtin_clzll(size - 1) - AM_POOL_MIN_LOG2;
+	return (x < AM_POOL_CLASSES ? x : -1);
+}
+
+/* returns the number of bytes actually allocated for a given size */
+size_t
+am_pool_size(size_t size)
+{
+	int x = am_pool_class(size);
+
+	if (x < 0)
+		return (size);
+	return ((size_t)AM_POOL_MIN << x);
+}
+
+void *
+am_pool_alloc(size_t size)
+{
+	struct am_pool_entry *pe;
+	int x = am_pool_class(size);
+
+	if (x < 0)
+		return (malloc(size));
+
+	pthread_mutex_lock(&am_pool_mtx);
+	pe = am_pool[x].head;
+	if (pe != NULL) {
+		am_pool[x].head = pe->next;
+		am_pool[x].count--;
+	}
+	pthread_mutex_unlock(&am_pool_mtx);
+
+	if (pe == NULL)
+		return (malloc((size_t)AM_POOL_MIN << x));
+	return (pe);
+}
+
+void
+am_pool_free(void *ptr, size_t size)
+{
+	struct am_pool_entry *pe = ptr;
+	int x;
+
+	if (ptr == NULL)
+		return;
+	x = am_pool_class(size);
+	if (x < 0) {
+		free(ptr);
+		return;
+	}
+
+	/* keep a limited amount of free memory around */
+	pthread_mutex_lock(&am_pool_mtx);
+	if (am_pool[x].count < AM_POOL_FREE_MAX) {
+		pe->next = am_pool[x].head;
+		am_pool[x].head = pe;
+		am_pool[x].count++;
+		pe = NULL;
+	}
+	pthread_mutex_unlock(&am_pool_mtx);
+
+	free(pe);
+}
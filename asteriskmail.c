@@ -23,16 +23,50 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/event.h>
+
+#include <strings.h>
+
 #include "asteriskmail.h"
 
+/*
+ * The message index is shared by all snapshots having the same index.
+ * Messages are appended in place, beyond the count of any published
+ * snapshot. Removing messages creates a new index.
+ */
+struct am_index {
+	struct am_retire retire;
+	int	max;
+	struct am_message *msg[];
+};
+
+/* the next view of one mailbox, prepared before the store is published */
+struct am_mailbox_update {
+	struct am_mailbox *mbox;
+	struct am_index *index;
+	struct am_snapshot *snap;
+};
+
+static __thread char linebuffer[ASTERISKMAIL_LINE_MAX];
+static struct am_snapshot am_store_empty;
+static _Atomic(struct am_snapshot *) am_store = &am_store_empty;
+static struct am_index *am_store_index;
+static uint64_t am_store_generation;
+static uint64_t am_store_uid;
+static pthread_mutex_t am_store_mtx = PTHREAD_MUTEX_INITIALIZER;
+#ifndef ASTERISKMAIL_NO_MAIN
 static struct pidfh *local_pid;
-static char linebuffer[ASTERISKMAIL_LINE_MAX];
-static TAILQ_HEAD(, am_message) head = TAILQ_HEAD_INITIALIZER(head);
 static int do_fork;
-static struct pollfd fds[ASTERISKMAIL_SOCK_MAX];
+static const char *pid_file = "/var/run/asteriskmail";
+static struct pollfd fds[ASTERISKMAIL_SOCK_MAX + 1];
+static int am_backend = AM_BACKEND_POLL;
+#endif
 char	hostname[128];
 const char *am_username = "asteriskmail";
 const char *am_password;
+uint64_t am_store_max_bytes;
+int am_store_max_count;
+int am_evict_policy = AM_EVICT_NONE;
 
 extern char *
 strafter(char *big, const char *small)
@@ -57,26 +91,80 @@ char   *
 handle_read_line(FILE *io)
 {
 	char buffer[2];
+	char *retval = NULL;
 	int size = 0;
+	AM_TRACE_BEGIN(start);
+
+	am_timer_command(0);
 
 	if (fread(buffer, 1, 2, io) != 2)
-		return (NULL);
+		goto done;
 
 	while (1) {
 		if (buffer[0] == '\r' && buffer[1] == '\n')
 			break;
 		if (size == ASTERISKMAIL_LINE_MAX - 1)
-			return (NULL);
+			goto done;
 		linebuffer[size++] = buffer[0];
 		buffer[0] = buffer[1];
 		if (fread(buffer + 1, 1, 1, io) != 1)
-			return (NULL);
+			goto done;
 	}
 	linebuffer[size++] = 0;
 #if 0
 	printf("GOT line: %s\n", linebuffer);
 #endif
-	return (linebuffer);
+	retval = linebuffer;
+	am_timer_command(1);
+done:
+	AM_TRACE_END(AM_TRACE_READ_LINE, start);
+	return (retval);
+}
+
+int
+handle_flush(FILE *io)
+{
+	int retval;
+	AM_TRACE_BEGIN(start);
+
+	/* a failed write is not retried, so the session must end */
+	retval = (fflush(io) != 0 || ferror(io));
+	AM_TRACE_END(AM_TRACE_WRITE, start);
+	return (retval);
+}
+
+FILE *
+handle_fdopen(int fd, int proto, struct am_arena *pa)
+{
+	FILE *io;
+	void *buf;
+
+	am_timer_start(fd, proto);
+
+	if (am_capture_enabled() || am_tls_enabled())
+		io = am_conn_fdopen(fd, proto);
+	else
+		io = fdopen(fd, "r+");
+	if (io == NULL)
+		return (NULL);
+
+	/* let stdio use the connection arena for buffering */
+	buf = am_arena_alloc(pa, ASTERISKMAIL_BUF_MAX);
+	if (buf != NULL)
+		setvbuf(io, buf, _IOFBF, ASTERISKMAIL_BUF_MAX);
+	return (io);
+}
+
+void
+handle_close(FILE *io, int fd)
+{
+	/* the timer must not see a closed, or reused, descriptor */
+	am_timer_stop();
+
+	if (io != NULL)
+		fclose(io);
+	else
+		close(fd);
 }
 
 int
@@ -85,46 +173,68 @@ handle_compare(const char *line, const char *cmd)
 	return (strncmp(line, cmd, strlen(cmd)));
 }
 
-int
-handle_foreach_message(struct am_message **ppam)
+/*
+ * Pin and return the current view of the message store. The view and
+ * the messages in it stay valid until handle_snapshot_leave() is
+ * called, even if they are removed from the store meanwhile. Only one
+ * snapshot per thread can be held at a time.
+ */
+const struct am_snapshot *
+handle_snapshot_enter(void)
 {
-	struct am_message *ptr = *ppam;
+	am_epoch_enter();
+	return (atomic_load(&am_store));
+}
 
-	if (ptr == NULL)
-		ptr = TAILQ_FIRST(&head);
-	else
-		ptr = TAILQ_NEXT(ptr, entry);
+void
+handle_snapshot_leave(void)
+{
+	am_cold_leave();
+	am_epoch_leave();
+}
 
-	*ppam = ptr;
+/*
+ * Pin and return the current view of one mailbox. It is left using
+ * handle_snapshot_leave(), and the same rules apply.
+ */
+const struct am_snapshot *
+handle_mailbox_enter(const struct am_mailbox *mbox)
+{
+	const struct am_snapshot *ps;
 
-	return (ptr != NULL);
+	am_epoch_enter();
+	ps = atomic_load(&mbox->store);
+	return (ps != NULL ? ps : &am_store_empty);
 }
 
 void
 handle_import(struct am_message *pam)
 {
+	char *data = pam->data;
 	char *hdr;
 	char *gsm;
 	char *b64;
 	char ch;
 	int x;
 	int y;
+	uint64_t start = am_metrics_now();
+	AM_TRACE_BEGIN(trace);
 
-	hdr = strstr(pam->data, "\r\n\r\n");
+	hdr = strstr(data, "\r\n\r\n");
 	if (hdr == NULL)
-		return;
+		goto done;
 
-	gsm = strafter(pam->data, "\r\nContent-Type: text/html; charset=gsm-7\r\n");
+	gsm = strafter(data, "\r\nContent-Type: text/html; charset=gsm-7\r\n");
 	if (gsm == NULL)
-		gsm = strafter(pam->data, "\nContent-Type: text/html; charset=gsm-7\n");
+		gsm = strafter(data, "\nContent-Type: text/html; charset=gsm-7\n");
 	if (gsm == NULL || gsm > hdr)
-		return;
+		goto done;
 
-	b64 = strafter(pam->data, "\r\nContent-Transfer-Encoding: base64\r\n");
+	b64 = strafter(data, "\r\nContent-Transfer-Encoding: base64\r\n");
 	if (b64 == NULL)
-		b64 = strafter(pam->data, "\nContent-Transfer-Encoding: base64\n");
+		b64 = strafter(data, "\nContent-Transfer-Encoding: base64\n");
 	if (b64 == NULL || b64 > hdr)
-		return;
+		goto done;
 
 	while (1) {
 		ch = *--gsm;
@@ -139,29 +249,29 @@ handle_import(struct am_message *pam)
 			break;
 	}
 	for (y = x = pam->bytes - 1; x != -1; x--) {
-		ch = ((uint8_t *)pam->data)[x];
+		ch = ((uint8_t *)data)[x];
 		if (ch == 0)
 			continue;
-		((uint8_t *)pam->data)[y--] = ch;
+		((uint8_t *)data)[y--] = ch;
 	}
 	/* fill rest of beginning with zero */
 	while (y > -1)
-		((uint8_t *)pam->data)[y--] = 0;
+		((uint8_t *)data)[y--] = 0;
 
-	strcpy(pam->data, "Content-Type: text/html; charset=utf-8\r\n");
+	strcpy(data, "Content-Type: text/html; charset=utf-8\r\n");
 
 	/* remove zeroed bytes */
 	for (x = y = 0; x != pam->bytes; x++) {
-		if (((uint8_t *)pam->data)[x] == 0)
+		if (((uint8_t *)data)[x] == 0)
 			continue;
-		((uint8_t *)pam->data)[y++] = ((uint8_t *)pam->data)[x];
+		((uint8_t *)data)[y++] = ((uint8_t *)data)[x];
 	}
-	((uint8_t *)pam->data)[y++] = 0;
+	((uint8_t *)data)[y++] = 0;
 
 	/* convert data format */
-	hdr = strstr(pam->data, "\r\n\r\n");
+	hdr = strstr(data, "\r\n\r\n");
 	if (hdr == NULL)
-		return;
+		goto done;
 
 	hdr += 4;
 
@@ -170,6 +280,7 @@ handle_import(struct am_message *pam)
 	/* reset parsing */
 	base64_get_utf8(NULL);
 
+	AM_TRACE_BEGIN(decode);
 	while (1) {
 		x = base64_get_utf8(&hdr);
 		if (x < 0)
@@ -177,67 +288,998 @@ handle_import(struct am_message *pam)
 		*gsm++ = x;
 	}
 	*gsm++ = 0;
+	AM_TRACE_END(AM_TRACE_BASE64, decode);
 
 	/* compute new length - ignore rest */
-	pam->bytes = strlen(pam->data) + 1;
+	pam->bytes = strlen(data) + 1;
+done:
+	AM_TRACE_END(AM_TRACE_IMPORT, trace);
+	am_metrics_observe(AM_HIST_IMPORT, start);
+}
+
+/*
+ * Returns the value of the given header, between "ptr" and the end of
+ * the headers, and its length without the line ending. The name
+ * includes the colon and is matched ignoring case.
+ */
+const char *
+handle_message_header(const char *ptr, const char *end, const char *name, size_t *plen)
+{
+	size_t len = strlen(name);
+	const char *eol;
+
+	while (ptr < end) {
+		eol = memchr(ptr, '\n', end - ptr);
+		if (eol == NULL)
+			eol = end;
+		if ((size_t)(eol - ptr) > len && strncasecmp(ptr, name, len) == 0) {
+			for (ptr += len; *ptr == ' ' || *ptr == '\t'; ptr++)
+				;
+			*plen = eol - ptr;
+			if (*plen != 0 && ptr[*plen - 1] == '\r')
+				(*plen)--;
+			return (ptr);
+		}
+		ptr = eol + 1;
+	}
+	return (NULL);
+}
+
+static size_t
+handle_message_size(const struct am_message *pam)
+{
+	void *data = atomic_load(&__DECONST(struct am_message *, pam)->data);
+
+	/* cold messages are charged for their compressed data */
+	if ((uintptr_t)data & AM_COLD_TAG)
+		return (am_pool_size(sizeof(*pam)) + am_cold_charge(data));
+	return (am_pool_size(sizeof(*pam)) + pam->size);
+}
+
+static int
+handle_store_fits(uint64_t bytes, int count, size_t size)
+{
+	if (am_store_max_count != 0 && count >= am_store_max_count)
+		return (0);
+	if (am_store_max_bytes != 0 && bytes + size > am_store_max_bytes)
+		return (0);
+	return (1);
+}
+
+static int
+handle_store_evictable(const struct am_message *pam)
+{
+	switch (am_evict_policy) {
+	case AM_EVICT_OLDEST:
+		return (1);
+	case AM_EVICT_DELIVERED:
+		return ((pam->flags & AM_MSG_DELIVERED) != 0);
+	default:
+		return (0);
+	}
 }
 
+static int
+handle_store_check_snapshot(const struct am_snapshot *ps, size_t size)
+{
+	const struct am_message *pam;
+	uint64_t bytes = ps->bytes;
+	int count = ps->count;
+	int x;
+
+	if (am_store_max_bytes != 0 && size > am_store_max_bytes)
+		return (1);
+
+	for (x = 0; x != ps->count; x++) {
+		if (handle_store_fits(bytes, count, size))
+			break;
+		pam = ps->msg[x];
+		if (handle_store_evictable(pam) == 0)
+			continue;
+		bytes -= handle_message_size(pam);
+		count--;
+	}
+	return (handle_store_fits(bytes, count, size) == 0);
+}
+
+/*
+ * Check if a message of the given size can be stored, possibly after
+ * evicting messages according to the eviction policy. Returns zero
+ * if there is room. Nothing is evicted by this function.
+ */
 int
-handle_delete_message(struct am_message *pam)
+handle_store_check(size_t size)
+{
+	int retval;
+
+	retval = handle_store_check_snapshot(handle_snapshot_enter(), size);
+	handle_snapshot_leave();
+	return (retval);
+}
+
+static void
+handle_free_message(struct am_retire *pr)
+{
+	struct am_message *pam = (struct am_message *)pr;
+
+	if ((uintptr_t)pam->data & AM_COLD_TAG)
+		am_cold_free(pam->data);
+	else
+		am_pool_free(pam->data, pam->size);
+	am_pool_free(pam, sizeof(*pam));
+}
+
+static size_t
+handle_index_size(int max)
+{
+	return (sizeof(struct am_index) + max * sizeof(struct am_message *));
+}
+
+static void
+handle_free_index(struct am_retire *pr)
+{
+	struct am_index *pi = (struct am_index *)pr;
+
+	am_pool_free(pi, handle_index_size(pi->max));
+}
+
+static void
+handle_free_snapshot(struct am_retire *pr)
+{
+	am_pool_free(pr, sizeof(struct am_snapshot));
+}
+
+static struct am_index *
+handle_index_alloc(int max)
+{
+	struct am_index *pi;
+
+	pi = am_pool_alloc(handle_index_size(max));
+	if (pi != NULL)
+		pi->max = max;
+	return (pi);
+}
+
+static void
+handle_mailbox_abort(struct am_mailbox_update *pu, int num)
+{
+	for (; num-- != 0; pu++) {
+		if (pu->index != NULL && pu->index != pu->mbox->index)
+			handle_free_index(&pu->index->retire);
+		am_pool_free(pu->snap, sizeof(*pu->snap));
+	}
+}
+
+/*
+ * Prepare the views of the mailboxes which change along with the new
+ * store index. Mailboxes in "lost" had messages removed, and are
+ * rebuilt in one pass over the store. Otherwise the new message, if
+ * any, is appended to its mailbox, in place when there is room.
+ * Returns the number of updates, or -1 when out of memory.
+ */
+static int
+handle_mailbox_prepare(struct am_mailbox_update *pu, const struct am_index *pi,
+    int count, uint64_t lost, struct am_message *pam)
+{
+	const struct am_snapshot *old;
+	struct am_mailbox *mbox;
+	struct am_message *ptr;
+	struct am_snapshot *ps;
+	uint64_t mask = lost;
+	int slot[AM_MAILBOX_MAX];
+	int num = 0;
+	int max;
+	int x;
+
+	if (pam != NULL)
+		mask |= 1ULL << pam->mbox->id;
+
+	for (x = 0; x != am_mailbox_count(); x++) {
+		if ((mask & (1ULL << x)) == 0)
+			continue;
+		mbox = am_mailbox_get(x);
+		old = atomic_load(&mbox->store);
+		if (old == NULL)
+			old = &am_store_empty;
+
+		slot[x] = num;
+		pu[num].mbox = mbox;
+		pu[num].index = NULL;
+		pu[num].snap = ps = am_pool_alloc(sizeof(*ps));
+		num++;
+		if (ps == NULL)
+			goto error;
+
+		max = (mbox->index == NULL) ? AM_INDEX_MIN : mbox->index->max;
+		if (old->count == max)
+			max *= 2;
+
+		if (lost & (1ULL << x)) {
+			pu[num - 1].index = handle_index_alloc(max);
+			ps->bytes = 0;
+			ps->count = 0;
+		} else {
+			if (mbox->index == NULL || max != mbox->index->max) {
+				pu[num - 1].index = handle_index_alloc(max);
+				if (pu[num - 1].index != NULL && old->count != 0)
+					memcpy(pu[num - 1].index->msg, old->msg,
+					    old->count * sizeof(old->msg[0]));
+			} else {
+				pu[num - 1].index = mbox->index;
+			}
+			ps->bytes = old->bytes;
+			ps->count = old->count;
+		}
+		if (pu[num - 1].index == NULL)
+			goto error;
+	}
+
+	/* the store index already holds the new message */
+	for (x = 0; lost != 0 && x != count; x++) {
+		ptr = pi->msg[x];
+		if ((lost & (1ULL << ptr->mbox->id)) == 0)
+			continue;
+		ps = pu[slot[ptr->mbox->id]].snap;
+		pu[slot[ptr->mbox->id]].index->msg[ps->count++] = ptr;
+		ps->bytes += handle_message_size(ptr);
+	}
+	if (pam != NULL && (lost & (1ULL << pam->mbox->id)) == 0) {
+		ps = pu[slot[pam->mbox->id]].snap;
+		pu[slot[pam->mbox->id]].index->msg[ps->count++] = pam;
+		ps->bytes += handle_message_size(pam);
+	}
+	return (num);
+error:
+	handle_mailbox_abort(pu, num);
+	return (-1);
+}
+
+static void
+handle_mailbox_commit(struct am_mailbox_update *pu, int num)
+{
+	struct am_snapshot *old;
+	struct am_mailbox *mbox;
+
+	for (; num-- != 0; pu++) {
+		mbox = pu->mbox;
+		old = atomic_load(&mbox->store);
+
+		pu->snap->msg = pu->index->msg;
+		pu->snap->generation = am_store_generation;
+		pu->snap->uidnext = am_store_uid + 1;
+		atomic_store(&mbox->store, pu->snap);
+
+		if (old != NULL)
+			am_epoch_retire(&old->retire, &handle_free_snapshot);
+		if (mbox->index != pu->index) {
+			if (mbox->index != NULL)
+				am_epoch_retire(&mbox->index->retire, &handle_free_index);
+			mbox->index = pu->index;
+		}
+	}
+}
+
+/*
+ * Publish a new view of the message store, together with the prepared
+ * views of the mailboxes. Must be called with the store locked. The
+ * previous views, and the previous indexes if they were replaced, are
+ * freed once the last reader has left them.
+ */
+static int
+handle_store_publish(struct am_index *pi, int count, uint64_t bytes,
+    struct am_mailbox_update *pu, int num)
+{
+	struct am_snapshot *old = atomic_load(&am_store);
+	struct am_snapshot *ps;
+
+	ps = am_pool_alloc(sizeof(*ps));
+	if (ps == NULL)
+		return (1);
+	ps->msg = pi->msg;
+	ps->generation = ++am_store_generation;
+	ps->uidnext = am_store_uid + 1;
+	ps->bytes = bytes;
+	ps->count = count;
+
+	am_metrics_gauge(AM_GAUGE_STORE_BYTES, (int64_t)bytes - (int64_t)old->bytes);
+	am_metrics_gauge(AM_GAUGE_STORE_MESSAGES, count - old->count);
+
+	atomic_store(&am_store, ps);
+	handle_mailbox_commit(pu, num);
+	am_imap_notify();
+
+	if (old != &am_store_empty)
+		am_epoch_retire(&old->retire, &handle_free_snapshot);
+	if (am_store_index != pi) {
+		if (am_store_index != NULL)
+			am_epoch_retire(&am_store_index->retire, &handle_free_index);
+		am_store_index = pi;
+	}
+	return (0);
+}
+
+static void
+handle_store_release(struct am_message *pam)
 {
-	if (pam->entry.tqe_prev != NULL)
-		TAILQ_REMOVE(&head, pam, entry);
+	pam->flags &= ~AM_MSG_STORED;
+	am_epoch_retire(&pam->retire, &handle_free_message);
+}
 
-	free(pam->data);
-	free(pam);
+/*
+ * Free a message which is not part of the message store.
+ */
+int
+handle_delete_message(struct am_message *pam)
+{
+	am_pool_free(pam->data, pam->size);
+	am_pool_free(pam, sizeof(*pam));
 	return (0);
 }
 
+/*
+ * Find a message by its unique id. The snapshot is ordered by id.
+ */
+struct am_message *
+handle_snapshot_lookup(const struct am_snapshot *ps, uint64_t uid)
+{
+	int lo = 0;
+	int hi = ps->count;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ps->msg[mid]->uid == uid)
+			return (ps->msg[mid]);
+		if (ps->msg[mid]->uid < uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (NULL);
+}
+
+/*
+ * Remove a batch of messages from the message store, given by their
+ * unique ids in increasing order. Ids which are no longer stored are
+ * ignored. Readers holding a snapshot containing the messages can
+ * still access them. Returns the number of messages removed.
+ */
+int
+handle_remove_messages(const uint64_t *uid, int num)
+{
+	const struct am_snapshot *ps;
+	struct am_retire *removed = NULL;
+	struct am_retire *pr;
+	struct am_mailbox_update update[AM_MAILBOX_MAX];
+	struct am_message *pam;
+	struct am_index *pi;
+	uint64_t bytes;
+	uint64_t lost = 0;
+	int nupdate = 0;
+	int count;
+	int x;
+	int y;
+
+	if (num == 0)
+		return (0);
+
+	pthread_mutex_lock(&am_store_mtx);
+	ps = atomic_load(&am_store);
+
+	if (am_store_index == NULL)
+		goto done;
+
+	pi = handle_index_alloc(am_store_index->max);
+	if (pi == NULL)
+		goto done;
+
+	bytes = ps->bytes;
+	for (x = y = count = 0; x != ps->count; x++) {
+		pam = ps->msg[x];
+		while (y != num && uid[y] < pam->uid)
+			y++;
+		if (y != num && uid[y] == pam->uid) {
+			bytes -= handle_message_size(pam);
+			lost |= 1ULL << pam->mbox->id;
+			pam->retire.next = removed;
+			removed = &pam->retire;
+			continue;
+		}
+		pi->msg[count++] = pam;
+	}
+
+	if (removed != NULL)
+		nupdate = handle_mailbox_prepare(update, pi, count, lost, NULL);
+	if (removed == NULL || nupdate < 0 ||
+	    handle_store_publish(pi, count, bytes, update, nupdate) != 0) {
+		if (nupdate > 0)
+			handle_mailbox_abort(update, nupdate);
+		handle_free_index(&pi->retire);
+		removed = NULL;
+	} else {
+		am_upgrade_queue_remove(uid, num);
+		am_replica_remove(uid, num);
+	}
+done:
+	pthread_mutex_unlock(&am_store_mtx);
+
+	for (count = 0; (pr = removed) != NULL; count++) {
+		removed = pr->next;
+		am_search_remove(((struct am_message *)pr)->uid);
+		handle_store_release((struct am_message *)pr);
+	}
+	return (count);
+}
+
+/*
+ * Swap the data of stored messages for another encoding of the same
+ * bytes, see cold.c, and charge the store for the new size. Messages
+ * which are no longer stored are left alone. On return "data" holds
+ * what the caller must retire, which is the previous data of the
+ * messages swapped and the unused data of the others.
+ */
+void
+handle_store_swap(struct am_message **pam, void **data, int num)
+{
+	const struct am_snapshot *ps;
+	struct am_mailbox_update update[AM_MAILBOX_MAX];
+	uint64_t bytes;
+	uint64_t lost = 0;
+	int nupdate;
+	int x;
+
+	pthread_mutex_lock(&am_store_mtx);
+	ps = atomic_load(&am_store);
+
+	bytes = ps->bytes;
+	for (x = 0; x != num; x++) {
+		if (handle_snapshot_lookup(ps, pam[x]->uid) != pam[x])
+			continue;
+		bytes -= handle_message_size(pam[x]);
+		data[x] = atomic_exchange(&pam[x]->data, data[x]);
+		bytes += handle_message_size(pam[x]);
+		lost |= 1ULL << pam[x]->mbox->id;
+	}
+	if (lost == 0)
+		goto done;
+
+	/* the mailboxes of the messages swapped are summed up again */
+	nupdate = handle_mailbox_prepare(update, am_store_index, ps->count, lost, NULL);
+	if (nupdate < 0 ||
+	    handle_store_publish(am_store_index, ps->count, bytes, update, nupdate) != 0) {
+		if (nupdate > 0)
+			handle_mailbox_abort(update, nupdate);
+		/* the charges must match the published view */
+		for (x = 0; x != num; x++) {
+			if (handle_snapshot_lookup(ps, pam[x]->uid) == pam[x])
+				data[x] = atomic_exchange(&pam[x]->data, data[x]);
+		}
+	}
+done:
+	pthread_mutex_unlock(&am_store_mtx);
+}
+
 int
 handle_insert_message(struct am_message *pam)
 {
-	TAILQ_INSERT_TAIL(&head, pam, entry);
+	const struct am_snapshot *ps;
+	struct am_mailbox_update update[AM_MAILBOX_MAX];
+	struct am_retire *evicted = NULL;
+	struct am_retire *pr;
+	struct am_message *ptr;
+	struct am_index *pi;
+	uint64_t bytes;
+	uint64_t lost = 0;
+	uint64_t last;
+	uint64_t uid;
+	size_t size;
+	int nupdate;
+	int count;
+	int max;
+	int x;
+
+	if (pam->mbox == NULL)
+		pam->mbox = am_mailbox_default();
+
+	/* move the data into the smallest pool, so that the accounting is exact */
+	if (am_pool_size(pam->bytes) < (size_t)pam->size) {
+		ptr = am_pool_alloc(pam->bytes);
+		if (ptr != NULL) {
+			memcpy(ptr, pam->data, pam->bytes);
+			am_pool_free(pam->data, pam->size);
+			pam->data = ptr;
+			pam->size = am_pool_size(pam->bytes);
+		}
+	}
+	size = handle_message_size(pam);
+
+	pthread_mutex_lock(&am_store_mtx);
+	ps = atomic_load(&am_store);
+
+	if (handle_store_check_snapshot(ps, size) != 0)
+		goto error;
+
+	bytes = ps->bytes;
+	count = ps->count;
+	max = (am_store_index == NULL) ? AM_INDEX_MIN : am_store_index->max;
+	if (count == max)
+		max *= 2;
+
+	if (handle_store_fits(bytes, count, size) == 0) {
+		/* evict messages into a new index */
+		pi = handle_index_alloc(max);
+		if (pi == NULL)
+			goto error;
+		count = 0;
+		for (x = 0; x != ps->count; x++) {
+			ptr = ps->msg[x];
+			if (handle_store_fits(bytes, ps->count - x + count, size) == 0 &&
+			    handle_store_evictable(ptr) != 0) {
+				bytes -= handle_message_size(ptr);
+				lost |= 1ULL << ptr->mbox->id;
+				ptr->retire.next = evicted;
+				evicted = &ptr->retire;
+				continue;
+			}
+			pi->msg[count++] = ptr;
+		}
+	} else if (am_store_index == NULL || max != am_store_index->max) {
+		/* grow the index */
+		pi = handle_index_alloc(max);
+		if (pi == NULL)
+			goto error;
+		if (count != 0)
+			memcpy(pi->msg, ps->msg, count * sizeof(pi->msg[0]));
+	} else {
+		/* append in place */
+		pi = am_store_index;
+	}
+
+	pi->msg[count++] = pam;
+	/*
+	 * Keep the id of a message handed over by a previous instance.
+	 * The id is only taken for good once the new view is published,
+	 * so that a failed insert leaves no gap in the ids.
+	 */
+	uid = pam->uid;
+	last = am_store_uid;
+	if (pam->uid <= am_store_uid)
+		pam->uid = am_store_uid + 1;
+	am_store_uid = pam->uid;
+	pam->flags |= AM_MSG_STORED;
+
+	nupdate = handle_mailbox_prepare(update, pi, count, lost, pam);
+	if (nupdate < 0 ||
+	    handle_store_publish(pi, count, bytes + size, update, nupdate) != 0) {
+		if (nupdate > 0)
+			handle_mailbox_abort(update, nupdate);
+		am_store_uid = last;
+		pam->uid = uid;
+		pam->flags &= ~AM_MSG_STORED;
+		if (pi != am_store_index)
+			handle_free_index(&pi->retire);
+		goto error;
+	}
+
+	/* the new instance and the replica evict the same messages first */
+	for (pr = evicted; pr != NULL; pr = pr->next) {
+		am_upgrade_queue_remove(&((struct am_message *)pr)->uid, 1);
+		am_replica_remove(&((struct am_message *)pr)->uid, 1);
+	}
+	am_upgrade_queue_message(pam);
+	am_replica_message(pam);
+
+	am_search_insert(pam);
+
+	/* free evicted messages */
+	while ((pr = evicted) != NULL) {
+		evicted = pr->next;
+		am_search_remove(((struct am_message *)pr)->uid);
+		handle_store_release((struct am_message *)pr);
+		am_metrics_count(AM_CNT_MESSAGES_EVICTED, 1);
+	}
+	pthread_mutex_unlock(&am_store_mtx);
 	return (0);
+error:
+	pthread_mutex_unlock(&am_store_mtx);
+	return (1);
+}
+
+/*
+ * Send the whole message store to a new instance, and forward all
+ * later changes to it until handle_store_handoff_stop() is called.
+ * Only taking the snapshot locks the store.
+ */
+int
+handle_store_handoff(int fd)
+{
+	const struct am_snapshot *ps;
+	int retval = 0;
+	int x;
+
+	pthread_mutex_lock(&am_store_mtx);
+	/* the cold thread may retire the data while it is being sent */
+	ps = handle_snapshot_enter();
+	am_upgrade_attach();
+	pthread_mutex_unlock(&am_store_mtx);
+
+	for (x = 0; x != ps->count && retval == 0; x++)
+		retval = am_upgrade_message(fd, ps->msg[x]);
+	handle_snapshot_leave();
+	if (retval == 0)
+		retval = am_upgrade_end(fd);
+	if (retval == 0)
+		retval = am_upgrade_forward(fd);
+	return (retval);
+}
+
+/* returns non-zero if the new instance missed any changes */
+int
+handle_store_handoff_stop(void)
+{
+	return (am_upgrade_detach());
+}
+
+/*
+ * Pin the current view of the message store, and start queueing all
+ * later changes for the replica, see replica.c. The view is left
+ * using handle_snapshot_leave(). The sequence number of the last
+ * change before the view is returned in "pseq".
+ */
+const struct am_snapshot *
+handle_store_follow(uint64_t *pseq)
+{
+	const struct am_snapshot *ps;
+
+	pthread_mutex_lock(&am_store_mtx);
+	ps = handle_snapshot_enter();
+	*pseq = am_replica_attach();
+	pthread_mutex_unlock(&am_store_mtx);
+	return (ps);
 }
 
 int
 handle_append_message(struct am_message *pam, uint8_t data)
 {
 	void *ptr;
+	int size;
 
-	pam->bytes++;
-	if (pam->bytes <= 0) {
-		free(pam->data);
-		pam->bytes = 0;
-		return (1);
-	}
-	if ((pam->bytes & (pam->bytes - 1)) == 0) {
-		ptr = pam->data;
-		pam->data = realloc(ptr, 2 * pam->bytes);
-		if (pam->data == NULL) {
-			free(ptr);
-			pam->bytes = 0;
-			return (1);
-		}
+	if (pam->bytes == pam->size) {
+		if (pam->size == 0)
+			size = AM_MESSAGE_SIZE_MIN;
+		else if (pam->size <= INT_MAX / 2)
+			size = 2 * pam->size;
+		else
+			goto error;
+
+		ptr = am_pool_alloc(size);
+		if (ptr == NULL)
+			goto error;
+		if (pam->bytes != 0)
+			memcpy(ptr, pam->data, pam->bytes);
+		am_pool_free(pam->data, pam->size);
+		pam->data = ptr;
+		pam->size = am_pool_size(size);
 	}
-	((uint8_t *)pam->data)[pam->bytes - 1] = data;
+	((uint8_t *)pam->data)[pam->bytes++] = data;
 	return (0);
+error:
+	am_pool_free(pam->data, pam->size);
+	pam->data = NULL;
+	pam->bytes = 0;
+	pam->size = 0;
+	return (1);
 }
 
 struct am_message *
 handle_create_message(void)
 {
-	struct am_message *pam = malloc(sizeof(*pam));
+	struct am_message *pam = am_pool_alloc(sizeof(*pam));
 
 	if (pam != NULL)
 		memset(pam, 0, sizeof(*pam));
 	return (pam);
 }
 
+/*
+ * Returns the data of a stored message, which stays valid until the
+ * snapshot is left. Compressed messages are decompressed, and NULL is
+ * returned if that fails. Reading makes the message hot again.
+ */
+const char *
+handle_message_data(const struct am_message *pam)
+{
+	struct am_message *pm = __DECONST(struct am_message *, pam);
+	void *data;
+
+	if (atomic_load_explicit(&pm->flags, memory_order_relaxed) & AM_MSG_IDLE_MASK)
+		atomic_fetch_and(&pm->flags, ~AM_MSG_IDLE_MASK);
+	data = atomic_load(&pm->data);
+	if ((uintptr_t)data & AM_COLD_TAG)
+		return (am_cold_data(pam, data));
+	return (data);
+}
+
+/* returns the size of a stored message without its zero terminator */
+int
+handle_message_length(const struct am_message *pam)
+{
+	struct am_message *pm = __DECONST(struct am_message *, pam);
+	void *data = atomic_load(&pm->data);
+	int last;
+
+	if (pam->bytes == 0)
+		return (0);
+	if ((uintptr_t)data & AM_COLD_TAG)
+		last = am_cold_last_byte(data);
+	else
+		last = ((uint8_t *)data)[pam->bytes - 1];
+	return (last == 0 ? pam->bytes - 1 : pam->bytes);
+}
+
+/*
+ * Returns a copy of a message, which is not part of the message store.
+ */
+struct am_message *
+handle_copy_message(const struct am_message *pam)
+{
+	struct am_message *copy;
+
+	copy = handle_create_message();
+	if (copy == NULL)
+		return (NULL);
+	copy->data = am_pool_alloc(pam->bytes);
+	if (copy->data == NULL) {
+		handle_delete_message(copy);
+		return (NULL);
+	}
+	memcpy(copy->data, pam->data, pam->bytes);
+	copy->bytes = pam->bytes;
+	copy->size = am_pool_size(pam->bytes);
+	copy->mbox = pam->mbox;
+	return (copy);
+}
+
+/*
+ * The benchmarks link this file directly and provide their own main().
+ */
+#ifndef ASTERISKMAIL_NO_MAIN
+/*
+ * Admission control. Connections beyond the global or the per source
+ * address limit are refused right after accept, with a protocol
+ * specific temporary error.
+ */
+#define	AM_CLIENT_HASH 256
+
+struct am_client {
+	struct am_client *next;
+	uint8_t	addr[16];
+	int	count;
+};
+
+struct am_worker {
+	void	(*func)(int);
+	int	fd;
+	uint8_t	addr[16];
+};
+
+static struct am_client *am_client_hash[AM_CLIENT_HASH];
+static pthread_mutex_t am_admit_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int am_sessions;
+static int am_max_sessions = 512;
+static int am_max_per_ip;
+static int am_backlog = 128;
+
+/* use IPv4 mapped addresses, so that all keys are 16 bytes */
+static void
+asteriskmail_addr(const struct sockaddr_storage *ss, uint8_t *addr)
+{
+	memset(addr, 0, 16);
+
+	switch (ss->ss_family) {
+	case AF_INET:
+		addr[10] = 0xff;
+		addr[11] = 0xff;
+		memcpy(addr + 12, &((const struct sockaddr_in *)ss)->sin_addr, 4);
+		break;
+	case AF_INET6:
+		memcpy(addr, &((const struct sockaddr_in6 *)ss)->sin6_addr, 16);
+		break;
+	default:
+		break;
+	}
+}
+
+static struct am_client **
+asteriskmail_client(const uint8_t *addr)
+{
+	struct am_client **ppc;
+	uint32_t hash = 2166136261U;
+	int x;
+
+	for (x = 0; x != 16; x++)
+		hash = (hash ^ addr[x]) * 16777619U;
+
+	for (ppc = &am_client_hash[hash % AM_CLIENT_HASH]; *ppc != NULL;
+	    ppc = &(*ppc)->next) {
+		if (memcmp((*ppc)->addr, addr, 16) == 0)
+			break;
+	}
+	return (ppc);
+}
+
+/* returns zero if the session may start, else the counter to bump */
+static int
+asteriskmail_admit(const uint8_t *addr)
+{
+	struct am_client **ppc;
+	struct am_client *pc;
+	int retval = 0;
+
+	pthread_mutex_lock(&am_admit_mtx);
+	if (am_max_sessions != 0 && am_sessions >= am_max_sessions) {
+		retval = AM_CNT_REJECTED_GLOBAL;
+		goto done;
+	}
+	if (am_max_per_ip != 0) {
+		ppc = asteriskmail_client(addr);
+		pc = *ppc;
+		if (pc == NULL) {
+			pc = am_pool_alloc(sizeof(*pc));
+			if (pc == NULL) {
+				retval = AM_CNT_REJECTED_GLOBAL;
+				goto done;
+			}
+			memcpy(pc->addr, addr, 16);
+			pc->count = 0;
+			pc->next = NULL;
+			*ppc = pc;
+		} else if (pc->count >= am_max_per_ip) {
+			retval = AM_CNT_REJECTED_PER_IP;
+			goto done;
+		}
+		pc->count++;
+	}
+	am_sessions++;
+done:
+	pthread_mutex_unlock(&am_admit_mtx);
+	return (retval);
+}
+
+static void
+asteriskmail_release(const uint8_t *addr)
+{
+	struct am_client **ppc;
+	struct am_client *pc;
+
+	pthread_mutex_lock(&am_admit_mtx);
+	am_sessions--;
+	if (am_max_per_ip != 0) {
+		ppc = asteriskmail_client(addr);
+		pc = *ppc;
+		if (pc != NULL && --(pc->count) == 0) {
+			*ppc = pc->next;
+			am_pool_free(pc, sizeof(*pc));
+		}
+	}
+	pthread_mutex_unlock(&am_admit_mtx);
+}
+
+static void
+asteriskmail_refuse(int proto, int fd)
+{
+	char buf[256];
+	int len;
+
+	switch (proto) {
+	case AM_PROTO_SMTP:
+		len = snprintf(buf, sizeof(buf), "421 %s Too many connections, "
+		    "try again later\r\n", hostname);
+		break;
+	case AM_PROTO_POP3:
+		len = snprintf(buf, sizeof(buf), "-ERR [SYS/TEMP] Too many connections, "
+		    "try again later\r\n");
+		break;
+	case AM_PROTO_IMAP:
+		len = snprintf(buf, sizeof(buf), "* BYE [UNAVAILABLE] Too many connections, "
+		    "try again later\r\n");
+		break;
+	default:
+		len = snprintf(buf, sizeof(buf), "HTTP/1.0 503 Service Unavailable\r\n"
+		    "Retry-After: 1\r\n"
+		    "Content-Length: 0\r\n"
+		    "Server: asteriskmail/1.0\r\n"
+		    "\r\n");
+		break;
+	}
+	/* never block the accept loop */
+	send(fd, buf, len, MSG_DONTWAIT);
+	close(fd);
+}
+
+static void *
+asteriskmail_worker(void *arg)
+{
+	struct am_worker *pw = arg;
+
+	am_metrics_gauge(AM_GAUGE_SESSIONS, 1);
+	pw->func(pw->fd);
+	am_timer_stop();
+	AM_TRACE_SESSION_END();
+	am_metrics_gauge(AM_GAUGE_SESSIONS, -1);
+
+	asteriskmail_release(pw->addr);
+	am_pool_free(pw, sizeof(*pw));
+	return (NULL);
+}
+
+/* serve each connection in its own thread */
+static void
+asteriskmail_start(int proto, int fd, const struct sockaddr_storage *ss)
+{
+	static void (*const func[AM_PROTO_MAX])(int) = {
+		[AM_PROTO_SMTP] = &handle_smtp_connection,
+		[AM_PROTO_POP3] = &handle_pop3_connection,
+		[AM_PROTO_HTTPD] = &handle_httpd_connection,
+		[AM_PROTO_IMAP] = &handle_imap_connection,
+	};
+	struct am_worker *pw;
+	pthread_attr_t attr;
+	pthread_t td;
+	int error;
+
+	pw = am_pool_alloc(sizeof(*pw));
+	if (pw == NULL) {
+		close(fd);
+		return;
+	}
+	pw->func = func[proto];
+	pw->fd = fd;
+	asteriskmail_addr(ss, pw->addr);
+
+	error = asteriskmail_admit(pw->addr);
+	if (error != 0) {
+		am_metrics_count(error, 1);
+		am_pool_free(pw, sizeof(*pw));
+		asteriskmail_refuse(proto, fd);
+		return;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	error = pthread_create(&td, &attr, &asteriskmail_worker, pw);
+	pthread_attr_destroy(&attr);
+
+	if (error != 0) {
+		asteriskmail_release(pw->addr);
+		am_pool_free(pw, sizeof(*pw));
+		close(fd);
+	}
+}
+
+/* accept all pending connections on a listening socket */
+static void
+asteriskmail_accept(int proto, int s, int max)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int x;
+	int f;
+
+	if (max > ASTERISKMAIL_ACCEPT_MAX)
+		max = ASTERISKMAIL_ACCEPT_MAX;
+	for (x = 0; x != max; x++) {
+		len = sizeof(ss);
+		f = accept4(s, (struct sockaddr *)&ss, &len, SOCK_CLOEXEC);
+		if (f < 0)
+			break;
+		asteriskmail_start(proto, f, &ss);
+	}
+}
+
 static int
 asteriskmail_do_listen(const char *host, const char *port, int buffer, struct pollfd *pfd, int num_sock)
 {
-	const struct timeval timeout = { .tv_sec = 4 };
 	struct addrinfo hints;
 	struct addrinfo *res;
 	struct addrinfo *res0;
@@ -269,11 +1311,12 @@ asteriskmail_do_listen(const char *host, const char *port, int buffer, struct po
 		setsockopt(s, SOL_SOCKET, SO_SNDBUF, &buffer, (int)sizeof(buffer));
 		setsockopt(s, SOL_SOCKET, SO_RCVBUF, &buffer, (int)sizeof(buffer));
 
-		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, (int)sizeof(timeout));
-		setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, (int)sizeof(timeout));
-		
+		/* the accept loop drains the queue until it would block */
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+		fcntl(s, F_SETFD, FD_CLOEXEC);
+
 		if (bind(s, res0->ai_addr, res0->ai_addrlen) == 0) {
-			if (listen(s, 1) == 0) {
+			if (listen(s, am_backlog) == 0) {
 				if (ns < num_sock) {
 					pfd[ns++].fd = s;
 					continue;
@@ -296,13 +1339,57 @@ asteriskmail_usage(void)
 	fprintf(stderr,
 	    "\n"
 	    "\n" "asteriskmail - AsteriskMail v1.0, compiled %s %s"
-	    "\n" "usage: asteriskmail [-B] [-L] [-b 127.0.0.1] [-p 25] [-P 110] [ -H 80] [-h]"
+	    "\n" "usage: asteriskmail [-B] [-L] [-b 127.0.0.1] [-p 25] [-P 110] [ -H 80] [-i 143] [-M 0] [-N 0] [-E none] [-f pidfile] [-R file] [-q 128] [-C 512] [-I 0]"
+	    "\n" "                   [-T smtp:300:600:3600] [-c cert -k key [-S]] [-W url [-w 100]] [-e poll]"
+	    "\n" "                   [-m name:password=recipient,...] [-d dongle0:250] [-A path]"
+	    "\n" "                   [-D 86400] [-Z 3600] [-j port] [-u host:port] [-h]"
 	    "\n" "       -B            run in background"
 	    "\n" "       -b <addr>     bind address"
 	    "\n" "       -L            bind SMTP to localhost"
 	    "\n" "       -p <port>     SMTP bind port"
 	    "\n" "       -P <port>     POP3 bind port"
 	    "\n" "       -H <port>     HTTPD bind port"
+	    "\n" "       -i <port>     IMAP bind port, default is no IMAP"
+	    "\n" "       -M <bytes>    maximum bytes held by the message store, 0 is unlimited"
+	    "\n" "       -N <count>    maximum number of stored messages, 0 is unlimited"
+	    "\n" "       -E <policy>   eviction policy when the store is full:"
+	    "\n" "                     none, oldest or delivered"
+	    "\n" "       -f <file>     PID file, default is /var/run/asteriskmail"
+	    "\n" "       -R <file>     record all sessions to the given capture file"
+	    "\n" "       -q <num>      listen backlog"
+	    "\n" "       -C <num>      maximum number of concurrent sessions, 0 is unlimited"
+	    "\n" "       -I <num>      maximum number of concurrent sessions per client"
+	    "\n" "                     address, 0 is unlimited"
+	    "\n" "       -T <timeouts> idle, command and session timeouts in seconds for"
+	    "\n" "                     smtp, pop3, http or imap, can be given once per protocol"
+	    "\n" "       -c <file>     TLS certificate chain, enables STARTTLS and STLS"
+	    "\n" "       -k <file>     TLS private key"
+	    "\n" "       -S            HTTPD port speaks HTTPS"
+	    "\n" "       -W <url>      POST new messages as JSON to the given http:// URL"
+	    "\n" "       -w <ms>       time to collect messages into one webhook request"
+	    "\n" "       -e <backend>  event backend of the accept loop, poll or kqueue"
+	    "\n" "       -m <mailbox>  add a mailbox, which receives the messages for the"
+	    "\n" "                     given SMTP recipients and its own name, and is"
+	    "\n" "                     logged into by name and the optional password,"
+	    "\n" "                     can be given several times"
+	    "\n" "       -d <dongle>   add a dongle to the outbound SMS pool, with the optional"
+	    "\n" "                     time between two segments in milliseconds, can be"
+	    "\n" "                     given several times, default is dongle0"
+	    "\n" "       -A <path>     Asterisk binary used to send SMS, default is"
+	    "\n" "                     " AM_ASTERISK_PATH
+	    "\n" "       -D <seconds>  drop messages with the sender, date and text of a"
+	    "\n" "                     message received within the given time, 0 disables"
+	    "\n" "       -Z <seconds>  compress stored messages not read for the given"
+	    "\n" "                     time, 0 disables"
+	    "\n" "       -j <port>     stream the message store to a replica connecting"
+	    "\n" "                     to the given port on the bind address"
+	    "\n" "       -u <addr>     run as a read-only replica of the primary at the"
+	    "\n" "                     given host:port, with the same -m mailboxes"
+	    "\n" "       SIGUSR1       promote a replica to a writable primary"
+	    "\n" "       SIGUSR2       start a new instance of the binary, hand over the"
+	    "\n" "                     listening sockets and the message store, and exit"
+	    "\n" "                     once the running sessions are done, closing those"
+	    "\n" "                     still running after a minute"
 	    "\n" "       -h            show usage"
 	    "\n",
 	    __DATE__, __TIME__);
@@ -323,7 +1410,7 @@ do_pidfile(void)
 	if (local_pid != NULL)
 		return (0);
 
-	local_pid = pidfile_open("/var/run/asteriskmail", 0600, NULL);
+	local_pid = pidfile_open(pid_file, 0600, NULL);
 	if (local_pid == NULL) {
 		return (EEXIST);
 	} else {
@@ -332,22 +1419,233 @@ do_pidfile(void)
 	return (0);
 }
 
+/*
+ * Zero downtime upgrade, see upgrade.c. The signal handler only wakes
+ * up the accept loop through a pipe.
+ */
+static char **am_argv;
+static char am_exec_path[PATH_MAX];
+static int am_wakeup[2] = { -1, -1 };
+
+static void
+asteriskmail_sigusr2(int sig)
+{
+	int error = errno;
+
+	write(am_wakeup[1], "", 1);
+	errno = error;
+}
+
+static void
+asteriskmail_sigusr1(int sig)
+{
+	am_replica_promote();
+}
+
+static int
+asteriskmail_sessions(void)
+{
+	int retval;
+
+	pthread_mutex_lock(&am_admit_mtx);
+	retval = am_sessions;
+	pthread_mutex_unlock(&am_admit_mtx);
+	return (retval);
+}
+
+/* returns only if the new instance could not be started */
+static void
+asteriskmail_upgrade(const int *num)
+{
+	int total = num[AM_PROTO_SMTP] + num[AM_PROTO_POP3] +
+	    num[AM_PROTO_HTTPD] + num[AM_PROTO_IMAP];
+	uint64_t deadline;
+	int fd;
+	int x;
+
+	/* let the new instance take the PID file */
+	if (local_pid != NULL) {
+		pidfile_close(local_pid);
+		local_pid = NULL;
+	}
+
+	/* replicas reconnect to the new instance */
+	am_replica_stop();
+
+	fd = am_upgrade_spawn(am_exec_path, am_argv, fds, num);
+	if (fd < 0)
+		goto error;
+	if (handle_store_handoff(fd) != 0 || am_upgrade_wait(fd) != 0) {
+		handle_store_handoff_stop();
+		close(fd);
+		goto error;
+	}
+
+	/* the new instance accepts from now on */
+	for (x = 0; x != total; x++)
+		close(fds[x].fd);
+
+	/* sessions get a while to finish, then they are cut off */
+	deadline = am_metrics_now() + AM_UPGRADE_DRAIN * 1000000000ULL;
+	while ((x = asteriskmail_sessions()) != 0) {
+		if (deadline != 0 && am_metrics_now() >= deadline) {
+			warnx("Closing %d sessions still running", x);
+			am_timer_expire();
+			deadline = 0;
+		}
+		usleep(AM_TIMER_TICK_MS * 1000);
+	}
+
+	/* the new instance only posts messages it received itself */
+	am_webhook_flush();
+	if (handle_store_handoff_stop() != 0)
+		warnx("New instance missed changes of the message store");
+	close(fd);
+	exit(0);
+error:
+	warnx("Upgrade failed, continuing");
+	if (do_pidfile() != 0)
+		warnx("Cannot create PID file");
+	if (am_replica_init() != 0)
+		warnx("Cannot restart replication");
+}
+
+/* returns the protocol of the listening socket at the given index */
+static int
+asteriskmail_proto(const int *num, int index)
+{
+	int x;
+
+	for (x = 0; x != AM_PROTO_MAX - 1; x++) {
+		if (index < num[x])
+			break;
+		index -= num[x];
+	}
+	return (x);
+}
+
+static void
+asteriskmail_serve_poll(const int *num)
+{
+	int ns = 0;
+	int c;
+	char ch;
+
+	for (c = 0; c != AM_PROTO_MAX; c++)
+		ns += num[c];
+
+	while (1) {
+		fds[ns].fd = am_wakeup[0];
+		for (c = 0; c != ns + 1; c++) {
+			fds[c].events = (POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI |
+			    POLLERR | POLLHUP | POLLNVAL);
+			fds[c].revents = 0;
+		}
+		if (poll(fds, ns + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			errx(EX_SOFTWARE, "Polling failed");
+		}
+		if (fds[ns].revents != 0) {
+			while (read(am_wakeup[0], &ch, 1) == 1)
+				;
+			asteriskmail_upgrade(num);
+		}
+		for (c = 0; c != ns; c++) {
+			if (fds[c].revents == 0)
+				continue;
+			asteriskmail_accept(asteriskmail_proto(num, c), fds[c].fd,
+			    ASTERISKMAIL_ACCEPT_MAX);
+		}
+	}
+}
+
+/*
+ * The kqueue backend registers the listening sockets once, instead of
+ * passing them to the kernel on every wakeup, and learns the length
+ * of each accept queue from the event. Each wakeup then takes exactly
+ * the pending connections, without a final accept() that would block.
+ */
+static void
+asteriskmail_serve_kqueue(const int *num)
+{
+	struct kevent ev[ASTERISKMAIL_SOCK_MAX + 1];
+	int kq;
+	int ns = 0;
+	int n;
+	int c;
+	char ch;
+
+	for (c = 0; c != AM_PROTO_MAX; c++)
+		ns += num[c];
+
+	kq = kqueue();
+	if (kq < 0)
+		errx(EX_SOFTWARE, "Cannot create kqueue");
+	for (c = 0; c != ns; c++) {
+		EV_SET(&ev[c], fds[c].fd, EVFILT_READ, EV_ADD, 0, 0,
+		    (void *)(intptr_t)asteriskmail_proto(num, c));
+	}
+	EV_SET(&ev[ns], am_wakeup[0], EVFILT_READ, EV_ADD, 0, 0,
+	    (void *)(intptr_t)AM_PROTO_MAX);
+	if (kevent(kq, ev, ns + 1, NULL, 0, NULL) != 0)
+		errx(EX_SOFTWARE, "Cannot register listening sockets");
+
+	while (1) {
+		n = kevent(kq, NULL, 0, ev, ns + 1, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			errx(EX_SOFTWARE, "Waiting for events failed");
+		}
+		for (c = 0; c != n; c++) {
+			if ((intptr_t)ev[c].udata == AM_PROTO_MAX) {
+				while (read(am_wakeup[0], &ch, 1) == 1)
+					;
+				asteriskmail_upgrade(num);
+				continue;
+			}
+			/* the data field is the length of the accept queue */
+			asteriskmail_accept((intptr_t)ev[c].udata, ev[c].ident,
+			    ev[c].data > 0 ? (int)ev[c].data : 1);
+		}
+	}
+}
+
 int
 main(int argc, char **argv)
 {
 	const char *smtp_port = "25";
 	const char *pop3_port = "110";
 	const char *httpd_port = "80";
+	const char *imap_port = NULL;
 	const char *host = "127.0.0.1";
+	const char *replica_port = NULL;
 	int opt;
 	int npop3;
 	int nsmtp;
 	int nhttpd;
+	int nimap = 0;
 	int do_bind_localhost = 0;
+	int upgrade_fd;
+	int nsock[AM_PROTO_MAX];
+	const char *capture_file = NULL;
+	const char *tls_cert = NULL;
+	const char *tls_key = NULL;
+	uint64_t num;
 
 	atexit(&do_exit);
 
-	while ((opt = getopt(argc, argv, "Lb:p:P:BhH:")) != -1) {
+	/* daemon() changes the working directory */
+	am_argv = argv;
+	if (strchr(argv[0], '/') == NULL ||
+	    realpath(argv[0], am_exec_path) == NULL)
+		strlcpy(am_exec_path, argv[0], sizeof(am_exec_path));
+#ifdef ASTERISKMAIL_TRACE
+	am_trace_init();
+#endif
+
+	while ((opt = getopt(argc, argv, "Lb:p:P:BhH:i:M:N:E:f:R:q:C:I:T:c:k:SW:w:e:m:d:A:D:Z:j:u:")) != -1) {
 		switch (opt) {
 		case 'b':
 			host = optarg;
@@ -361,12 +1659,112 @@ main(int argc, char **argv)
 		case 'H':
 			httpd_port = optarg;
 			break;
+		case 'i':
+			imap_port = optarg;
+			break;
 		case 'B':
 			do_fork = 1;
 			break;
+		case 'f':
+			pid_file = optarg;
+			break;
+		case 'R':
+			capture_file = optarg;
+			break;
+		case 'c':
+			tls_cert = optarg;
+			break;
+		case 'k':
+			tls_key = optarg;
+			break;
+		case 'S':
+			am_tls_https = 1;
+			break;
+		case 'W':
+			if (am_webhook_parse(optarg) != 0)
+				errx(EX_USAGE, "Invalid webhook URL '%s'", optarg);
+			break;
+		case 'w':
+			am_webhook_window = atoi(optarg);
+			break;
+		case 'e':
+			if (strcmp(optarg, "poll") == 0)
+				am_backend = AM_BACKEND_POLL;
+			else if (strcmp(optarg, "kqueue") == 0)
+				am_backend = AM_BACKEND_KQUEUE;
+			else
+				errx(EX_USAGE, "Invalid event backend '%s'", optarg);
+			break;
 		case 'L':
 			do_bind_localhost = 1;
 			break;
+		case 'm':
+			if (am_mailbox_parse(optarg) != 0)
+				errx(EX_USAGE, "Invalid mailbox '%s'", optarg);
+			break;
+		case 'd':
+			if (am_dongle_parse(optarg) != 0)
+				errx(EX_USAGE, "Invalid dongle '%s'", optarg);
+			break;
+		case 'A':
+			am_asterisk_path = optarg;
+			break;
+		case 'D':
+			if (expand_number(optarg, &num) != 0 || num > UINT_MAX)
+				errx(EX_USAGE, "Invalid duplicate window '%s'", optarg);
+			am_dedup_window = num;
+			break;
+		case 'Z':
+			if (expand_number(optarg, &num) != 0 || num > UINT_MAX)
+				errx(EX_USAGE, "Invalid cold message age '%s'", optarg);
+			am_cold_age = num;
+			break;
+		case 'j':
+			replica_port = optarg;
+			break;
+		case 'u':
+			if (am_replica_parse(optarg) != 0)
+				errx(EX_USAGE, "Invalid primary address '%s'", optarg);
+			break;
+		case 'M':
+			if (expand_number(optarg, &num) != 0)
+				errx(EX_USAGE, "Invalid number of bytes '%s'", optarg);
+			am_store_max_bytes = num;
+			break;
+		case 'N':
+			if (expand_number(optarg, &num) != 0 || num > INT_MAX)
+				errx(EX_USAGE, "Invalid number of messages '%s'", optarg);
+			am_store_max_count = num;
+			break;
+		case 'q':
+			am_backlog = atoi(optarg);
+			if (am_backlog < 1)
+				errx(EX_USAGE, "Invalid listen backlog '%s'", optarg);
+			break;
+		case 'C':
+			am_max_sessions = atoi(optarg);
+			if (am_max_sessions < 0)
+				errx(EX_USAGE, "Invalid number of sessions '%s'", optarg);
+			break;
+		case 'I':
+			am_max_per_ip = atoi(optarg);
+			if (am_max_per_ip < 0)
+				errx(EX_USAGE, "Invalid number of sessions '%s'", optarg);
+			break;
+		case 'T':
+			if (am_timer_parse(optarg) != 0)
+				errx(EX_USAGE, "Invalid timeouts '%s'", optarg);
+			break;
+		case 'E':
+			if (strcmp(optarg, "none") == 0)
+				am_evict_policy = AM_EVICT_NONE;
+			else if (strcmp(optarg, "oldest") == 0)
+				am_evict_policy = AM_EVICT_OLDEST;
+			else if (strcmp(optarg, "delivered") == 0)
+				am_evict_policy = AM_EVICT_DELIVERED;
+			else
+				errx(EX_USAGE, "Invalid eviction policy '%s'", optarg);
+			break;
 		default:
 			asteriskmail_usage();
 			return (EX_USAGE);
@@ -376,14 +1774,63 @@ main(int argc, char **argv)
 	if (gethostname(hostname, sizeof(hostname)) == -1)
 		errx(EX_SOFTWARE, "Cannot get hostname");
 
+	if (replica_port != NULL && am_replica_listen(host, replica_port) != 0)
+		errx(EX_USAGE, "Invalid replication port '%s'", replica_port);
+
+	if (tls_cert != NULL || tls_key != NULL || am_tls_https != 0) {
+		if (tls_cert == NULL)
+			errx(EX_USAGE, "TLS requires a certificate");
+		if (am_tls_init(tls_cert, tls_key != NULL ? tls_key : tls_cert) != 0)
+			errx(EX_SOFTWARE, "Cannot load TLS certificate '%s'", tls_cert);
+	}
+
 	if (do_pidfile()) {
 		errx(EX_SOFTWARE, "Cannot create PID file. "
 		    "CAPI server already running?");
 	}
-	if (do_fork) {
+	if (capture_file != NULL && am_capture_open(capture_file) != 0)
+		errx(EX_SOFTWARE, "Cannot open capture file '%s'", capture_file);
+	upgrade_fd = am_upgrade_fd();
+
+	/* a new instance is already detached from the terminal */
+	if (do_fork && upgrade_fd < 0) {
 		if (daemon(0, 0) != 0)
 			errx(EX_SOFTWARE, "Cannot daemonize");
 	}
+	/*
+	 * A peer that went away must end its own session only, so writes
+	 * to it fail with EPIPE instead.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* threads do not survive daemon() */
+	if (am_timer_init() != 0)
+		errx(EX_SOFTWARE, "Cannot start timer thread");
+	if (am_webhook_init() != 0)
+		errx(EX_SOFTWARE, "Cannot start webhook thread");
+	if (am_dongle_init() != 0)
+		errx(EX_SOFTWARE, "Cannot start dongle threads");
+	if (am_cold_init() != 0)
+		errx(EX_SOFTWARE, "Cannot start compression thread");
+
+	if (pipe(am_wakeup) != 0)
+		errx(EX_SOFTWARE, "Cannot create pipe");
+	for (opt = 0; opt != 2; opt++) {
+		fcntl(am_wakeup[opt], F_SETFL, fcntl(am_wakeup[opt], F_GETFL) | O_NONBLOCK);
+		fcntl(am_wakeup[opt], F_SETFD, FD_CLOEXEC);
+	}
+	signal(SIGUSR2, &asteriskmail_sigusr2);
+	signal(SIGUSR1, &asteriskmail_sigusr1);
+
+	if (upgrade_fd > -1) {
+		if (am_upgrade_receive(upgrade_fd, fds, nsock) != 0)
+			errx(EX_SOFTWARE, "Cannot take over from the previous instance");
+		nsmtp = nsock[AM_PROTO_SMTP];
+		npop3 = nsock[AM_PROTO_POP3];
+		nhttpd = nsock[AM_PROTO_HTTPD];
+		nimap = nsock[AM_PROTO_IMAP];
+		goto serve;
+	}
 	nsmtp = asteriskmail_do_listen(host, smtp_port, ASTERISKMAIL_BUF_MAX,
 	    fds, ASTERISKMAIL_SOCK_MAX);
 	if (nsmtp < 1) {
@@ -412,33 +1859,26 @@ main(int argc, char **argv)
 		errx(EX_SOFTWARE, "Could not bind to "
 		    "'%s' and '%s'\n", host, pop3_port);
 	}
-	while (1) {
-		int ns = nsmtp + npop3 + nhttpd;
-		int c;
-		int f;
-
-		for (c = 0; c != ns; c++) {
-			fds[c].events = (POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI |
-			    POLLERR | POLLHUP | POLLNVAL);
-			fds[c].revents = 0;
-		}
-		if (poll(fds, ns, -1) < 0)
-			errx(EX_SOFTWARE, "Polling failed");
-
-		for (c = 0; c != ns; c++) {
-			if (fds[c].revents == 0)
-				continue;
-			f = accept(fds[c].fd, NULL, NULL);
-			if (f < 0)
-				continue;
-			if (c < nsmtp)
-				handle_smtp_connection(f);
-			else if (c < nsmtp + npop3)
-				handle_pop3_connection(f);
-			else
-				handle_httpd_connection(f);
-			close(f);
+	if (imap_port != NULL) {
+		nimap = asteriskmail_do_listen(host, imap_port, ASTERISKMAIL_BUF_MAX,
+		    fds + nsmtp + npop3 + nhttpd, ASTERISKMAIL_SOCK_MAX - nsmtp - npop3 - nhttpd);
+		if (nimap < 1) {
+			errx(EX_SOFTWARE, "Could not bind to "
+			    "'%s' and '%s'\n", host, imap_port);
 		}
 	}
+serve:
+	/* after the store of a previous instance has been loaded */
+	if (am_replica_init() != 0)
+		errx(EX_SOFTWARE, "Cannot start replication thread");
+	nsock[AM_PROTO_SMTP] = nsmtp;
+	nsock[AM_PROTO_POP3] = npop3;
+	nsock[AM_PROTO_HTTPD] = nhttpd;
+	nsock[AM_PROTO_IMAP] = nimap;
+	if (am_backend == AM_BACKEND_KQUEUE)
+		asteriskmail_serve_kqueue(nsock);
+	else
+		asteriskmail_serve_poll(nsock);
 	return (0);
 }
+#endif					/* ASTERISKMAIL_NO_MAIN */
@@ -27,15 +27,20 @@
 #define	_ASTERISKMAIL_H_
 
 #include <stdint.h>
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <string.h>
 #include <poll.h>
+#include <signal.h>
 #include <sysexits.h>
 #include <err.h>
 #include <errno.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <libutil.h>
 
 #include <sys/types.h>
@@ -44,6 +49,7 @@
 #include <sys/filio.h>
 #include <sys/uio.h>
 #include <sys/queue.h>
+#include <sys/cdefs.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
@@ -51,31 +57,465 @@
 #define	ASTERISKMAIL_STRING_MAX	128
 #define	ASTERISKMAIL_BUF_MAX 4096
 #define	ASTERISKMAIL_SOCK_MAX 32
+#define	ASTERISKMAIL_ACCEPT_MAX 64	/* connections accepted per wakeup */
+
+#define	AM_ARENA_BUF_MAX 8192		/* built-in arena buffer */
+#define	AM_POOL_MIN_LOG2 6
+#define	AM_POOL_MIN (1U << AM_POOL_MIN_LOG2)
+#define	AM_POOL_CLASSES 11		/* 64 bytes to 64 KBytes */
+#define	AM_POOL_FREE_MAX 64		/* free entries kept per class */
+#define	AM_MESSAGE_SIZE_MIN 1024	/* initial message buffer */
+#define	AM_EPOCH_SLOTS 1024		/* concurrent store readers */
+#define	AM_INDEX_MIN 64			/* initial message index size */
+#define	AM_TIMER_TICK_MS 100		/* session timeout resolution */
+#define	AM_TLS_SESSION_CACHE 1024	/* cached TLS sessions */
+#define	AM_TLS_SESSION_TIMEOUT 3600	/* TLS session lifetime in seconds */
+#define	AM_WEBHOOK_WINDOW_MS 100	/* default batching window */
+#define	AM_WEBHOOK_QUEUE_MAX 4096	/* messages waiting for the webhook */
+#define	AM_WEBHOOK_BATCH_MAX 256	/* messages per webhook request */
+#define	AM_WEBHOOK_RETRY_MS 250		/* first webhook retry delay */
+#define	AM_WEBHOOK_RETRY_MAX 8		/* webhook retries per batch */
+#define	AM_WEBHOOK_TIMEOUT 10		/* webhook I/O timeout in seconds */
+#define	AM_HTTPD_DEFLATE_MIN 256	/* smallest HTTP body worth compressing */
+#define	AM_HTTPD_BODY_MAX 65536		/* largest HTTP request body */
+#define	AM_HTTP_HEAD_MAX 8192		/* HTTP request line and headers */
+#define	AM_HTTP_HEADER_MAX 32		/* HTTP request headers */
+#define	AM_HTTP_PARAM_MAX 64		/* HTTP query and form parameters */
+#define	AM_SMS_SEGMENT_MAX 140		/* characters per outbound SMS */
+#define	AM_SMS_RCPT_MAX 256		/* recipients per outbound SMS */
+#define	AM_SMS_PHONE_MAX 32		/* characters per phone number */
+#define	AM_SMS_DELAY_US 250000		/* default pause between outbound SMS */
+#define	AM_ASTERISK_PATH "/usr/local/sbin/asterisk"
+#define	AM_DONGLE_MAX 16		/* dongles in the outbound pool */
+#define	AM_DONGLE_NAME_MAX 32		/* characters per dongle name */
+#define	AM_DONGLE_FAIL_MAX 3		/* failures in a row opening the breaker */
+#define	AM_DONGLE_COOLDOWN_MS 30000	/* time until an open breaker is probed */
+#define	AM_DEDUP_BUCKETS 4096		/* fingerprint buckets, power of two */
+#define	AM_DEDUP_SLOTS 4		/* fingerprints per bucket */
+#define	AM_DEDUP_KICKS 16		/* relocations per fingerprint insert */
+#define	AM_DEDUP_WINDOW 86400		/* default duplicate window in seconds */
+#define	AM_COLD_AGE 3600		/* default idle time of cold messages */
+#define	AM_COLD_PASSES 8		/* idle scans before compressing */
+#define	AM_COLD_BATCH 256		/* messages compressed per snapshot */
+#define	AM_COLD_CACHE 64		/* decompressed messages kept */
+#define	AM_COLD_DICT_MAX 16384		/* compression dictionary */
+#define	AM_COLD_SAMPLE_MAX 512		/* dictionary bytes per message */
+#define	AM_COLD_TRAIN_MIN 32		/* messages to train the dictionary */
+#define	AM_SEARCH_BUCKETS 65536		/* word hash buckets */
+#define	AM_SEARCH_TOKEN_MAX 32		/* bytes indexed per word */
+#define	AM_SEARCH_QUERY_MAX 16		/* words per search query */
+#define	AM_SEARCH_RESULTS 50		/* default messages per search */
+#define	AM_SEARCH_COMPACT_MIN 1024	/* removed messages before compacting */
+#define	AM_REPLICA_BUF_MAX 65536	/* replication stream buffer */
+#define	AM_REPLICA_QUEUE_MAX (64U << 20)	/* bytes waiting for the replica */
+#define	AM_REPLICA_WAIT_MS 100		/* time between acknowledgement checks */
+#define	AM_REPLICA_RETRY_MS 1000	/* time between bind or connect attempts */
+#define	AM_REPLICA_TIMEOUT 10		/* replication I/O timeout in seconds */
+#define	AM_UPGRADE_QUEUE_MAX (64U << 20)	/* bytes waiting for the new instance */
+#define	AM_UPGRADE_DRAIN 60		/* seconds sessions get to finish on upgrade */
+#define	AM_MAILBOX_MAX 64		/* mailboxes, at most 64 */
+#define	AM_MAILBOX_HASH 256		/* recipient hash buckets */
+#define	AM_MAILBOX_RCPT_MAX 16		/* mailboxes per SMTP message */
+
+enum {
+	AM_PROTO_SMTP,
+	AM_PROTO_POP3,
+	AM_PROTO_HTTPD,
+	AM_PROTO_IMAP,
+	AM_PROTO_MAX,
+};
+
+/*
+ * The capture log starts with AM_CAPTURE_MAGIC followed by records.
+ * Each record is a header followed by "length" bytes of data. All
+ * header fields are little endian. The time is in nanoseconds since
+ * the capture was started.
+ */
+#define	AM_CAPTURE_MAGIC "AMCAP001"
+#define	AM_CAPTURE_MAGIC_LEN 8
+
+enum {
+	AM_CAPTURE_OPEN,
+	AM_CAPTURE_READ,		/* client to server */
+	AM_CAPTURE_WRITE,		/* server to client */
+	AM_CAPTURE_CLOSE,
+};
+
+struct am_capture_hdr {
+	uint64_t time;
+	uint32_t conn;
+	uint32_t length;
+	uint8_t	proto;
+	uint8_t	type;
+} __packed;
+
+enum {
+	AM_EVICT_NONE,
+	AM_EVICT_OLDEST,
+	AM_EVICT_DELIVERED,
+};
+
+enum {
+	AM_BACKEND_POLL,
+	AM_BACKEND_KQUEUE,
+};
+
+enum {
+	AM_CNT_SMTP_CONNECTIONS,
+	AM_CNT_POP3_CONNECTIONS,
+	AM_CNT_HTTPD_CONNECTIONS,
+	AM_CNT_IMAP_CONNECTIONS,
+	AM_CNT_MESSAGES_RECEIVED,
+	AM_CNT_BYTES_RECEIVED,
+	AM_CNT_MESSAGES_REJECTED,
+	AM_CNT_MESSAGES_EVICTED,
+	AM_CNT_MESSAGES_RETRIEVED,
+	AM_CNT_MESSAGES_DUPLICATE,
+	AM_CNT_SMS_SENT,
+	AM_CNT_SMS_FAILED,
+	AM_CNT_REJECTED_GLOBAL,
+	AM_CNT_REJECTED_PER_IP,
+	AM_CNT_SESSIONS_TIMED_OUT,
+	AM_CNT_TLS_FULL,
+	AM_CNT_TLS_RESUMED,
+	AM_CNT_TLS_FAILED,
+	AM_CNT_WEBHOOK_POSTED,
+	AM_CNT_WEBHOOK_DROPPED,
+	AM_CNT_WEBHOOK_ERRORS,
+	AM_CNT_HTTPD_IDENTITY,
+	AM_CNT_HTTPD_GZIP,
+	AM_CNT_HTTPD_DEFLATE,
+	AM_CNT_INBOX_HIT,
+	AM_CNT_INBOX_MISS,
+	AM_CNT_COLD_HIT,
+	AM_CNT_COLD_MISS,
+	AM_CNT_REPLICA_SENT,
+	AM_CNT_REPLICA_APPLIED,
+	AM_CNT_REPLICA_FULL,
+	AM_CNT_REPLICA_INCREMENTAL,
+	AM_CNT_MAX,
+};
+
+enum {
+	AM_GAUGE_STORE_BYTES,
+	AM_GAUGE_STORE_MESSAGES,
+	AM_GAUGE_OUTBOUND_QUEUE,
+	AM_GAUGE_SESSIONS,
+	AM_GAUGE_IMAP_IDLE,
+	AM_GAUGE_WEBHOOK_QUEUE,
+	AM_GAUGE_COLD_MESSAGES,
+	AM_GAUGE_COLD_BYTES,
+	AM_GAUGE_SEARCH_TERMS,
+	AM_GAUGE_SEARCH_BYTES,
+	AM_GAUGE_REPLICA_CONNECTED,
+	AM_GAUGE_REPLICA_LAG,
+	AM_GAUGE_REPLICA_QUEUE,
+	AM_GAUGE_READ_ONLY,
+	AM_GAUGE_MAX,
+};
+
+enum {
+	AM_HIST_SMTP_DATA,
+	AM_HIST_IMPORT,
+	AM_HIST_POP3_RETR,
+	AM_HIST_INBOX_RENDER,
+	AM_HIST_SMS_SEND,
+	AM_HIST_TLS_HANDSHAKE,
+	AM_HIST_WEBHOOK_POST,
+	AM_HIST_SEARCH,
+	AM_HIST_MAX,
+};
+
+enum {
+	AM_TRACE_READ_LINE,
+	AM_TRACE_DISPATCH,
+	AM_TRACE_APPEND,
+	AM_TRACE_IMPORT,
+	AM_TRACE_BASE64,
+	AM_TRACE_WRITE,
+	AM_TRACE_MAX,
+};
+
+#ifdef ASTERISKMAIL_TRACE
+#define	AM_TRACE_SESSION(proto) am_trace_session(proto)
+#define	AM_TRACE_SESSION_END() am_trace_session_end()
+#define	AM_TRACE_BEGIN(var) uint64_t var = am_trace_now()
+#define	AM_TRACE_END(id, var) am_trace_record(id, var)
+#else
+#define	AM_TRACE_SESSION(proto) do { } while (0)
+#define	AM_TRACE_SESSION_END() do { } while (0)
+#define	AM_TRACE_BEGIN(var) do { } while (0)
+#define	AM_TRACE_END(id, var) do { } while (0)
+#endif
+
+struct am_arena_chunk;
+
+struct am_arena {
+	struct am_arena_chunk *chunk;
+	size_t	offset;
+	uint8_t	buffer[AM_ARENA_BUF_MAX] __aligned(sizeof(void *));
+};
+
+/* memory which is freed once all store readers have moved past it */
+struct am_retire {
+	struct am_retire *next;
+	uint64_t epoch;
+	void	(*func)(struct am_retire *);
+};
+
+struct am_mailbox;
 
 struct am_message {
-	TAILQ_ENTRY(am_message) entry;
-	int	message_id;
+	struct am_retire retire;
+	struct am_mailbox *mbox;	/* NULL is the default mailbox */
+	uint64_t uid;			/* unique and increasing */
 	int	bytes;
-	void   *data;
+	int	size;			/* allocated size of data */
+	_Atomic int flags;
+#define	AM_MSG_DELIVERED 0x0001		/* retrieved by a POP3 client */
+#define	AM_MSG_STORED 0x0002		/* part of the message store */
+#define	AM_MSG_KEEP 0x0004		/* not worth compressing */
+#define	AM_MSG_IDLE_SHIFT 8		/* store scans without reads */
+#define	AM_MSG_IDLE_MASK 0xff00
+	_Atomic(void *) data;		/* tagged by AM_COLD_TAG when compressed */
+#define	AM_COLD_TAG 1
+};
+
+/* a piece of the HTTP request buffer */
+struct am_http_view {
+	uint32_t off;
+	uint32_t len;
+};
+
+struct am_http_field {
+	struct am_http_view name;
+	struct am_http_view value;
+	int	decoded;		/* value was decoded in place */
+};
+
+/*
+ * State of the incremental HTTP/1.x request parser. All strings are
+ * views into the buffer given to am_http_parse(), so the buffer may
+ * be moved between calls.
+ */
+struct am_http_req {
+	int	state;
+	int	status;			/* HTTP status of a parse error */
+	uint32_t pos;			/* bytes parsed */
+	uint32_t mark;			/* start of the current token */
+	uint32_t mark2;			/* start of the current value */
+	uint64_t chunk;			/* bytes left of the current chunk */
+	int64_t	length;			/* Content-Length or -1 */
+	int	chunked;
+	int	expect;			/* client waits for 100 Continue */
+	struct am_http_view method;
+	struct am_http_view path;
+	struct am_http_view query;
+	struct am_http_view version;
+	struct am_http_view body;
+	struct am_http_field header[AM_HTTP_HEADER_MAX];
+	struct am_http_field param[AM_HTTP_PARAM_MAX];
+	int	nheader;
+	int	nparam;
+};
+
+enum {
+	AM_HTTP_ERROR = -1,
+	AM_HTTP_MORE,			/* need more data */
+	AM_HTTP_HEAD,			/* headers done, body follows */
+	AM_HTTP_DONE,			/* request complete */
+};
+
+/* session timeouts in seconds */
+struct am_timeout {
+	unsigned idle;			/* waiting for a command */
+	unsigned command;		/* running one command */
+	unsigned session;		/* whole session */
+};
+
+/* immutable view of the message store, oldest message first */
+struct am_snapshot {
+	struct am_retire retire;
+	struct am_message **msg;
+	uint64_t generation;
+	uint64_t uidnext;		/* next unique message id */
+	uint64_t bytes;			/* allocated bytes */
+	int	count;
+};
+
+struct am_index;
+struct am_inbox;
+
+/*
+ * A mailbox has its own view of the messages routed to it, which is
+ * published together with the view of the whole store. The first
+ * mailbox is the default one, which takes all messages for unknown
+ * recipients, and logs in with am_username and am_password.
+ */
+struct am_mailbox {
+	const char *name;
+	const char *password;		/* NULL accepts any password */
+	_Atomic(struct am_snapshot *) store;
+	struct am_index *index;		/* protected by the store lock */
+	_Atomic(struct am_inbox *) inbox; /* HTTP inbox page */
+	_Atomic uint64_t received;
+	_Atomic uint64_t retrieved;
+	int	id;
+};
+
+/*
+ * One outbound SMS to one recipient. All segments are sent in order by
+ * the same dongle, and the first failed segment ends the job.
+ */
+struct am_dongle_job {
+	TAILQ_ENTRY(am_dongle_job) entry;
+	int    *pending;		/* jobs of the batch not done */
+	const char *phone;
+	char  **seg;
+	int	nseg;
+	int	sent;			/* segments sent */
+	int	error;
 };
 
 extern const int base64_get(char **);
 extern const int base64_get_utf8(char **);
 extern char *handle_read_line(FILE *io);
+extern int handle_flush(FILE *io);
+extern FILE *handle_fdopen(int, int, struct am_arena *);
+extern void handle_close(FILE *, int);
+extern int handle_writev(FILE *, struct iovec *, int);
+extern ssize_t handle_read(FILE *, void *, size_t);
 extern int handle_extract_receip(const char *, char *, int);
 extern int handle_compare(const char *, const char *);
-extern int handle_foreach_message(struct am_message **);
+extern const struct am_snapshot *handle_snapshot_enter(void);
+extern void handle_snapshot_leave(void);
+extern const struct am_snapshot *handle_mailbox_enter(const struct am_mailbox *);
+extern struct am_message *handle_copy_message(const struct am_message *);
+extern const char *handle_message_data(const struct am_message *);
+extern int handle_message_length(const struct am_message *);
+extern const char *handle_message_header(const char *, const char *, const char *, size_t *);
 extern void handle_import(struct am_message *);
 extern int handle_delete_message(struct am_message *);
+extern struct am_message *handle_snapshot_lookup(const struct am_snapshot *, uint64_t);
+extern int handle_remove_messages(const uint64_t *, int);
 extern int handle_insert_message(struct am_message *);
 extern int handle_append_message(struct am_message *, uint8_t);
+extern int handle_store_check(size_t);
+extern void handle_store_swap(struct am_message **, void **, int);
 extern struct am_message *handle_create_message(void);
 extern void handle_smtp_connection(int);
 extern void handle_pop3_connection(int);
 extern void handle_httpd_connection(int);
+extern void handle_imap_connection(int);
+extern void am_imap_notify(void);
 extern char *strafter(char *, const char *);
+extern uint64_t am_metrics_now(void);
+extern void am_metrics_count(int, uint64_t);
+extern void am_metrics_gauge(int, int64_t);
+extern void am_metrics_observe(int, uint64_t);
+extern void am_metrics_print(FILE *);
+extern void am_arena_init(struct am_arena *);
+extern void *am_arena_alloc(struct am_arena *, size_t);
+extern char *am_arena_strdup(struct am_arena *, const char *);
+extern void am_arena_free(struct am_arena *);
+extern size_t am_pool_size(size_t);
+extern void *am_pool_alloc(size_t);
+extern void am_pool_free(void *, size_t);
+extern void am_epoch_enter(void);
+extern void am_epoch_leave(void);
+extern void am_epoch_retire(struct am_retire *, void (*)(struct am_retire *));
+extern int am_timer_init(void);
+extern void am_timer_start(int, int);
+extern void am_timer_stop(void);
+extern void am_timer_expire(void);
+extern void am_timer_command(int);
+extern int am_timer_parse(const char *);
+extern int am_capture_open(const char *);
+extern int am_capture_enabled(void);
+extern uint32_t am_capture_conn_alloc(void);
+extern void am_capture_record(uint32_t, uint8_t, uint8_t, const void *, uint32_t);
+extern FILE *am_conn_fdopen(int, int);
+extern int handle_starttls(FILE *);
+extern int handle_tls_active(void);
+extern int am_tls_init(const char *, const char *);
+extern int am_tls_enabled(void);
+extern void *am_tls_accept(int);
+extern int handle_store_handoff(int);
+extern int handle_store_handoff_stop(void);
+extern const struct am_snapshot *handle_store_follow(uint64_t *);
+extern int am_upgrade_spawn(const char *, char **, const struct pollfd *, const int *);
+extern int am_upgrade_wait(int);
+extern int am_upgrade_fd(void);
+extern int am_upgrade_receive(int, struct pollfd *, int *);
+extern int am_upgrade_message(int, const struct am_message *);
+extern int am_upgrade_end(int);
+extern void am_upgrade_queue_message(const struct am_message *);
+extern void am_upgrade_queue_remove(const uint64_t *, int);
+extern void am_upgrade_attach(void);
+extern int am_upgrade_forward(int);
+extern int am_upgrade_detach(void);
+extern int am_webhook_parse(const char *);
+extern int am_webhook_init(void);
+extern void am_webhook_post(uint64_t);
+extern void am_webhook_flush(void);
+extern void am_http_init(struct am_http_req *);
+extern int am_http_parse(struct am_http_req *, char *, size_t *);
+extern int am_http_match(const char *, const struct am_http_view *, const char *);
+extern char *am_http_string(char *, const struct am_http_view *);
+extern char *am_http_header(struct am_http_req *, char *, const char *);
+extern char *am_http_param(struct am_http_req *, char *, const char *, int *);
+extern int am_http_form(struct am_http_req *, char *);
+extern int am_mailbox_parse(const char *);
+extern struct am_mailbox *am_mailbox_default(void);
+extern struct am_mailbox *am_mailbox_get(int);
+extern int am_mailbox_count(void);
+extern struct am_mailbox *am_mailbox_route(const char *);
+extern struct am_mailbox *am_mailbox_login(const char *, const char *);
+extern void am_mailbox_print(FILE *);
+extern int am_dongle_parse(const char *);
+extern int am_dongle_init(void);
+extern void am_dongle_send(struct am_dongle_job *, int);
+extern void am_dongle_print(FILE *);
+extern uint64_t am_dedup_hash(const struct am_message *, uint64_t);
+extern int am_dedup_check(uint64_t);
+extern void am_dedup_forget(uint64_t);
+extern const char *am_cold_data(const struct am_message *, const void *);
+extern int am_cold_last_byte(const void *);
+extern void *am_cold_copy(const struct am_message *, const void *);
+extern void am_cold_free(void *);
+extern size_t am_cold_charge(const void *);
+extern void am_cold_leave(void);
+extern int am_cold_init(void);
+extern void am_search_insert(const struct am_message *);
+extern void am_search_remove(uint64_t);
+extern int am_search_query(struct am_arena *, const char *, uint64_t **);
+extern int am_replica_parse(const char *);
+extern int am_replica_listen(const char *, const char *);
+extern int am_replica_init(void);
+extern void am_replica_stop(void);
+extern void am_replica_promote(void);
+extern uint64_t am_replica_attach(void);
+extern void am_replica_message(const struct am_message *);
+extern void am_replica_remove(const uint64_t *, int);
+extern void am_trace_init(void);
+extern uint64_t am_trace_now(void);
+extern void am_trace_session(const char *);
+extern void am_trace_session_end(void);
+extern void am_trace_record(int, uint64_t);
+extern void am_trace_print(FILE *);
 extern char hostname[128];
 extern const char *am_username;
 extern const char *am_password;
+extern uint64_t am_store_max_bytes;
+extern int am_store_max_count;
+extern int am_evict_policy;
+extern struct am_timeout am_timeout[AM_PROTO_MAX];
+extern int am_tls_https;
+extern unsigned am_webhook_window;
+extern const char *am_asterisk_path;
+extern unsigned am_dedup_window;
+extern unsigned am_cold_age;
+extern _Atomic int am_read_only;
+extern uint64_t am_replica_id;
 
 #endif					/* _ASTERISKMAIL_H_ */
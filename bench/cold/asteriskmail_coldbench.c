@@ -0,0 +1,614 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Cold storage benchmark for AsteriskMail. The inbox is filled by SMTP
+ * with a corpus of SMS like messages, made from the kinds of texts a
+ * phone typically receives: one time codes, carrier notices, bank
+ * alerts, delivery notices and personal messages. The resident set
+ * size of the server is then sampled before and after the background
+ * compression has settled, and POP3 RETR latency is measured for a
+ * small hot working set and for random reads across the whole inbox.
+ * Run it once against a server started with "-Z 0" and once with a
+ * short age like "-Z 1" to see the tradeoff. The results are printed
+ * as one JSON object per line.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define	BENCH_HOT	16		/* messages in the hot working set */
+
+struct bench_stats {
+	uint64_t *sample;
+	size_t	count;
+	size_t	max;
+	uint64_t errors;
+	uint64_t bytes;
+};
+
+static const char *bench_service[] = {
+	"Google", "Microsoft", "Apple ID", "BankID", "Vipps", "PayPal",
+	"WhatsApp", "Telegram", "Signal", "Amazon", "Steam", "Discord",
+};
+
+static const char *bench_shop[] = {
+	"REMA 1000", "KIWI", "Circle K", "Elkjop", "Spotify", "Netflix",
+	"Ruter", "Vinmonopolet", "XXL Sport", "IKEA",
+};
+
+static const char *bench_carrier[] = {
+	"PostNord", "Posten", "DHL Express", "Helthjem", "UPS", "Bring",
+};
+
+static const char *bench_word[] = {
+	"hi", "are", "you", "coming", "home", "tonight", "dinner", "at",
+	"seven", "ok", "thanks", "see", "you", "later", "can", "call",
+	"me", "when", "free", "running", "late", "sorry", "the", "kids",
+	"need", "pickup", "from", "school", "love", "you", "bring", "milk",
+	"meeting", "moved", "to", "tomorrow", "great", "news", "happy",
+	"birthday", "lol", "where", "are", "we", "meeting", "train", "is",
+};
+
+static const char *bench_host = "127.0.0.1";
+static const char *bench_smtp_port = "25";
+static const char *bench_pop3_port = "110";
+static const char *bench_http_port = "80";
+static const char *bench_user = "asteriskmail";
+static const char *bench_pass = "asteriskmail";
+static int bench_messages = 10000;
+static int bench_requests = 2000;
+static int bench_wait = 120;
+static int bench_timeout = 5;
+static pid_t bench_pid;
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+bench_record(struct bench_stats *ps, uint64_t ns)
+{
+	if (ps->count == ps->max) {
+		ps->max = ps->max ? 2 * ps->max : 1024;
+		ps->sample = realloc(ps->sample, ps->max * sizeof(ps->sample[0]));
+		if (ps->sample == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+	ps->sample[ps->count++] = ns;
+}
+
+static int
+bench_connect(const char *port)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *res0;
+	struct timeval tv = { .tv_sec = bench_timeout };
+	int flag = 1;
+	int s = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(bench_host, port, &hints, &res) != 0)
+		return (-1);
+
+	for (res0 = res; res0 != NULL; res0 = res0->ai_next) {
+		s = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol);
+		if (s < 0)
+			continue;
+		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(s, res0->ai_addr, res0->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+
+	if (s < 0)
+		return (-1);
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return (s);
+}
+
+/* read one reply line into the given buffer, returns its length or -1 */
+static ssize_t
+bench_line(int s, char *line, size_t max)
+{
+	size_t len = 0;
+	ssize_t total = 0;
+	char c;
+
+	while (read(s, &c, 1) == 1) {
+		total++;
+		if (len + 1 < max)
+			line[len++] = c;
+		if (c == '\n') {
+			line[len] = 0;
+			return (total);
+		}
+	}
+	return (-1);
+}
+
+static int
+bench_command(int s, const char *cmd)
+{
+	size_t len = strlen(cmd);
+
+	return (write(s, cmd, len) != (ssize_t)len);
+}
+
+/* read lines until one starts with the given prefix */
+static int
+bench_expect(int s, const char *prefix)
+{
+	char line[512];
+
+	do {
+		if (bench_line(s, line, sizeof(line)) < 0)
+			return (1);
+	} while (strncmp(line, prefix, strlen(prefix)) != 0);
+	return (0);
+}
+
+#define	BENCH_NUM(array) (sizeof(array) / sizeof((array)[0]))
+
+static unsigned
+bench_rand(unsigned *pseed, unsigned num)
+{
+	*pseed = *pseed * 1103515245U + 12345U;
+	return ((*pseed >> 8) % num);
+}
+
+/* produce the body of message "x", the same for every run */
+static void
+bench_text(char *text, size_t max, int x)
+{
+	unsigned seed = x * 2654435761U;
+	unsigned a, b, c, d;
+	size_t len;
+	int y;
+
+	a = bench_rand(&seed, 10000);
+	b = bench_rand(&seed, 10000);
+	c = bench_rand(&seed, 10000);
+	d = bench_rand(&seed, 10000);
+
+	switch (bench_rand(&seed, 10)) {
+	case 0:
+	case 1:
+	case 2:
+	case 3:
+		snprintf(text, max, "%s code: %04u%02u. It expires in %u "
+		    "minutes. Do not share this code with anyone, %s will "
+		    "never ask for it.", bench_service[a % BENCH_NUM(bench_service)],
+		    b, c % 100, 5 + d % 10, bench_service[a % BENCH_NUM(bench_service)]);
+		break;
+	case 4:
+		snprintf(text, max, "Card ending %04u was charged NOK %u.%02u "
+		    "at %s. Available balance is NOK %u.%02u. Not you? Call "
+		    "+47 915 %04u.", a, b % 2000, c % 100,
+		    bench_shop[d % BENCH_NUM(bench_shop)], b * 3, d % 100, c);
+		break;
+	case 5:
+		snprintf(text, max, "%s: Your parcel %04u%04u will be "
+		    "delivered tomorrow between %02u:00 and %02u:00. Track it "
+		    "or change the delivery at https://track.example.com/%04u%04u",
+		    bench_carrier[a % BENCH_NUM(bench_carrier)], b, c,
+		    8 + d % 4, 14 + a % 6, b, c);
+		break;
+	case 6:
+		snprintf(text, max, "You have used %u%% of your %u GB data "
+		    "allowance for this month. Buy more data by replying "
+		    "DATA to this message. Roaming rates apply abroad.",
+		    75 + a % 26, 5 * (1 + b % 6));
+		break;
+	default:
+		/* personal messages have no structure at all */
+		len = 0;
+		text[0] = 0;
+		for (y = 3 + a % 30; y != 0 && len + 16 < max; y--) {
+			len += snprintf(text + len, max - len, "%s%s", len ? " " : "",
+			    bench_word[bench_rand(&seed, BENCH_NUM(bench_word))]);
+		}
+		break;
+	}
+}
+
+/* fill the inbox with the corpus, one SMTP session each */
+static void
+bench_fill(void)
+{
+	char line[2048];
+	char text[1024];
+	int s;
+	int x;
+
+	for (x = 0; x != bench_messages; x++) {
+		bench_text(text, sizeof(text), x);
+		snprintf(line, sizeof(line),
+		    "Date: Mon, 19 Oct 2026 %02d:%02d:%02d +0200\r\n"
+		    "Subject: SMS from +47%08d\r\n"
+		    "From: +47%08d <+47%08d@localhost>\r\n"
+		    "Content-Type: text/plain; charset=utf-8\r\n"
+		    "\r\n"
+		    "%s\r\n"
+		    ".\r\n",
+		    x / 3600 % 24, x / 60 % 60, x % 60,
+		    90000000 + x % 5000, 90000000 + x % 5000, 90000000 + x % 5000,
+		    text);
+
+		s = bench_connect(bench_smtp_port);
+		if (s < 0 || bench_expect(s, "2") ||
+		    bench_command(s, "HELO localhost\r\n") || bench_expect(s, "2") ||
+		    bench_command(s, "MAIL FROM:<localhost>\r\n") || bench_expect(s, "2") ||
+		    bench_command(s, "RCPT TO:<localhost>\r\n") || bench_expect(s, "2") ||
+		    bench_command(s, "DATA\r\n") || bench_expect(s, "3") ||
+		    bench_command(s, line) || bench_expect(s, "2"))
+			errx(EX_UNAVAILABLE, "Cannot deliver message %d", x);
+		bench_command(s, "QUIT\r\n");
+		close(s);
+	}
+}
+
+/* read a value from the metrics page, returns -1 when not found */
+static int64_t
+bench_metric(const char *name)
+{
+	char line[512];
+	char cmd[256];
+	size_t len = strlen(name);
+	int64_t value = -1;
+	int s;
+
+	s = bench_connect(bench_http_port);
+	if (s < 0)
+		return (-1);
+	snprintf(cmd, sizeof(cmd), "GET /metrics HTTP/1.0\r\n"
+	    "Host: %s\r\n"
+	    "\r\n", bench_host);
+	if (bench_command(s, cmd) == 0) {
+		while (bench_line(s, line, sizeof(line)) >= 0) {
+			if (strncmp(line, name, len) == 0 && line[len] == ' ')
+				value = strtoll(line + len + 1, NULL, 10);
+		}
+	}
+	close(s);
+	return (value);
+}
+
+/* resident set size of the server in kilobytes */
+static int64_t
+bench_server_rss(void)
+{
+	char cmd[64];
+	char line[64];
+	FILE *fp;
+	char *ptr;
+
+	if (bench_pid == 0)
+		return (-1);
+	snprintf(cmd, sizeof(cmd), "ps -o rss= -p %d", (int)bench_pid);
+	fp = popen(cmd, "r");
+	if (fp == NULL)
+		return (-1);
+	ptr = fgets(line, sizeof(line), fp);
+	pclose(fp);
+	if (ptr == NULL)
+		return (-1);
+	return (strtoll(ptr, NULL, 10));
+}
+
+/*
+ * Wait until the background compression has stopped making progress
+ * for a couple of seconds, or until the time is up.
+ */
+static void
+bench_settle(void)
+{
+	uint64_t end = bench_now() + (uint64_t)bench_wait * 1000000000ULL;
+	int64_t last = -1;
+	int64_t value;
+	int same = 0;
+
+	while (bench_now() < end) {
+		value = bench_metric("asteriskmail_cold_messages");
+		if (value < 0)
+			return;
+		if (value != 0 && value == last) {
+			if (++same == 4)
+				return;
+		} else {
+			same = 0;
+		}
+		last = value;
+		usleep(500000);
+	}
+}
+
+static void
+bench_report(const char *state, int64_t count)
+{
+	printf("{\"op\":\"memory\",\"state\":\"%s\",\"messages\":%d,"
+	    "\"rss_kb\":%jd,\"cold_messages\":%jd,\"cold_bytes\":%jd,"
+	    "\"store_bytes\":%jd}\n", state, bench_messages,
+	    (intmax_t)bench_server_rss(), (intmax_t)count,
+	    (intmax_t)bench_metric("asteriskmail_cold_bytes"),
+	    (intmax_t)bench_metric("asteriskmail_store_bytes"));
+	fflush(stdout);
+}
+
+static int
+bench_login(void)
+{
+	char cmd[256];
+	int s;
+
+	s = bench_connect(bench_pop3_port);
+	if (s < 0)
+		return (-1);
+	if (bench_expect(s, "+OK"))
+		goto fail;
+	snprintf(cmd, sizeof(cmd), "USER %s\r\n", bench_user);
+	if (bench_command(s, cmd) || bench_expect(s, "+OK"))
+		goto fail;
+	snprintf(cmd, sizeof(cmd), "PASS %s\r\n", bench_pass);
+	if (bench_command(s, cmd) || bench_expect(s, "+OK"))
+		goto fail;
+	return (s);
+fail:
+	close(s);
+	return (-1);
+}
+
+/* returns the number of messages in the maildrop */
+static int
+bench_stat(int s)
+{
+	char line[512];
+
+	if (bench_command(s, "STAT\r\n") ||
+	    bench_line(s, line, sizeof(line)) < 0 ||
+	    strncmp(line, "+OK ", 4) != 0)
+		return (-1);
+	return (atoi(line + 4));
+}
+
+static int
+bench_retr(int s, int index, struct bench_stats *ps)
+{
+	char line[512];
+	uint64_t start;
+	uint64_t bytes = 0;
+	ssize_t n;
+
+	snprintf(line, sizeof(line), "RETR %d\r\n", index);
+	start = bench_now();
+	if (bench_command(s, line) ||
+	    bench_line(s, line, sizeof(line)) < 0 ||
+	    strncmp(line, "+OK", 3) != 0)
+		return (1);
+	while (1) {
+		n = bench_line(s, line, sizeof(line));
+		if (n < 0)
+			return (1);
+		if (strcmp(line, ".\r\n") == 0)
+			break;
+		bytes += n;
+	}
+	bench_record(ps, bench_now() - start);
+	ps->bytes += bytes;
+	return (0);
+}
+
+static int
+bench_compare(const void *pa, const void *pb)
+{
+	const uint64_t a = *(const uint64_t *)pa;
+	const uint64_t b = *(const uint64_t *)pb;
+
+	return ((a > b) - (a < b));
+}
+
+static double
+bench_percentile(const struct bench_stats *ps, double pct)
+{
+	size_t index;
+
+	if (ps->count == 0)
+		return (0.0);
+	index = (size_t)(pct * (double)(ps->count - 1) / 100.0 + 0.5);
+	return ((double)ps->sample[index] / 1000.0);
+}
+
+/*
+ * Read messages over one POP3 session. The hot pattern cycles through
+ * the newest few messages, which should stay decompressed, while the
+ * random pattern picks any message and mostly has to decompress it.
+ */
+static void
+bench_read(const char *pattern)
+{
+	struct bench_stats stats;
+	uint64_t start;
+	double seconds;
+	int count;
+	int s;
+	int x;
+
+	memset(&stats, 0, sizeof(stats));
+
+	s = bench_login();
+	if (s < 0)
+		errx(EX_UNAVAILABLE, "Cannot log in to POP3 server");
+	count = bench_stat(s);
+	if (count < 1)
+		errx(EX_UNAVAILABLE, "The maildrop is empty");
+
+	srandom(1);
+	start = bench_now();
+	for (x = 0; x != bench_requests; x++) {
+		int index;
+
+		if (strcmp(pattern, "hot") == 0)
+			index = count - (x % BENCH_HOT < count ? x % BENCH_HOT : 0);
+		else
+			index = 1 + random() % count;
+		if (bench_retr(s, index, &stats))
+			stats.errors++;
+	}
+	seconds = (double)(bench_now() - start) / 1000000000.0;
+	bench_command(s, "QUIT\r\n");
+	close(s);
+
+	qsort(stats.sample, stats.count, sizeof(stats.sample[0]), &bench_compare);
+
+	printf("{\"op\":\"pop3_retr\",\"pattern\":\"%s\",\"requests\":%d,"
+	    "\"seconds\":%.3f,\"count\":%zu,\"errors\":%ju,"
+	    "\"bytes_per_request\":%.1f,"
+	    "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+	    pattern, bench_requests, seconds, stats.count,
+	    (uintmax_t)stats.errors,
+	    stats.count ? (double)stats.bytes / stats.count : 0.0,
+	    bench_percentile(&stats, 50.0), bench_percentile(&stats, 99.0),
+	    bench_percentile(&stats, 100.0));
+	fflush(stdout);
+	free(stats.sample);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: asteriskmail_coldbench [-b 127.0.0.1] [-p 25] [-P 110] [-H 80]"
+	    "\n" "       [-u asteriskmail:asteriskmail] [-m 10000] [-n 2000]"
+	    "\n" "       [-w 120] [-t 5] [-x pid]"
+	    "\n" "       -b <addr>     server address"
+	    "\n" "       -p <port>     SMTP port"
+	    "\n" "       -P <port>     POP3 port"
+	    "\n" "       -H <port>     HTTP port, for the metrics page"
+	    "\n" "       -u <user:pw>  POP3 credentials"
+	    "\n" "       -m <num>      number of messages to deliver first, may be zero"
+	    "\n" "       -n <num>      number of reads per access pattern"
+	    "\n" "       -w <sec>      longest time to wait for compression to settle,"
+	    "\n" "                     use zero when the server does not compress"
+	    "\n" "       -t <sec>      I/O timeout"
+	    "\n" "       -x <pid>      process ID of the server, to measure its RSS"
+	    "\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *ptr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:p:P:H:u:m:n:w:t:x:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			bench_host = optarg;
+			break;
+		case 'p':
+			bench_smtp_port = optarg;
+			break;
+		case 'P':
+			bench_pop3_port = optarg;
+			break;
+		case 'H':
+			bench_http_port = optarg;
+			break;
+		case 'u':
+			bench_user = optarg;
+			ptr = strchr(optarg, ':');
+			if (ptr == NULL)
+				usage();
+			*ptr = 0;
+			bench_pass = ptr + 1;
+			break;
+		case 'm':
+			bench_messages = atoi(optarg);
+			break;
+		case 'n':
+			bench_requests = atoi(optarg);
+			break;
+		case 'w':
+			bench_wait = atoi(optarg);
+			break;
+		case 't':
+			bench_timeout = atoi(optarg);
+			break;
+		case 'x':
+			bench_pid = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (bench_messages < 0 || bench_requests < 1 || bench_wait < 0 ||
+	    bench_timeout < 1)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (bench_messages != 0)
+		bench_fill();
+	bench_report("filled", bench_metric("asteriskmail_cold_messages"));
+
+	bench_settle();
+	bench_report("settled", bench_metric("asteriskmail_cold_messages"));
+
+	bench_read("hot");
+	bench_read("random");
+	bench_report("read", bench_metric("asteriskmail_cold_messages"));
+	return (0);
+}
@@ -0,0 +1,480 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * HTTP compression benchmark for AsteriskMail. The inbox is filled with
+ * messages by SMTP, and then fetched repeatedly, once for each content
+ * coding. For every coding, the bytes on the wire, the response time
+ * and the CPU time spent per request are measured. The server CPU time
+ * is only measured when the process ID of the server is given. The
+ * results are printed as one JSON object per line.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+struct bench_stats {
+	uint64_t *sample;
+	size_t	count;
+	size_t	max;
+	uint64_t errors;
+	uint64_t wire;			/* bytes received, headers included */
+	uint64_t body;			/* body bytes received */
+	uint64_t inflated;		/* body bytes after decoding */
+};
+
+static const struct {
+	const char *name;
+	const char *accept;
+	int	wbits;			/* for inflateInit2(), 0 for identity */
+} bench_coding[] = {
+	{ "identity", "identity", 0 },
+	{ "gzip", "gzip", 15 + 16 },
+	{ "deflate", "deflate", 15 },
+};
+
+static const char *bench_host = "127.0.0.1";
+static const char *bench_http_port = "80";
+static const char *bench_smtp_port = "25";
+static const char *bench_path = "/";
+static int bench_messages = 200;
+static int bench_requests = 1000;
+static int bench_timeout = 5;
+static pid_t bench_pid;
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+bench_record(struct bench_stats *ps, uint64_t ns)
+{
+	if (ps->count == ps->max) {
+		ps->max = ps->max ? 2 * ps->max : 1024;
+		ps->sample = realloc(ps->sample, ps->max * sizeof(ps->sample[0]));
+		if (ps->sample == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+	ps->sample[ps->count++] = ns;
+}
+
+static int
+bench_connect(const char *port)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *res0;
+	struct timeval tv = { .tv_sec = bench_timeout };
+	int flag = 1;
+	int s = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(bench_host, port, &hints, &res) != 0)
+		return (-1);
+
+	for (res0 = res; res0 != NULL; res0 = res0->ai_next) {
+		s = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol);
+		if (s < 0)
+			continue;
+		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(s, res0->ai_addr, res0->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+
+	if (s < 0)
+		return (-1);
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return (s);
+}
+
+/* read one reply line into the given buffer */
+static int
+bench_line(int s, char *line, size_t max)
+{
+	size_t len = 0;
+	char c;
+
+	while (read(s, &c, 1) == 1) {
+		if (len + 1 < max)
+			line[len++] = c;
+		if (c == '\n') {
+			line[len] = 0;
+			return (0);
+		}
+	}
+	return (1);
+}
+
+static int
+bench_command(int s, const char *cmd)
+{
+	size_t len = strlen(cmd);
+
+	return (write(s, cmd, len) != (ssize_t)len);
+}
+
+/* read lines until one starts with the given prefix */
+static int
+bench_expect(int s, const char *prefix)
+{
+	char line[512];
+
+	do {
+		if (bench_line(s, line, sizeof(line)))
+			return (1);
+	} while (strncmp(line, prefix, strlen(prefix)) != 0);
+	return (0);
+}
+
+/* fill the inbox with SMS like messages, one SMTP session each */
+static void
+bench_fill(void)
+{
+	char line[1024];
+	int s;
+	int x;
+
+	for (x = 0; x != bench_messages; x++) {
+		snprintf(line, sizeof(line),
+		    "Date: Mon, 19 Oct 2026 12:00:00 +0200\r\n"
+		    "Subject: SMS from +4712345%03d\r\n"
+		    "From: +4712345%03d <+4712345%03d@localhost>\r\n"
+		    "Content-Type: text/plain; charset=utf-8\r\n"
+		    "\r\n"
+		    "Your verification code is %06d. It expires in %d minutes. "
+		    "Do not share this code with anyone.\r\n"
+		    ".\r\n",
+		    x % 1000, x % 1000, x % 1000,
+		    (x * 7919) % 1000000, 5 + x % 10);
+
+		s = bench_connect(bench_smtp_port);
+		if (s < 0 || bench_expect(s, "2") ||
+		    bench_command(s, "HELO localhost\r\n") || bench_expect(s, "2") ||
+		    bench_command(s, "MAIL FROM:<localhost>\r\n") || bench_expect(s, "2") ||
+		    bench_command(s, "RCPT TO:<localhost>\r\n") || bench_expect(s, "2") ||
+		    bench_command(s, "DATA\r\n") || bench_expect(s, "3") ||
+		    bench_command(s, line) || bench_expect(s, "2"))
+			errx(EX_UNAVAILABLE, "Cannot deliver message %d", x);
+		bench_command(s, "QUIT\r\n");
+		close(s);
+	}
+}
+
+/* decode a response body, returns the decoded length or -1 */
+static ssize_t
+bench_inflate(const uint8_t *data, size_t len, int wbits)
+{
+	uint8_t buffer[16384];
+	z_stream zs;
+	ssize_t total = 0;
+	int error;
+
+	if (wbits == 0)
+		return (len);
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, wbits) != Z_OK)
+		return (-1);
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = len;
+	do {
+		zs.next_out = buffer;
+		zs.avail_out = sizeof(buffer);
+		error = inflate(&zs, Z_NO_FLUSH);
+		total += sizeof(buffer) - zs.avail_out;
+	} while (error == Z_OK);
+	inflateEnd(&zs);
+	return (error == Z_STREAM_END ? total : -1);
+}
+
+/*
+ * Fetch the page once, the response ends when the server closes. The
+ * response time does not include decoding the body.
+ */
+static int
+bench_fetch(int coding, struct bench_stats *ps, uint8_t **pbuf, size_t *pmax)
+{
+	char cmd[512];
+	uint8_t *body;
+	uint64_t start;
+	size_t len = 0;
+	ssize_t n;
+	int s;
+
+	start = bench_now();
+	s = bench_connect(bench_http_port);
+	if (s < 0)
+		return (1);
+	snprintf(cmd, sizeof(cmd), "GET %s HTTP/1.0\r\n"
+	    "Host: %s\r\n"
+	    "Accept-Encoding: %s\r\n"
+	    "\r\n", bench_path, bench_host, bench_coding[coding].accept);
+	if (bench_command(s, cmd)) {
+		close(s);
+		return (1);
+	}
+	while (1) {
+		if (len == *pmax) {
+			*pmax = *pmax ? 2 * *pmax : 65536;
+			*pbuf = realloc(*pbuf, *pmax);
+			if (*pbuf == NULL)
+				errx(EX_SOFTWARE, "Out of memory");
+		}
+		n = read(s, *pbuf + len, *pmax - len);
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	close(s);
+	if (n < 0)
+		return (1);
+	start = bench_now() - start;
+
+	body = memmem(*pbuf, len, "\r\n\r\n", 4);
+	if (body == NULL || len < 12 || memcmp(*pbuf + 9, "200", 3) != 0)
+		return (1);
+	body += 4;
+
+	n = bench_inflate(body, len - (body - *pbuf), bench_coding[coding].wbits);
+	if (n < 0)
+		return (1);
+	bench_record(ps, start);
+	ps->wire += len;
+	ps->body += len - (body - *pbuf);
+	ps->inflated += n;
+	return (0);
+}
+
+/* CPU time of the server in microseconds, from "[[dd-]hh:]mm:ss[.cc]" */
+static int64_t
+bench_server_cpu(void)
+{
+	char cmd[64];
+	char line[64];
+	char *ptr;
+	double value = 0.0;
+	FILE *fp;
+
+	if (bench_pid == 0)
+		return (-1);
+	snprintf(cmd, sizeof(cmd), "ps -o time= -p %d", (int)bench_pid);
+	fp = popen(cmd, "r");
+	if (fp == NULL)
+		return (-1);
+	ptr = fgets(line, sizeof(line), fp);
+	pclose(fp);
+	if (ptr == NULL)
+		return (-1);
+
+	while (*ptr == ' ')
+		ptr++;
+	if (strchr(ptr, '-') != NULL) {
+		value = strtod(ptr, &ptr) * 24.0;
+		ptr++;
+	}
+	while (1) {
+		value += strtod(ptr, &ptr);
+		if (*ptr != ':')
+			break;
+		value *= 60.0;
+		ptr++;
+	}
+	return ((int64_t)(value * 1000000.0));
+}
+
+/* CPU time of this process in microseconds */
+static int64_t
+bench_client_cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ((int64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+	    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+static int
+bench_compare(const void *pa, const void *pb)
+{
+	const uint64_t a = *(const uint64_t *)pa;
+	const uint64_t b = *(const uint64_t *)pb;
+
+	return ((a > b) - (a < b));
+}
+
+static double
+bench_percentile(const struct bench_stats *ps, double pct)
+{
+	size_t index;
+
+	if (ps->count == 0)
+		return (0.0);
+	index = (size_t)(pct * (double)(ps->count - 1) / 100.0 + 0.5);
+	return ((double)ps->sample[index] / 1000.0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: asteriskmail_gzipbench [-b 127.0.0.1] [-H 80] [-p 25] [-u /]"
+	    "\n" "       [-m 200] [-n 1000] [-t 5] [-x pid]"
+	    "\n" "       -b <addr>     server address"
+	    "\n" "       -H <port>     HTTP port"
+	    "\n" "       -p <port>     SMTP port"
+	    "\n" "       -u <path>     page to fetch"
+	    "\n" "       -m <num>      number of messages to deliver first, may be zero"
+	    "\n" "       -n <num>      number of requests per content coding"
+	    "\n" "       -t <sec>      I/O timeout"
+	    "\n" "       -x <pid>      process ID of the server, to measure its CPU time"
+	    "\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_stats stats;
+	uint8_t *buffer = NULL;
+	size_t max = 0;
+	uint64_t start;
+	int64_t server;
+	int64_t client;
+	double seconds;
+	int coding;
+	int opt;
+	int x;
+
+	while ((opt = getopt(argc, argv, "b:H:p:u:m:n:t:x:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			bench_host = optarg;
+			break;
+		case 'H':
+			bench_http_port = optarg;
+			break;
+		case 'p':
+			bench_smtp_port = optarg;
+			break;
+		case 'u':
+			bench_path = optarg;
+			break;
+		case 'm':
+			bench_messages = atoi(optarg);
+			break;
+		case 'n':
+			bench_requests = atoi(optarg);
+			break;
+		case 't':
+			bench_timeout = atoi(optarg);
+			break;
+		case 'x':
+			bench_pid = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (bench_messages < 0 || bench_requests < 1 || bench_timeout < 1)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (bench_messages != 0)
+		bench_fill();
+
+	for (coding = 0; coding != (int)(sizeof(bench_coding) / sizeof(bench_coding[0])); coding++) {
+		memset(&stats, 0, sizeof(stats));
+
+		server = bench_server_cpu();
+		client = bench_client_cpu();
+		start = bench_now();
+		for (x = 0; x != bench_requests; x++) {
+			if (bench_fetch(coding, &stats, &buffer, &max))
+				stats.errors++;
+		}
+		seconds = (double)(bench_now() - start) / 1000000000.0;
+		client = bench_client_cpu() - client;
+		if (server > -1) {
+			int64_t value = bench_server_cpu();
+
+			server = (value > -1) ? value - server : -1;
+		}
+		qsort(stats.sample, stats.count, sizeof(stats.sample[0]), &bench_compare);
+
+		printf("{\"op\":\"http_fetch\",\"path\":\"%s\",\"encoding\":\"%s\","
+		    "\"requests\":%d,\"seconds\":%.3f,\"count\":%zu,\"errors\":%ju,"
+		    "\"wire_bytes_per_request\":%.1f,\"body_bytes_per_request\":%.1f,"
+		    "\"decoded_bytes_per_request\":%.1f,"
+		    "\"server_cpu_us_per_request\":%.1f,"
+		    "\"client_cpu_us_per_request\":%.1f,"
+		    "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+		    bench_path, bench_coding[coding].name, bench_requests, seconds,
+		    stats.count, (uintmax_t)stats.errors,
+		    stats.count ? (double)stats.wire / stats.count : 0.0,
+		    stats.count ? (double)stats.body / stats.count : 0.0,
+		    stats.count ? (double)stats.inflated / stats.count : 0.0,
+		    server < 0 ? -1.0 : (double)server / bench_requests,
+		    (double)client / bench_requests,
+		    bench_percentile(&stats, 50.0), bench_percentile(&stats, 99.0),
+		    bench_percentile(&stats, 100.0));
+		free(stats.sample);
+	}
+	free(buffer);
+	return (0);
+}
@@ -0,0 +1,464 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * IMAP IDLE benchmark for AsteriskMail. A number of clients log in,
+ * select INBOX and wait in IDLE. Then messages are delivered by SMTP,
+ * one at a time, and the time from the end of the DATA command until
+ * each idle client receives the EXISTS response is measured. When the
+ * process ID of the server is given, the memory cost of the idle
+ * connections is measured as well. The results are printed as one JSON
+ * object per line.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+struct bench_stats {
+	uint64_t *sample;
+	size_t	count;
+	size_t	max;
+	uint64_t errors;
+};
+
+struct bench_idler {
+	char	buffer[256];
+	size_t	len;
+	int	s;
+	int	notified;
+};
+
+static const char *bench_host = "127.0.0.1";
+static const char *bench_imap_port = "143";
+static const char *bench_smtp_port = "25";
+static const char *bench_user = "asteriskmail";
+static const char *bench_pass = "asteriskmail";
+static int bench_clients = 100;
+static int bench_messages = 100;
+static int bench_wait = 10;
+static int bench_timeout = 5;
+static pid_t bench_pid;
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+bench_record(struct bench_stats *ps, uint64_t ns)
+{
+	if (ps->count == ps->max) {
+		ps->max = ps->max ? 2 * ps->max : 1024;
+		ps->sample = realloc(ps->sample, ps->max * sizeof(ps->sample[0]));
+		if (ps->sample == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+	ps->sample[ps->count++] = ns;
+}
+
+static int
+bench_connect(const char *port)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *res0;
+	struct timeval tv = { .tv_sec = bench_timeout };
+	int flag = 1;
+	int s = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(bench_host, port, &hints, &res) != 0)
+		return (-1);
+
+	for (res0 = res; res0 != NULL; res0 = res0->ai_next) {
+		s = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol);
+		if (s < 0)
+			continue;
+		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(s, res0->ai_addr, res0->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+
+	if (s < 0)
+		return (-1);
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return (s);
+}
+
+/* read one reply line into the given buffer */
+static int
+bench_line(int s, char *line, size_t max)
+{
+	size_t len = 0;
+	char c;
+
+	while (read(s, &c, 1) == 1) {
+		if (len + 1 < max)
+			line[len++] = c;
+		if (c == '\n') {
+			line[len] = 0;
+			return (0);
+		}
+	}
+	return (1);
+}
+
+static int
+bench_command(int s, const char *cmd)
+{
+	size_t len = strlen(cmd);
+
+	return (write(s, cmd, len) != (ssize_t)len);
+}
+
+/* read lines until one starts with the given prefix */
+static int
+bench_expect(int s, const char *prefix)
+{
+	char line[512];
+
+	do {
+		if (bench_line(s, line, sizeof(line)))
+			return (1);
+	} while (strncmp(line, prefix, strlen(prefix)) != 0);
+	return (0);
+}
+
+static int
+bench_idle_start(struct bench_idler *pi)
+{
+	char cmd[256];
+
+	pi->s = bench_connect(bench_imap_port);
+	if (pi->s < 0)
+		return (1);
+	snprintf(cmd, sizeof(cmd), "a LOGIN \"%s\" \"%s\"\r\n", bench_user, bench_pass);
+	if (bench_expect(pi->s, "* OK") ||
+	    bench_command(pi->s, cmd) || bench_expect(pi->s, "a OK") ||
+	    bench_command(pi->s, "b SELECT INBOX\r\n") || bench_expect(pi->s, "b OK") ||
+	    bench_command(pi->s, "c IDLE\r\n") || bench_expect(pi->s, "+"))
+		return (1);
+	fcntl(pi->s, F_SETFL, fcntl(pi->s, F_GETFL) | O_NONBLOCK);
+	return (0);
+}
+
+/* returns non-zero when the idler has received an EXISTS response */
+static int
+bench_idle_read(struct bench_idler *pi)
+{
+	char *line;
+	char *end;
+	ssize_t n;
+
+	n = read(pi->s, pi->buffer + pi->len, sizeof(pi->buffer) - pi->len - 1);
+	if (n <= 0)
+		return (0);
+	pi->len += n;
+	pi->buffer[pi->len] = 0;
+
+	for (line = pi->buffer; (end = strstr(line, "\r\n")) != NULL; line = end + 2) {
+		if (strncmp(line, "* ", 2) == 0 &&
+		    strncmp(end - 6, "EXISTS", 6) == 0)
+			pi->notified = 1;
+	}
+	pi->len -= line - pi->buffer;
+	memmove(pi->buffer, line, pi->len);
+	if (pi->len == sizeof(pi->buffer) - 1)
+		pi->len = 0;
+	return (pi->notified);
+}
+
+/* deliver one message and wait for all idlers to see it */
+static void
+bench_deliver(struct bench_idler *pi, struct pollfd *pfd, int num,
+    struct bench_stats *ps)
+{
+	char line[512];
+	uint64_t start;
+	uint64_t deadline;
+	int pending = bench_clients;
+	int s;
+	int x;
+
+	s = bench_connect(bench_smtp_port);
+	if (s < 0 || bench_expect(s, "2") ||
+	    bench_command(s, "HELO localhost\r\n") || bench_expect(s, "2") ||
+	    bench_command(s, "MAIL FROM:<localhost>\r\n") || bench_expect(s, "2") ||
+	    bench_command(s, "RCPT TO:<localhost>\r\n") || bench_expect(s, "2") ||
+	    bench_command(s, "DATA\r\n") || bench_expect(s, "3")) {
+		ps->errors += bench_clients;
+		goto done;
+	}
+	snprintf(line, sizeof(line),
+	    "Date: Mon, 19 Oct 2026 12:00:00 +0200\r\n"
+	    "Subject: SMS from +4712345%03d\r\n"
+	    "From: +4712345%03d <+4712345%03d@localhost>\r\n"
+	    "Content-Type: text/plain; charset=utf-8\r\n"
+	    "\r\n"
+	    "IDLE benchmark message %d\r\n",
+	    num % 1000, num % 1000, num % 1000, num);
+	if (bench_command(s, line)) {
+		ps->errors += bench_clients;
+		goto done;
+	}
+
+	for (x = 0; x != bench_clients; x++)
+		pi[x].notified = 0;
+
+	/* the message is stored when the server sees the final dot */
+	start = bench_now();
+	if (bench_command(s, ".\r\n")) {
+		ps->errors += bench_clients;
+		goto done;
+	}
+	deadline = start + (uint64_t)bench_timeout * 1000000000ULL;
+
+	while (pending != 0 && bench_now() < deadline) {
+		for (x = 0; x != bench_clients; x++) {
+			pfd[x].fd = pi[x].notified ? -1 : pi[x].s;
+			pfd[x].events = POLLIN;
+			pfd[x].revents = 0;
+		}
+		if (poll(pfd, bench_clients, 100) < 0 && errno != EINTR)
+			break;
+		for (x = 0; x != bench_clients; x++) {
+			if (pfd[x].revents == 0 || pi[x].notified)
+				continue;
+			if (bench_idle_read(pi + x)) {
+				bench_record(ps, bench_now() - start);
+				pending--;
+			}
+		}
+	}
+	ps->errors += pending;
+
+	bench_expect(s, "2");
+	bench_command(s, "QUIT\r\n");
+done:
+	if (s > -1)
+		close(s);
+}
+
+/* resident memory of the server in kilobytes */
+static long
+bench_rss(void)
+{
+	char cmd[64];
+	FILE *fp;
+	long kb = -1;
+
+	snprintf(cmd, sizeof(cmd), "ps -o rss= -p %d", (int)bench_pid);
+	fp = popen(cmd, "r");
+	if (fp == NULL)
+		return (-1);
+	if (fscanf(fp, "%ld", &kb) != 1)
+		kb = -1;
+	pclose(fp);
+	return (kb);
+}
+
+static int
+bench_compare(const void *pa, const void *pb)
+{
+	const uint64_t a = *(const uint64_t *)pa;
+	const uint64_t b = *(const uint64_t *)pb;
+
+	return ((a > b) - (a < b));
+}
+
+static double
+bench_percentile(const struct bench_stats *ps, double pct)
+{
+	size_t index;
+
+	if (ps->count == 0)
+		return (0.0);
+	index = (size_t)(pct * (double)(ps->count - 1) / 100.0 + 0.5);
+	return ((double)ps->sample[index] / 1000.0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: asteriskmail_imapbench [-b 127.0.0.1] [-i 143] [-p 25] [-u user] [-w pass]"
+	    "\n" "       [-c 100] [-m 100] [-d 10] [-t 5] [-x pid]"
+	    "\n" "       -b <addr>     server address"
+	    "\n" "       -i <port>     IMAP port"
+	    "\n" "       -p <port>     SMTP port"
+	    "\n" "       -u <user>     IMAP user name"
+	    "\n" "       -w <pass>     IMAP password"
+	    "\n" "       -c <num>      number of idle clients"
+	    "\n" "       -m <num>      number of messages to deliver"
+	    "\n" "       -d <ms>       delay between messages"
+	    "\n" "       -t <sec>      notification timeout, expired ones count as errors"
+	    "\n" "       -x <pid>      process ID of the server, to measure memory"
+	    "\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_stats stats;
+	struct bench_idler *pi;
+	struct pollfd *pfd;
+	struct rlimit rl;
+	uint64_t start;
+	double seconds;
+	long rss_before = -1;
+	long rss_after = -1;
+	int opt;
+	int x;
+
+	while ((opt = getopt(argc, argv, "b:i:p:u:w:c:m:d:t:x:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			bench_host = optarg;
+			break;
+		case 'i':
+			bench_imap_port = optarg;
+			break;
+		case 'p':
+			bench_smtp_port = optarg;
+			break;
+		case 'u':
+			bench_user = optarg;
+			break;
+		case 'w':
+			bench_pass = optarg;
+			break;
+		case 'c':
+			bench_clients = atoi(optarg);
+			break;
+		case 'm':
+			bench_messages = atoi(optarg);
+			break;
+		case 'd':
+			bench_wait = atoi(optarg);
+			break;
+		case 't':
+			bench_timeout = atoi(optarg);
+			break;
+		case 'x':
+			bench_pid = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (bench_clients < 1 || bench_messages < 1 || bench_wait < 0 ||
+	    bench_timeout < 1)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* every idle client holds a socket */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur < (rlim_t)bench_clients + 64) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	pi = calloc(bench_clients, sizeof(*pi));
+	pfd = calloc(bench_clients, sizeof(*pfd));
+	if (pi == NULL || pfd == NULL)
+		errx(EX_SOFTWARE, "Out of memory");
+	memset(&stats, 0, sizeof(stats));
+
+	if (bench_pid != 0)
+		rss_before = bench_rss();
+	start = bench_now();
+	for (x = 0; x != bench_clients; x++) {
+		if (bench_idle_start(pi + x))
+			errx(EX_SOFTWARE, "Cannot start IDLE on connection %d", x);
+	}
+	seconds = (double)(bench_now() - start) / 1000000000.0;
+	if (bench_pid != 0)
+		rss_after = bench_rss();
+
+	printf("{\"op\":\"imap_idle_setup\",\"clients\":%d,\"seconds\":%.3f,"
+	    "\"rss_before_kb\":%ld,\"rss_after_kb\":%ld,\"kb_per_client\":%.1f}\n",
+	    bench_clients, seconds, rss_before, rss_after,
+	    (rss_before < 0 || rss_after < 0) ? 0.0 :
+	    (double)(rss_after - rss_before) / bench_clients);
+
+	start = bench_now();
+	for (x = 0; x != bench_messages; x++) {
+		bench_deliver(pi, pfd, x, &stats);
+		if (bench_wait != 0)
+			usleep(bench_wait * 1000);
+	}
+	seconds = (double)(bench_now() - start) / 1000000000.0;
+	qsort(stats.sample, stats.count, sizeof(stats.sample[0]), &bench_compare);
+
+	printf("{\"op\":\"imap_idle_notify\",\"clients\":%d,\"messages\":%d,"
+	    "\"seconds\":%.3f,\"count\":%zu,\"errors\":%ju,\"p50_us\":%.1f,"
+	    "\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+	    bench_clients, bench_messages, seconds, stats.count,
+	    (uintmax_t)stats.errors, bench_percentile(&stats, 50.0),
+	    bench_percentile(&stats, 99.0), bench_percentile(&stats, 100.0));
+
+	for (x = 0; x != bench_clients; x++) {
+		bench_command(pi[x].s, "DONE\r\nd LOGOUT\r\n");
+		close(pi[x].s);
+	}
+	free(stats.sample);
+	free(pfd);
+	free(pi);
+	return (0);
+}
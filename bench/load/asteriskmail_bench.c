@@ -0,0 +1,727 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Loopback load generator for AsteriskMail. It optionally starts the
+ * daemon on loopback ports and drives a configurable mix of SMTP
+ * deliveries, POP3 sweeps and HTTP inbox fetches from many concurrent
+ * clients. The results are printed as one JSON object per line.
+ *
+ * The "slow" operation is a POP3 client which stops reading, to check
+ * that the command timeout of the daemon ends such a session, and the
+ * daemon keeps running. The exit status is non-zero if a slow client
+ * was not disconnected, or with -x, if the daemon died during the run.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sysexits.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+enum {
+	OP_SMTP,
+	OP_POP3,
+	OP_HTTP,
+	OP_SLOW,
+	OP_MAX,
+};
+
+#define	BENCH_SLOW_MAX (1 << 20)	/* commands pipelined by a slow client */
+
+static const char *op_name[OP_MAX] = {
+	[OP_SMTP] = "smtp",
+	[OP_POP3] = "pop3",
+	[OP_HTTP] = "http",
+	[OP_SLOW] = "slow",
+};
+
+struct bench_stats {
+	uint64_t *sample;
+	size_t	count;
+	size_t	max;
+	uint64_t errors;
+	uint64_t bytes;
+};
+
+struct bench_client {
+	pthread_t thread;
+	unsigned seed;
+	struct bench_stats stats[OP_MAX];
+};
+
+static const char *bench_host = "127.0.0.1";
+static const char *bench_port[OP_MAX] = {
+	[OP_SMTP] = "2525",
+	[OP_POP3] = "1110",
+	[OP_HTTP] = "8080",
+};
+static int bench_weight[OP_MAX] = {
+	[OP_SMTP] = 70,
+	[OP_POP3] = 20,
+	[OP_HTTP] = 10,
+};
+static int bench_clients = 16;
+static int bench_duration = 10;
+static int bench_body_size = 160;
+static int bench_retr_max = 8;
+static int bench_timeout = 5;
+static int bench_slow_pause = 2;
+static uint64_t bench_deadline;
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+bench_record(struct bench_stats *ps, uint64_t ns)
+{
+	if (ps->count == ps->max) {
+		ps->max = ps->max ? 2 * ps->max : 1024;
+		ps->sample = realloc(ps->sample, ps->max * sizeof(ps->sample[0]));
+		if (ps->sample == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+	ps->sample[ps->count++] = ns;
+}
+
+static FILE *
+bench_connect(int op)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *res0;
+	struct timeval tv = { .tv_sec = bench_timeout };
+	FILE *io;
+	int flag = 1;
+	int s = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(bench_host, bench_port[op], &hints, &res) != 0)
+		return (NULL);
+
+	for (res0 = res; res0 != NULL; res0 = res0->ai_next) {
+		s = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol);
+		if (s < 0)
+			continue;
+		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(s, res0->ai_addr, res0->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+
+	if (s < 0)
+		return (NULL);
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	io = fdopen(s, "r+");
+	if (io == NULL)
+		close(s);
+	return (io);
+}
+
+/* read one reply line and check its first character */
+static int
+bench_expect(FILE *io, char ch, struct bench_stats *ps)
+{
+	char line[512];
+
+	if (fflush(io) != 0 || fgets(line, sizeof(line), io) == NULL)
+		return (1);
+	ps->bytes += strlen(line);
+	/* a negative reply is not an I/O error */
+	return ((line[0] != ch) ? -1 : 0);
+}
+
+/* read a multi-line POP3 reply terminated by a single dot */
+static int
+bench_expect_multi(FILE *io, struct bench_stats *ps, int *pnum)
+{
+	char line[4096];
+	int num = 0;
+	int error;
+
+	error = bench_expect(io, '+', ps);
+	if (error != 0)
+		return (error);
+	while (fgets(line, sizeof(line), io) != NULL) {
+		ps->bytes += strlen(line);
+		if (strcmp(line, ".\r\n") == 0) {
+			if (pnum != NULL)
+				*pnum = num;
+			return (0);
+		}
+		num++;
+	}
+	return (1);
+}
+
+static void
+bench_body(struct bench_client *pc, char *ptr, int size)
+{
+	static const char b64[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const char text[] =
+	    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789  .,";
+	uint8_t in[3];
+	int x;
+	int y;
+
+	/* generate GSM-7 text and encode it like Asterisk does */
+	for (x = 0; x < size; x += 3) {
+		for (y = 0; y != 3; y++)
+			in[y] = text[rand_r(&pc->seed) % (sizeof(text) - 1)];
+		*ptr++ = b64[in[0] >> 2];
+		*ptr++ = b64[((in[0] & 3) << 4) | (in[1] >> 4)];
+		*ptr++ = b64[((in[1] & 15) << 2) | (in[2] >> 6)];
+		*ptr++ = b64[in[2] & 63];
+	}
+	*ptr = 0;
+}
+
+static int
+bench_smtp(struct bench_client *pc, struct bench_stats *ps)
+{
+	char body[4 * (bench_body_size + 2) / 3 + 8];
+	FILE *io;
+	int retval = 1;
+
+	io = bench_connect(OP_SMTP);
+	if (io == NULL)
+		return (1);
+
+	bench_body(pc, body, bench_body_size);
+
+	if (bench_expect(io, '2', ps))
+		goto done;
+	fprintf(io, "EHLO localhost\r\n");
+	if (bench_expect(io, '2', ps))
+		goto done;
+	fprintf(io, "MAIL FROM:<localhost>\r\n");
+	if (bench_expect(io, '2', ps))
+		goto done;
+	fprintf(io, "RCPT TO:<localhost>\r\n");
+	if (bench_expect(io, '2', ps))
+		goto done;
+	fprintf(io, "DATA\r\n");
+	if (bench_expect(io, '3', ps))
+		goto done;
+	ps->bytes += fprintf(io,
+	    "Date: Mon, 19 Oct 2026 12:00:00 +0200\r\n"
+	    "Subject: SMS from +4712345%03d\r\n"
+	    "From: +4712345%03d <+4712345%03d@localhost>\r\n"
+	    "Content-Type: text/html; charset=gsm-7\r\n"
+	    "Content-Transfer-Encoding: base64\r\n"
+	    "Content-Disposition: inline\r\n"
+	    "\r\n"
+	    "%s\r\n"
+	    ".\r\n",
+	    (int)(pc->seed % 1000), (int)(pc->seed % 1000),
+	    (int)(pc->seed % 1000), body);
+	if (bench_expect(io, '2', ps))
+		goto done;
+	fprintf(io, "QUIT\r\n");
+	bench_expect(io, '2', ps);
+	retval = 0;
+done:
+	fclose(io);
+	return (retval);
+}
+
+static int
+bench_pop3(struct bench_client *pc, struct bench_stats *ps)
+{
+	FILE *io;
+	int retval = 1;
+	int error;
+	int num;
+	int x;
+
+	io = bench_connect(OP_POP3);
+	if (io == NULL)
+		return (1);
+
+	if (bench_expect(io, '+', ps))
+		goto done;
+	fprintf(io, "USER asteriskmail\r\n");
+	if (bench_expect(io, '+', ps))
+		goto done;
+	fprintf(io, "PASS asteriskmail\r\n");
+	if (bench_expect(io, '+', ps))
+		goto done;
+	fprintf(io, "LIST\r\n");
+	if (bench_expect_multi(io, ps, &num))
+		goto done;
+	if (num > bench_retr_max)
+		num = bench_retr_max;
+	for (x = 1; x <= num; x++) {
+		fprintf(io, "RETR %d\r\n", x);
+		error = bench_expect_multi(io, ps, NULL);
+		if (error > 0)
+			goto done;
+		/* removed by a concurrent session after our login */
+		if (error < 0)
+			continue;
+		fprintf(io, "DELE %d\r\n", x);
+		if (bench_expect(io, '+', ps))
+			goto done;
+	}
+	fprintf(io, "QUIT\r\n");
+	bench_expect(io, '+', ps);
+	retval = 0;
+done:
+	fclose(io);
+	return (retval);
+}
+
+static int
+bench_http(struct bench_client *pc, struct bench_stats *ps)
+{
+	char buffer[4096];
+	size_t len;
+	FILE *io;
+	int error;
+
+	io = bench_connect(OP_HTTP);
+	if (io == NULL)
+		return (1);
+
+	fprintf(io, "GET / HTTP/1.0\r\n"
+	    "Host: localhost\r\n"
+	    "\r\n");
+	fflush(io);
+	while ((len = fread(buffer, 1, sizeof(buffer), io)) != 0)
+		ps->bytes += len;
+	error = ferror(io);
+	fclose(io);
+	return (error != 0);
+}
+
+/*
+ * Log in, pipeline RETR commands until the daemon stops reading
+ * because its replies are not read, and then read nothing for a
+ * while. The daemon must have ended the session by then. A session
+ * which still waits for commands after the replies were read is an
+ * error.
+ */
+static int
+bench_slow(struct bench_client *pc, struct bench_stats *ps)
+{
+	char buffer[4096];
+	ssize_t len;
+	FILE *io;
+	int size = 4096;
+	int retval = 1;
+	int num;
+	int x;
+	int s;
+
+	io = bench_connect(OP_POP3);
+	if (io == NULL)
+		return (1);
+	s = fileno(io);
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	if (bench_expect(io, '+', ps))
+		goto done;
+	fprintf(io, "USER asteriskmail\r\n");
+	if (bench_expect(io, '+', ps))
+		goto done;
+	fprintf(io, "PASS asteriskmail\r\n");
+	if (bench_expect(io, '+', ps))
+		goto done;
+
+	for (x = 0; x + 8 <= (int)sizeof(buffer); x += 8)
+		memcpy(buffer + x, "RETR 1\r\n", 8);
+	for (num = 0; num < BENCH_SLOW_MAX; num += len / 8) {
+		len = send(s, buffer, x, MSG_DONTWAIT);
+		if (len < x)
+			break;
+	}
+	if (num >= BENCH_SLOW_MAX)
+		goto done;
+	sleep(bench_slow_pause);
+
+	/* what was sent before the session ended is still read */
+	while ((len = read(s, buffer, sizeof(buffer))) > 0)
+		ps->bytes += len;
+	if (len == 0 || errno == ECONNRESET)
+		retval = 0;
+done:
+	fclose(io);
+	return (retval);
+}
+
+static void *
+bench_client_loop(void *arg)
+{
+	struct bench_client *pc = arg;
+	uint64_t start;
+	int total = 0;
+	int error;
+	int op;
+	int x;
+
+	for (op = 0; op != OP_MAX; op++)
+		total += bench_weight[op];
+
+	while (bench_now() < bench_deadline) {
+		x = rand_r(&pc->seed) % total;
+		for (op = 0; op != OP_MAX - 1; op++) {
+			if (x < bench_weight[op])
+				break;
+			x -= bench_weight[op];
+		}
+
+		start = bench_now();
+		switch (op) {
+		case OP_SMTP:
+			error = bench_smtp(pc, &pc->stats[op]);
+			break;
+		case OP_POP3:
+			error = bench_pop3(pc, &pc->stats[op]);
+			break;
+		case OP_HTTP:
+			error = bench_http(pc, &pc->stats[op]);
+			break;
+		default:
+			error = bench_slow(pc, &pc->stats[op]);
+			break;
+		}
+		if (error)
+			pc->stats[op].errors++;
+		else
+			bench_record(&pc->stats[op], bench_now() - start);
+	}
+	return (NULL);
+}
+
+static int
+bench_compare(const void *pa, const void *pb)
+{
+	const uint64_t a = *(const uint64_t *)pa;
+	const uint64_t b = *(const uint64_t *)pb;
+
+	return ((a > b) - (a < b));
+}
+
+static double
+bench_percentile(const struct bench_stats *ps, double pct)
+{
+	size_t index;
+
+	if (ps->count == 0)
+		return (0.0);
+	index = (size_t)(pct * (double)(ps->count - 1) / 100.0 + 0.5);
+	return ((double)ps->sample[index] / 1000.0);
+}
+
+static void
+bench_report(struct bench_client *pc, double seconds)
+{
+	struct bench_stats sum;
+	int op;
+	int x;
+
+	for (op = 0; op != OP_MAX; op++) {
+		memset(&sum, 0, sizeof(sum));
+		for (x = 0; x != bench_clients; x++) {
+			struct bench_stats *ps = &pc[x].stats[op];
+
+			while (ps->count != 0)
+				bench_record(&sum, ps->sample[--ps->count]);
+			sum.errors += ps->errors;
+			sum.bytes += ps->bytes;
+		}
+		if (sum.count == 0 && sum.errors == 0)
+			continue;
+
+		qsort(sum.sample, sum.count, sizeof(sum.sample[0]), &bench_compare);
+
+		printf("{\"op\":\"%s\",\"clients\":%d,\"seconds\":%.3f,"
+		    "\"count\":%zu,\"errors\":%ju,\"ops_per_sec\":%.1f,"
+		    "\"bytes\":%ju,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+		    "\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+		    op_name[op], bench_clients, seconds, sum.count,
+		    (uintmax_t)sum.errors, (double)sum.count / seconds,
+		    (uintmax_t)sum.bytes,
+		    bench_percentile(&sum, 50.0), bench_percentile(&sum, 99.0),
+		    bench_percentile(&sum, 99.9), bench_percentile(&sum, 100.0));
+		free(sum.sample);
+	}
+}
+
+static pid_t
+bench_start_daemon(const char *path, char **extra, int nextra)
+{
+	char pidfile[64];
+	char *argv[16 + nextra];
+	FILE *io;
+	pid_t pid;
+	int argc = 0;
+	int x;
+
+	snprintf(pidfile, sizeof(pidfile), "/tmp/asteriskmail_bench.%d.pid",
+	    (int)getpid());
+
+	argv[argc++] = (char *)path;
+	argv[argc++] = "-b";
+	argv[argc++] = (char *)bench_host;
+	argv[argc++] = "-p";
+	argv[argc++] = (char *)bench_port[OP_SMTP];
+	argv[argc++] = "-P";
+	argv[argc++] = (char *)bench_port[OP_POP3];
+	argv[argc++] = "-H";
+	argv[argc++] = (char *)bench_port[OP_HTTP];
+	argv[argc++] = "-f";
+	argv[argc++] = pidfile;
+	for (x = 0; x != nextra; x++)
+		argv[argc++] = extra[x];
+	argv[argc] = NULL;
+
+	pid = fork();
+	if (pid < 0)
+		err(EX_OSERR, "Cannot fork");
+	if (pid == 0) {
+		execv(path, argv);
+		_exit(EX_OSERR);
+	}
+
+	/* wait for the listening sockets to appear */
+	for (x = 0; x != 500; x++) {
+		io = bench_connect(OP_HTTP);
+		if (io != NULL) {
+			fclose(io);
+			return (pid);
+		}
+		usleep(10000);
+	}
+	kill(pid, SIGKILL);
+	errx(EX_SOFTWARE, "Daemon '%s' did not start", path);
+}
+
+/* returns non-zero if the daemon did not survive the run */
+static int
+bench_stop_daemon(pid_t pid, double seconds)
+{
+	struct rusage ru;
+	int status;
+
+	if (waitpid(pid, &status, WNOHANG) == pid) {
+		printf("{\"op\":\"daemon\",\"died\":true,\"signal\":%d}\n",
+		    WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+		return (1);
+	}
+	kill(pid, SIGTERM);
+	if (wait4(pid, &status, 0, &ru) != pid)
+		return (1);
+
+	printf("{\"op\":\"daemon\",\"seconds\":%.3f,\"user_sec\":%.6f,"
+	    "\"sys_sec\":%.6f,\"maxrss_kb\":%ld}\n", seconds,
+	    ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0,
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0,
+	    ru.ru_maxrss);
+	return (0);
+}
+
+static void
+bench_parse_mix(char *str)
+{
+	char *tok;
+	char *val;
+	int op;
+
+	for (op = 0; op != OP_MAX; op++)
+		bench_weight[op] = 0;
+
+	while ((tok = strsep(&str, ",")) != NULL) {
+		val = strchr(tok, '=');
+		if (val == NULL)
+			errx(EX_USAGE, "Invalid mix '%s'", tok);
+		*val++ = 0;
+		for (op = 0; op != OP_MAX; op++) {
+			if (strcmp(tok, op_name[op]) == 0)
+				break;
+		}
+		if (op == OP_MAX)
+			errx(EX_USAGE, "Invalid operation '%s'", tok);
+		bench_weight[op] = atoi(val);
+	}
+	for (op = 0; op != OP_MAX; op++) {
+		if (bench_weight[op] != 0)
+			return;
+	}
+	errx(EX_USAGE, "All mix weights are zero");
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: asteriskmail_bench [-x daemon] [-b 127.0.0.1] [-p 2525] [-P 1110] [-H 8080]"
+	    "\n" "                          [-c 16] [-d 10] [-s 160] [-r 8] [-t 5] [-k 2]"
+	    "\n" "                          [-m smtp=70,pop3=20,http=10,slow=0]"
+	    "\n" "                          [-- daemon arguments]"
+	    "\n" "       -x <path>     start this daemon binary on the given ports"
+	    "\n" "       -b <addr>     loopback address"
+	    "\n" "       -p <port>     SMTP port"
+	    "\n" "       -P <port>     POP3 port"
+	    "\n" "       -H <port>     HTTPD port"
+	    "\n" "       -c <num>      number of concurrent clients"
+	    "\n" "       -d <sec>      duration of the run in seconds"
+	    "\n" "       -s <bytes>    size of the GSM-7 text body of each SMTP message"
+	    "\n" "       -r <num>      maximum number of RETR/DELE per POP3 sweep"
+	    "\n" "       -t <sec>      client I/O timeout, expired operations count as errors"
+	    "\n" "       -k <sec>      time a slow client reads nothing, must be longer"
+	    "\n" "                     than the POP3 command timeout of the daemon"
+	    "\n" "       -m <mix>      relative weights of the operations"
+	    "\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_client *pc;
+	const char *daemon_path = NULL;
+	uint64_t start;
+	double seconds;
+	pid_t pid = -1;
+	int error = 0;
+	int opt;
+	int x;
+
+	while ((opt = getopt(argc, argv, "x:b:p:P:H:c:d:s:r:m:t:k:h")) != -1) {
+		switch (opt) {
+		case 'x':
+			daemon_path = optarg;
+			break;
+		case 'b':
+			bench_host = optarg;
+			break;
+		case 'p':
+			bench_port[OP_SMTP] = optarg;
+			break;
+		case 'P':
+			bench_port[OP_POP3] = optarg;
+			break;
+		case 'H':
+			bench_port[OP_HTTP] = optarg;
+			break;
+		case 'c':
+			bench_clients = atoi(optarg);
+			break;
+		case 'd':
+			bench_duration = atoi(optarg);
+			break;
+		case 's':
+			bench_body_size = atoi(optarg);
+			break;
+		case 'r':
+			bench_retr_max = atoi(optarg);
+			break;
+		case 'm':
+			bench_parse_mix(optarg);
+			break;
+		case 't':
+			bench_timeout = atoi(optarg);
+			break;
+		case 'k':
+			bench_slow_pause = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (bench_clients < 1 || bench_duration < 1 || bench_timeout < 1 ||
+	    bench_slow_pause < 1 ||
+	    bench_body_size < 1 || bench_body_size > 8192)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (daemon_path != NULL)
+		pid = bench_start_daemon(daemon_path, argv, argc);
+
+	pc = calloc(bench_clients, sizeof(*pc));
+	if (pc == NULL)
+		errx(EX_SOFTWARE, "Out of memory");
+
+	start = bench_now();
+	bench_deadline = start + (uint64_t)bench_duration * 1000000000ULL;
+
+	for (x = 0; x != bench_clients; x++) {
+		pc[x].seed = x + 1;
+		if (pthread_create(&pc[x].thread, NULL, &bench_client_loop, pc + x) != 0)
+			errx(EX_SOFTWARE, "Cannot create thread");
+	}
+	for (x = 0; x != bench_clients; x++)
+		pthread_join(pc[x].thread, NULL);
+
+	seconds = (double)(bench_now() - start) / 1000000000.0;
+
+	bench_report(pc, seconds);
+
+	/* every slow client must have been disconnected */
+	for (x = 0; x != bench_clients; x++)
+		error |= (pc[x].stats[OP_SLOW].errors != 0);
+
+	if (pid > 0)
+		error |= bench_stop_daemon(pid, seconds);
+
+	free(pc);
+	return (error);
+}
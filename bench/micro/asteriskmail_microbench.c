@@ -0,0 +1,477 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks for the string processing kernels of AsteriskMail.
+ * The daemon sources are linked directly. Memory allocations are
+ * counted by wrapping the allocator at link time. Kernels with an
+ * allocation limit fail the run when they exceed it.
+ */
+
+#include <sys/socket.h>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "asteriskmail.h"
+
+/* sessions and messages come from arenas and pools, see alloc.c */
+#define	BENCH_SMTP_ALLOCS_MAX 2		/* allocations per SMTP message */
+
+struct corpus {
+	char	name[64];
+	char   *data;
+	size_t	bytes;
+};
+
+struct kernel {
+	const char *name;
+	void	(*func)(const struct corpus *);
+	int	max_allocs;		/* per message, or -1 for no limit */
+};
+
+static struct corpus *corpus;
+static int ncorpus;
+static int bench_msec = 200;
+static uint64_t num_allocs;
+
+extern void *__real_malloc(size_t);
+extern void *__real_calloc(size_t, size_t);
+extern void *__real_realloc(void *, size_t);
+
+void *
+__wrap_malloc(size_t size)
+{
+	num_allocs++;
+	return (__real_malloc(size));
+}
+
+void *
+__wrap_calloc(size_t num, size_t size)
+{
+	num_allocs++;
+	return (__real_calloc(num, size));
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+	num_allocs++;
+	return (__real_realloc(ptr, size));
+}
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+corpus_add(const char *name, const char *data, size_t bytes)
+{
+	struct corpus *pc;
+
+	corpus = realloc(corpus, (ncorpus + 1) * sizeof(corpus[0]));
+	if (corpus == NULL)
+		errx(EX_SOFTWARE, "Out of memory");
+	pc = &corpus[ncorpus++];
+	strlcpy(pc->name, name, sizeof(pc->name));
+	pc->data = malloc(bytes + 1);
+	if (pc->data == NULL)
+		errx(EX_SOFTWARE, "Out of memory");
+	memcpy(pc->data, data, bytes);
+	pc->data[bytes] = 0;
+	pc->bytes = bytes;
+}
+
+/* build a message looking like the ones Asterisk delivers */
+static void
+corpus_synthetic(int size)
+{
+	static const char b64[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const char text[] =
+	    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789  .,";
+	unsigned seed = size;
+	char name[64];
+	char *buf;
+	char *ptr;
+	uint8_t in[3];
+	int x;
+	int y;
+
+	buf = malloc(2 * size + 512);
+	if (buf == NULL)
+		errx(EX_SOFTWARE, "Out of memory");
+
+	ptr = buf + sprintf(buf,
+	    "Date: Mon, 19 Oct 2026 12:00:00 +0200\r\n"
+	    "Subject: SMS from +4712345678\r\n"
+	    "From: +4712345678 <+4712345678@localhost>\r\n"
+	    "Content-Type: text/html; charset=gsm-7\r\n"
+	    "Content-Transfer-Encoding: base64\r\n"
+	    "Content-Disposition: inline\r\n"
+	    "\r\n");
+
+	for (x = 0; x < size; x += 3) {
+		for (y = 0; y != 3; y++)
+			in[y] = text[rand_r(&seed) % (sizeof(text) - 1)];
+		*ptr++ = b64[in[0] >> 2];
+		*ptr++ = b64[((in[0] & 3) << 4) | (in[1] >> 4)];
+		*ptr++ = b64[((in[1] & 15) << 2) | (in[2] >> 6)];
+		*ptr++ = b64[in[2] & 63];
+	}
+	ptr += sprintf(ptr, "\r\n");
+
+	snprintf(name, sizeof(name), "synthetic-%d", size);
+	corpus_add(name, buf, ptr - buf);
+	free(buf);
+}
+
+/* load recorded messages, one raw SMTP DATA payload per file */
+static void
+corpus_load(const char *path)
+{
+	struct dirent *dp;
+	char fname[PATH_MAX];
+	char *buf;
+	DIR *dir;
+	FILE *fp;
+	long len;
+
+	dir = opendir(path);
+	if (dir == NULL)
+		err(EX_NOINPUT, "Cannot open '%s'", path);
+
+	while ((dp = readdir(dir)) != NULL) {
+		if (dp->d_name[0] == '.')
+			continue;
+		snprintf(fname, sizeof(fname), "%s/%s", path, dp->d_name);
+		fp = fopen(fname, "r");
+		if (fp == NULL)
+			continue;
+		if (fseek(fp, 0, SEEK_END) == 0 && (len = ftell(fp)) > 0) {
+			buf = malloc(len);
+			rewind(fp);
+			if (buf != NULL && fread(buf, 1, len, fp) == (size_t)len)
+				corpus_add(dp->d_name, buf, len);
+			free(buf);
+		}
+		fclose(fp);
+	}
+	closedir(dir);
+}
+
+static void
+kernel_copy(const struct corpus *pc)
+{
+	static char *buf;
+	static size_t max;
+
+	if (pc->bytes + 1 > max) {
+		max = pc->bytes + 1;
+		buf = realloc(buf, max);
+	}
+	memcpy(buf, pc->data, pc->bytes + 1);
+	__asm__ __volatile__("" : : "r"(buf) : "memory");
+}
+
+static void
+kernel_strafter(const struct corpus *pc)
+{
+	char *ptr;
+
+	ptr = strafter(pc->data, "\r\nContent-Transfer-Encoding: base64\r\n");
+	__asm__ __volatile__("" : : "r"(ptr) : "memory");
+	ptr = strafter(pc->data, "\r\nSubject: ");
+	__asm__ __volatile__("" : : "r"(ptr) : "memory");
+	ptr = strafter(pc->data, "\r\nFrom: ");
+	__asm__ __volatile__("" : : "r"(ptr) : "memory");
+}
+
+static void
+kernel_read_line(const struct corpus *pc)
+{
+	static const struct corpus *last;
+	static FILE *fp;
+
+	if (last != pc) {
+		if (fp != NULL)
+			fclose(fp);
+		fp = fmemopen(pc->data, pc->bytes, "r");
+		if (fp == NULL)
+			err(EX_SOFTWARE, "Cannot open memory stream");
+		last = pc;
+	}
+	rewind(fp);
+	while (handle_read_line(fp) != NULL)
+		;
+}
+
+static void
+kernel_base64_get_utf8(const struct corpus *pc)
+{
+	char *ptr;
+	int ch;
+
+	ptr = strstr(pc->data, "\r\n\r\n");
+	if (ptr == NULL)
+		return;
+	ptr += 4;
+
+	base64_get_utf8(NULL);
+	while ((ch = base64_get_utf8(&ptr)) >= 0)
+		__asm__ __volatile__("" : : "r"(ch));
+}
+
+static void
+kernel_import(const struct corpus *pc)
+{
+	static struct am_message am;
+	static size_t max;
+
+	if (pc->bytes + 1 > max) {
+		max = pc->bytes + 1;
+		am.data = realloc(am.data, max);
+	}
+	memcpy(am.data, pc->data, pc->bytes + 1);
+	am.bytes = pc->bytes + 1;
+	handle_import(&am);
+}
+
+/* the SMTP side of one message, excluding the socket */
+static void
+kernel_ingest(const struct corpus *pc)
+{
+	struct am_message *pam;
+	size_t x;
+
+	pam = handle_create_message();
+	if (pam == NULL)
+		return;
+	for (x = 0; x != pc->bytes; x++) {
+		if (handle_append_message(pam, pc->data[x]) != 0)
+			goto done;
+	}
+	if (handle_append_message(pam, 0) != 0)
+		goto done;
+	handle_import(pam);
+done:
+	handle_delete_message(pam);
+}
+
+/* adds the message to the search index, under a new id each time */
+static void
+kernel_search_insert(const struct corpus *pc)
+{
+	static struct am_message am;
+
+	am.data = pc->data;
+	am.bytes = pc->bytes + 1;
+	am.uid++;
+	am_search_insert(&am);
+}
+
+/* the client side of an SMTP session, running in lock step */
+static void
+smtp_client_cmd(int fd, const char *cmd, size_t len)
+{
+	char ch;
+
+	if (len != 0 && write(fd, cmd, len) != (ssize_t)len)
+		return;
+	/* wait for the reply line */
+	while (read(fd, &ch, 1) == 1 && ch != '\n')
+		;
+}
+
+static void *
+smtp_client(void *arg)
+{
+	int *pipe_fd = arg;
+	const struct corpus *pc;
+	int fd;
+
+	while (read(pipe_fd[0], &pc, sizeof(pc)) == sizeof(pc) &&
+	    read(pipe_fd[0], &fd, sizeof(fd)) == sizeof(fd)) {
+		smtp_client_cmd(fd, "", 0);
+		smtp_client_cmd(fd, "HELO bench\r\n", 12);
+		smtp_client_cmd(fd, "MAIL FROM:<bench@localhost>\r\n", 29);
+		smtp_client_cmd(fd, "RCPT TO:<localhost@localhost>\r\n", 31);
+		smtp_client_cmd(fd, "DATA\r\n", 6);
+		if (write(fd, pc->data, pc->bytes) == (ssize_t)pc->bytes)
+			smtp_client_cmd(fd, "\r\n.\r\n", 5);
+		smtp_client_cmd(fd, "QUIT\r\n", 6);
+		close(fd);
+	}
+	return (NULL);
+}
+
+/* a complete SMTP session, over a socket pair */
+static void
+kernel_smtp_session(const struct corpus *pc)
+{
+	static int pipe_fd[2] = { -1, -1 };
+	static pthread_t client;
+	int fd[2];
+
+	if (pipe_fd[0] < 0) {
+		if (pipe(pipe_fd) != 0 ||
+		    pthread_create(&client, NULL, &smtp_client, pipe_fd) != 0)
+			err(EX_SOFTWARE, "Cannot create client thread");
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) != 0)
+		err(EX_SOFTWARE, "Cannot create socket pair");
+
+	/* keep the store at one message, so that each session evicts one */
+	am_store_max_count = 1;
+	am_evict_policy = AM_EVICT_OLDEST;
+
+	if (write(pipe_fd[1], &pc, sizeof(pc)) != sizeof(pc) ||
+	    write(pipe_fd[1], &fd[0], sizeof(fd[0])) != sizeof(fd[0]))
+		err(EX_SOFTWARE, "Cannot start client");
+
+	handle_smtp_connection(fd[1]);
+}
+
+static const struct kernel kernels[] = {
+	{ "copy", &kernel_copy, -1 },
+	{ "strafter", &kernel_strafter, -1 },
+	{ "handle_read_line", &kernel_read_line, -1 },
+	{ "base64_get_utf8", &kernel_base64_get_utf8, -1 },
+	{ "handle_import", &kernel_import, -1 },
+	{ "ingest", &kernel_ingest, -1 },
+	{ "search_insert", &kernel_search_insert, -1 },
+	{ "smtp_session", &kernel_smtp_session, BENCH_SMTP_ALLOCS_MAX },
+};
+
+/* returns non-zero if the kernel exceeded its allocation limit */
+static int
+bench_run(const struct kernel *pk, const struct corpus *pc)
+{
+	uint64_t deadline;
+	uint64_t start;
+	uint64_t stop;
+	uint64_t allocs;
+	uint64_t iter;
+	int x;
+
+	/* warm up */
+	for (x = 0; x != 16; x++)
+		pk->func(pc);
+
+	allocs = num_allocs;
+	start = bench_now();
+	deadline = start + (uint64_t)bench_msec * 1000000ULL;
+	iter = 0;
+	do {
+		for (x = 0; x != 16; x++)
+			pk->func(pc);
+		iter += 16;
+	} while ((stop = bench_now()) < deadline);
+
+	allocs = num_allocs - allocs;
+
+	printf("{\"kernel\":\"%s\",\"corpus\":\"%s\",\"bytes\":%zu,"
+	    "\"iterations\":%ju,\"ns_per_msg\":%.1f,\"ns_per_byte\":%.3f,"
+	    "\"allocs_per_msg\":%.2f}\n",
+	    pk->name, pc->name, pc->bytes, (uintmax_t)iter,
+	    (double)(stop - start) / iter,
+	    (double)(stop - start) / iter / pc->bytes,
+	    (double)allocs / iter);
+
+	if (pk->max_allocs > -1 && allocs > (uint64_t)pk->max_allocs * iter) {
+		warnx("%s: %.2f allocations per message on %s, limit is %d",
+		    pk->name, (double)allocs / iter, pc->name, pk->max_allocs);
+		return (1);
+	}
+	return (0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: asteriskmail_microbench [-c corpus_dir] [-k kernel] [-t 200] [-s]"
+	    "\n" "       -c <dir>      add recorded messages, one raw message per file"
+	    "\n" "       -k <name>     only run the given kernel"
+	    "\n" "       -t <msec>     time spent on each kernel and corpus"
+	    "\n" "       -s            skip the synthetic corpus"
+	    "\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *only = NULL;
+	int synthetic = 1;
+	int failed = 0;
+	int opt;
+	int x;
+	int y;
+
+	while ((opt = getopt(argc, argv, "c:k:t:sh")) != -1) {
+		switch (opt) {
+		case 'c':
+			corpus_load(optarg);
+			break;
+		case 'k':
+			only = optarg;
+			break;
+		case 't':
+			bench_msec = atoi(optarg);
+			if (bench_msec < 1)
+				usage();
+			break;
+		case 's':
+			synthetic = 0;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (synthetic) {
+		corpus_synthetic(16);
+		corpus_synthetic(160);
+		corpus_synthetic(1600);
+		corpus_synthetic(16000);
+	}
+	if (ncorpus == 0)
+		errx(EX_USAGE, "No corpus selected");
+
+	for (x = 0; x != (int)(sizeof(kernels) / sizeof(kernels[0])); x++) {
+		if (only != NULL && strcmp(only, kernels[x].name) != 0)
+			continue;
+		for (y = 0; y != ncorpus; y++)
+			failed |= bench_run(&kernels[x], &corpus[y]);
+	}
+	return (failed);
+}
@@ -0,0 +1,489 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Replay sessions recorded by "asteriskmail -R" against a running
+ * instance. Client data is sent with the recorded timing, optionally
+ * accelerated, and the time to the first byte of every server
+ * response is compared with the recorded one. The results are
+ * printed as one JSON object per protocol and line.
+ */
+
+#include <sys/endian.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "asteriskmail.h"
+
+struct replay_record {
+	uint64_t time;
+	uint32_t length;
+	uint8_t	type;
+	char   *data;
+};
+
+struct replay_session {
+	uint32_t conn;
+	uint8_t	proto;
+	int	nrec;
+	struct replay_record *rec;
+};
+
+struct replay_stats {
+	pthread_mutex_t mtx;
+	uint64_t *recorded;
+	uint64_t *replayed;
+	size_t	count;
+	size_t	max;
+	uint64_t sessions;
+	uint64_t errors;
+	uint64_t mismatch;
+};
+
+static const char *replay_name[AM_PROTO_MAX] = {
+	[AM_PROTO_SMTP] = "smtp",
+	[AM_PROTO_POP3] = "pop3",
+	[AM_PROTO_HTTPD] = "http",
+	[AM_PROTO_IMAP] = "imap",
+};
+
+static const char *replay_host = "127.0.0.1";
+static const char *replay_port[AM_PROTO_MAX] = {
+	[AM_PROTO_SMTP] = "25",
+	[AM_PROTO_POP3] = "110",
+	[AM_PROTO_HTTPD] = "80",
+	[AM_PROTO_IMAP] = "143",
+};
+static struct replay_session *session;
+static int nsession;
+static double replay_speed = 1.0;
+static int replay_timeout = 5;
+static uint64_t replay_start;
+static uint64_t replay_base;
+static pthread_mutex_t replay_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int replay_next;
+static struct replay_stats stats[AM_PROTO_MAX];
+
+static uint64_t
+replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* sleep until the given recorded time, scaled by the replay speed */
+static void
+replay_wait(uint64_t when)
+{
+	uint64_t target;
+	uint64_t now;
+	struct timespec ts;
+
+	if (replay_speed <= 0.0)
+		return;
+	target = replay_start + (uint64_t)((double)(when - replay_base) / replay_speed);
+	now = replay_now();
+	if (target <= now)
+		return;
+	ts.tv_sec = (target - now) / 1000000000ULL;
+	ts.tv_nsec = (target - now) % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+static struct replay_session *
+replay_find(uint32_t conn, uint8_t proto)
+{
+	int x;
+
+	/* sessions are mostly appended, so search from the end */
+	for (x = nsession; x--; ) {
+		if (session[x].conn == conn)
+			return (&session[x]);
+	}
+	session = realloc(session, (nsession + 1) * sizeof(session[0]));
+	if (session == NULL)
+		errx(EX_SOFTWARE, "Out of memory");
+	memset(&session[nsession], 0, sizeof(session[0]));
+	session[nsession].conn = conn;
+	session[nsession].proto = proto;
+	return (&session[nsession++]);
+}
+
+static void
+replay_load(const char *path)
+{
+	char magic[AM_CAPTURE_MAGIC_LEN];
+	struct am_capture_hdr hdr;
+	struct replay_session *ps;
+	struct replay_record *pr;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		err(EX_NOINPUT, "Cannot open '%s'", path);
+	if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+	    memcmp(magic, AM_CAPTURE_MAGIC, sizeof(magic)) != 0)
+		errx(EX_DATAERR, "'%s' is not a capture file", path);
+
+	while (fread(&hdr, sizeof(hdr), 1, fp) == 1) {
+		if (hdr.proto >= AM_PROTO_MAX)
+			errx(EX_DATAERR, "Invalid protocol in capture file");
+
+		ps = replay_find(le32toh(hdr.conn), hdr.proto);
+		ps->rec = realloc(ps->rec, (ps->nrec + 1) * sizeof(ps->rec[0]));
+		if (ps->rec == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+		pr = &ps->rec[ps->nrec++];
+		pr->time = le64toh(hdr.time);
+		pr->length = le32toh(hdr.length);
+		pr->type = hdr.type;
+		pr->data = NULL;
+		if (pr->length == 0)
+			continue;
+		pr->data = malloc(pr->length);
+		if (pr->data == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+		if (fread(pr->data, pr->length, 1, fp) != 1) {
+			/* truncated log, ignore the last record */
+			ps->nrec--;
+			break;
+		}
+	}
+	fclose(fp);
+
+	if (nsession == 0)
+		errx(EX_DATAERR, "No sessions in '%s'", path);
+	replay_base = session[0].rec[0].time;
+}
+
+static int
+replay_connect(int proto)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *res0;
+	int flag = 1;
+	int s = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(replay_host, replay_port[proto], &hints, &res) != 0)
+		return (-1);
+
+	for (res0 = res; res0 != NULL; res0 = res0->ai_next) {
+		s = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol);
+		if (s < 0)
+			continue;
+		if (connect(s, res0->ai_addr, res0->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+
+	if (s > -1)
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	return (s);
+}
+
+/*
+ * Receive a response of about "expect" bytes. Returns the number of
+ * bytes received or -1 on timeout. The time of the first byte is
+ * stored in "pfirst".
+ */
+static ssize_t
+replay_receive(int s, size_t expect, uint64_t *pfirst)
+{
+	struct pollfd pfd = { .fd = s, .events = POLLIN };
+	char buffer[4096];
+	size_t total = 0;
+	ssize_t len;
+	int timeout = replay_timeout * 1000;
+
+	while (total < expect) {
+		if (poll(&pfd, 1, timeout) < 1)
+			return (total ? (ssize_t)total : -1);
+		len = read(s, buffer, sizeof(buffer));
+		if (len <= 0)
+			break;
+		if (total == 0)
+			*pfirst = replay_now();
+		total += len;
+	}
+	/* drain data beyond the recorded response, if any */
+	while (poll(&pfd, 1, 0) > 0 &&
+	    (len = read(s, buffer, sizeof(buffer))) > 0)
+		total += len;
+	return (total);
+}
+
+static void
+replay_sample(struct replay_stats *pst, uint64_t recorded, uint64_t replayed, int mismatch)
+{
+	pthread_mutex_lock(&pst->mtx);
+	if (pst->count == pst->max) {
+		pst->max = pst->max ? 2 * pst->max : 1024;
+		pst->recorded = realloc(pst->recorded, pst->max * sizeof(uint64_t));
+		pst->replayed = realloc(pst->replayed, pst->max * sizeof(uint64_t));
+		if (pst->recorded == NULL || pst->replayed == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+	pst->recorded[pst->count] = recorded;
+	pst->replayed[pst->count] = replayed;
+	pst->count++;
+	pst->mismatch += (mismatch != 0);
+	pthread_mutex_unlock(&pst->mtx);
+}
+
+static void
+replay_session(struct replay_session *ps)
+{
+	struct replay_stats *pst = &stats[ps->proto];
+	uint64_t rec_sent;
+	uint64_t sent;
+	uint64_t first;
+	size_t expect;
+	ssize_t len;
+	int error = 0;
+	int x;
+	int y;
+	int s;
+
+	replay_wait(ps->rec[0].time);
+
+	s = replay_connect(ps->proto);
+	if (s < 0) {
+		error = 1;
+		goto done;
+	}
+	sent = replay_now();
+	rec_sent = ps->rec[0].time;
+
+	for (x = 0; x != ps->nrec; x++) {
+		struct replay_record *pr = &ps->rec[x];
+
+		switch (pr->type) {
+		case AM_CAPTURE_READ:
+			replay_wait(pr->time);
+			if (write(s, pr->data, pr->length) != (ssize_t)pr->length) {
+				error = 1;
+				goto done;
+			}
+			sent = replay_now();
+			rec_sent = pr->time;
+			break;
+		case AM_CAPTURE_WRITE:
+			/* merge all consecutive server writes into one response */
+			expect = 0;
+			for (y = x; y != ps->nrec &&
+			    ps->rec[y].type == AM_CAPTURE_WRITE; y++)
+				expect += ps->rec[y].length;
+
+			len = replay_receive(s, expect, &first);
+			if (len < 0) {
+				error = 1;
+				goto done;
+			}
+			if (len != 0) {
+				replay_sample(pst, pr->time - rec_sent,
+				    first - sent, (size_t)len != expect);
+			}
+			x = y - 1;
+			break;
+		case AM_CAPTURE_CLOSE:
+			goto done;
+		default:
+			break;
+		}
+	}
+done:
+	if (s > -1)
+		close(s);
+	pthread_mutex_lock(&pst->mtx);
+	pst->sessions++;
+	pst->errors += error;
+	pthread_mutex_unlock(&pst->mtx);
+}
+
+static void *
+replay_worker(void *arg)
+{
+	int x;
+
+	while (1) {
+		pthread_mutex_lock(&replay_mtx);
+		x = replay_next++;
+		pthread_mutex_unlock(&replay_mtx);
+		if (x >= nsession)
+			break;
+		replay_session(&session[x]);
+	}
+	return (NULL);
+}
+
+static int
+replay_compare(const void *pa, const void *pb)
+{
+	const uint64_t a = *(const uint64_t *)pa;
+	const uint64_t b = *(const uint64_t *)pb;
+
+	return ((a > b) - (a < b));
+}
+
+static double
+replay_percentile(uint64_t *ptr, size_t count, double pct)
+{
+	if (count == 0)
+		return (0.0);
+	return ((double)ptr[(size_t)(pct * (double)(count - 1) / 100.0 + 0.5)] / 1000.0);
+}
+
+static void
+replay_report(double seconds)
+{
+	struct replay_stats *pst;
+	int proto;
+
+	for (proto = 0; proto != AM_PROTO_MAX; proto++) {
+		pst = &stats[proto];
+		if (pst->sessions == 0)
+			continue;
+
+		qsort(pst->recorded, pst->count, sizeof(uint64_t), &replay_compare);
+		qsort(pst->replayed, pst->count, sizeof(uint64_t), &replay_compare);
+
+		printf("{\"proto\":\"%s\",\"speed\":%.2f,\"seconds\":%.3f,"
+		    "\"sessions\":%ju,\"errors\":%ju,\"responses\":%zu,"
+		    "\"size_mismatch\":%ju,"
+		    "\"recorded_p50_us\":%.1f,\"recorded_p99_us\":%.1f,"
+		    "\"replay_p50_us\":%.1f,\"replay_p99_us\":%.1f,"
+		    "\"delta_p50_us\":%.1f,\"delta_p99_us\":%.1f}\n",
+		    replay_name[proto], replay_speed, seconds,
+		    (uintmax_t)pst->sessions, (uintmax_t)pst->errors,
+		    pst->count, (uintmax_t)pst->mismatch,
+		    replay_percentile(pst->recorded, pst->count, 50.0),
+		    replay_percentile(pst->recorded, pst->count, 99.0),
+		    replay_percentile(pst->replayed, pst->count, 50.0),
+		    replay_percentile(pst->replayed, pst->count, 99.0),
+		    replay_percentile(pst->replayed, pst->count, 50.0) -
+		    replay_percentile(pst->recorded, pst->count, 50.0),
+		    replay_percentile(pst->replayed, pst->count, 99.0) -
+		    replay_percentile(pst->recorded, pst->count, 99.0));
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: asteriskmail_replay [-b 127.0.0.1] [-p 25] [-P 110] [-H 80]"
+	    " [-i 143] [-s 1.0] [-j 64] [-t 5] <capture file>"
+	    "\n" "       -b <addr>     address of the instance to replay against"
+	    "\n" "       -p <port>     SMTP port"
+	    "\n" "       -P <port>     POP3 port"
+	    "\n" "       -H <port>     HTTPD port"
+	    "\n" "       -i <port>     IMAP port"
+	    "\n" "       -s <speed>    replay speed factor, 0 is as fast as possible"
+	    "\n" "       -j <num>      maximum number of concurrent sessions"
+	    "\n" "       -t <sec>      response timeout"
+	    "\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	pthread_t *thread;
+	int nthread = 64;
+	int opt;
+	int x;
+
+	while ((opt = getopt(argc, argv, "b:p:P:H:i:s:j:t:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			replay_host = optarg;
+			break;
+		case 'p':
+			replay_port[AM_PROTO_SMTP] = optarg;
+			break;
+		case 'P':
+			replay_port[AM_PROTO_POP3] = optarg;
+			break;
+		case 'H':
+			replay_port[AM_PROTO_HTTPD] = optarg;
+			break;
+		case 'i':
+			replay_port[AM_PROTO_IMAP] = optarg;
+			break;
+		case 's':
+			replay_speed = atof(optarg);
+			break;
+		case 'j':
+			nthread = atoi(optarg);
+			break;
+		case 't':
+			replay_timeout = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || nthread < 1 || replay_timeout < 1 || replay_speed < 0.0)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	for (x = 0; x != AM_PROTO_MAX; x++)
+		pthread_mutex_init(&stats[x].mtx, NULL);
+
+	replay_load(argv[0]);
+
+	thread = calloc(nthread, sizeof(thread[0]));
+	if (thread == NULL)
+		errx(EX_SOFTWARE, "Out of memory");
+
+	replay_start = replay_now();
+
+	for (x = 0; x != nthread; x++) {
+		if (pthread_create(&thread[x], NULL, &replay_worker, NULL) != 0)
+			errx(EX_SOFTWARE, "Cannot create thread");
+	}
+	for (x = 0; x != nthread; x++)
+		pthread_join(thread[x], NULL);
+
+	replay_report((double)(replay_now() - replay_start) / 1000000000.0);
+
+	free(thread);
+	return (0);
+}
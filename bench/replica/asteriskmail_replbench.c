@@ -0,0 +1,493 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Replication lag benchmark for AsteriskMail. A number of SMTP senders
+ * deliver messages to the primary at a fixed total rate for a given
+ * time, and the time each message is acknowledged is recorded. Another
+ * thread polls the metrics page of the replica as fast as it can, and
+ * the N-th change applied by the replica is matched with the N-th
+ * message acknowledged by the primary, which gives the replication lag
+ * of each message, to within one poll. Comparing the SMTP latency with
+ * a run where the replica is stopped shows what replication costs the
+ * sender. Start the servers with "-D 0", so that no message is dropped
+ * as a duplicate, and without store limits. The results are printed as
+ * one JSON object per line.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define	BENCH_APPLIED "asteriskmail_replication_records_total{direction=\"applied\"}"
+#define	BENCH_LAG "asteriskmail_replication_lag_records"
+
+struct bench_stats {
+	uint64_t *sample;
+	size_t	count;
+	size_t	max;
+	uint64_t errors;
+};
+
+struct bench_sender {
+	pthread_t thread;
+	int	index;
+	struct bench_stats smtp;
+};
+
+static const char *bench_host = "127.0.0.1";
+static const char *bench_replica_host;
+static const char *bench_smtp_port = "25";
+static const char *bench_http_port = "80";
+static const char *bench_replica_port = "8080";
+static int bench_senders = 4;
+static int bench_rate = 1000;
+static int bench_seconds = 10;
+static int bench_timeout = 5;
+static int bench_poll_us = 1000;
+
+/* acknowledgement times, in the order the primary gave them */
+static pthread_mutex_t bench_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct bench_stats bench_acked;
+static volatile int bench_done;
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+bench_sleep_until(uint64_t when)
+{
+	uint64_t now = bench_now();
+
+	if (when > now)
+		usleep((when - now) / 1000);
+}
+
+static void
+bench_record(struct bench_stats *ps, uint64_t ns)
+{
+	if (ps->count == ps->max) {
+		ps->max = ps->max ? 2 * ps->max : 1024;
+		ps->sample = realloc(ps->sample, ps->max * sizeof(ps->sample[0]));
+		if (ps->sample == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+	ps->sample[ps->count++] = ns;
+}
+
+static int
+bench_connect(const char *host, const char *port)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *res0;
+	struct timeval tv = { .tv_sec = bench_timeout };
+	int flag = 1;
+	int s = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(host, port, &hints, &res) != 0)
+		return (-1);
+
+	for (res0 = res; res0 != NULL; res0 = res0->ai_next) {
+		s = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol);
+		if (s < 0)
+			continue;
+		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(s, res0->ai_addr, res0->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+
+	if (s < 0)
+		return (-1);
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return (s);
+}
+
+/* read one reply line into the given buffer, returns its length or -1 */
+static ssize_t
+bench_line(int s, char *line, size_t max)
+{
+	size_t len = 0;
+	ssize_t total = 0;
+	char c;
+
+	while (read(s, &c, 1) == 1) {
+		total++;
+		if (len + 1 < max)
+			line[len++] = c;
+		if (c == '\n') {
+			line[len] = 0;
+			return (total);
+		}
+	}
+	return (-1);
+}
+
+static int
+bench_command(int s, const char *cmd)
+{
+	size_t len = strlen(cmd);
+
+	return (write(s, cmd, len) != (ssize_t)len);
+}
+
+/* read lines until one starts with the given prefix */
+static int
+bench_expect(int s, const char *prefix)
+{
+	char line[512];
+
+	do {
+		if (bench_line(s, line, sizeof(line)) < 0)
+			return (1);
+	} while (strncmp(line, prefix, strlen(prefix)) != 0);
+	return (0);
+}
+
+/*
+ * Read a value from a metrics page, returns -1 when not found. The
+ * page is read buffered, so that polling it is cheap.
+ */
+static int64_t
+bench_metric(const char *host, const char *port, const char *name)
+{
+	char line[512];
+	char cmd[256];
+	size_t len = strlen(name);
+	int64_t value = -1;
+	FILE *fp;
+	int s;
+
+	s = bench_connect(host, port);
+	if (s < 0)
+		return (-1);
+	snprintf(cmd, sizeof(cmd), "GET /metrics HTTP/1.0\r\n"
+	    "Host: %s\r\n"
+	    "\r\n", host);
+	if (bench_command(s, cmd) != 0 || (fp = fdopen(s, "r")) == NULL) {
+		close(s);
+		return (-1);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, name, len) == 0 && line[len] == ' ')
+			value = strtoll(line + len + 1, NULL, 10);
+	}
+	fclose(fp);
+	return (value);
+}
+
+/* deliver one message in its own SMTP session, like Asterisk does */
+static int
+bench_deliver(int index, int seq)
+{
+	char line[1024];
+	int s;
+	int error;
+
+	snprintf(line, sizeof(line),
+	    "Subject: SMS from +47%08d\r\n"
+	    "From: +47%08d <+47%08d@localhost>\r\n"
+	    "Content-Type: text/plain; charset=utf-8\r\n"
+	    "\r\n"
+	    "Replication test message %d from sender %d, your code is %06d.\r\n"
+	    ".\r\n",
+	    90000000 + index, 90000000 + index, 90000000 + index,
+	    seq, index, (seq * 7919 + index) % 1000000);
+
+	s = bench_connect(bench_host, bench_smtp_port);
+	if (s < 0)
+		return (1);
+	error = (bench_expect(s, "2") ||
+	    bench_command(s, "HELO localhost\r\n") || bench_expect(s, "2") ||
+	    bench_command(s, "MAIL FROM:<localhost>\r\n") || bench_expect(s, "2") ||
+	    bench_command(s, "RCPT TO:<localhost>\r\n") || bench_expect(s, "2") ||
+	    bench_command(s, "DATA\r\n") || bench_expect(s, "3") ||
+	    bench_command(s, line) || bench_expect(s, "2"));
+	if (error == 0)
+		bench_command(s, "QUIT\r\n");
+	close(s);
+	return (error);
+}
+
+/* deliver messages at this sender's share of the rate until the time is up */
+static void *
+bench_sender_loop(void *arg)
+{
+	struct bench_sender *ps = arg;
+	uint64_t interval;
+	uint64_t start;
+	uint64_t end;
+	uint64_t next;
+	uint64_t now;
+	int seq;
+
+	interval = bench_rate ? 1000000000ULL * bench_senders / bench_rate : 0;
+	start = bench_now();
+	end = start + (uint64_t)bench_seconds * 1000000000ULL;
+	/* spread the senders over the interval */
+	next = start + interval * ps->index / bench_senders;
+
+	for (seq = 0; (now = bench_now()) < end; seq++) {
+		bench_sleep_until(next);
+		next += interval;
+		now = bench_now();
+		if (bench_deliver(ps->index, seq) != 0) {
+			ps->smtp.errors++;
+			continue;
+		}
+		bench_record(&ps->smtp, bench_now() - now);
+		pthread_mutex_lock(&bench_mtx);
+		bench_record(&bench_acked, bench_now());
+		pthread_mutex_unlock(&bench_mtx);
+	}
+	return (NULL);
+}
+
+static int
+bench_compare(const void *pa, const void *pb)
+{
+	const uint64_t a = *(const uint64_t *)pa;
+	const uint64_t b = *(const uint64_t *)pb;
+
+	return ((a > b) - (a < b));
+}
+
+static double
+bench_percentile(const struct bench_stats *ps, double pct)
+{
+	size_t index;
+
+	if (ps->count == 0)
+		return (0.0);
+	index = (size_t)(pct * (double)(ps->count - 1) / 100.0 + 0.5);
+	return ((double)ps->sample[index] / 1000.0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: asteriskmail_replbench [-b 127.0.0.1] [-p 25] [-H 80]"
+	    "\n" "       [-B 127.0.0.1] [-R 8080] [-c 4] [-r 1000] [-s 10] [-i 1000] [-t 5]"
+	    "\n" "       -b <addr>     primary address"
+	    "\n" "       -p <port>     SMTP port of the primary"
+	    "\n" "       -H <port>     HTTP port of the primary, for the metrics page"
+	    "\n" "       -B <addr>     replica address, default is the primary address"
+	    "\n" "       -R <port>     HTTP port of the replica, for the metrics page"
+	    "\n" "       -c <num>      number of concurrent SMTP senders"
+	    "\n" "       -r <num>      messages per second in total, 0 is unpaced"
+	    "\n" "       -s <sec>      time to deliver messages for"
+	    "\n" "       -i <usec>     time between polls of the replica"
+	    "\n" "       -t <sec>      I/O timeout, and longest time to wait for"
+	    "\n" "                     the replica to catch up"
+	    "\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_sender *ps;
+	struct bench_stats smtp;
+	struct bench_stats lag;
+	uint64_t start;
+	uint64_t seconds;
+	uint64_t deadline;
+	uint64_t caught = 0;
+	uint64_t now;
+	int64_t base;
+	int64_t value;
+	int64_t records;
+	int64_t records_max = 0;
+	size_t seen = 0;
+	size_t acked;
+	size_t y;
+	int opt;
+	int x;
+
+	while ((opt = getopt(argc, argv, "b:p:H:B:R:c:r:s:i:t:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			bench_host = optarg;
+			break;
+		case 'p':
+			bench_smtp_port = optarg;
+			break;
+		case 'H':
+			bench_http_port = optarg;
+			break;
+		case 'B':
+			bench_replica_host = optarg;
+			break;
+		case 'R':
+			bench_replica_port = optarg;
+			break;
+		case 'c':
+			bench_senders = atoi(optarg);
+			break;
+		case 'r':
+			bench_rate = atoi(optarg);
+			break;
+		case 's':
+			bench_seconds = atoi(optarg);
+			break;
+		case 'i':
+			bench_poll_us = atoi(optarg);
+			break;
+		case 't':
+			bench_timeout = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (bench_senders < 1 || bench_rate < 0 || bench_seconds < 1 ||
+	    bench_poll_us < 0 || bench_timeout < 1)
+		usage();
+	if (bench_replica_host == NULL)
+		bench_replica_host = bench_host;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	base = bench_metric(bench_replica_host, bench_replica_port, BENCH_APPLIED);
+	if (base < 0)
+		errx(EX_UNAVAILABLE, "Cannot read the metrics of the replica");
+	if (bench_metric(bench_host, bench_http_port, BENCH_LAG) < 0)
+		errx(EX_UNAVAILABLE, "The primary does not replicate");
+
+	ps = calloc(bench_senders, sizeof(ps[0]));
+	if (ps == NULL)
+		errx(EX_SOFTWARE, "Out of memory");
+
+	start = bench_now();
+	for (x = 0; x != bench_senders; x++) {
+		ps[x].index = x;
+		if (pthread_create(&ps[x].thread, NULL, &bench_sender_loop, ps + x) != 0)
+			errx(EX_SOFTWARE, "Cannot create thread");
+	}
+
+	/*
+	 * Poll the replica until the senders are done and it has applied
+	 * every message, or until it does not catch up in time.
+	 */
+	memset(&lag, 0, sizeof(lag));
+	deadline = 0;
+	while (1) {
+		value = bench_metric(bench_replica_host, bench_replica_port, BENCH_APPLIED);
+		now = bench_now();
+		if (value >= 0) {
+			value -= base;
+			pthread_mutex_lock(&bench_mtx);
+			acked = bench_acked.count;
+			for (; seen < acked && (int64_t)seen < value; seen++)
+				bench_record(&lag, now - bench_acked.sample[seen]);
+			pthread_mutex_unlock(&bench_mtx);
+		}
+		records = bench_metric(bench_host, bench_http_port, BENCH_LAG);
+		if (records > records_max)
+			records_max = records;
+
+		if (bench_done == 0 && now >= start + (uint64_t)bench_seconds * 1000000000ULL) {
+			for (x = 0; x != bench_senders; x++)
+				pthread_join(ps[x].thread, NULL);
+			bench_done = 1;
+			deadline = bench_now() + (uint64_t)bench_timeout * 1000000000ULL;
+		}
+		if (bench_done != 0 && seen == bench_acked.count) {
+			caught = bench_now();
+			break;
+		}
+		if (deadline != 0 && now >= deadline)
+			break;
+		if (bench_poll_us != 0)
+			usleep(bench_poll_us);
+	}
+	seconds = bench_now() - start;
+
+	memset(&smtp, 0, sizeof(smtp));
+	for (x = 0; x != bench_senders; x++) {
+		for (y = 0; y != ps[x].smtp.count; y++)
+			bench_record(&smtp, ps[x].smtp.sample[y]);
+		smtp.errors += ps[x].smtp.errors;
+		free(ps[x].smtp.sample);
+	}
+	qsort(smtp.sample, smtp.count, sizeof(smtp.sample[0]), &bench_compare);
+	qsort(lag.sample, lag.count, sizeof(lag.sample[0]), &bench_compare);
+
+	printf("{\"op\":\"smtp_ingest\",\"senders\":%d,\"rate\":%d,"
+	    "\"seconds\":%d,\"count\":%zu,\"errors\":%ju,\"per_second\":%.1f,"
+	    "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+	    bench_senders, bench_rate, bench_seconds, smtp.count,
+	    (uintmax_t)smtp.errors, (double)smtp.count / bench_seconds,
+	    bench_percentile(&smtp, 50.0), bench_percentile(&smtp, 99.0),
+	    bench_percentile(&smtp, 100.0));
+	printf("{\"op\":\"replication_lag\",\"count\":%zu,\"missing\":%zu,"
+	    "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,"
+	    "\"catchup_ms\":%.1f,\"max_lag_records\":%jd,\"seconds\":%.3f}\n",
+	    lag.count, bench_acked.count - lag.count,
+	    bench_percentile(&lag, 50.0), bench_percentile(&lag, 99.0),
+	    bench_percentile(&lag, 100.0),
+	    (caught != 0 && bench_acked.count != 0) ? (double)(caught -
+	    bench_acked.sample[bench_acked.count - 1]) / 1000000.0 : -1.0,
+	    (intmax_t)records_max, (double)seconds / 1000000000.0);
+
+	free(smtp.sample);
+	free(lag.sample);
+	free(bench_acked.sample);
+	free(ps);
+	return (0);
+}
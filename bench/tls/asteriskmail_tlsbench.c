@@ -0,0 +1,403 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * TLS handshake benchmark for AsteriskMail. Many concurrent clients
+ * upgrade POP3 sessions with STLS, or open HTTPS connections, and end
+ * the session right after the handshake. The run has two phases: one
+ * where every handshake is a full one, and one where each client
+ * offers the session it got last, so that the cost of resumption can
+ * be compared. The results are printed as one JSON object per line.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sysexits.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <openssl/ssl.h>
+
+enum {
+	MODE_POP3,
+	MODE_HTTPS,
+};
+
+enum {
+	PHASE_FULL,
+	PHASE_RESUMED,
+	PHASE_MAX,
+};
+
+static const char *phase_name[PHASE_MAX] = {
+	[PHASE_FULL] = "full",
+	[PHASE_RESUMED] = "resumed",
+};
+
+struct bench_stats {
+	uint64_t *sample;
+	size_t	count;
+	size_t	max;
+	uint64_t errors;
+	uint64_t reused;
+};
+
+struct bench_client {
+	pthread_t thread;
+	SSL_SESSION *session;
+	struct bench_stats stats[PHASE_MAX];
+};
+
+static const char *bench_host = "127.0.0.1";
+static const char *bench_port = "1110";
+static SSL_CTX *bench_ctx;
+static int bench_mode = MODE_POP3;
+static int bench_phase;
+static int bench_clients = 16;
+static int bench_duration = 5;
+static int bench_timeout = 5;
+static uint64_t bench_deadline;
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+bench_record(struct bench_stats *ps, uint64_t ns)
+{
+	if (ps->count == ps->max) {
+		ps->max = ps->max ? 2 * ps->max : 1024;
+		ps->sample = realloc(ps->sample, ps->max * sizeof(ps->sample[0]));
+		if (ps->sample == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+	ps->sample[ps->count++] = ns;
+}
+
+static int
+bench_connect(void)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *res0;
+	struct timeval tv = { .tv_sec = bench_timeout };
+	int flag = 1;
+	int s = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(bench_host, bench_port, &hints, &res) != 0)
+		return (-1);
+
+	for (res0 = res; res0 != NULL; res0 = res0->ai_next) {
+		s = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol);
+		if (s < 0)
+			continue;
+		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(s, res0->ai_addr, res0->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+
+	if (s < 0)
+		return (-1);
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return (s);
+}
+
+/* read one plain text reply line and check its first character */
+static int
+bench_expect(int s, char ch)
+{
+	char c;
+	int first = -1;
+
+	while (read(s, &c, 1) == 1) {
+		if (first < 0)
+			first = c;
+		if (c == '\n')
+			return (first != ch);
+	}
+	return (1);
+}
+
+/* read one TLS protected reply line and check its first character */
+static int
+bench_ssl_expect(SSL *ssl, char ch)
+{
+	char c;
+	int first = -1;
+
+	while (SSL_read(ssl, &c, 1) == 1) {
+		if (first < 0)
+			first = c;
+		if (c == '\n')
+			return (first != ch);
+	}
+	return (1);
+}
+
+static int
+bench_session(struct bench_client *pc, struct bench_stats *ps)
+{
+	static const char stls[] = "STLS\r\n";
+	static const char quit[] = "QUIT\r\n";
+	static const char get[] = "GET /metrics HTTP/1.0\r\n\r\n";
+	char buffer[4096];
+	SSL *ssl = NULL;
+	int retval = 1;
+	int s;
+
+	s = bench_connect();
+	if (s < 0)
+		return (1);
+
+	if (bench_mode == MODE_POP3) {
+		if (bench_expect(s, '+') ||
+		    write(s, stls, sizeof(stls) - 1) != sizeof(stls) - 1 ||
+		    bench_expect(s, '+'))
+			goto done;
+	}
+
+	ssl = SSL_new(bench_ctx);
+	if (ssl == NULL || SSL_set_fd(ssl, s) != 1)
+		goto done;
+	if (bench_phase == PHASE_RESUMED && pc->session != NULL)
+		SSL_set_session(ssl, pc->session);
+	if (SSL_connect(ssl) != 1)
+		goto done;
+	if (SSL_session_reused(ssl))
+		ps->reused++;
+
+	/* a short exchange, which also delivers TLS 1.3 tickets */
+	if (bench_mode == MODE_POP3) {
+		if (SSL_write(ssl, quit, sizeof(quit) - 1) != sizeof(quit) - 1 ||
+		    bench_ssl_expect(ssl, '+'))
+			goto done;
+	} else {
+		if (SSL_write(ssl, get, sizeof(get) - 1) != sizeof(get) - 1)
+			goto done;
+		while (SSL_read(ssl, buffer, sizeof(buffer)) > 0)
+			;
+	}
+
+	if (pc->session != NULL)
+		SSL_SESSION_free(pc->session);
+	pc->session = SSL_get1_session(ssl);
+	SSL_shutdown(ssl);
+	retval = 0;
+done:
+	SSL_free(ssl);
+	close(s);
+	return (retval);
+}
+
+static void *
+bench_client_loop(void *arg)
+{
+	struct bench_client *pc = arg;
+	struct bench_stats *ps = &pc->stats[bench_phase];
+	uint64_t start;
+
+	while (bench_now() < bench_deadline) {
+		start = bench_now();
+		if (bench_session(pc, ps))
+			ps->errors++;
+		else
+			bench_record(ps, bench_now() - start);
+	}
+	return (NULL);
+}
+
+static int
+bench_compare(const void *pa, const void *pb)
+{
+	const uint64_t a = *(const uint64_t *)pa;
+	const uint64_t b = *(const uint64_t *)pb;
+
+	return ((a > b) - (a < b));
+}
+
+static double
+bench_percentile(const struct bench_stats *ps, double pct)
+{
+	size_t index;
+
+	if (ps->count == 0)
+		return (0.0);
+	index = (size_t)(pct * (double)(ps->count - 1) / 100.0 + 0.5);
+	return ((double)ps->sample[index] / 1000.0);
+}
+
+static void
+bench_report(struct bench_client *pc, int phase, double seconds)
+{
+	struct bench_stats sum;
+	int x;
+
+	memset(&sum, 0, sizeof(sum));
+	for (x = 0; x != bench_clients; x++) {
+		struct bench_stats *ps = &pc[x].stats[phase];
+
+		while (ps->count != 0)
+			bench_record(&sum, ps->sample[--ps->count]);
+		free(ps->sample);
+		sum.errors += ps->errors;
+		sum.reused += ps->reused;
+	}
+	qsort(sum.sample, sum.count, sizeof(sum.sample[0]), &bench_compare);
+
+	printf("{\"op\":\"%s\",\"handshake\":\"%s\",\"clients\":%d,"
+	    "\"seconds\":%.3f,\"count\":%zu,\"errors\":%ju,\"reused\":%ju,"
+	    "\"handshakes_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+	    "\"max_us\":%.1f}\n",
+	    bench_mode == MODE_POP3 ? "pop3_stls" : "https",
+	    phase_name[phase], bench_clients, seconds, sum.count,
+	    (uintmax_t)sum.errors, (uintmax_t)sum.reused,
+	    (double)sum.count / seconds,
+	    bench_percentile(&sum, 50.0), bench_percentile(&sum, 99.0),
+	    bench_percentile(&sum, 100.0));
+	free(sum.sample);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: asteriskmail_tlsbench [-b 127.0.0.1] [-p 1110] [-m pop3] [-c 16] [-d 5] [-t 5]"
+	    "\n" "       -b <addr>     server address"
+	    "\n" "       -p <port>     server port"
+	    "\n" "       -m <mode>     pop3 to upgrade with STLS, or https"
+	    "\n" "       -c <num>      number of concurrent clients"
+	    "\n" "       -d <sec>      duration of each phase in seconds"
+	    "\n" "       -t <sec>      client I/O timeout, expired handshakes count as errors"
+	    "\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_client *pc;
+	uint64_t start;
+	double seconds;
+	int opt;
+	int x;
+
+	while ((opt = getopt(argc, argv, "b:p:m:c:d:t:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			bench_host = optarg;
+			break;
+		case 'p':
+			bench_port = optarg;
+			break;
+		case 'm':
+			if (strcmp(optarg, "pop3") == 0)
+				bench_mode = MODE_POP3;
+			else if (strcmp(optarg, "https") == 0)
+				bench_mode = MODE_HTTPS;
+			else
+				usage();
+			break;
+		case 'c':
+			bench_clients = atoi(optarg);
+			break;
+		case 'd':
+			bench_duration = atoi(optarg);
+			break;
+		case 't':
+			bench_timeout = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (bench_clients < 1 || bench_duration < 1 || bench_timeout < 1)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* the server certificate is not verified, only timed */
+	bench_ctx = SSL_CTX_new(TLS_client_method());
+	if (bench_ctx == NULL)
+		errx(EX_SOFTWARE, "Cannot create TLS context");
+	SSL_CTX_set_verify(bench_ctx, SSL_VERIFY_NONE, NULL);
+
+	pc = calloc(bench_clients, sizeof(*pc));
+	if (pc == NULL)
+		errx(EX_SOFTWARE, "Out of memory");
+
+	for (bench_phase = 0; bench_phase != PHASE_MAX; bench_phase++) {
+		start = bench_now();
+		bench_deadline = start + (uint64_t)bench_duration * 1000000000ULL;
+
+		for (x = 0; x != bench_clients; x++) {
+			if (pthread_create(&pc[x].thread, NULL,
+			    &bench_client_loop, pc + x) != 0)
+				errx(EX_SOFTWARE, "Cannot create thread");
+		}
+		for (x = 0; x != bench_clients; x++)
+			pthread_join(pc[x].thread, NULL);
+
+		seconds = (double)(bench_now() - start) / 1000000000.0;
+		bench_report(pc, bench_phase, seconds);
+	}
+
+	for (x = 0; x != bench_clients; x++) {
+		if (pc[x].session != NULL)
+			SSL_SESSION_free(pc[x].session);
+	}
+	SSL_CTX_free(bench_ctx);
+	free(pc);
+	return (0);
+}
@@ -0,0 +1,427 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Local stand-in for a webhook receiver. It accepts the JSON batches
+ * POSTed by AsteriskMail, one connection at a time, and answers them
+ * with keep-alive replies. Failures and slow receivers can be
+ * simulated, to exercise the retries and the bounded queue of the
+ * server. Each request is printed as one JSON object per line, and a
+ * summary is printed when the expected number of messages was seen.
+ * With -v the bodies are printed as well.
+ *
+ * With -x the sink starts the daemon itself, posting to the sink, and
+ * sends it the expected number of messages by SMTP, each one after the
+ * previous batch was answered. Together with -k, which drops every
+ * kept connection with a reset, each batch goes out over a connection
+ * the receiver has closed. The exit status is non-zero if a message
+ * is missing or the daemon died.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#define	SINK_TIMEOUT 30		/* seconds for a check with -x */
+
+static const char *sink_host = "127.0.0.1";
+static const char *sink_port = "8088";
+static int sink_fail;
+static int sink_delay;
+static int sink_close;
+static int sink_drop;
+static int sink_verbose;
+static long sink_expect;
+static const char *sink_smtp_port = "2525";
+static pid_t sink_pid = -1;
+
+static uint64_t
+sink_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static int
+sink_listen(void)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	int flag = 1;
+	int s;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if (getaddrinfo(sink_host, sink_port, &hints, &res) != 0)
+		errx(EX_USAGE, "Cannot resolve '%s'", sink_host);
+	s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (s < 0)
+		err(EX_SOFTWARE, "socket");
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+	if (bind(s, res->ai_addr, res->ai_addrlen) != 0 || listen(s, 16) != 0)
+		err(EX_SOFTWARE, "Cannot listen on '%s' port '%s'", sink_host, sink_port);
+	freeaddrinfo(res);
+	return (s);
+}
+
+static void
+sink_timeout(int sig)
+{
+	static const char msg[] = "{\"op\":\"webhook_check\",\"result\":\"timeout\"}\n";
+
+	if (sink_pid > 0)
+		kill(sink_pid, SIGKILL);
+	write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+	_exit(1);
+}
+
+static void
+sink_start_daemon(const char *path, char **extra, int nextra)
+{
+	char pidfile[64];
+	char url[128];
+	char *argv[16 + nextra];
+	int argc = 0;
+	int x;
+
+	snprintf(pidfile, sizeof(pidfile), "/tmp/asteriskmail_sink.%d.pid",
+	    (int)getpid());
+	snprintf(url, sizeof(url), "http://%s:%s/hook", sink_host, sink_port);
+
+	argv[argc++] = (char *)path;
+	argv[argc++] = "-b";
+	argv[argc++] = (char *)sink_host;
+	argv[argc++] = "-p";
+	argv[argc++] = (char *)sink_smtp_port;
+	argv[argc++] = "-f";
+	argv[argc++] = pidfile;
+	argv[argc++] = "-W";
+	argv[argc++] = url;
+	for (x = 0; x != nextra; x++)
+		argv[argc++] = extra[x];
+	argv[argc] = NULL;
+
+	sink_pid = fork();
+	if (sink_pid < 0)
+		err(EX_OSERR, "Cannot fork");
+	if (sink_pid == 0) {
+		execv(path, argv);
+		_exit(EX_OSERR);
+	}
+}
+
+static FILE *
+sink_smtp_connect(void)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	FILE *io;
+	int s;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(sink_host, sink_smtp_port, &hints, &res) != 0)
+		errx(EX_USAGE, "Cannot resolve '%s'", sink_host);
+	s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (s > -1 && connect(s, res->ai_addr, res->ai_addrlen) != 0) {
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+	if (s < 0)
+		return (NULL);
+	io = fdopen(s, "r+");
+	if (io == NULL)
+		close(s);
+	return (io);
+}
+
+/* send one message to the daemon, returns non-zero on failure */
+static int
+sink_smtp_send(long num)
+{
+	static const char *cmd[] = { "HELO sink", "MAIL FROM:<sink@localhost>",
+	    "RCPT TO:<localhost@localhost>", "DATA", NULL, "QUIT" };
+	char line[256];
+	FILE *io;
+	int retval = 0;
+	int x;
+
+	/* the daemon may still be starting */
+	for (x = 0; (io = sink_smtp_connect()) == NULL; x++) {
+		if (x == 500)
+			return (1);
+		usleep(10000);
+	}
+	if (fgets(line, sizeof(line), io) == NULL || line[0] != '2')
+		retval = 1;
+	for (x = 0; retval == 0 && x != sizeof(cmd) / sizeof(cmd[0]); x++) {
+		if (cmd[x] != NULL)
+			fprintf(io, "%s\r\n", cmd[x]);
+		else
+			fprintf(io, "Subject: sink %ld\r\n\r\nmessage %ld\r\n.\r\n",
+			    num, num);
+		if (fflush(io) != 0 || fgets(line, sizeof(line), io) == NULL ||
+		    (line[0] != '2' && line[0] != '3'))
+			retval = 1;
+	}
+	fclose(io);
+	return (retval);
+}
+
+/* send the next message once all sent ones were posted back */
+static int
+sink_next(const char *daemon_path, long messages, long *psent)
+{
+	if (daemon_path == NULL || messages != *psent || *psent == sink_expect)
+		return (0);
+	return (sink_smtp_send((*psent)++));
+}
+
+/* count the messages of a batch */
+static long
+sink_count(const char *body)
+{
+	long num = 0;
+
+	while ((body = strstr(body, "{\"uid\":")) != NULL) {
+		num++;
+		body += 7;
+	}
+	return (num);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: asteriskmail_webhook_sink [-b 127.0.0.1] [-p 8088] [-f 0] [-d 0] [-n 0] [-c] [-k] [-v]"
+	    "\n" "                                  [-x asteriskmail] [-S 2525] [-- daemon arguments]"
+	    "\n" "       -b <addr>     listen address"
+	    "\n" "       -p <port>     listen port"
+	    "\n" "       -f <num>      answer every num'th request with 503"
+	    "\n" "       -d <ms>       delay before each reply"
+	    "\n" "       -n <num>      exit after receiving num messages"
+	    "\n" "       -c            close the connection after each reply"
+	    "\n" "       -k            reset the connection after each reply, without telling"
+	    "\n" "       -x <path>     start this daemon and send it the -n messages"
+	    "\n" "       -S <port>     SMTP port of the started daemon"
+	    "\n" "       -v            print the request bodies"
+	    "\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+	char line[4096];
+	const char *daemon_path = NULL;
+	char *body;
+	FILE *io;
+	uint64_t first = 0;
+	uint64_t now;
+	long length;
+	long messages = 0;
+	long sent = 0;
+	long requests = 0;
+	long failed = 0;
+	long connections = 0;
+	long bytes = 0;
+	long num;
+	int status;
+	int failed_check = 0;
+	int keep;
+	int opt;
+	int s;
+	int c;
+
+	while ((opt = getopt(argc, argv, "b:p:f:d:n:ckS:x:vh")) != -1) {
+		switch (opt) {
+		case 'b':
+			sink_host = optarg;
+			break;
+		case 'p':
+			sink_port = optarg;
+			break;
+		case 'f':
+			sink_fail = atoi(optarg);
+			break;
+		case 'd':
+			sink_delay = atoi(optarg);
+			break;
+		case 'n':
+			sink_expect = atol(optarg);
+			break;
+		case 'c':
+			sink_close = 1;
+			break;
+		case 'k':
+			sink_drop = 1;
+			break;
+		case 'S':
+			sink_smtp_port = optarg;
+			break;
+		case 'x':
+			daemon_path = optarg;
+			break;
+		case 'v':
+			sink_verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (sink_fail < 0 || sink_delay < 0 || sink_expect < 0 ||
+	    (daemon_path != NULL && sink_expect == 0))
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+	s = sink_listen();
+
+	if (daemon_path != NULL) {
+		signal(SIGALRM, &sink_timeout);
+		alarm(SINK_TIMEOUT);
+		sink_start_daemon(daemon_path, argv, argc);
+		if (sink_next(daemon_path, messages, &sent) != 0)
+			failed_check = 1;
+	}
+
+	while (failed_check == 0 && (sink_expect == 0 || messages < sink_expect)) {
+		c = accept(s, NULL, NULL);
+		if (c < 0)
+			continue;
+		io = fdopen(c, "r+");
+		if (io == NULL) {
+			close(c);
+			continue;
+		}
+		connections++;
+
+		for (keep = 1; keep != 0 && (sink_expect == 0 || messages < sink_expect);) {
+			if (fgets(line, sizeof(line), io) == NULL)
+				break;
+			length = 0;
+			while (fgets(line, sizeof(line), io) != NULL &&
+			    line[0] != '\r' && line[0] != '\n') {
+				if (strncasecmp(line, "Content-Length:", 15) == 0)
+					length = atol(line + 15);
+			}
+			body = malloc(length + 1);
+			if (body == NULL || fread(body, 1, length, io) != (size_t)length) {
+				free(body);
+				break;
+			}
+			body[length] = 0;
+			now = sink_now();
+			if (first == 0)
+				first = now;
+
+			requests++;
+			bytes += length;
+			if (sink_delay != 0)
+				usleep(sink_delay * 1000);
+			status = (sink_fail != 0 && requests % sink_fail == 0) ? 503 : 200;
+			num = sink_count(body);
+			if (status == 200)
+				messages += num;
+			else
+				failed++;
+
+			keep = !sink_close && !sink_drop;
+			fprintf(io, "HTTP/1.1 %d %s\r\n"
+			    "Content-Length: 0\r\n"
+			    "%s"
+			    "\r\n", status, status == 200 ? "OK" : "Service Unavailable",
+			    (keep || sink_drop) ? "" : "Connection: close\r\n");
+			fflush(io);
+
+			printf("{\"op\":\"webhook_request\",\"status\":%d,\"bytes\":%ld,"
+			    "\"messages\":%ld,\"connection\":%ld,\"elapsed_ms\":%.1f}\n",
+			    status, length, num, connections,
+			    (double)(now - first) / 1000000.0);
+			if (sink_verbose)
+				printf("%s\n", body);
+			fflush(stdout);
+			free(body);
+
+			/* the next message goes out in a batch of its own */
+			if (keep && sink_next(daemon_path, messages, &sent) != 0)
+				failed_check = 1;
+		}
+		if (sink_drop) {
+			/* reset, so that the next write of the daemon fails */
+			setsockopt(c, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+		}
+		fclose(io);
+		/* after the connection is gone */
+		if (sink_next(daemon_path, messages, &sent) != 0)
+			failed_check = 1;
+	}
+
+	printf("{\"op\":\"webhook_summary\",\"requests\":%ld,\"failed\":%ld,"
+	    "\"connections\":%ld,\"messages\":%ld,\"bytes\":%ld,"
+	    "\"messages_per_request\":%.1f}\n",
+	    requests, failed, connections, messages, bytes,
+	    requests != failed ? (double)messages / (requests - failed) : 0.0);
+	close(s);
+
+	if (daemon_path != NULL) {
+		alarm(0);
+		/* the daemon must have survived every dropped connection */
+		if (waitpid(sink_pid, &status, WNOHANG) != 0)
+			failed_check = 1;
+		else
+			kill(sink_pid, SIGTERM);
+		waitpid(sink_pid, &status, 0);
+		printf("{\"op\":\"webhook_check\",\"result\":\"%s\"}\n",
+		    failed_check ? "failed" : "ok");
+		return (failed_check);
+	}
+	return (0);
+}
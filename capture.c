@@ -0,0 +1,91 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Session capture. When enabled, the connection stream copies all
+ * data read from and written to the socket into a binary log, together
+ * with a timestamp. TLS sessions are recorded in plain text. The log
+ * format is described in asteriskmail.h and is read by
+ * asteriskmail_replay.
+ */
+
+#include <sys/endian.h>
+
+#include "asteriskmail.h"
+
+static FILE *am_capture_log;
+static uint64_t am_capture_start;
+static _Atomic uint32_t am_capture_conn;
+
+int
+am_capture_open(const char *path)
+{
+	static const char magic[AM_CAPTURE_MAGIC_LEN] = AM_CAPTURE_MAGIC;
+
+	am_capture_log = fopen(path, "w");
+	if (am_capture_log == NULL)
+		return (errno);
+	if (fwrite(magic, sizeof(magic), 1, am_capture_log) != 1 ||
+	    fflush(am_capture_log) != 0) {
+		fclose(am_capture_log);
+		am_capture_log = NULL;
+		return (EIO);
+	}
+	am_capture_start = am_metrics_now();
+	return (0);
+}
+
+int
+am_capture_enabled(void)
+{
+	return (am_capture_log != NULL);
+}
+
+uint32_t
+am_capture_conn_alloc(void)
+{
+	return (am_capture_conn++);
+}
+
+void
+am_capture_record(uint32_t conn, uint8_t proto, uint8_t type, const void *data, uint32_t len)
+{
+	struct am_capture_hdr hdr;
+
+	hdr.time = htole64(am_metrics_now() - am_capture_start);
+	hdr.conn = htole32(conn);
+	hdr.length = htole32(len);
+	hdr.proto = proto;
+	hdr.type = type;
+
+	/* keep the records of concurrent sessions apart */
+	flockfile(am_capture_log);
+	fwrite(&hdr, sizeof(hdr), 1, am_capture_log);
+	if (len != 0)
+		fwrite(data, len, 1, am_capture_log);
+	if (type == AM_CAPTURE_CLOSE)
+		fflush(am_capture_log);
+	funlockfile(am_capture_log);
+}
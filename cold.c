@@ -0,0 +1,466 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Cold message compression. Most stored SMS are read once, or never,
+ * and many of them are alike, like one-time codes and carrier notices.
+ * A thread scans the store, and messages which were not read for a
+ * number of scans in a row are compressed with raw deflate, using a
+ * preset dictionary which is taken once from the first cold messages,
+ * so that even short messages compress well. The message data pointer
+ * is swapped for the compressed data, tagged in its lowest bit, and
+ * the raw data is freed once no reader can reference it any more.
+ * Reads of cold messages are decompressed into a small cache of hot
+ * messages, which is shared by all threads, and each thread remembers
+ * its last message until it leaves the snapshot. A cold message which
+ * is read again is made hot by the next scan. The store limit charges
+ * each message for the data it holds, so the swaps are done with the
+ * store locked, a batch at a time.
+ */
+
+#include <zlib.h>
+
+#include "asteriskmail.h"
+
+/* compressed message data */
+struct am_cold {
+	uint32_t len;
+	uint8_t	last;			/* last byte of the raw data */
+	uint8_t	data[];
+};
+
+/* replaced message data waiting to be freed */
+struct am_cold_old {
+	struct am_retire retire;
+	void   *data;			/* tagged when compressed */
+	int	size;
+};
+
+/* messages whose data is swapped at once */
+struct am_cold_batch {
+	struct am_message *pam[AM_COLD_BATCH];
+	void   *data[AM_COLD_BATCH];
+	struct am_cold_old *old[AM_COLD_BATCH];
+	int	num;
+};
+
+/* decompressed message data */
+struct am_cold_hot {
+	struct am_retire retire;
+	uint64_t uid;
+	int	bytes;
+	char	data[];
+};
+
+static uint8_t am_cold_dict[AM_COLD_DICT_MAX];
+static size_t am_cold_dict_len;
+static _Atomic(struct am_cold_hot *) am_cold_cache[AM_COLD_CACHE];
+static __thread const struct am_message *am_cold_last;
+static __thread const char *am_cold_last_data;
+
+unsigned am_cold_age = AM_COLD_AGE;
+
+static struct am_cold *
+am_cold_untag(const void *data)
+{
+	return ((struct am_cold *)((uintptr_t)data & ~(uintptr_t)AM_COLD_TAG));
+}
+
+static size_t
+am_cold_size(const struct am_cold *pc)
+{
+	return (sizeof(*pc) + pc->len);
+}
+
+static void
+am_cold_free_old(struct am_retire *pr)
+{
+	struct am_cold_old *po = (struct am_cold_old *)pr;
+
+	if ((uintptr_t)po->data & AM_COLD_TAG)
+		am_cold_free(po->data);
+	else
+		am_pool_free(po->data, po->size);
+	am_pool_free(po, sizeof(*po));
+}
+
+static void
+am_cold_free_hot(struct am_retire *pr)
+{
+	struct am_cold_hot *ph = (struct am_cold_hot *)pr;
+
+	am_pool_free(ph, sizeof(*ph) + ph->bytes);
+}
+
+/* frees the compressed data of a message */
+void
+am_cold_free(void *data)
+{
+	struct am_cold *pc = am_cold_untag(data);
+
+	am_metrics_gauge(AM_GAUGE_COLD_MESSAGES, -1);
+	am_metrics_gauge(AM_GAUGE_COLD_BYTES, -(int64_t)am_cold_size(pc));
+	am_pool_free(pc, am_cold_size(pc));
+}
+
+/* returns the bytes charged to the store for compressed data */
+size_t
+am_cold_charge(const void *data)
+{
+	return (am_pool_size(am_cold_size(am_cold_untag(data))));
+}
+
+int
+am_cold_last_byte(const void *data)
+{
+	return (am_cold_untag(data)->last);
+}
+
+static int
+am_cold_inflate(const struct am_message *pam, const struct am_cold *pc, void *dst)
+{
+	z_stream zs = {};
+	int error = 0;
+
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+		return (ENOMEM);
+	if (am_cold_dict_len != 0 &&
+	    inflateSetDictionary(&zs, am_cold_dict, am_cold_dict_len) != Z_OK)
+		error = EIO;
+	zs.next_in = __DECONST(uint8_t *, pc->data);
+	zs.avail_in = pc->len;
+	zs.next_out = dst;
+	zs.avail_out = pam->bytes;
+	if (error == 0 &&
+	    (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out != 0))
+		error = EIO;
+	inflateEnd(&zs);
+	return (error);
+}
+
+/*
+ * Returns the decompressed data of a cold message. The data stays
+ * valid until the caller leaves its snapshot.
+ */
+const char *
+am_cold_data(const struct am_message *pam, const void *data)
+{
+	const struct am_cold *pc = am_cold_untag(data);
+	_Atomic(struct am_cold_hot *) *pslot;
+	struct am_cold_hot *ph;
+	struct am_cold_hot *old;
+
+	if (am_cold_last == pam)
+		return (am_cold_last_data);
+
+	pslot = &am_cold_cache[pam->uid % AM_COLD_CACHE];
+	ph = atomic_load(pslot);
+	if (ph != NULL && ph->uid == pam->uid) {
+		am_metrics_count(AM_CNT_COLD_HIT, 1);
+	} else {
+		am_metrics_count(AM_CNT_COLD_MISS, 1);
+		ph = am_pool_alloc(sizeof(*ph) + pam->bytes);
+		if (ph == NULL)
+			return (NULL);
+		ph->uid = pam->uid;
+		ph->bytes = pam->bytes;
+		if (am_cold_inflate(pam, pc, ph->data) != 0) {
+			am_pool_free(ph, sizeof(*ph) + ph->bytes);
+			return (NULL);
+		}
+		/* the previous entry may still be read by others */
+		old = atomic_exchange(pslot, ph);
+		if (old != NULL)
+			am_epoch_retire(&old->retire, &am_cold_free_hot);
+	}
+	am_cold_last = pam;
+	am_cold_last_data = ph->data;
+	return (ph->data);
+}
+
+/* called when the thread leaves its snapshot */
+void
+am_cold_leave(void)
+{
+	am_cold_last = NULL;
+}
+
+/* returns a copy of the raw data of a cold message, to be freed by free() */
+void *
+am_cold_copy(const struct am_message *pam, const void *data)
+{
+	void *ptr = malloc(pam->bytes);
+
+	if (ptr != NULL && am_cold_inflate(pam, am_cold_untag(data), ptr) != 0) {
+		free(ptr);
+		ptr = NULL;
+	}
+	return (ptr);
+}
+
+/* the dictionary is made of the most recent cold messages */
+static void
+am_cold_train(const struct am_snapshot *ps)
+{
+	const struct am_message *pam;
+	size_t len;
+	int count = 0;
+	int x;
+
+	for (x = ps->count; x-- != 0 && am_cold_dict_len != AM_COLD_DICT_MAX; ) {
+		pam = ps->msg[x];
+		if ((atomic_load(&pam->flags) & AM_MSG_IDLE_MASK) <
+		    (AM_COLD_PASSES << AM_MSG_IDLE_SHIFT))
+			continue;
+		len = pam->bytes;
+		if (len > AM_COLD_SAMPLE_MAX)
+			len = AM_COLD_SAMPLE_MAX;
+		if (len > AM_COLD_DICT_MAX - am_cold_dict_len)
+			len = AM_COLD_DICT_MAX - am_cold_dict_len;
+		/* zlib prefers the common strings at the end */
+		memcpy(am_cold_dict + AM_COLD_DICT_MAX - am_cold_dict_len - len,
+		    pam->data, len);
+		am_cold_dict_len += len;
+		count++;
+	}
+	if (count < AM_COLD_TRAIN_MIN) {
+		am_cold_dict_len = 0;
+		return;
+	}
+	memmove(am_cold_dict, am_cold_dict + AM_COLD_DICT_MAX - am_cold_dict_len,
+	    am_cold_dict_len);
+}
+
+/* returns the compressed data of a message, or NULL */
+static void *
+am_cold_compress(z_stream *zs, struct am_message *pam, uint8_t *buf, size_t max)
+{
+	struct am_cold *pc;
+	void *data = atomic_load(&pam->data);
+	size_t len;
+
+	if (deflateReset(zs) != Z_OK ||
+	    deflateSetDictionary(zs, am_cold_dict, am_cold_dict_len) != Z_OK)
+		return (NULL);
+	zs->next_in = data;
+	zs->avail_in = pam->bytes;
+	zs->next_out = buf;
+	zs->avail_out = max;
+	if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+		return (NULL);
+	len = max - zs->avail_out;
+
+	/* keep the message as is, if nothing is gained */
+	if (am_pool_size(sizeof(*pc) + len) + am_pool_size(sizeof(struct am_cold_old)) >=
+	    (size_t)pam->size) {
+		atomic_fetch_or(&pam->flags, AM_MSG_KEEP);
+		return (NULL);
+	}
+	pc = am_pool_alloc(sizeof(*pc) + len);
+	if (pc == NULL)
+		return (NULL);
+	pc->len = len;
+	pc->last = ((uint8_t *)data)[pam->bytes - 1];
+	memcpy(pc->data, buf, len);
+
+	am_metrics_gauge(AM_GAUGE_COLD_MESSAGES, 1);
+	am_metrics_gauge(AM_GAUGE_COLD_BYTES, am_cold_size(pc));
+	return ((void *)((uintptr_t)pc | AM_COLD_TAG));
+}
+
+/* returns the raw data of a cold message, or NULL */
+static void *
+am_cold_thaw(struct am_message *pam, void *data)
+{
+	void *ptr = am_pool_alloc(pam->size);
+
+	if (ptr != NULL && am_cold_inflate(pam, am_cold_untag(data), ptr) != 0) {
+		am_pool_free(ptr, pam->size);
+		ptr = NULL;
+	}
+	return (ptr);
+}
+
+/* queue new data for a message, it is not visible to readers yet */
+static void
+am_cold_batch_add(struct am_cold_batch *pb, struct am_message *pam, void *data)
+{
+	struct am_cold_old *po = am_pool_alloc(sizeof(*po));
+
+	if (po == NULL) {
+		if ((uintptr_t)data & AM_COLD_TAG)
+			am_cold_free(data);
+		else
+			am_pool_free(data, pam->size);
+		return;
+	}
+	pb->pam[pb->num] = pam;
+	pb->data[pb->num] = data;
+	pb->old[pb->num] = po;
+	pb->num++;
+}
+
+/* swap the data of the queued messages, readers see either one */
+static void
+am_cold_batch_apply(struct am_cold_batch *pb)
+{
+	struct am_cold_old *po;
+	int x;
+
+	if (pb->num == 0)
+		return;
+	handle_store_swap(pb->pam, pb->data, pb->num);
+	for (x = 0; x != pb->num; x++) {
+		po = pb->old[x];
+		po->data = pb->data[x];
+		po->size = pb->pam[x]->size;
+		am_epoch_retire(&po->retire, &am_cold_free_old);
+	}
+	pb->num = 0;
+}
+
+/* returns the index of the first message with an id above the given one */
+static int
+am_cold_next(const struct am_snapshot *ps, uint64_t uid)
+{
+	int lo = 0;
+	int hi = ps->count;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ps->msg[mid]->uid <= uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+/* one scan over the store, the snapshot is renewed now and then */
+static void
+am_cold_scan(z_stream *zs, uint8_t **pbuf, size_t *pmax)
+{
+	static struct am_cold_batch batch;
+	const struct am_snapshot *ps;
+	struct am_message *pam;
+	uint64_t uid;
+	size_t max;
+	void *data;
+	int flags;
+	int idle;
+	int x;
+
+	ps = handle_snapshot_enter();
+	if (am_cold_dict_len == 0)
+		am_cold_train(ps);
+
+	for (x = 0; x != ps->count; x++) {
+		pam = ps->msg[x];
+		flags = atomic_load(&pam->flags);
+		data = atomic_load(&pam->data);
+		idle = (flags & AM_MSG_IDLE_MASK) >= (AM_COLD_PASSES << AM_MSG_IDLE_SHIFT);
+
+		if ((uintptr_t)data & AM_COLD_TAG) {
+			/* reads reset the idle count */
+			if (idle)
+				continue;
+			data = am_cold_thaw(pam, data);
+		} else {
+			if (flags & AM_MSG_KEEP)
+				continue;
+			if (idle == 0) {
+				atomic_fetch_add(&pam->flags, 1 << AM_MSG_IDLE_SHIFT);
+				continue;
+			}
+			/* wait for enough cold messages to train the dictionary */
+			if (am_cold_dict_len == 0)
+				continue;
+
+			max = deflateBound(zs, pam->bytes);
+			if (max > *pmax) {
+				free(*pbuf);
+				*pbuf = malloc(max);
+				*pmax = (*pbuf != NULL) ? max : 0;
+				if (*pbuf == NULL)
+					break;
+			}
+			data = am_cold_compress(zs, pam, *pbuf, max);
+		}
+		if (data == NULL)
+			continue;
+		am_cold_batch_add(&batch, pam, data);
+
+		/* let the freeing of memory proceed */
+		if (batch.num == AM_COLD_BATCH) {
+			am_cold_batch_apply(&batch);
+			uid = pam->uid;
+			handle_snapshot_leave();
+			ps = handle_snapshot_enter();
+			x = am_cold_next(ps, uid) - 1;
+		}
+	}
+	am_cold_batch_apply(&batch);
+	handle_snapshot_leave();
+}
+
+static void *
+am_cold_thread(void *arg)
+{
+	z_stream zs = {};
+	struct timespec ts;
+	uint8_t *buf = NULL;
+	size_t max = 0;
+
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+	    8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return (NULL);
+
+	/* a message is cold after a number of scans without reads */
+	ts.tv_sec = am_cold_age / AM_COLD_PASSES;
+	ts.tv_nsec = (am_cold_age % AM_COLD_PASSES) * (1000000000 / AM_COLD_PASSES);
+
+	while (1) {
+		nanosleep(&ts, NULL);
+		am_cold_scan(&zs, &buf, &max);
+	}
+	return (NULL);
+}
+
+int
+am_cold_init(void)
+{
+	pthread_t td;
+	int error;
+
+	if (am_cold_age == 0)
+		return (0);
+	error = pthread_create(&td, NULL, &am_cold_thread, NULL);
+	if (error != 0)
+		return (error);
+	pthread_detach(td);
+	return (0);
+}
@@ -0,0 +1,223 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Connection streams. When a session may need more than a plain
+ * socket, it is wrapped into a stdio stream which can switch to TLS
+ * in the middle of the session, and which feeds the session capture.
+ * Each thread serves one connection, so the current connection is
+ * kept in thread local storage.
+ */
+
+#include <openssl/ssl.h>
+
+#include "asteriskmail.h"
+
+struct am_conn {
+	int	fd;
+	uint32_t capture;
+	uint8_t	proto;
+	SSL    *ssl;
+};
+
+static __thread struct am_conn *am_conn_curr;
+
+static int
+am_conn_read(void *arg, char *buf, int len)
+{
+	struct am_conn *pc = arg;
+	int retval;
+
+	if (pc->ssl != NULL) {
+		retval = SSL_read(pc->ssl, buf, len);
+		if (retval <= 0) {
+			if (SSL_get_error(pc->ssl, retval) == SSL_ERROR_ZERO_RETURN)
+				return (0);
+			errno = EIO;
+			return (-1);
+		}
+	} else {
+		retval = read(pc->fd, buf, len);
+	}
+	if (retval > 0 && am_capture_enabled())
+		am_capture_record(pc->capture, pc->proto, AM_CAPTURE_READ, buf, retval);
+	return (retval);
+}
+
+static int
+am_conn_write(void *arg, const char *buf, int len)
+{
+	struct am_conn *pc = arg;
+	int retval;
+
+	if (pc->ssl != NULL) {
+		retval = SSL_write(pc->ssl, buf, len);
+		if (retval <= 0) {
+			errno = EIO;
+			return (-1);
+		}
+	} else {
+		retval = write(pc->fd, buf, len);
+	}
+	if (retval > 0 && am_capture_enabled())
+		am_capture_record(pc->capture, pc->proto, AM_CAPTURE_WRITE, buf, retval);
+	return (retval);
+}
+
+static int
+am_conn_close(void *arg)
+{
+	struct am_conn *pc = arg;
+	int retval;
+
+	if (pc->ssl != NULL) {
+		SSL_shutdown(pc->ssl);
+		SSL_free(pc->ssl);
+	}
+	if (am_capture_enabled())
+		am_capture_record(pc->capture, pc->proto, AM_CAPTURE_CLOSE, NULL, 0);
+
+	retval = close(pc->fd);
+	if (am_conn_curr == pc)
+		am_conn_curr = NULL;
+	am_pool_free(pc, sizeof(*pc));
+	return (retval);
+}
+
+FILE *
+am_conn_fdopen(int fd, int proto)
+{
+	struct am_conn *pc;
+	FILE *io;
+
+	pc = am_pool_alloc(sizeof(*pc));
+	if (pc == NULL)
+		return (NULL);
+	pc->fd = fd;
+	pc->proto = proto;
+	pc->ssl = NULL;
+
+	io = funopen(pc, &am_conn_read, &am_conn_write, NULL, &am_conn_close);
+	if (io == NULL) {
+		am_pool_free(pc, sizeof(*pc));
+		return (NULL);
+	}
+	if (am_capture_enabled()) {
+		pc->capture = am_capture_conn_alloc();
+		am_capture_record(pc->capture, pc->proto, AM_CAPTURE_OPEN, NULL, 0);
+	}
+	am_conn_curr = pc;
+	return (io);
+}
+
+/*
+ * Switch the current connection to TLS. Any reply must be flushed
+ * before. Data which the client sent ahead of the handshake is thrown
+ * away, so that it cannot be injected into the protected session.
+ */
+int
+handle_starttls(FILE *io)
+{
+	struct am_conn *pc = am_conn_curr;
+
+	if (pc == NULL || pc->ssl != NULL)
+		return (1);
+
+	fpurge(io);
+
+	pc->ssl = am_tls_accept(pc->fd);
+	return (pc->ssl == NULL);
+}
+
+/* returns non-zero if the current connection is protected by TLS */
+int
+handle_tls_active(void)
+{
+	struct am_conn *pc = am_conn_curr;
+
+	return (pc != NULL && pc->ssl != NULL);
+}
+
+/*
+ * Write a reply made of several pieces with a single system call,
+ * past the stdio buffer. Wrapped streams, which may encrypt or capture
+ * the data, are written through stdio instead.
+ */
+int
+handle_writev(FILE *io, struct iovec *iov, int cnt)
+{
+	ssize_t len;
+	int x;
+
+	if (am_conn_curr != NULL) {
+		for (x = 0; x != cnt; x++) {
+			if (fwrite(iov[x].iov_base, 1, iov[x].iov_len, io) != iov[x].iov_len)
+				return (EIO);
+		}
+		return (handle_flush(io));
+	}
+	if (handle_flush(io) != 0)
+		return (EIO);
+
+	while (cnt != 0) {
+		len = writev(fileno(io), iov, cnt);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno);
+		}
+		/* skip what was written */
+		for (; cnt != 0 && (size_t)len >= iov->iov_len; iov++, cnt--)
+			len -= iov->iov_len;
+		if (cnt != 0) {
+			iov->iov_base = (char *)iov->iov_base + len;
+			iov->iov_len -= len;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Read whatever is available, up to the given length, past the stdio
+ * buffer. This must not be mixed with buffered reads on the same
+ * stream. Returns the number of bytes read, zero at end of file or
+ * negative on error.
+ */
+ssize_t
+handle_read(FILE *io, void *buf, size_t len)
+{
+	ssize_t retval;
+
+	if (len > INT_MAX)
+		len = INT_MAX;
+	do {
+		if (am_conn_curr != NULL)
+			retval = am_conn_read(am_conn_curr, buf, len);
+		else
+			retval = read(fileno(io), buf, len);
+	} while (retval < 0 && errno == EINTR);
+	return (retval);
+}
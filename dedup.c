@@ -0,0 +1,234 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Duplicate detection. Asterisk delivers the SMS stored on a dongle
+ * again when the dongle registers anew. Each received message is
+ * fingerprinted by a 64-bit hash of its sender, its date, its decoded
+ * body and its mailboxes, and the fingerprints seen within the last
+ * window are kept in a fixed size cuckoo filter. A fingerprint has two
+ * candidate buckets, so that a lookup reads at most eight slots, and
+ * slots older than the window count as free. When both buckets are
+ * full a few entries are moved to their other bucket before the
+ * oldest one is overwritten, which only lets an old duplicate through.
+ */
+
+#include "asteriskmail.h"
+
+struct am_dedup_slot {
+	uint32_t tag;
+	uint32_t time;			/* seconds, zero is free */
+};
+
+struct am_dedup_bucket {
+	struct am_dedup_slot slot[AM_DEDUP_SLOTS];
+};
+
+static struct am_dedup_bucket am_dedup[AM_DEDUP_BUCKETS];
+static pthread_mutex_t am_dedup_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned am_dedup_window = AM_DEDUP_WINDOW;
+
+static uint64_t
+am_dedup_fnv(uint64_t hash, const char *ptr, size_t len)
+{
+	while (len--)
+		hash = (hash ^ (uint8_t)*ptr++) * 1099511628211ULL;
+	/* keep the fields apart */
+	return ((hash ^ 0xff) * 1099511628211ULL);
+}
+
+/*
+ * Returns the fingerprint of a message stored into the given set of
+ * mailboxes, or zero if the message has no sender or no date, which
+ * are needed to tell a repeated text from a repeated delivery.
+ */
+uint64_t
+am_dedup_hash(const struct am_message *pam, uint64_t mask)
+{
+	const char *from;
+	const char *date;
+	const char *body;
+	size_t flen;
+	size_t dlen;
+	uint64_t hash = 14695981039346656037ULL;
+
+	if (am_dedup_window == 0)
+		return (0);
+	body = strstr(pam->data, "\r\n\r\n");
+	if (body == NULL)
+		return (0);
+	from = handle_message_header(pam->data, body, "From:", &flen);
+	date = handle_message_header(pam->data, body, "Date:", &dlen);
+	if (from == NULL || date == NULL)
+		return (0);
+	body += 4;
+
+	hash = am_dedup_fnv(hash, from, flen);
+	hash = am_dedup_fnv(hash, date, dlen);
+	hash = am_dedup_fnv(hash, body, strlen(body));
+	hash = am_dedup_fnv(hash, (const char *)&mask, sizeof(mask));
+	return (hash != 0 ? hash : 1);
+}
+
+static uint32_t
+am_dedup_clock(void)
+{
+	return (am_metrics_now() / 1000000000ULL + 1);
+}
+
+static uint32_t
+am_dedup_tag(uint64_t fp)
+{
+	uint32_t tag = fp >> 32;
+
+	return (tag != 0 ? tag : 1);
+}
+
+static uint32_t
+am_dedup_alt(uint32_t index, uint32_t tag)
+{
+	return ((index ^ (tag * 0x5bd1e995U)) % AM_DEDUP_BUCKETS);
+}
+
+static int
+am_dedup_live(const struct am_dedup_slot *ps, uint32_t now)
+{
+	return (ps->time != 0 && now - ps->time < am_dedup_window);
+}
+
+/* returns the slot of a live fingerprint in the given bucket */
+static struct am_dedup_slot *
+am_dedup_find(uint32_t index, uint32_t tag, uint32_t now)
+{
+	struct am_dedup_slot *ps = am_dedup[index].slot;
+	int x;
+
+	for (x = 0; x != AM_DEDUP_SLOTS; x++) {
+		if (ps[x].tag == tag && am_dedup_live(ps + x, now))
+			return (ps + x);
+	}
+	return (NULL);
+}
+
+/* returns a free or expired slot in the given bucket */
+static struct am_dedup_slot *
+am_dedup_free(uint32_t index, uint32_t now)
+{
+	struct am_dedup_slot *ps = am_dedup[index].slot;
+	int x;
+
+	for (x = 0; x != AM_DEDUP_SLOTS; x++) {
+		if (!am_dedup_live(ps + x, now))
+			return (ps + x);
+	}
+	return (NULL);
+}
+
+static void
+am_dedup_insert(uint32_t index, uint32_t tag, uint32_t now)
+{
+	struct am_dedup_slot *ps;
+	struct am_dedup_slot *oldest;
+	struct am_dedup_slot entry = { tag, now };
+	struct am_dedup_slot victim;
+	int kick;
+	int x;
+
+	for (kick = 0; ; kick++) {
+		ps = am_dedup_free(index, now);
+		if (ps == NULL)
+			ps = am_dedup_free(am_dedup_alt(index, entry.tag), now);
+		if (ps != NULL) {
+			*ps = entry;
+			return;
+		}
+		if (kick == AM_DEDUP_KICKS)
+			break;
+
+		/* move a resident entry to its other bucket */
+		ps = &am_dedup[index].slot[(entry.tag + kick) % AM_DEDUP_SLOTS];
+		victim = *ps;
+		*ps = entry;
+		entry = victim;
+		index = am_dedup_alt(index, entry.tag);
+	}
+
+	/* the oldest of the two buckets is forgotten */
+	oldest = NULL;
+	ps = am_dedup[index].slot;
+	for (x = 0; x != AM_DEDUP_SLOTS; x++) {
+		if (oldest == NULL || ps[x].time < oldest->time)
+			oldest = ps + x;
+	}
+	ps = am_dedup[am_dedup_alt(index, entry.tag)].slot;
+	for (x = 0; x != AM_DEDUP_SLOTS; x++) {
+		if (ps[x].time < oldest->time)
+			oldest = ps + x;
+	}
+	if (oldest->time < entry.time)
+		*oldest = entry;
+}
+
+/*
+ * Returns non-zero if the fingerprint was seen within the window.
+ * Else it is remembered from now on.
+ */
+int
+am_dedup_check(uint64_t fp)
+{
+	uint32_t index = fp % AM_DEDUP_BUCKETS;
+	uint32_t tag = am_dedup_tag(fp);
+	uint32_t now = am_dedup_clock();
+	int found;
+
+	pthread_mutex_lock(&am_dedup_mtx);
+	found = (am_dedup_find(index, tag, now) != NULL ||
+	    am_dedup_find(am_dedup_alt(index, tag), tag, now) != NULL);
+	if (found == 0)
+		am_dedup_insert(index, tag, now);
+	pthread_mutex_unlock(&am_dedup_mtx);
+
+	return (found);
+}
+
+/* forgets a fingerprint, when the message could not be stored */
+void
+am_dedup_forget(uint64_t fp)
+{
+	struct am_dedup_slot *ps;
+	uint32_t index = fp % AM_DEDUP_BUCKETS;
+	uint32_t tag = am_dedup_tag(fp);
+	uint32_t now = am_dedup_clock();
+
+	pthread_mutex_lock(&am_dedup_mtx);
+	ps = am_dedup_find(index, tag, now);
+	if (ps == NULL)
+		ps = am_dedup_find(am_dedup_alt(index, tag), tag, now);
+	if (ps != NULL)
+		ps->time = 0;
+	pthread_mutex_unlock(&am_dedup_mtx);
+}
@@ -0,0 +1,418 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Outbound SMS dongle pool. Every dongle has its own queue and its own
+ * thread, so that the outbound capacity grows with the number of
+ * modems. Each dongle keeps a minimum time between two segments, and
+ * a circuit breaker which opens after a number of failed segments in
+ * a row. An open dongle gets no new work, and its queued jobs are
+ * moved to the other dongles. After a cooldown a single job probes
+ * the dongle again. A job is one message to one recipient, and is
+ * given to the healthy dongle which would start it first, so that the
+ * parts of a message are sent in order by the same modem.
+ */
+
+#include <sys/wait.h>
+
+#include <spawn.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "asteriskmail.h"
+
+enum {
+	AM_DONGLE_CLOSED,
+	AM_DONGLE_OPEN,
+	AM_DONGLE_HALF_OPEN,
+};
+
+struct am_dongle {
+	TAILQ_HEAD(, am_dongle_job) head;
+	pthread_cond_t cv;
+	char	name[AM_DONGLE_NAME_MAX];
+	uint64_t interval;		/* nanoseconds between two segments */
+	uint64_t latency;		/* average time to send one segment */
+	uint64_t next;			/* earliest time of the next segment */
+	uint64_t opened;		/* time the breaker opened */
+	uint64_t sent;
+	uint64_t failed;
+	uint64_t trips;
+	int	queued;			/* segments queued or being sent */
+	int	failures;		/* failed segments in a row */
+	int	state;
+};
+
+struct am_dongle_stats {
+	uint64_t sent;
+	uint64_t failed;
+	uint64_t trips;
+	int	queued;
+	int	state;
+};
+
+extern char **environ;
+
+static struct am_dongle am_dongle[AM_DONGLE_MAX];
+static int am_dongle_num;
+static pthread_mutex_t am_dongle_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t am_dongle_done = PTHREAD_COND_INITIALIZER;
+
+const char *am_asterisk_path = AM_ASTERISK_PATH;
+
+/* parse name[:ms], where ms is the time between two segments */
+int
+am_dongle_parse(const char *str)
+{
+	struct am_dongle *pd;
+	const char *ptr;
+	unsigned long ms = AM_SMS_DELAY_US / 1000;
+	size_t len;
+	char *end;
+	int x;
+
+	if (am_dongle_num == AM_DONGLE_MAX)
+		return (E2BIG);
+	ptr = strchr(str, ':');
+	len = (ptr != NULL) ? (size_t)(ptr - str) : strlen(str);
+	if (len == 0 || len >= AM_DONGLE_NAME_MAX)
+		return (EINVAL);
+
+	/* the name ends up in an Asterisk CLI command */
+	for (x = 0; x != (int)len; x++) {
+		if (!isalnum((uint8_t)str[x]) && str[x] != '-' && str[x] != '_')
+			return (EINVAL);
+	}
+	if (ptr != NULL) {
+		if (!isdigit((uint8_t)ptr[1]))
+			return (EINVAL);
+		errno = 0;
+		ms = strtoul(ptr + 1, &end, 10);
+		if (*end != 0 || errno != 0 || ms > 3600 * 1000)
+			return (EINVAL);
+	}
+	for (x = 0; x != am_dongle_num; x++) {
+		if (strlen(am_dongle[x].name) == len &&
+		    strncmp(am_dongle[x].name, str, len) == 0)
+			return (EEXIST);
+	}
+
+	pd = &am_dongle[am_dongle_num++];
+	memcpy(pd->name, str, len);
+	pd->name[len] = 0;
+	pd->interval = ms * 1000000ULL;
+	return (0);
+}
+
+/* runs one Asterisk command, without a shell in between */
+static int
+am_dongle_exec(const struct am_dongle *pd, const char *phone, const char *text)
+{
+	char cmd[512 + 128];
+	char *argv[4];
+	uint64_t start;
+	pid_t pid;
+	int status;
+	int error;
+
+	if (snprintf(cmd, sizeof(cmd), "dongle sms %s %s \"%s\"",
+	    pd->name, phone, text) >= (int)sizeof(cmd))
+		return (EINVAL);
+
+	argv[0] = __DECONST(char *, "asterisk");
+	argv[1] = __DECONST(char *, "-rx");
+	argv[2] = cmd;
+	argv[3] = NULL;
+
+	start = am_metrics_now();
+	error = posix_spawn(&pid, am_asterisk_path, NULL, NULL, argv, environ);
+	if (error == 0) {
+		while (waitpid(pid, &status, 0) < 0) {
+			if (errno != EINTR) {
+				status = -1;
+				break;
+			}
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			error = EIO;
+	}
+	am_metrics_observe(AM_HIST_SMS_SEND, start);
+
+	if (error != 0) {
+		am_metrics_count(AM_CNT_SMS_FAILED, 1);
+		return (error);
+	}
+	am_metrics_count(AM_CNT_SMS_SENT, 1);
+	return (0);
+}
+
+/* returns non-zero if the dongle may take a new job */
+static int
+am_dongle_usable(struct am_dongle *pd, uint64_t now)
+{
+	switch (pd->state) {
+	case AM_DONGLE_OPEN:
+		if (now - pd->opened < AM_DONGLE_COOLDOWN_MS * 1000000ULL)
+			return (0);
+		pd->state = AM_DONGLE_HALF_OPEN;
+		/* FALLTHROUGH */
+	case AM_DONGLE_HALF_OPEN:
+		/* a single job probes the dongle */
+		return (pd->queued == 0);
+	default:
+		return (1);
+	}
+}
+
+/* returns the time until a new job on the dongle would start */
+static uint64_t
+am_dongle_load(const struct am_dongle *pd, uint64_t now)
+{
+	uint64_t wait = (pd->next > now) ? pd->next - now : 0;
+
+	return (wait + (uint64_t)pd->queued * (pd->interval + pd->latency));
+}
+
+static void
+am_dongle_finish(struct am_dongle_job *pj)
+{
+	/* the segments not sent leave the queue */
+	am_metrics_gauge(AM_GAUGE_OUTBOUND_QUEUE, -(pj->nseg - pj->sent));
+	if (--*pj->pending == 0)
+		pthread_cond_broadcast(&am_dongle_done);
+}
+
+/* gives a job to the least loaded healthy dongle, called locked */
+static void
+am_dongle_queue(struct am_dongle_job *pj, uint64_t now)
+{
+	struct am_dongle *best = NULL;
+	struct am_dongle *pd;
+	uint64_t load;
+	uint64_t min = 0;
+	int x;
+
+	for (x = 0; x != am_dongle_num; x++) {
+		pd = &am_dongle[x];
+		if (!am_dongle_usable(pd, now))
+			continue;
+		load = am_dongle_load(pd, now);
+		if (best == NULL || load < min ||
+		    (load == min && pd->queued < best->queued)) {
+			best = pd;
+			min = load;
+		}
+	}
+
+	if (best == NULL) {
+		/* all breakers are open */
+		pj->error = EAGAIN;
+		am_dongle_finish(pj);
+		return;
+	}
+	TAILQ_INSERT_TAIL(&best->head, pj, entry);
+	best->queued += pj->nseg;
+	pthread_cond_signal(&best->cv);
+}
+
+/* sends the segments of one job, called locked */
+static void
+am_dongle_run(struct am_dongle *pd, struct am_dongle_job *pj)
+{
+	struct timespec ts;
+	uint64_t start;
+	uint64_t now;
+	int error;
+
+	while (pj->sent != pj->nseg) {
+		pthread_mutex_unlock(&am_dongle_mtx);
+
+		/* nice operation a bit */
+		now = am_metrics_now();
+		if (pd->next > now) {
+			ts.tv_sec = (pd->next - now) / 1000000000ULL;
+			ts.tv_nsec = (pd->next - now) % 1000000000ULL;
+			while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+				;
+		}
+		start = am_metrics_now();
+		error = am_dongle_exec(pd, pj->phone, pj->seg[pj->sent]);
+		now = am_metrics_now();
+
+		pthread_mutex_lock(&am_dongle_mtx);
+		pd->next = now + pd->interval;
+		pd->latency = (pd->latency * 7 + (now - start)) / 8;
+		pd->queued--;
+
+		if (error != 0) {
+			pd->failed++;
+			if (++pd->failures >= AM_DONGLE_FAIL_MAX ||
+			    pd->state == AM_DONGLE_HALF_OPEN) {
+				if (pd->state != AM_DONGLE_OPEN)
+					pd->trips++;
+				pd->state = AM_DONGLE_OPEN;
+				pd->opened = now;
+			}
+			/* the remaining segments of this recipient are dropped */
+			pd->queued -= pj->nseg - pj->sent - 1;
+			pj->error = error;
+			return;
+		}
+		pd->sent++;
+		pd->failures = 0;
+		pd->state = AM_DONGLE_CLOSED;
+		pj->sent++;
+		am_metrics_gauge(AM_GAUGE_OUTBOUND_QUEUE, -1);
+	}
+}
+
+static void *
+am_dongle_thread(void *arg)
+{
+	struct am_dongle *pd = arg;
+	struct am_dongle_job *pj;
+
+	pthread_mutex_lock(&am_dongle_mtx);
+	while (1) {
+		pj = TAILQ_FIRST(&pd->head);
+		if (pj == NULL) {
+			pthread_cond_wait(&pd->cv, &am_dongle_mtx);
+			continue;
+		}
+		TAILQ_REMOVE(&pd->head, pj, entry);
+
+		if (pd->state == AM_DONGLE_OPEN) {
+			/* the breaker opened after the job was queued */
+			pd->queued -= pj->nseg;
+			am_dongle_queue(pj, am_metrics_now());
+			continue;
+		}
+		am_dongle_run(pd, pj);
+		am_dongle_finish(pj);
+	}
+	return (NULL);
+}
+
+/*
+ * Sends a number of jobs and waits until all of them are done. The
+ * result of each job is its number of segments sent and an error
+ * code, which is EAGAIN when no dongle was available.
+ */
+void
+am_dongle_send(struct am_dongle_job *pj, int num)
+{
+	uint64_t now = am_metrics_now();
+	int64_t total = 0;
+	int pending = num;
+	int x;
+
+	if (num == 0)
+		return;
+	for (x = 0; x != num; x++) {
+		pj[x].pending = &pending;
+		pj[x].sent = 0;
+		pj[x].error = 0;
+		total += pj[x].nseg;
+	}
+	am_metrics_gauge(AM_GAUGE_OUTBOUND_QUEUE, total);
+
+	pthread_mutex_lock(&am_dongle_mtx);
+	for (x = 0; x != num; x++)
+		am_dongle_queue(pj + x, now);
+	while (pending != 0)
+		pthread_cond_wait(&am_dongle_done, &am_dongle_mtx);
+	pthread_mutex_unlock(&am_dongle_mtx);
+}
+
+void
+am_dongle_print(FILE *io)
+{
+	struct am_dongle_stats stats[AM_DONGLE_MAX];
+	int x;
+
+	pthread_mutex_lock(&am_dongle_mtx);
+	for (x = 0; x != am_dongle_num; x++) {
+		stats[x].sent = am_dongle[x].sent;
+		stats[x].failed = am_dongle[x].failed;
+		stats[x].trips = am_dongle[x].trips;
+		stats[x].queued = am_dongle[x].queued;
+		stats[x].state = am_dongle[x].state;
+	}
+	pthread_mutex_unlock(&am_dongle_mtx);
+
+	fprintf(io, "# HELP asteriskmail_dongle_queue_depth Number of outbound SMS segments waiting per dongle\n"
+	    "# TYPE asteriskmail_dongle_queue_depth gauge\n");
+	for (x = 0; x != am_dongle_num; x++) {
+		fprintf(io, "asteriskmail_dongle_queue_depth{dongle=\"%s\"} %d\n",
+		    am_dongle[x].name, stats[x].queued);
+	}
+
+	fprintf(io, "# HELP asteriskmail_dongle_segments_total Number of outbound SMS segments per dongle\n"
+	    "# TYPE asteriskmail_dongle_segments_total counter\n");
+	for (x = 0; x != am_dongle_num; x++) {
+		fprintf(io, "asteriskmail_dongle_segments_total{dongle=\"%s\",result=\"sent\"} %ju\n"
+		    "asteriskmail_dongle_segments_total{dongle=\"%s\",result=\"failed\"} %ju\n",
+		    am_dongle[x].name, (uintmax_t)stats[x].sent,
+		    am_dongle[x].name, (uintmax_t)stats[x].failed);
+	}
+
+	fprintf(io, "# HELP asteriskmail_dongle_breaker_state Circuit breaker per dongle, 0 is closed, 1 open and 2 half open\n"
+	    "# TYPE asteriskmail_dongle_breaker_state gauge\n");
+	for (x = 0; x != am_dongle_num; x++) {
+		fprintf(io, "asteriskmail_dongle_breaker_state{dongle=\"%s\"} %d\n",
+		    am_dongle[x].name, stats[x].state);
+	}
+
+	fprintf(io, "# HELP asteriskmail_dongle_breaker_trips_total Number of times the circuit breaker opened per dongle\n"
+	    "# TYPE asteriskmail_dongle_breaker_trips_total counter\n");
+	for (x = 0; x != am_dongle_num; x++) {
+		fprintf(io, "asteriskmail_dongle_breaker_trips_total{dongle=\"%s\"} %ju\n",
+		    am_dongle[x].name, (uintmax_t)stats[x].trips);
+	}
+}
+
+int
+am_dongle_init(void)
+{
+	struct am_dongle *pd;
+	pthread_t td;
+	int error;
+	int x;
+
+	if (am_dongle_num == 0 && am_dongle_parse("dongle0") != 0)
+		return (EINVAL);
+
+	for (x = 0; x != am_dongle_num; x++) {
+		pd = &am_dongle[x];
+		TAILQ_INIT(&pd->head);
+		pthread_cond_init(&pd->cv, NULL);
+		error = pthread_create(&td, NULL, &am_dongle_thread, pd);
+		if (error != 0)
+			return (error);
+		pthread_detach(td);
+	}
+	return (0);
+}
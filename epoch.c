@@ -0,0 +1,136 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Epoch based reclamation. Readers announce the global epoch in a
+ * slot while they look at shared data, and never take a lock. Memory
+ * unlinked by a writer is tagged with the epoch at the time it was
+ * retired. The global epoch only advances when all active readers
+ * have observed the current one, so memory retired in epoch N cannot
+ * be referenced by anyone once the global epoch reaches N + 2.
+ */
+
+#include <sched.h>
+
+#include "asteriskmail.h"
+
+static _Atomic uint64_t am_epoch = 1;
+static _Atomic uint64_t am_epoch_slot[AM_EPOCH_SLOTS];
+static __thread int am_epoch_index = -1;
+static struct am_retire *am_epoch_head;
+static pthread_mutex_t am_epoch_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+void
+am_epoch_enter(void)
+{
+	uint64_t zero;
+	uint64_t epoch;
+	int x;
+	int y;
+
+	/* spread the threads over the slots */
+	x = ((uintptr_t)&am_epoch_index >> 6) % AM_EPOCH_SLOTS;
+
+	for (y = 0;; y++) {
+		epoch = atomic_load(&am_epoch);
+		zero = 0;
+		if (atomic_compare_exchange_weak(&am_epoch_slot[x], &zero, epoch))
+			break;
+		x = (x + 1) % AM_EPOCH_SLOTS;
+		if (y == AM_EPOCH_SLOTS) {
+			/* all slots are busy */
+			sched_yield();
+			y = 0;
+		}
+	}
+	am_epoch_index = x;
+}
+
+void
+am_epoch_leave(void)
+{
+	atomic_store(&am_epoch_slot[am_epoch_index], 0);
+	am_epoch_index = -1;
+}
+
+/* must be called with the retire list locked */
+static int
+am_epoch_advance(void)
+{
+	uint64_t epoch = atomic_load(&am_epoch);
+	uint64_t value;
+	int x;
+
+	for (x = 0; x != AM_EPOCH_SLOTS; x++) {
+		value = atomic_load(&am_epoch_slot[x]);
+		if (value != 0 && value != epoch)
+			return (0);
+	}
+	atomic_store(&am_epoch, epoch + 1);
+	return (1);
+}
+
+/*
+ * Queue memory for freeing. The given function is called once no
+ * reader can reference the memory any more, which may be during a
+ * later call to this function.
+ */
+void
+am_epoch_retire(struct am_retire *pr, void (*func)(struct am_retire *))
+{
+	struct am_retire **ppr;
+	struct am_retire *head = NULL;
+	uint64_t epoch;
+
+	pthread_mutex_lock(&am_epoch_mtx);
+	pr->epoch = atomic_load(&am_epoch);
+	pr->func = func;
+	pr->next = am_epoch_head;
+	am_epoch_head = pr;
+
+	/* without readers, two steps make everything retired so far free */
+	if (am_epoch_advance())
+		am_epoch_advance();
+	epoch = atomic_load(&am_epoch);
+
+	/* collect everything which is safe to free */
+	ppr = &am_epoch_head;
+	while ((pr = *ppr) != NULL) {
+		if (pr->epoch + 2 <= epoch) {
+			*ppr = pr->next;
+			pr->next = head;
+			head = pr;
+		} else {
+			ppr = &pr->next;
+		}
+	}
+	pthread_mutex_unlock(&am_epoch_mtx);
+
+	while ((pr = head) != NULL) {
+		head = pr->next;
+		pr->func(pr);
+	}
+}
@@ -0,0 +1,586 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Incremental HTTP/1.x request parser. The caller appends whatever it
+ * has received to one buffer and calls am_http_parse() again, which
+ * continues where it stopped. Every byte is looked at once. The
+ * method, path, query parameters and headers are recorded as offset
+ * and length views into the buffer, and nothing is copied. Chunked
+ * bodies are joined in place. The parser does no I/O by itself, so it
+ * works the same with blocking and non-blocking sockets.
+ */
+
+#include <strings.h>
+#include <ctype.h>
+
+#include "asteriskmail.h"
+
+enum {
+	AM_HTTP_S_METHOD,
+	AM_HTTP_S_PATH,
+	AM_HTTP_S_QUERY,
+	AM_HTTP_S_VERSION,
+	AM_HTTP_S_LINE_LF,
+	AM_HTTP_S_FIELD,
+	AM_HTTP_S_NAME,
+	AM_HTTP_S_SPACE,
+	AM_HTTP_S_VALUE,
+	AM_HTTP_S_HEAD_LF,
+	AM_HTTP_S_BODY,			/* all states from here are past the head */
+	AM_HTTP_S_CHUNK_SIZE,
+	AM_HTTP_S_CHUNK_EXT,
+	AM_HTTP_S_CHUNK_LF,
+	AM_HTTP_S_CHUNK_DATA,
+	AM_HTTP_S_CHUNK_CR,
+	AM_HTTP_S_CHUNK_END,
+	AM_HTTP_S_TRAILER,
+	AM_HTTP_S_TRAILER_LINE,
+	AM_HTTP_S_TRAILER_LF,
+	AM_HTTP_S_DONE,
+};
+
+/* characters allowed in methods and header names */
+static int
+am_http_tchar(uint8_t ch)
+{
+	return (isalnum(ch) || (ch != 0 && strchr("!#$%&'*+-.^_`|~", ch) != NULL));
+}
+
+static int
+am_http_hex(uint8_t ch)
+{
+	if (ch >= '0' && ch <= '9')
+		return (ch - '0');
+	if (ch >= 'a' && ch <= 'f')
+		return (ch - 'a' + 10);
+	if (ch >= 'A' && ch <= 'F')
+		return (ch - 'A' + 10);
+	return (-1);
+}
+
+static void
+am_http_view(struct am_http_view *pv, uint32_t start, uint32_t end)
+{
+	pv->off = start;
+	pv->len = end - start;
+}
+
+void
+am_http_init(struct am_http_req *pr)
+{
+	memset(pr, 0, sizeof(*pr));
+	pr->state = AM_HTTP_S_METHOD;
+	pr->length = -1;
+}
+
+static int
+am_http_error(struct am_http_req *pr, int status)
+{
+	pr->status = status;
+	pr->state = AM_HTTP_S_DONE;
+	return (AM_HTTP_ERROR);
+}
+
+/* records one parameter, "eq" is the offset following '=' or zero */
+static int
+am_http_param_add(struct am_http_req *pr, uint32_t start, uint32_t eq, uint32_t end)
+{
+	struct am_http_field *pf;
+
+	if (start == end)
+		return (0);
+	if (pr->nparam == AM_HTTP_PARAM_MAX)
+		return (E2BIG);
+	pf = pr->param + pr->nparam++;
+	if (eq == 0) {
+		am_http_view(&pf->name, start, end);
+		am_http_view(&pf->value, end, end);
+	} else {
+		am_http_view(&pf->name, start, eq - 1);
+		am_http_view(&pf->value, eq, end);
+	}
+	pf->decoded = 0;
+	return (0);
+}
+
+/* looks at the headers the parser itself needs */
+static int
+am_http_field(struct am_http_req *pr, const char *buf, const struct am_http_field *pf)
+{
+	const char *value = buf + pf->value.off;
+	int64_t length = 0;
+	uint32_t x;
+
+	if (pf->name.len == 14 &&
+	    strncasecmp(buf + pf->name.off, "Content-Length", 14) == 0) {
+		if (pf->value.len == 0)
+			return (400);
+		for (x = 0; x != pf->value.len; x++) {
+			if (value[x] < '0' || value[x] > '9')
+				return (400);
+			if (length > AM_HTTPD_BODY_MAX)
+				return (413);
+			length = 10 * length + (value[x] - '0');
+		}
+		if (length > AM_HTTPD_BODY_MAX)
+			return (413);
+		if (pr->length >= 0 && pr->length != length)
+			return (400);
+		pr->length = length;
+	} else if (pf->name.len == 17 &&
+	    strncasecmp(buf + pf->name.off, "Transfer-Encoding", 17) == 0) {
+		if (pf->value.len != 7 || strncasecmp(value, "chunked", 7) != 0)
+			return (501);
+		pr->chunked = 1;
+	} else if (pf->name.len == 6 &&
+	    strncasecmp(buf + pf->name.off, "Expect", 6) == 0) {
+		if (pf->value.len != 12 || strncasecmp(value, "100-continue", 12) != 0)
+			return (417);
+		pr->expect = 1;
+	}
+	return (0);
+}
+
+/*
+ * Parses the bytes added to the buffer since the last call. Returns
+ * AM_HTTP_HEAD once when the headers are complete and a body follows,
+ * and AM_HTTP_DONE when the request is complete. On error, the HTTP
+ * status to reply with is stored in the request. While a chunked body
+ * is read, the framing is removed from the buffer, and the length of
+ * the buffer is updated.
+ */
+int
+am_http_parse(struct am_http_req *pr, char *buf, size_t *plen)
+{
+	struct am_http_field *pf;
+	size_t len = *plen;
+	uint32_t pos = pr->pos;
+	uint32_t end;
+	uint32_t gap;
+	uint64_t n;
+	uint8_t ch;
+	int digit;
+	int error;
+
+	if (pr->state == AM_HTTP_S_DONE)
+		return (pr->status != 0 ? AM_HTTP_ERROR : AM_HTTP_DONE);
+
+	while (pos < len) {
+		ch = buf[pos];
+
+		switch (pr->state) {
+		case AM_HTTP_S_METHOD:
+			if (ch == ' ' && pos != pr->mark) {
+				am_http_view(&pr->method, pr->mark, pos);
+				pr->mark = pos + 1;
+				pr->state = AM_HTTP_S_PATH;
+			} else if ((ch == '\r' || ch == '\n') && pos == pr->mark) {
+				/* empty lines ahead of the request are allowed */
+				pr->mark++;
+			} else if (!am_http_tchar(ch)) {
+				return (am_http_error(pr, 400));
+			}
+			pos++;
+			break;
+
+		case AM_HTTP_S_PATH:
+			if (ch == ' ' || ch == '?') {
+				if (pos == pr->mark || buf[pr->mark] != '/')
+					return (am_http_error(pr, 400));
+				am_http_view(&pr->path, pr->mark, pos);
+				pr->mark = pos + 1;
+				pr->mark2 = 0;
+				pr->query.off = pos + 1;
+				pr->state = (ch == '?') ? AM_HTTP_S_QUERY : AM_HTTP_S_VERSION;
+			} else if (ch <= ' ' || ch == 0x7f) {
+				return (am_http_error(pr, 400));
+			}
+			pos++;
+			break;
+
+		case AM_HTTP_S_QUERY:
+			if (ch == ' ' || ch == '&') {
+				if (am_http_param_add(pr, pr->mark, pr->mark2, pos) != 0)
+					return (am_http_error(pr, 414));
+				pr->mark = pos + 1;
+				pr->mark2 = 0;
+				if (ch == ' ') {
+					am_http_view(&pr->query, pr->query.off, pos);
+					pr->state = AM_HTTP_S_VERSION;
+				}
+			} else if (ch == '=' && pr->mark2 == 0) {
+				pr->mark2 = pos + 1;
+			} else if (ch < ' ' || ch == 0x7f) {
+				return (am_http_error(pr, 400));
+			}
+			pos++;
+			break;
+
+		case AM_HTTP_S_VERSION:
+			if (ch == '\r' || ch == '\n') {
+				am_http_view(&pr->version, pr->mark, pos);
+				if (pr->version.len != 8 ||
+				    strncmp(buf + pr->mark, "HTTP/1.", 7) != 0 ||
+				    !isdigit(buf[pos - 1]))
+					return (am_http_error(pr,
+					    strncmp(buf + pr->mark, "HTTP/", 5) ? 400 : 505));
+				pr->mark = pos + 1;
+				pr->state = (ch == '\r') ? AM_HTTP_S_LINE_LF : AM_HTTP_S_FIELD;
+			} else if (ch <= ' ' || ch == 0x7f) {
+				return (am_http_error(pr, 400));
+			}
+			pos++;
+			break;
+
+		case AM_HTTP_S_LINE_LF:
+			if (ch != '\n')
+				return (am_http_error(pr, 400));
+			pr->state = AM_HTTP_S_FIELD;
+			pos++;
+			break;
+
+		case AM_HTTP_S_FIELD:
+			if (ch == '\r') {
+				pr->state = AM_HTTP_S_HEAD_LF;
+				pos++;
+				break;
+			} else if (ch == '\n') {
+				pr->state = AM_HTTP_S_HEAD_LF;
+				break;
+			}
+			/* this also refuses folded header lines */
+			if (!am_http_tchar(ch))
+				return (am_http_error(pr, 400));
+			pr->mark = pos;
+			pr->state = AM_HTTP_S_NAME;
+			pos++;
+			break;
+
+		case AM_HTTP_S_NAME:
+			if (ch == ':') {
+				if (pr->nheader == AM_HTTP_HEADER_MAX)
+					return (am_http_error(pr, 431));
+				am_http_view(&pr->header[pr->nheader].name, pr->mark, pos);
+				pr->state = AM_HTTP_S_SPACE;
+			} else if (!am_http_tchar(ch)) {
+				return (am_http_error(pr, 400));
+			}
+			pos++;
+			break;
+
+		case AM_HTTP_S_SPACE:
+			if (ch == ' ' || ch == '\t') {
+				pos++;
+				break;
+			}
+			pr->mark2 = pos;
+			pr->state = AM_HTTP_S_VALUE;
+			break;
+
+		case AM_HTTP_S_VALUE:
+			if (ch == '\r' || ch == '\n') {
+				for (end = pos; end != pr->mark2 &&
+				    (buf[end - 1] == ' ' || buf[end - 1] == '\t'); end--)
+					;
+				pf = pr->header + pr->nheader++;
+				am_http_view(&pf->value, pr->mark2, end);
+				pf->decoded = 1;
+				error = am_http_field(pr, buf, pf);
+				if (error != 0)
+					return (am_http_error(pr, error));
+				pr->state = (ch == '\r') ? AM_HTTP_S_LINE_LF : AM_HTTP_S_FIELD;
+			} else if ((ch < ' ' && ch != '\t') || ch == 0x7f) {
+				return (am_http_error(pr, 400));
+			}
+			pos++;
+			break;
+
+		case AM_HTTP_S_HEAD_LF:
+			if (ch != '\n')
+				return (am_http_error(pr, 400));
+			pos++;
+
+			/* a body with two lengths may be read differently by a proxy */
+			if (pr->chunked && pr->length >= 0)
+				return (am_http_error(pr, 400));
+			am_http_view(&pr->body, pos, pos);
+			pr->pos = pos;
+			if (pr->chunked) {
+				pr->mark2 = 0;
+				pr->state = AM_HTTP_S_CHUNK_SIZE;
+				return (AM_HTTP_HEAD);
+			} else if (pr->length > 0) {
+				pr->state = AM_HTTP_S_BODY;
+				return (AM_HTTP_HEAD);
+			}
+			pr->state = AM_HTTP_S_DONE;
+			return (AM_HTTP_DONE);
+
+		case AM_HTTP_S_BODY:
+			n = pr->length - pr->body.len;
+			if (n > len - pos)
+				n = len - pos;
+			pr->body.len += n;
+			pos += n;
+			if (pr->body.len == pr->length) {
+				pr->pos = pos;
+				pr->state = AM_HTTP_S_DONE;
+				return (AM_HTTP_DONE);
+			}
+			break;
+
+		case AM_HTTP_S_CHUNK_SIZE:
+			digit = am_http_hex(ch);
+			if (digit >= 0) {
+				if (pr->chunk > AM_HTTPD_BODY_MAX)
+					return (am_http_error(pr, 413));
+				pr->chunk = 16 * pr->chunk + digit;
+				pr->mark2 = 1;
+				pos++;
+				break;
+			}
+			if (pr->mark2 == 0)
+				return (am_http_error(pr, 400));
+			if (ch == ';' || ch == ' ' || ch == '\t')
+				pr->state = AM_HTTP_S_CHUNK_EXT;
+			else if (ch == '\r')
+				pr->state = AM_HTTP_S_CHUNK_LF;
+			else if (ch == '\n')
+				pr->state = AM_HTTP_S_CHUNK_LF;
+			else
+				return (am_http_error(pr, 400));
+			if (ch != '\n')
+				pos++;
+			break;
+
+		case AM_HTTP_S_CHUNK_EXT:
+			/* chunk extensions are ignored */
+			if (ch == '\r' || ch == '\n')
+				pr->state = AM_HTTP_S_CHUNK_LF;
+			if (ch != '\n')
+				pos++;
+			break;
+
+		case AM_HTTP_S_CHUNK_LF:
+			if (ch != '\n')
+				return (am_http_error(pr, 400));
+			pos++;
+			if (pr->chunk == 0) {
+				pr->state = AM_HTTP_S_TRAILER;
+			} else if (pr->body.len + pr->chunk > AM_HTTPD_BODY_MAX) {
+				return (am_http_error(pr, 413));
+			} else {
+				pr->state = AM_HTTP_S_CHUNK_DATA;
+			}
+			break;
+
+		case AM_HTTP_S_CHUNK_DATA:
+			n = pr->chunk;
+			if (n > len - pos)
+				n = len - pos;
+			memmove(buf + pr->body.off + pr->body.len, buf + pos, n);
+			pr->body.len += n;
+			pr->chunk -= n;
+			pos += n;
+			if (pr->chunk == 0)
+				pr->state = AM_HTTP_S_CHUNK_CR;
+			break;
+
+		case AM_HTTP_S_CHUNK_CR:
+			if (ch == '\r')
+				pos++;
+			else if (ch != '\n')
+				return (am_http_error(pr, 400));
+			pr->state = AM_HTTP_S_CHUNK_END;
+			break;
+
+		case AM_HTTP_S_CHUNK_END:
+			if (ch != '\n')
+				return (am_http_error(pr, 400));
+			pos++;
+			pr->mark2 = 0;
+			pr->state = AM_HTTP_S_CHUNK_SIZE;
+			break;
+
+		case AM_HTTP_S_TRAILER:
+			/* trailer fields are ignored */
+			if (ch == '\r') {
+				pr->state = AM_HTTP_S_TRAILER_LF;
+				pos++;
+			} else if (ch == '\n') {
+				pr->state = AM_HTTP_S_TRAILER_LF;
+			} else {
+				pr->state = AM_HTTP_S_TRAILER_LINE;
+			}
+			break;
+
+		case AM_HTTP_S_TRAILER_LINE:
+			if (ch == '\n')
+				pr->state = AM_HTTP_S_TRAILER;
+			pos++;
+			break;
+
+		case AM_HTTP_S_TRAILER_LF:
+			if (ch != '\n')
+				return (am_http_error(pr, 400));
+			pos++;
+			pr->state = AM_HTTP_S_DONE;
+			break;
+
+		default:
+			break;
+		}
+
+		if (pr->state < AM_HTTP_S_BODY && pos >= AM_HTTP_HEAD_MAX)
+			return (am_http_error(pr, 431));
+		if (pr->state == AM_HTTP_S_DONE)
+			break;
+	}
+
+	/* throw away the chunk framing, so that the buffer does not fill up */
+	if (pr->chunked && pr->state > AM_HTTP_S_BODY) {
+		end = pr->body.off + pr->body.len;
+		gap = pos - end;
+		if (gap != 0) {
+			memmove(buf + end, buf + pos, len - pos);
+			len -= gap;
+			pos -= gap;
+			*plen = len;
+		}
+	}
+	pr->pos = pos;
+	return (pr->state == AM_HTTP_S_DONE ? AM_HTTP_DONE : AM_HTTP_MORE);
+}
+
+/* returns non-zero if the view holds exactly the given string */
+int
+am_http_match(const char *buf, const struct am_http_view *pv, const char *str)
+{
+	size_t len = strlen(str);
+
+	return (pv->len == len && memcmp(buf + pv->off, str, len) == 0);
+}
+
+/*
+ * Zero terminates a view in place. The byte following any view is a
+ * delimiter or past the data, so the buffer must have room for one
+ * more byte than it holds.
+ */
+char *
+am_http_string(char *buf, const struct am_http_view *pv)
+{
+	buf[pv->off + pv->len] = 0;
+	return (buf + pv->off);
+}
+
+/* returns the value of the first header with the given name, or NULL */
+char *
+am_http_header(struct am_http_req *pr, char *buf, const char *name)
+{
+	const struct am_http_field *pf;
+	size_t len = strlen(name);
+	int x;
+
+	for (x = 0; x != pr->nheader; x++) {
+		pf = pr->header + x;
+		if (pf->name.len == len &&
+		    strncasecmp(buf + pf->name.off, name, len) == 0)
+			return (am_http_string(buf, &pf->value));
+	}
+	return (NULL);
+}
+
+/*
+ * Returns the decoded value of the next parameter with the given name,
+ * starting at the index given, which is then advanced. The index may
+ * be NULL to get the first one. Values are decoded in place.
+ */
+char *
+am_http_param(struct am_http_req *pr, char *buf, const char *name, int *pindex)
+{
+	struct am_http_field *pf;
+	char *out;
+	char *ptr;
+	char *end;
+	int x;
+
+	for (x = (pindex != NULL) ? *pindex : 0; x < pr->nparam; x++) {
+		pf = pr->param + x;
+		if (!am_http_match(buf, &pf->name, name))
+			continue;
+		if (pindex != NULL)
+			*pindex = x + 1;
+		if (pf->decoded == 0) {
+			out = ptr = buf + pf->value.off;
+			end = ptr + pf->value.len;
+			while (ptr != end) {
+				if (*ptr == '+') {
+					*out++ = ' ';
+					ptr++;
+				} else if (*ptr == '%' && end - ptr >= 3 &&
+				    am_http_hex(ptr[1]) >= 0 && am_http_hex(ptr[2]) >= 0) {
+					*out++ = (am_http_hex(ptr[1]) << 4) | am_http_hex(ptr[2]);
+					ptr += 3;
+				} else {
+					*out++ = *ptr++;
+				}
+			}
+			pf->value.len = out - (buf + pf->value.off);
+			pf->decoded = 1;
+		}
+		return (am_http_string(buf, &pf->value));
+	}
+	if (pindex != NULL)
+		*pindex = x;
+	return (NULL);
+}
+
+/* adds the parameters of an application/x-www-form-urlencoded body */
+int
+am_http_form(struct am_http_req *pr, char *buf)
+{
+	uint32_t end = pr->body.off + pr->body.len;
+	uint32_t start = pr->body.off;
+	uint32_t eq = 0;
+	uint32_t pos;
+
+	/* tolerate a line break after the body */
+	while (end != start && (buf[end - 1] == '\r' || buf[end - 1] == '\n'))
+		end--;
+
+	for (pos = start; pos != end; pos++) {
+		if (buf[pos] == '&') {
+			if (am_http_param_add(pr, start, eq, pos) != 0)
+				return (E2BIG);
+			start = pos + 1;
+			eq = 0;
+		} else if (buf[pos] == '=' && eq == 0) {
+			eq = pos + 1;
+		}
+	}
+	return (am_http_param_add(pr, start, eq, end));
+}
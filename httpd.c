@@ -23,14 +23,91 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/endian.h>
+
 #include <stdlib.h>
 #include <stdbool.h>
+#include <strings.h>
 #include <ctype.h>
+#include <zlib.h>
 
 #include "asteriskmail.h"
 
-static uint32_t base64_bits;
-static uint32_t base64_value;
+enum {
+	AM_HTTPD_IDENTITY,
+	AM_HTTPD_GZIP,
+	AM_HTTPD_DEFLATE,
+};
+
+/*
+ * A response body together with its raw deflate stream. The gzip and
+ * the zlib formats only differ in the framing around the stream, so
+ * one compression serves both content codings.
+ */
+struct am_httpd_body {
+	char   *data;
+	size_t	len;
+	uint8_t *deflate;		/* NULL if not compressed */
+	size_t	deflate_len;
+	uint32_t crc32;			/* gzip trailer */
+	uint32_t adler32;		/* zlib trailer */
+};
+
+/* the inbox page of one store generation */
+struct am_inbox {
+	struct am_retire retire;
+	uint64_t generation;
+	struct am_httpd_body body;
+};
+
+enum {
+	AM_HTTPD_TYPE_OTHER,
+	AM_HTTPD_TYPE_JSON,
+	AM_HTTPD_TYPE_FORM,
+};
+
+enum {
+	AM_SMS_PENDING,
+	AM_SMS_SENT,
+	AM_SMS_FAILED,
+	AM_SMS_INVALID,
+	AM_SMS_DUPLICATE,
+};
+
+struct am_sms_rcpt {
+	char   *phone;
+	int	status;
+	int	sent;			/* segments sent */
+};
+
+/* an outbound SMS request */
+struct am_sms_req {
+	struct am_sms_rcpt *rcpt;
+	int	nrcpt;
+	char   *message;
+	char   *id;			/* form ID */
+};
+
+/* the request being served */
+struct am_httpd_ctx {
+	FILE   *io;
+	struct am_arena *arena;
+	struct am_http_req *req;
+	char   *buf;			/* request buffer the views point into */
+	int	encoding;
+};
+
+struct am_httpd_route {
+	const char *method;
+	const char *path;
+	void	(*handler)(struct am_httpd_ctx *);
+};
+
+static pthread_mutex_t am_inbox_mtx = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic unsigned curr_sms_id;
+
+static __thread uint32_t base64_bits;
+static __thread uint32_t base64_value;
 
 static int
 is_separator(const char ch)
@@ -154,333 +231,224 @@ gethex(char ch)
 	return (0);
 }
 
-static void
-handle_httpd_decode_string(char *ptr)
+/* returns the preferred content coding of an Accept-Encoding header */
+static int
+handle_httpd_accept_encoding(const char *ptr)
 {
-	char *out = ptr;
+	const char *end;
+	const char *q;
+	size_t len;
+	int mask = 0;
+	int enc;
 
-	while (*ptr) {
-		if (ptr[0] == ' ' || ptr[0] == '&' || ptr[0] == '?')
-			break;
-		if (ptr[0] == '+') {
-			*out++ = ' ';
+	while (*ptr != 0) {
+		while (*ptr == ' ' || *ptr == '\t' || *ptr == ',')
 			ptr++;
-		} else if (ptr[0] == '%' && ptr[1] != 0 && ptr[2] != 0) {
-			*out++ = (gethex(ptr[1]) << 4) | gethex(ptr[2]);
-			ptr += 3;
-		} else {
-			*out++ = *ptr++;
+		if (*ptr == 0)
+			break;
+		len = strcspn(ptr, " \t;,");
+		if ((len == 4 && strncasecmp(ptr, "gzip", 4) == 0) ||
+		    (len == 6 && strncasecmp(ptr, "x-gzip", 6) == 0))
+			enc = (1 << AM_HTTPD_GZIP);
+		else if (len == 7 && strncasecmp(ptr, "deflate", 7) == 0)
+			enc = (1 << AM_HTTPD_DEFLATE);
+		else if (len == 1 && ptr[0] == '*')
+			enc = (1 << AM_HTTPD_GZIP) | (1 << AM_HTTPD_DEFLATE);
+		else
+			enc = 0;
+
+		/* a quality value of zero refuses the coding */
+		end = ptr + strcspn(ptr, ",");
+		for (q = ptr + len; q + 1 < end; q++) {
+			if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+				if (strtod(q + 2, NULL) <= 0.0)
+					enc = 0;
+				break;
+			}
 		}
+		mask |= enc;
+		ptr = end;
 	}
-	*out++ = 0;
+	if (mask & (1 << AM_HTTPD_GZIP))
+		return (AM_HTTPD_GZIP);
+	if (mask & (1 << AM_HTTPD_DEFLATE))
+		return (AM_HTTPD_DEFLATE);
+	return (AM_HTTPD_IDENTITY);
 }
 
-void
-handle_httpd_connection(int fd)
+static int
+handle_httpd_deflate(struct am_httpd_body *pb, int level)
 {
-	enum { MAX_LENGTH = 140 };
+	z_stream zs;
+	size_t max;
 
-	static int curr_sms_id;
-	struct am_message *pamm;
-	char message_buf[2048];
-	char smtpd_buf[2048];
-	char system_cmd[512 + 128];
-	char *hdr;
-	char *ptr;
-	char *line;
-	char default_phone[64] = {};
-	FILE *io;
-	int len;
-	int num;
-	int x;
-	int page;
-	int y;
-
-	io = fdopen(fd, "r+");
-	if (io == NULL)
-		goto done;
-
-	page = -1;
-
-	/* dump HTTP request header */
-	while (1) {
-next_line:
-		line = handle_read_line(io);
-		if (line == NULL)
-			goto done;
-		if (line[0] == 0)
-			break;
-		if (page < 0 && strstr(line, "GET /send_sms.cgi?") == line) {
-			char *phone;
-			char *message;
-			char *id;
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		return (ENOMEM);
+	max = deflateBound(&zs, pb->len);
+	pb->deflate = malloc(max);
+	if (pb->deflate == NULL) {
+		deflateEnd(&zs);
+		return (ENOMEM);
+	}
+	zs.next_in = (Bytef *)pb->data;
+	zs.avail_in = pb->len;
+	zs.next_out = pb->deflate;
+	zs.avail_out = max;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&zs);
+		free(pb->deflate);
+		pb->deflate = NULL;
+		return (EIO);
+	}
+	pb->deflate_len = zs.total_out;
+	deflateEnd(&zs);
 
-			page = 1;
+	pb->crc32 = crc32(crc32(0, Z_NULL, 0), (const Bytef *)pb->data, pb->len);
+	pb->adler32 = adler32(adler32(0, Z_NULL, 0), (const Bytef *)pb->data, pb->len);
+	return (0);
+}
 
-			phone = strstr(line, "&phone=");
-			if (phone == NULL)
-				phone = strstr(line, "?phone=");
+/* sends a complete response, compressed if the client allows it */
+static int
+handle_httpd_send(FILE *io, const char *status, const char *type,
+    const struct am_httpd_body *pb, int encoding)
+{
+	static const uint8_t gzip_hdr[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+	static const uint8_t zlib_hdr[2] = { 0x78, 0x9c };
+	struct iovec iov[4];
+	uint8_t trailer[8];
+	char hdr[256];
+	size_t size;
+	int cnt;
 
-			id = strstr(line, "&id=");
-			if (id == NULL)
-				id = strstr(line, "?id=");
+	if (pb->deflate == NULL)
+		encoding = AM_HTTPD_IDENTITY;
 
-			message = strstr(line, "&message=");
-			if (message == NULL)
-				message = strstr(line, "?message=");
+	iov[2].iov_base = pb->deflate;
+	iov[2].iov_len = pb->deflate_len;
+	iov[3].iov_base = trailer;
 
-			if (phone == NULL || message == NULL || id == NULL) {
-				page = 2;
-				goto next_line;
-			}
-			phone += 7;
-			message += 9;
-			id += 4;
-
-			handle_httpd_decode_string(phone);
-			handle_httpd_decode_string(message);
-			handle_httpd_decode_string(id);
-
-			ptr = id;
-			if (*ptr == 0 || atoi(id) != curr_sms_id) {
-				page = 2;
-				goto next_line;
-			}
-			ptr = phone;
-			if (*ptr == 0) {
-				page = 2;
-				goto next_line;
-			}
-			while (*ptr) {
-				if (*ptr == '+') {
-					ptr++;
-					continue;
-				} else if (*ptr >= '0' && *ptr <= '9') {
-					ptr++;
-					continue;
-				}
-				page = 2;
-				goto next_line;
-			}
-			ptr = message;
-			while (isspace(*ptr)) {
-				ptr++;
-			}
-			if (*ptr == 0) {
-				page = 2;
-				goto next_line;
-			}
-			memset(message_buf, ' ', sizeof(message_buf));
-			message_buf[sizeof(message_buf) - 1] = 0;
-
-			ptr = message;
-			hdr = message_buf;
-			while (*ptr) {
-				if (*hdr == 0) {
-					page = 2;
-					goto next_line;
-				} else {
-					*hdr++ = *ptr++;
-				}
-			}
-			*hdr++ = 0;
-
-			/* make a copy of outgoing messages */
-			pamm = handle_create_message();
-			if (pamm != NULL) {
-				snprintf(smtpd_buf, sizeof(smtpd_buf),
-				    "Subject: SMS\r\n"
-				    "From: home\r\n"
-				    "To: %s <%s>\r\n"
-				    "Content-Type: text/html; charset=utf-8\r\n"
-				    "\r\n\r\n%s",
-				    phone, phone, message);
-				ptr = smtpd_buf;
-				while (*ptr) {
-					if (handle_append_message(pamm, *ptr))
-						break;
-					ptr++;
-				}
-				/* zero terminate */
-				if (*ptr == 0 &&
-				    handle_append_message(pamm, 0) == 0) {
-					handle_insert_message(pamm);
-				} else {
-					handle_delete_message(pamm);
-				}
-			}
-
-			ptr = message_buf;
-			while (1) {
-				len = strlen(ptr);
-				if (len == 0)
-					break;
-
-				/* get maximum length */
-				x = len;
-				if (x > MAX_LENGTH) {
-					x = MAX_LENGTH;
-
-					/* try word separation */
-					while (x--) {
-						if (is_separator(ptr[x])) {
-							while (is_separator(ptr[x]) && x < MAX_LENGTH)
-								x++;
-							break;
-						}
-					}
-
-					/* send full text */
-					if (x < 1)
-						x = MAX_LENGTH;
-				}
+	switch (encoding) {
+	case AM_HTTPD_GZIP:
+		le32enc(trailer, pb->crc32);
+		le32enc(trailer + 4, (uint32_t)pb->len);
+		iov[1].iov_base = __DECONST(uint8_t *, gzip_hdr);
+		iov[1].iov_len = sizeof(gzip_hdr);
+		iov[3].iov_len = 8;
+		cnt = 4;
+		size = iov[1].iov_len + iov[2].iov_len + iov[3].iov_len;
+		am_metrics_count(AM_CNT_HTTPD_GZIP, size);
+		break;
+	case AM_HTTPD_DEFLATE:
+		be32enc(trailer, pb->adler32);
+		iov[1].iov_base = __DECONST(uint8_t *, zlib_hdr);
+		iov[1].iov_len = sizeof(zlib_hdr);
+		iov[3].iov_len = 4;
+		cnt = 4;
+		size = iov[1].iov_len + iov[2].iov_len + iov[3].iov_len;
+		am_metrics_count(AM_CNT_HTTPD_DEFLATE, size);
+		break;
+	default:
+		iov[1].iov_base = pb->data;
+		iov[1].iov_len = pb->len;
+		cnt = 2;
+		size = pb->len;
+		am_metrics_count(AM_CNT_HTTPD_IDENTITY, size);
+		break;
+	}
 
-				y = ptr[x];
-				ptr[x] = 0;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\n"
+	    "Content-Type: %s\r\n"
+	    "Server: asteriskmail/1.0\r\n"
+	    "%s"
+	    "Vary: Accept-Encoding\r\n"
+	    "Content-Length: %zu\r\n"
+	    "\r\n", status, type,
+	    encoding == AM_HTTPD_GZIP ? "Content-Encoding: gzip\r\n" :
+	    encoding == AM_HTTPD_DEFLATE ? "Content-Encoding: deflate\r\n" : "",
+	    size);
 
-				snprintf(system_cmd, sizeof(system_cmd),
-				    "/usr/local/sbin/asterisk"
-				    " -rx \"dongle sms dongle0 %s "
-				    "\\\"%s\\\"\"", phone, ptr);
+	return (handle_writev(io, iov, cnt));
+}
 
-				if (system(system_cmd) != 0) {
-					page = 3;
-					goto next_line;
-				}
+/* sends a response from memory, compressing it on the fly */
+static int
+handle_httpd_send_data(FILE *io, const char *status, const char *type,
+    char *data, size_t len, int encoding)
+{
+	struct am_httpd_body body = { .data = data, .len = len };
+	int error;
 
-				/* nice operation a bit */
-				usleep(250000);
+	if (encoding != AM_HTTPD_IDENTITY && len >= AM_HTTPD_DEFLATE_MIN)
+		handle_httpd_deflate(&body, Z_DEFAULT_COMPRESSION);
+	error = handle_httpd_send(io, status, type, &body, encoding);
+	free(body.deflate);
+	return (error);
+}
 
-				ptr[x] = y;
-				ptr += x;
-			}
-			curr_sms_id++;
-			if (curr_sms_id >= 10000)
-				curr_sms_id = 0;
-
-		} else if (page < 0 && (strstr(line, "GET / ") == line ||
-		    strstr(line, "GET /index.html") == line)) {
-			page = 4;
-		} else if (page < 0 && strstr(line, "GET /sms_form.html") == line) {
-			char *phone;
-
-			phone = strstr(line, "&phone=");
-			if (phone == NULL)
-				phone = strstr(line, "?phone=");
-			if (phone != NULL) {
-				phone += 7;
-				handle_httpd_decode_string(phone);
-				strlcpy(default_phone, phone, sizeof(default_phone));
-			}
+/* renders a dynamic response into memory, so that it can be compressed */
+static int
+handle_httpd_send_dynamic(FILE *io, const char *type, void (*func)(FILE *), int encoding)
+{
+	char *data = NULL;
+	size_t len = 0;
+	FILE *mem;
+	int error;
 
-			page = 5;
-		}
+	mem = open_memstream(&data, &len);
+	if (mem == NULL)
+		return (ENOMEM);
+	func(mem);
+	if (fclose(mem) != 0) {
+		free(data);
+		return (ENOMEM);
 	}
+	error = handle_httpd_send_data(io, "200 OK", type, data, len, encoding);
+	free(data);
+	return (error);
+}
 
-	switch (page) {
-	case 1:
-		fprintf(io, "HTTP/1.0 200 OK\r\n"
-		    "Content-Type: text/html\r\n"
-		    "Server: asteriskmail/1.0\r\n"
-		    "\r\n"
-		    "<html><head><title>AsteriskMail Inbox</title>"
-		    "</head>"
-		    "<h1>SMS was successfully sent. <a HREF=\"index.html\">Click here to go back</a>.</h1><br>"
-		    "</html>");
-		goto done;
-	case 2:
-		fprintf(io, "HTTP/1.0 200 OK\r\n"
-		    "Content-Type: text/html\r\n"
-		    "Server: asteriskmail/1.0\r\n"
-		    "\r\n"
-		    "<html><head><title>AsteriskMail Inbox</title>"
-		    "</head>"
-		    "<h1>ERROR: Invalid SMS message, phone number or ID.<br><a HREF=\"sms_form.html\">Click here to retry</a></h1><br>"
-		    "</html>");
-		goto done;
-	case 3:
-		fprintf(io, "HTTP/1.0 200 OK\r\n"
-		    "Content-Type: text/html\r\n"
-		    "Server: asteriskmail/1.0\r\n"
-		    "\r\n"
-		    "<html><head><title>AsteriskMail Inbox</title>"
-		    "</head>"
-		    "<h1>ERROR: Sending SMS.<br><a HREF=\"sms_form.html\">Click here to retry</a></h1><br>"
-		    "</html>");
-		goto done;
-	case 5:
-		fprintf(io, "HTTP/1.0 200 OK\r\n"
-		    "Content-Type: text/html\r\n"
-		    "Server: asteriskmail/1.0\r\n"
-		    "\r\n"
-		    "<html><head><title>AsteriskMail Send SMS</title>"
-		    "</head>"
-		    "<br><br><form action=\"send_sms.cgi\" id=\"smsform\" accept-charset=\"UTF-8\">"
-		    "<table bgcolor=\"#c0c0c0\">"
-		    "<tr><th COLSPAN=\"2\">Send SMS</th></tr>"
-		    "<tr><th>"
-		    "<div align=\"right\">Mobile:</div></th><th><div align=\"left\">"
-		    "<input type=\"tel\" maxlength=\"30\" name=\"phone\" value=\"%s\"></div></th></tr>"
-		    "<tr><th>"
-		    "<div align=\"right\">Message:</div></th><th><div align=\"left\">"
-		    "<textarea maxlength=\"%d\" name=\"message\" form=\"smsform\" autocomplete=\"off\" "
-		    "wrap=\"logical\" rows=\"12\" cols=\"32\" type=\"password\">"
-		    "</textarea></div></th></tr>"
-		    "<tr><th></th><th>"
-		    "<div align=\"right\"><input type=\"submit\" value=\"Submit\"></div>"
-		    "</th></table>"
-		    "<input type=\"hidden\" name=\"id\" value=\"%d\"> "
-		    "</form>"
-		    "<br><a HREF=\"index.html\">Click here to go back</a>"
-		    "</html>", default_phone, MAX_LENGTH * 10, curr_sms_id);
-		goto done;
-	case 4:
-		break;
-	default:
-		fprintf(io, "HTTP/1.0 200 OK\r\n"
-		    "Content-Type: text/html\r\n"
-		    "Server: asteriskmail/1.0\r\n"
-		    "\r\n"
-		    "<html><head><title>AsteriskMail Inbox</title>"
-		    "</head>"
-		    "<h1>Invalid page requested! <a HREF=\"index.html\">Click here to go back</a>.</h1><br>"
-		    "</html>");
-		goto done;
-	}
+static int
+handle_httpd_inbox_render(FILE *io, const struct am_snapshot *ps)
+{
+	struct am_message *pamm;
+	char *data;
+	char *hdr;
+	char *ptr;
+	int num;
+	int x;
 
-	fprintf(io, "HTTP/1.0 200 OK\r\n"
-	    "Content-Type: text/html\r\n"
-	    "Server: asteriskmail/1.0\r\n"
-	    "\r\n"
-	    "<html><head><title>AsteriskMail Inbox</title>"
+	fprintf(io, "<html><head><title>AsteriskMail Inbox</title>"
 	    "<meta HTTP-EQUIV=\"refresh\" CONTENT=\"120\">"
 	    "<meta charset=\"UTF-8\">"
 	    "</meta>"
 	    "</head>"
 	    "<h1>List of incoming messages</h1><br>");
 
-	pamm = NULL;
-	num = 0;
-	while (handle_foreach_message(&pamm))
-		num++;
+	num = ps->count;
 
 	if (num == 0) {
 		fprintf(io, "<br><i>There are currently no incoming messages</i><br>");
 	} else {
-		x = 0;
-		while (handle_foreach_message(&pamm)) {
-			x++;
-			fprintf(io, "<h2>Message %d of %d: ", x, num);
+		for (x = 0; x != num; x++) {
+			pamm = ps->msg[x];
+			data = __DECONST(char *, handle_message_data(pamm));
+			if (data == NULL)
+				return (ENOMEM);
+			fprintf(io, "<h2>Message %d of %d: ", x + 1, num);
 
-			hdr = strstr(pamm->data, "\r\n\r\n");
+			hdr = strstr(data, "\r\n\r\n");
 			if (hdr == NULL)
-				hdr = pamm->data + strlen(pamm->data);
+				hdr = data + strlen(data);
 			else
 				hdr += 4;
 
-			ptr = strafter(pamm->data, "\r\nSubject: ");
+			ptr = strafter(data, "\r\nSubject: ");
 			if (ptr == NULL)
-				ptr = strafter(pamm->data, "\nSubject: ");
+				ptr = strafter(data, "\nSubject: ");
 			if (ptr != NULL && ptr <= hdr) {
 				while (1) {
 					char ch;
@@ -489,14 +457,14 @@ next_line:
 					if (isprint(ch) == 0)
 						break;
 					if (fwrite(&ch, 1, 1, io) != 1)
-						goto done;
+						return (EIO);
 				}
 			}
 			fprintf(io, " - ");
 
-			ptr = strafter(pamm->data, "\r\nFrom: ");
+			ptr = strafter(data, "\r\nFrom: ");
 			if (ptr == NULL)
-				ptr = strafter(pamm->data, "\nFrom: ");
+				ptr = strafter(data, "\nFrom: ");
 			if (ptr != NULL && ptr <= hdr) {
 				bool done = false;
 				uint8_t offset = 0;
@@ -519,7 +487,7 @@ next_line:
 							done = true;
 					}
 					if (fwrite(&ch, 1, 1, io) != 1)
-						goto done;
+						return (EIO);
 				}
 				telno[offset] = 0;
 
@@ -536,16 +504,16 @@ next_line:
 				while (*ptr != 0) {
 					if (*ptr == '<') {
 						if (fwrite("&lt;", 1, 4, io) != 4)
-							goto done;
+							return (EIO);
 					} else if (*ptr == '>') {
 						if (fwrite("&gt;", 1, 4, io) != 4)
-							goto done;
+							return (EIO);
 					} else if (*ptr == '\"') {
 						if (fwrite("&quot;", 1, 6, io) != 6)
-							goto done;
+							return (EIO);
 					} else {
 						if (fwrite(ptr, 1, 1, io) != 1)
-							goto done;
+							return (EIO);
 					}
 					ptr++;
 				}
@@ -557,9 +525,1217 @@ next_line:
 	fprintf(io,
 	    "<br><a HREF=\"sms_form.html\">Click here to send SMS</a>"
 	    "</html>");
-done:
-	if (io != NULL) {
-		fflush(io);
-		fclose(io);
+	return (ferror(io) ? EIO : 0);
+}
+
+static void
+handle_httpd_inbox_free(struct am_retire *pr)
+{
+	struct am_inbox *pi = (struct am_inbox *)pr;
+
+	free(pi->body.deflate);
+	free(pi->body.data);
+	free(pi);
+}
+
+/*
+ * Returns the inbox page of the given mailbox snapshot, or of a newer
+ * one. The page is rendered and compressed once per generation of the
+ * mailbox, and stays valid until the snapshot is left.
+ */
+static const struct am_inbox *
+handle_httpd_inbox(struct am_mailbox *mbox, const struct am_snapshot *ps)
+{
+	struct am_inbox *old;
+	struct am_inbox *pi;
+	uint64_t start;
+	FILE *mem;
+	int error;
+
+	pi = atomic_load(&mbox->inbox);
+	if (pi != NULL && pi->generation >= ps->generation) {
+		am_metrics_count(AM_CNT_INBOX_HIT, 1);
+		return (pi);
+	}
+
+	/* let one thread do the work, the others wait for its result */
+	pthread_mutex_lock(&am_inbox_mtx);
+	old = atomic_load(&mbox->inbox);
+	if (old != NULL && old->generation >= ps->generation) {
+		pthread_mutex_unlock(&am_inbox_mtx);
+		am_metrics_count(AM_CNT_INBOX_HIT, 1);
+		return (old);
+	}
+	am_metrics_count(AM_CNT_INBOX_MISS, 1);
+	start = am_metrics_now();
+
+	pi = calloc(1, sizeof(*pi));
+	if (pi == NULL)
+		goto error;
+	pi->generation = ps->generation;
+
+	mem = open_memstream(&pi->body.data, &pi->body.len);
+	if (mem == NULL)
+		goto error;
+	error = handle_httpd_inbox_render(mem, ps);
+	if (fclose(mem) != 0 || error != 0)
+		goto error;
+
+	/* without the compressed form, the page is still worth caching */
+	handle_httpd_deflate(&pi->body, Z_BEST_COMPRESSION);
+
+	atomic_store(&mbox->inbox, pi);
+	pthread_mutex_unlock(&am_inbox_mtx);
+	am_metrics_observe(AM_HIST_INBOX_RENDER, start);
+
+	if (old != NULL)
+		am_epoch_retire(&old->retire, &handle_httpd_inbox_free);
+	return (pi);
+error:
+	pthread_mutex_unlock(&am_inbox_mtx);
+	if (pi != NULL) {
+		free(pi->body.data);
+		free(pi);
+	}
+	return (NULL);
+}
+
+/* returns the length of the next outbound SMS segment */
+static int
+handle_httpd_sms_split(const char *ptr)
+{
+	int len = strlen(ptr);
+	int x;
+
+	/* get maximum length */
+	x = len;
+	if (x > AM_SMS_SEGMENT_MAX) {
+		x = AM_SMS_SEGMENT_MAX;
+
+		/* try word separation */
+		while (x--) {
+			if (is_separator(ptr[x])) {
+				while (is_separator(ptr[x]) && x < AM_SMS_SEGMENT_MAX)
+					x++;
+				break;
+			}
+		}
+
+		/* send full text */
+		if (x < 1)
+			x = AM_SMS_SEGMENT_MAX;
+	}
+	return (x);
+}
+
+/*
+ * Splits a message into segments and quotes them for the Asterisk
+ * command line. This is done once, however many recipients there are.
+ */
+static char **
+handle_httpd_sms_segments(struct am_arena *pa, const char *message, int *pnum)
+{
+	const char *ptr;
+	char **seg;
+	char *out;
+	int num;
+	int x;
+	int y;
+
+	for (num = 0, ptr = message; *ptr != 0; num++)
+		ptr += handle_httpd_sms_split(ptr);
+
+	seg = am_arena_alloc(pa, (num + 1) * sizeof(seg[0]));
+	if (seg == NULL)
+		return (NULL);
+
+	for (x = 0, ptr = message; x != num; x++) {
+		y = handle_httpd_sms_split(ptr);
+		out = am_arena_alloc(pa, 2 * y + 1);
+		if (out == NULL)
+			return (NULL);
+		seg[x] = out;
+		for (; y != 0; y--) {
+			if (*ptr == '"' || *ptr == '\\')
+				*out++ = '\\';
+			*out++ = *ptr++;
+		}
+		*out = 0;
+	}
+	*pnum = num;
+	return (seg);
+}
+
+static int
+handle_httpd_sms_valid(const char *phone)
+{
+	const char *ptr;
+
+	if (*phone == 0 || strlen(phone) > AM_SMS_PHONE_MAX)
+		return (0);
+	for (ptr = phone; *ptr != 0; ptr++) {
+		if (*ptr != '+' && (*ptr < '0' || *ptr > '9'))
+			return (0);
+	}
+	return (1);
+}
+
+/* adds a comma separated list of recipients */
+static int
+handle_httpd_sms_rcpt(struct am_sms_req *pq, char *list)
+{
+	struct am_sms_rcpt *pr;
+	char *phone;
+	char *end;
+
+	while ((phone = strsep(&list, ",")) != NULL) {
+		while (isspace(*phone))
+			phone++;
+		end = phone + strlen(phone);
+		while (end != phone && isspace(end[-1]))
+			*--end = 0;
+		if (*phone == 0)
+			continue;
+		if (pq->nrcpt == AM_SMS_RCPT_MAX)
+			return (E2BIG);
+		pr = pq->rcpt + pq->nrcpt++;
+		pr->phone = phone;
+		pr->status = AM_SMS_PENDING;
+		pr->sent = 0;
+	}
+	return (0);
+}
+
+/*
+ * Sends all segments to every pending recipient. Each recipient is a
+ * job of its own, so that the dongle pool spreads the recipients over
+ * the modems, while the parts of one message arrive in order. A failed
+ * segment gives up on that recipient only.
+ */
+static void
+handle_httpd_sms_batch(struct am_arena *pa, struct am_sms_rcpt *pr, int nrcpt,
+    char **seg, int nseg)
+{
+	struct am_dongle_job *pj;
+	int num = 0;
+	int x;
+
+	pj = am_arena_alloc(pa, sizeof(*pj) * nrcpt);
+
+	for (x = 0; x != nrcpt; x++) {
+		if (pr[x].status != AM_SMS_PENDING)
+			continue;
+		if (pj == NULL) {
+			pr[x].status = AM_SMS_FAILED;
+			continue;
+		}
+		pj[num].phone = pr[x].phone;
+		pj[num].seg = seg;
+		pj[num].nseg = nseg;
+		num++;
+	}
+	if (pj == NULL)
+		return;
+
+	am_dongle_send(pj, num);
+
+	for (x = num = 0; x != nrcpt; x++) {
+		if (pr[x].status != AM_SMS_PENDING)
+			continue;
+		pr[x].sent = pj[num].sent;
+		pr[x].status = (pj[num].error != 0) ? AM_SMS_FAILED : AM_SMS_SENT;
+		num++;
+	}
+}
+
+static int
+handle_httpd_sms_append(struct am_message *pamm, const char *str)
+{
+	while (*str != 0) {
+		if (handle_append_message(pamm, *str))
+			return (1);
+		str++;
+	}
+	return (0);
+}
+
+/* make a copy of outgoing messages */
+static void
+handle_httpd_sms_copy(const struct am_sms_rcpt *pr, int nrcpt, const char *message)
+{
+	struct am_message *pamm;
+	int error;
+	int x;
+	int y;
+
+	pamm = handle_create_message();
+	if (pamm == NULL)
+		return;
+
+	error = handle_httpd_sms_append(pamm,
+	    "Subject: SMS\r\n"
+	    "From: home\r\n"
+	    "To: ");
+	for (x = y = 0; x != nrcpt; x++) {
+		if (pr[x].status != AM_SMS_PENDING)
+			continue;
+		if (y++ != 0)
+			error |= handle_httpd_sms_append(pamm, ", ");
+		error |= handle_httpd_sms_append(pamm, pr[x].phone);
+		error |= handle_httpd_sms_append(pamm, " <");
+		error |= handle_httpd_sms_append(pamm, pr[x].phone);
+		error |= handle_httpd_sms_append(pamm, ">");
+	}
+	error |= handle_httpd_sms_append(pamm, "\r\n"
+	    "Content-Type: text/html; charset=utf-8\r\n"
+	    "\r\n\r\n");
+	error |= handle_httpd_sms_append(pamm, message);
+
+	/* zero terminate */
+	if (error != 0 ||
+	    handle_append_message(pamm, 0) != 0 ||
+	    handle_insert_message(pamm) != 0) {
+		handle_delete_message(pamm);
+	}
+}
+
+static char *
+handle_httpd_json_space(char *ptr)
+{
+	while (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n')
+		ptr++;
+	return (ptr);
+}
+
+static int
+handle_httpd_json_hex(const char *ptr, uint32_t *pcode)
+{
+	int x;
+
+	*pcode = 0;
+	for (x = 0; x != 4; x++) {
+		if (!isxdigit(ptr[x]))
+			return (EINVAL);
+		*pcode = (*pcode << 4) | gethex(ptr[x]);
+	}
+	return (0);
+}
+
+/*
+ * Decodes the JSON string at the given quote in place, and returns
+ * the input following it. The result is UTF-8 and zero terminated.
+ */
+static char *
+handle_httpd_json_string(char *ptr, char **pstr)
+{
+	uint32_t code;
+	uint32_t low;
+	char *out = ptr;
+
+	*pstr = out;
+	ptr++;
+
+	while (*ptr != '"') {
+		if ((uint8_t)*ptr < 0x20)
+			return (NULL);
+		if (*ptr != '\\') {
+			*out++ = *ptr++;
+			continue;
+		}
+		ptr++;
+		switch (*ptr++) {
+		case '"':
+		case '\\':
+		case '/':
+			*out++ = ptr[-1];
+			break;
+		case 'b':
+			*out++ = '\b';
+			break;
+		case 'f':
+			*out++ = '\f';
+			break;
+		case 'n':
+			*out++ = '\n';
+			break;
+		case 'r':
+			*out++ = '\r';
+			break;
+		case 't':
+			*out++ = '\t';
+			break;
+		case 'u':
+			if (handle_httpd_json_hex(ptr, &code) != 0)
+				return (NULL);
+			ptr += 4;
+			/* surrogate pair */
+			if (code >= 0xd800 && code < 0xdc00 &&
+			    ptr[0] == '\\' && ptr[1] == 'u' &&
+			    handle_httpd_json_hex(ptr + 2, &low) == 0 &&
+			    low >= 0xdc00 && low < 0xe000) {
+				code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+				ptr += 6;
+			}
+			if (code == 0) {
+				return (NULL);
+			} else if (code < 0x80) {
+				*out++ = code;
+			} else if (code < 0x800) {
+				*out++ = 0xc0 | (code >> 6);
+				*out++ = 0x80 | (code & 0x3f);
+			} else if (code < 0x10000) {
+				*out++ = 0xe0 | (code >> 12);
+				*out++ = 0x80 | ((code >> 6) & 0x3f);
+				*out++ = 0x80 | (code & 0x3f);
+			} else {
+				*out++ = 0xf0 | (code >> 18);
+				*out++ = 0x80 | ((code >> 12) & 0x3f);
+				*out++ = 0x80 | ((code >> 6) & 0x3f);
+				*out++ = 0x80 | (code & 0x3f);
+			}
+			break;
+		default:
+			return (NULL);
+		}
 	}
+	*out = 0;
+	return (ptr + 1);
+}
+
+/* skips one JSON value of any kind */
+static char *
+handle_httpd_json_skip(char *ptr)
+{
+	char *str;
+	int depth = 0;
+
+	do {
+		ptr = handle_httpd_json_space(ptr);
+		switch (*ptr) {
+		case '"':
+			ptr = handle_httpd_json_string(ptr, &str);
+			if (ptr == NULL)
+				return (NULL);
+			break;
+		case '{':
+		case '[':
+			depth++;
+			ptr++;
+			break;
+		case '}':
+		case ']':
+		case ',':
+		case ':':
+			if (depth == 0)
+				return (NULL);
+			if (*ptr == '}' || *ptr == ']')
+				depth--;
+			ptr++;
+			break;
+		case 0:
+			return (NULL);
+		default:
+			/* number, true, false or null */
+			while (*ptr != 0 && strchr(",:{}[]\" \t\r\n", *ptr) == NULL)
+				ptr++;
+			break;
+		}
+	} while (depth != 0);
+	return (ptr);
+}
+
+/* parses {"to":["+4712345678",...],"message":"..."} */
+static int
+handle_httpd_sms_json(char *ptr, struct am_sms_req *pq)
+{
+	char *key;
+	char *value;
+
+	ptr = handle_httpd_json_space(ptr);
+	if (*ptr++ != '{')
+		return (EINVAL);
+	ptr = handle_httpd_json_space(ptr);
+	if (*ptr == '}')
+		return (0);
+
+	while (1) {
+		if (*ptr != '"' || (ptr = handle_httpd_json_string(ptr, &key)) == NULL)
+			return (EINVAL);
+		ptr = handle_httpd_json_space(ptr);
+		if (*ptr++ != ':')
+			return (EINVAL);
+		ptr = handle_httpd_json_space(ptr);
+
+		if (strcmp(key, "to") == 0 && *ptr == '[') {
+			ptr = handle_httpd_json_space(ptr + 1);
+			while (*ptr != ']') {
+				if (*ptr != '"' ||
+				    (ptr = handle_httpd_json_string(ptr, &value)) == NULL)
+					return (EINVAL);
+				if (handle_httpd_sms_rcpt(pq, value) != 0)
+					return (E2BIG);
+				ptr = handle_httpd_json_space(ptr);
+				if (*ptr == ',')
+					ptr = handle_httpd_json_space(ptr + 1);
+				else if (*ptr != ']')
+					return (EINVAL);
+			}
+			ptr++;
+		} else if ((strcmp(key, "to") == 0 ||
+		    strcmp(key, "message") == 0) && *ptr == '"') {
+			if ((ptr = handle_httpd_json_string(ptr, &value)) == NULL)
+				return (EINVAL);
+			if (key[0] == 'm')
+				pq->message = value;
+			else if (handle_httpd_sms_rcpt(pq, value) != 0)
+				return (E2BIG);
+		} else if ((ptr = handle_httpd_json_skip(ptr)) == NULL) {
+			return (EINVAL);
+		}
+
+		ptr = handle_httpd_json_space(ptr);
+		if (*ptr == '}')
+			return (0);
+		if (*ptr++ != ',')
+			return (EINVAL);
+		ptr = handle_httpd_json_space(ptr);
+	}
+}
+
+static void
+handle_httpd_json_write(FILE *io, const char *str, size_t len)
+{
+	uint8_t ch;
+
+	fputc('"', io);
+	while (len--) {
+		ch = *str++;
+		if (ch == '"' || ch == '\\')
+			fprintf(io, "\\%c", ch);
+		else if (ch < 0x20)
+			fprintf(io, "\\u%04x", ch);
+		else
+			fputc(ch, io);
+	}
+	fputc('"', io);
+}
+
+static void
+handle_httpd_json_print(FILE *io, const char *str)
+{
+	handle_httpd_json_write(io, str, strlen(str));
+}
+
+static void
+handle_httpd_sms_result(FILE *io, const struct am_sms_req *pq, int nseg)
+{
+	static const char *status[] = {
+		[AM_SMS_PENDING] = "pending",
+		[AM_SMS_SENT] = "sent",
+		[AM_SMS_FAILED] = "failed",
+		[AM_SMS_INVALID] = "invalid",
+		[AM_SMS_DUPLICATE] = "duplicate",
+	};
+	int count[AM_SMS_DUPLICATE + 1] = {};
+	int x;
+
+	for (x = 0; x != pq->nrcpt; x++)
+		count[pq->rcpt[x].status]++;
+
+	fprintf(io, "{\"segments\":%d,\"sent\":%d,\"failed\":%d,\"invalid\":%d,"
+	    "\"duplicate\":%d,\"results\":[", nseg, count[AM_SMS_SENT],
+	    count[AM_SMS_FAILED], count[AM_SMS_INVALID], count[AM_SMS_DUPLICATE]);
+	for (x = 0; x != pq->nrcpt; x++) {
+		fprintf(io, "%s{\"to\":", x ? "," : "");
+		handle_httpd_json_print(io, pq->rcpt[x].phone);
+		fprintf(io, ",\"status\":\"%s\",\"segments\":%d}",
+		    status[pq->rcpt[x].status], pq->rcpt[x].sent);
+	}
+	fprintf(io, "]}\n");
+}
+
+/* sends an error response, with its length so that the client can close */
+static void
+handle_httpd_api_error(FILE *io, const char *status, const char *error)
+{
+	char buffer[256];
+	int len;
+
+	len = snprintf(buffer, sizeof(buffer), "{\"error\":\"%s\"}\n", error);
+	fprintf(io, "HTTP/1.0 %s\r\n"
+	    "Content-Type: application/json\r\n"
+	    "Server: asteriskmail/1.0\r\n"
+	    "Content-Length: %d\r\n"
+	    "\r\n"
+	    "%s", status, len, buffer);
+}
+
+
+static const char *
+handle_httpd_status(int status)
+{
+	switch (status) {
+	case 400:
+		return ("400 Bad Request");
+	case 401:
+		return ("401 Unauthorized");
+	case 405:
+		return ("405 Method Not Allowed");
+	case 413:
+		return ("413 Payload Too Large");
+	case 414:
+		return ("414 URI Too Long");
+	case 417:
+		return ("417 Expectation Failed");
+	case 431:
+		return ("431 Request Header Fields Too Large");
+	case 501:
+		return ("501 Not Implemented");
+	case 503:
+		return ("503 Service Unavailable");
+	case 505:
+		return ("505 HTTP Version Not Supported");
+	default:
+		return ("500 Internal Server Error");
+	}
+}
+
+static void
+handle_httpd_error(FILE *io, int status)
+{
+	const char *str = handle_httpd_status(status);
+
+	fprintf(io, "HTTP/1.0 %s\r\n"
+	    "%s"
+	    "Content-Type: text/plain\r\n"
+	    "Server: asteriskmail/1.0\r\n"
+	    "Content-Length: %zu\r\n"
+	    "\r\n"
+	    "%s\n", str, (status == 401) ?
+	    "WWW-Authenticate: Basic realm=\"AsteriskMail\", charset=\"UTF-8\"\r\n" : "",
+	    strlen(str) + 1, str);
+}
+
+/*
+ * Reads and discards what the client still sends after an error
+ * response, up to a limit. Closing a socket with unread data resets
+ * the connection, and the client may then lose the response.
+ */
+static void
+handle_httpd_linger(FILE *io, int fd)
+{
+	char buffer[ASTERISKMAIL_BUF_MAX];
+	size_t total = 0;
+	ssize_t len;
+
+	if (handle_flush(io) != 0)
+		return;
+	if (!handle_tls_active() && shutdown(fd, SHUT_WR) != 0)
+		return;
+
+	while (total < 16 * AM_HTTPD_BODY_MAX) {
+		am_timer_command(0);
+		len = handle_read(io, buffer, sizeof(buffer));
+		if (len <= 0)
+			break;
+		total += len;
+	}
+}
+
+/*
+ * Reads one request into a buffer from the arena. The buffer holds
+ * the largest head allowed, and grows when a body follows, to its
+ * exact size when the length is known. Returns the parser result. A
+ * status of zero means the client went away.
+ */
+static int
+handle_httpd_request(FILE *io, struct am_arena *pa, struct am_http_req *pr, char **pbuf)
+{
+	size_t size = AM_HTTP_HEAD_MAX;
+	size_t len = 0;
+	size_t want;
+	ssize_t retval;
+	char *buf;
+	char *temp;
+	int state;
+
+	am_http_init(pr);
+
+	buf = am_arena_alloc(pa, size + 1);
+	if (buf == NULL)
+		goto nomem;
+
+	while (1) {
+		/* only the body can fill the buffer, the head has a limit */
+		if (len == size) {
+			want = 2 * size;
+			if (pr->length > 0)
+				want = pr->body.off + pr->length;
+			if (want > AM_HTTP_HEAD_MAX + AM_HTTPD_BODY_MAX)
+				want = AM_HTTP_HEAD_MAX + AM_HTTPD_BODY_MAX;
+			if (want <= size) {
+				pr->status = 413;
+				return (AM_HTTP_ERROR);
+			}
+			temp = am_arena_alloc(pa, want + 1);
+			if (temp == NULL)
+				goto nomem;
+			memcpy(temp, buf, len);
+			buf = temp;
+			size = want;
+		}
+
+		am_timer_command(0);
+		retval = handle_read(io, buf + len, size - len);
+		if (retval <= 0)
+			return (AM_HTTP_ERROR);
+		am_timer_command(1);
+
+		len += retval;
+		state = am_http_parse(pr, buf, &len);
+		if (state == AM_HTTP_HEAD) {
+			if (pr->expect) {
+				fprintf(io, "HTTP/1.1 100 Continue\r\n\r\n");
+				if (handle_flush(io) != 0)
+					return (AM_HTTP_ERROR);
+			}
+			/* the start of the body may have come with the head */
+			state = am_http_parse(pr, buf, &len);
+		}
+		if (state != AM_HTTP_MORE)
+			break;
+	}
+	*pbuf = buf;
+	return (state);
+nomem:
+	pr->status = 503;
+	return (AM_HTTP_ERROR);
+}
+
+static void
+handle_httpd_page_status(FILE *io, const char *msg)
+{
+	fprintf(io, "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: text/html\r\n"
+	    "Server: asteriskmail/1.0\r\n"
+	    "\r\n"
+	    "<html><head><title>AsteriskMail Inbox</title>"
+	    "</head>"
+	    "<h1>%s</h1><br>"
+	    "</html>", msg);
+}
+
+/*
+ * Returns the mailbox given by HTTP basic authentication, or NULL. The
+ * default mailbox needs no credentials, as long as it is the only one.
+ */
+static struct am_mailbox *
+handle_httpd_login(struct am_httpd_ctx *pc)
+{
+	char buffer[ASTERISKMAIL_STRING_MAX];
+	char *ptr;
+	char *pass;
+	int len;
+	int ch;
+
+	ptr = am_http_header(pc->req, pc->buf, "Authorization");
+	if (ptr == NULL) {
+		if (am_mailbox_count() == 1)
+			return (am_mailbox_default());
+		return (NULL);
+	}
+	if (strncasecmp(ptr, "Basic ", 6) != 0)
+		return (NULL);
+	ptr += 6;
+	while (*ptr == ' ')
+		ptr++;
+
+	base64_get(NULL);
+	for (len = 0; (ch = base64_get(&ptr)) >= 0; ) {
+		if (len == sizeof(buffer) - 1)
+			return (NULL);
+		buffer[len++] = ch;
+	}
+	buffer[len] = 0;
+
+	pass = strchr(buffer, ':');
+	if (pass == NULL)
+		return (NULL);
+	*pass++ = 0;
+	return (am_mailbox_login(buffer, pass));
+}
+
+static void
+handle_httpd_page_inbox(struct am_httpd_ctx *pc)
+{
+	const struct am_snapshot *ps;
+	const struct am_inbox *pi;
+	struct am_mailbox *mbox;
+
+	mbox = handle_httpd_login(pc);
+	if (mbox == NULL) {
+		handle_httpd_error(pc->io, 401);
+		return;
+	}
+
+	/* a pinned snapshot never blocks ingest, however slow the client */
+	ps = handle_mailbox_enter(mbox);
+	pi = handle_httpd_inbox(mbox, ps);
+	if (pi != NULL) {
+		handle_httpd_send(pc->io, "200 OK", "text/html", &pi->body, pc->encoding);
+	} else {
+		/* out of memory, render straight to the client */
+		fprintf(pc->io, "HTTP/1.0 200 OK\r\n"
+		    "Content-Type: text/html\r\n"
+		    "Server: asteriskmail/1.0\r\n"
+		    "\r\n");
+		handle_httpd_inbox_render(pc->io, ps);
+	}
+	handle_snapshot_leave();
+}
+
+static void
+handle_httpd_page_form(struct am_httpd_ctx *pc)
+{
+	const char *phone;
+
+	phone = am_http_param(pc->req, pc->buf, "phone", NULL);
+
+	fprintf(pc->io, "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: text/html\r\n"
+	    "Server: asteriskmail/1.0\r\n"
+	    "\r\n"
+	    "<html><head><title>AsteriskMail Send SMS</title>"
+	    "</head>"
+	    "<br><br><form action=\"send_sms.cgi\" id=\"smsform\" accept-charset=\"UTF-8\">"
+	    "<table bgcolor=\"#c0c0c0\">"
+	    "<tr><th COLSPAN=\"2\">Send SMS</th></tr>"
+	    "<tr><th>"
+	    "<div align=\"right\">Mobile:</div></th><th><div align=\"left\">"
+	    "<input type=\"tel\" maxlength=\"30\" name=\"phone\" value=\"%.63s\"></div></th></tr>"
+	    "<tr><th>"
+	    "<div align=\"right\">Message:</div></th><th><div align=\"left\">"
+	    "<textarea maxlength=\"%d\" name=\"message\" form=\"smsform\" autocomplete=\"off\" "
+	    "wrap=\"logical\" rows=\"12\" cols=\"32\" type=\"password\">"
+	    "</textarea></div></th></tr>"
+	    "<tr><th></th><th>"
+	    "<div align=\"right\"><input type=\"submit\" value=\"Submit\"></div>"
+	    "</th></table>"
+	    "<input type=\"hidden\" name=\"id\" value=\"%d\"> "
+	    "</form>"
+	    "<br><a HREF=\"index.html\">Click here to go back</a>"
+	    "</html>", phone ? phone : "", AM_SMS_SEGMENT_MAX * 10,
+	    (int)(curr_sms_id % 10000));
+}
+
+/* GET /send_sms.cgi?phone=...&message=...&id=... from the SMS form */
+static void
+handle_httpd_page_send(struct am_httpd_ctx *pc)
+{
+	struct am_sms_rcpt rcpt;
+	const char *ptr;
+	char **seg;
+	char *phone;
+	char *message;
+	char *id;
+	int nseg;
+
+	phone = am_http_param(pc->req, pc->buf, "phone", NULL);
+	message = am_http_param(pc->req, pc->buf, "message", NULL);
+	id = am_http_param(pc->req, pc->buf, "id", NULL);
+
+	if (phone == NULL || message == NULL || id == NULL || *id == 0 ||
+	    atoi(id) != (int)(curr_sms_id % 10000) ||
+	    !handle_httpd_sms_valid(phone))
+		goto invalid;
+	for (ptr = message; isspace(*ptr); ptr++)
+		;
+	if (*ptr == 0)
+		goto invalid;
+
+	seg = handle_httpd_sms_segments(pc->arena, message, &nseg);
+	if (seg == NULL)
+		goto failed;
+	rcpt.phone = phone;
+	rcpt.status = AM_SMS_PENDING;
+	rcpt.sent = 0;
+
+	handle_httpd_sms_copy(&rcpt, 1, message);
+	handle_httpd_sms_batch(pc->arena, &rcpt, 1, seg, nseg);
+	if (rcpt.status != AM_SMS_SENT)
+		goto failed;
+	curr_sms_id++;
+
+	handle_httpd_page_status(pc->io, "SMS was successfully sent. "
+	    "<a HREF=\"index.html\">Click here to go back</a>.");
+	return;
+invalid:
+	handle_httpd_page_status(pc->io, "ERROR: Invalid SMS message, phone number or ID.<br>"
+	    "<a HREF=\"sms_form.html\">Click here to retry</a>");
+	return;
+failed:
+	handle_httpd_page_status(pc->io, "ERROR: Sending SMS.<br>"
+	    "<a HREF=\"sms_form.html\">Click here to retry</a>");
+}
+
+static void
+handle_httpd_page_metrics(struct am_httpd_ctx *pc)
+{
+	if (handle_httpd_send_dynamic(pc->io, "text/plain; version=0.0.4",
+	    &am_metrics_print, pc->encoding) != ENOMEM)
+		return;
+	fprintf(pc->io, "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: text/plain; version=0.0.4\r\n"
+	    "Server: asteriskmail/1.0\r\n"
+	    "\r\n");
+	am_metrics_print(pc->io);
+}
+
+#ifdef ASTERISKMAIL_TRACE
+static void
+handle_httpd_page_trace(struct am_httpd_ctx *pc)
+{
+	if (handle_httpd_send_dynamic(pc->io, "application/json",
+	    &am_trace_print, pc->encoding) != ENOMEM)
+		return;
+	fprintf(pc->io, "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: application/json\r\n"
+	    "Server: asteriskmail/1.0\r\n"
+	    "\r\n");
+	am_trace_print(pc->io);
+}
+#endif
+
+/*
+ * POST /api/sms sends one message to a list of recipients, and reports
+ * the outcome per recipient. Form bodies can be posted by any web page,
+ * so they must carry the same ID as the SMS form. JSON bodies cannot be
+ * sent across sites without the consent of the server.
+ */
+static void
+handle_httpd_api_sms(struct am_httpd_ctx *pc)
+{
+	static const char *rcpt_names[] = { "to", "phone" };
+	struct am_http_req *pr = pc->req;
+	struct am_sms_req req = {};
+	const char *ptr;
+	char **seg;
+	char *value;
+	char *data = NULL;
+	size_t len = 0;
+	FILE *mem;
+	int type = AM_HTTPD_TYPE_OTHER;
+	int first;
+	int index;
+	int nseg;
+	int error = 0;
+	int x;
+	int y;
+
+	if (pr->length < 0 && !pr->chunked) {
+		handle_httpd_api_error(pc->io, "411 Length Required", "Content-Length required");
+		return;
+	}
+	ptr = am_http_header(pr, pc->buf, "Content-Type");
+	if (ptr != NULL) {
+		if (strncasecmp(ptr, "application/json", 16) == 0)
+			type = AM_HTTPD_TYPE_JSON;
+		else if (strncasecmp(ptr, "application/x-www-form-urlencoded", 33) == 0)
+			type = AM_HTTPD_TYPE_FORM;
+	}
+	if (type == AM_HTTPD_TYPE_OTHER) {
+		handle_httpd_api_error(pc->io, "415 Unsupported Media Type",
+		    "body must be application/json or application/x-www-form-urlencoded");
+		return;
+	}
+
+	req.rcpt = am_arena_alloc(pc->arena, AM_SMS_RCPT_MAX * sizeof(req.rcpt[0]));
+	if (req.rcpt == NULL) {
+		handle_httpd_api_error(pc->io, "503 Service Unavailable", "out of memory");
+		return;
+	}
+
+	if (type == AM_HTTPD_TYPE_JSON) {
+		error = handle_httpd_sms_json(am_http_string(pc->buf, &pr->body), &req);
+	} else {
+		/* only the body counts, not the query string */
+		first = pr->nparam;
+		if (am_http_form(pr, pc->buf) != 0) {
+			handle_httpd_api_error(pc->io, "400 Bad Request", "too many fields");
+			return;
+		}
+		for (x = 0; x != 2; x++) {
+			index = first;
+			while (error == 0 && (value = am_http_param(pr, pc->buf,
+			    rcpt_names[x], &index)) != NULL)
+				error = handle_httpd_sms_rcpt(&req, value);
+		}
+		index = first;
+		req.message = am_http_param(pr, pc->buf, "message", &index);
+		index = first;
+		req.id = am_http_param(pr, pc->buf, "id", &index);
+		if (error == 0 && (req.id == NULL ||
+		    atoi(req.id) != (int)(curr_sms_id % 10000))) {
+			handle_httpd_api_error(pc->io, "403 Forbidden", "invalid id");
+			return;
+		}
+	}
+	if (error == E2BIG) {
+		handle_httpd_api_error(pc->io, "400 Bad Request", "too many recipients");
+		return;
+	} else if (error != 0) {
+		handle_httpd_api_error(pc->io, "400 Bad Request", "malformed body");
+		return;
+	} else if (req.nrcpt == 0) {
+		handle_httpd_api_error(pc->io, "400 Bad Request", "no recipients");
+		return;
+	}
+	if (req.message != NULL) {
+		while (isspace(*req.message))
+			req.message++;
+	}
+	if (req.message == NULL || *req.message == 0) {
+		handle_httpd_api_error(pc->io, "400 Bad Request", "empty message");
+		return;
+	}
+
+	for (x = 0; x != req.nrcpt; x++) {
+		if (!handle_httpd_sms_valid(req.rcpt[x].phone)) {
+			req.rcpt[x].status = AM_SMS_INVALID;
+			continue;
+		}
+		for (y = 0; y != x; y++) {
+			if (req.rcpt[y].status != AM_SMS_INVALID &&
+			    strcmp(req.rcpt[y].phone, req.rcpt[x].phone) == 0) {
+				req.rcpt[x].status = AM_SMS_DUPLICATE;
+				break;
+			}
+		}
+	}
+
+	seg = handle_httpd_sms_segments(pc->arena, req.message, &nseg);
+	if (seg == NULL) {
+		handle_httpd_api_error(pc->io, "503 Service Unavailable", "out of memory");
+		return;
+	}
+	handle_httpd_sms_copy(req.rcpt, req.nrcpt, req.message);
+	handle_httpd_sms_batch(pc->arena, req.rcpt, req.nrcpt, seg, nseg);
+	if (type == AM_HTTPD_TYPE_FORM)
+		curr_sms_id++;
+
+	mem = open_memstream(&data, &len);
+	if (mem != NULL) {
+		handle_httpd_sms_result(mem, &req, nseg);
+		if (fclose(mem) == 0) {
+			handle_httpd_send_data(pc->io, "200 OK", "application/json",
+			    data, len, pc->encoding);
+			free(data);
+			return;
+		}
+		free(data);
+	}
+	fprintf(pc->io, "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: application/json\r\n"
+	    "Server: asteriskmail/1.0\r\n"
+	    "\r\n");
+	handle_httpd_sms_result(pc->io, &req, nseg);
+}
+
+static void
+handle_httpd_search_header(FILE *io, const char *name, const char *data,
+    const char *end, const char *header)
+{
+	const char *ptr;
+	size_t len;
+
+	ptr = handle_message_header(data, end, header, &len);
+	fprintf(io, ",\"%s\":", name);
+	if (ptr != NULL)
+		handle_httpd_json_write(io, ptr, len);
+	else
+		fprintf(io, "null");
+}
+
+/* prints the matching messages of the snapshot, newest first */
+static int
+handle_httpd_search_result(FILE *io, const struct am_snapshot *ps,
+    const char *query, const uint64_t *uid, int num, int limit)
+{
+	struct am_message *pamm;
+	const char *data;
+	const char *body;
+	const char *end;
+	int count = 0;
+	int x;
+
+	fprintf(io, "{\"query\":");
+	handle_httpd_json_print(io, query);
+	fprintf(io, ",\"messages\":[");
+	for (x = num; x-- != 0; ) {
+		pamm = handle_snapshot_lookup(ps, uid[x]);
+		if (pamm == NULL)
+			continue;
+		if (count++ >= limit)
+			continue;
+		data = handle_message_data(pamm);
+		if (data == NULL)
+			return (ENOMEM);
+		end = data + handle_message_length(pamm);
+		body = memmem(data, end - data, "\r\n\r\n", 4);
+		if (body == NULL)
+			body = end;
+
+		fprintf(io, "%s{\"uid\":%ju", count > 1 ? "," : "",
+		    (uintmax_t)pamm->uid);
+		handle_httpd_search_header(io, "from", data, body, "From:");
+		handle_httpd_search_header(io, "date", data, body, "Date:");
+		handle_httpd_search_header(io, "subject", data, body, "Subject:");
+		if (body != end)
+			body += 4;
+		while (end != body && (end[-1] == '\r' || end[-1] == '\n'))
+			end--;
+		fprintf(io, ",\"text\":");
+		handle_httpd_json_write(io, body, end - body);
+		fprintf(io, "}");
+	}
+	fprintf(io, "],\"count\":%d}\n", count);
+	return (ferror(io) ? EIO : 0);
+}
+
+/* GET /search?q=...&limit=... returns the messages containing all words */
+static void
+handle_httpd_page_search(struct am_httpd_ctx *pc)
+{
+	const struct am_snapshot *ps;
+	struct am_mailbox *mbox;
+	uint64_t *uid;
+	uint64_t start;
+	const char *query;
+	const char *ptr;
+	char *data = NULL;
+	size_t len = 0;
+	FILE *mem;
+	int limit = AM_SEARCH_RESULTS;
+	int error;
+	int num;
+
+	mbox = handle_httpd_login(pc);
+	if (mbox == NULL) {
+		handle_httpd_error(pc->io, 401);
+		return;
+	}
+	query = am_http_param(pc->req, pc->buf, "q", NULL);
+	if (query == NULL || *query == 0) {
+		handle_httpd_api_error(pc->io, "400 Bad Request", "missing query");
+		return;
+	}
+	ptr = am_http_param(pc->req, pc->buf, "limit", NULL);
+	if (ptr != NULL) {
+		limit = atoi(ptr);
+		if (limit < 0) {
+			handle_httpd_api_error(pc->io, "400 Bad Request", "invalid limit");
+			return;
+		}
+	}
+
+	start = am_metrics_now();
+	ps = handle_mailbox_enter(mbox);
+	num = am_search_query(pc->arena, query, &uid);
+	mem = (num < 0) ? NULL : open_memstream(&data, &len);
+	error = ENOMEM;
+	if (mem != NULL) {
+		error = handle_httpd_search_result(mem, ps, query, uid, num, limit);
+		if (fclose(mem) != 0 && error == 0)
+			error = EIO;
+	}
+	handle_snapshot_leave();
+	am_metrics_observe(AM_HIST_SEARCH, start);
+
+	if (error == 0) {
+		handle_httpd_send_data(pc->io, "200 OK", "application/json",
+		    data, len, pc->encoding);
+	} else {
+		handle_httpd_api_error(pc->io, "503 Service Unavailable", "out of memory");
+	}
+	free(data);
+}
+
+static const struct am_httpd_route am_httpd_routes[] = {
+	{ "GET", "/", &handle_httpd_page_inbox },
+	{ "GET", "/index.html", &handle_httpd_page_inbox },
+	{ "GET", "/sms_form.html", &handle_httpd_page_form },
+	{ "GET", "/send_sms.cgi", &handle_httpd_page_send },
+	{ "GET", "/metrics", &handle_httpd_page_metrics },
+	{ "GET", "/search", &handle_httpd_page_search },
+#ifdef ASTERISKMAIL_TRACE
+	{ "GET", "/trace.json", &handle_httpd_page_trace },
+#endif
+	{ "POST", "/api/sms", &handle_httpd_api_sms },
+};
+
+void
+handle_httpd_connection(int fd)
+{
+	const struct am_httpd_route *pt;
+	struct am_httpd_ctx ctx = {};
+	struct am_http_req *pr;
+	struct am_arena arena;
+	const char *ptr;
+	FILE *io;
+	size_t x;
+	int allowed = 0;
+
+	am_metrics_count(AM_CNT_HTTPD_CONNECTIONS, 1);
+	AM_TRACE_SESSION("http");
+
+	am_arena_init(&arena);
+
+	io = handle_fdopen(fd, AM_PROTO_HTTPD, &arena);
+	if (io == NULL)
+		goto done;
+	if (am_tls_https != 0 && handle_starttls(io) != 0)
+		goto done;
+
+	pr = am_arena_alloc(&arena, sizeof(*pr));
+	if (pr == NULL)
+		goto done;
+
+	if (handle_httpd_request(io, &arena, pr, &ctx.buf) != AM_HTTP_DONE) {
+		if (pr->status != 0) {
+			handle_httpd_error(io, pr->status);
+			handle_httpd_linger(io, fd);
+		}
+		goto done;
+	}
+
+	ctx.io = io;
+	ctx.arena = &arena;
+	ctx.req = pr;
+	ctx.encoding = AM_HTTPD_IDENTITY;
+
+	ptr = am_http_header(pr, ctx.buf, "Accept-Encoding");
+	if (ptr != NULL)
+		ctx.encoding = handle_httpd_accept_encoding(ptr);
+
+	for (x = 0; x != sizeof(am_httpd_routes) / sizeof(am_httpd_routes[0]); x++) {
+		pt = am_httpd_routes + x;
+		if (!am_http_match(ctx.buf, &pr->path, pt->path))
+			continue;
+		if (am_http_match(ctx.buf, &pr->method, pt->method)) {
+			pt->handler(&ctx);
+			goto done;
+		}
+		allowed = 1;
+	}
+
+	if (allowed)
+		handle_httpd_error(io, 405);
+	else
+		handle_httpd_page_status(io, "Invalid page requested! "
+		    "<a HREF=\"index.html\">Click here to go back</a>.");
+done:
+	if (io != NULL)
+		handle_flush(io);
+	handle_close(io, fd);
+	am_arena_free(&arena);
 }
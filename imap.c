@@ -0,0 +1,1777 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * IMAP4rev1 server. There is a single mailbox, INBOX, which is the
+ * message store. Like with POP3, each session works on its own list of
+ * messages, which is only synchronized with the store where the
+ * protocol allows it, and \Deleted flags are local to the session
+ * until EXPUNGE. The \Seen flag is the delivered flag of the store.
+ *
+ * Clients can wait for new messages in IDLE. Every change of the store
+ * wakes up all idling sessions, through a pipe each, and they report
+ * the new message count right away.
+ */
+
+#include <sys/param.h>
+
+#include <ctype.h>
+#include <time.h>
+
+#include "asteriskmail.h"
+
+#define	IMAP_CAPABILITY "IMAP4rev1 IDLE LITERAL+"
+#define	IMAP_SECTION_MAX 8		/* body sections per FETCH */
+#define	IMAP_KEY_MAX 64			/* search keys per SEARCH */
+
+/* synchronization flags */
+#define	IMAP_SYNC_EXPUNGE 0x01		/* report removed messages */
+#define	IMAP_SYNC_QUIET 0x02		/* do not report new messages */
+
+struct imap_box {
+	struct am_mailbox *mbox;	/* kept for the whole session */
+	uint64_t *uid;
+	int	*bytes;
+	uint8_t	*deleted;
+	uint64_t last;			/* largest unique id seen */
+	int	count;
+	int	max;
+	int	readonly;
+};
+
+enum {
+	IMAP_SECTION_ALL,
+	IMAP_SECTION_HEADER,
+	IMAP_SECTION_TEXT,
+	IMAP_SECTION_FIELDS,
+	IMAP_SECTION_FIELDS_NOT,
+	IMAP_SECTION_MIME,
+};
+
+#define	IMAP_FETCH_UID 0x0001
+#define	IMAP_FETCH_FLAGS 0x0002
+#define	IMAP_FETCH_SIZE 0x0004
+#define	IMAP_FETCH_DATE 0x0008
+#define	IMAP_FETCH_ENVELOPE 0x0010
+#define	IMAP_FETCH_BODY 0x0020
+#define	IMAP_FETCH_STRUCTURE 0x0040
+
+struct imap_section {
+	const char *label;		/* response item name */
+	const char *spec;		/* section text, echoed back */
+	const char *fields;		/* header field list */
+	uint32_t start;
+	uint32_t count;
+	int	type;
+	int	peek;
+	int	partial;
+};
+
+struct imap_fetch {
+	struct imap_section section[IMAP_SECTION_MAX];
+	int	nsection;
+	int	items;
+};
+
+enum {
+	IMAP_KEY_AND,
+	IMAP_KEY_ALL,
+	IMAP_KEY_NONE,
+	IMAP_KEY_SEEN,
+	IMAP_KEY_UNSEEN,
+	IMAP_KEY_DELETED,
+	IMAP_KEY_UNDELETED,
+	IMAP_KEY_NOT,
+	IMAP_KEY_OR,
+	IMAP_KEY_SEQ,
+	IMAP_KEY_UID,
+	IMAP_KEY_LARGER,
+	IMAP_KEY_SMALLER,
+	IMAP_KEY_HEADER,
+	IMAP_KEY_BODY,
+	IMAP_KEY_TEXT,
+	IMAP_KEY_BEFORE,
+	IMAP_KEY_ON,
+	IMAP_KEY_SINCE,
+};
+
+struct imap_key {
+	struct imap_key *next;
+	struct imap_key *a;
+	struct imap_key *b;
+	const char *field;
+	const char *arg;
+	uint64_t num;
+	int	type;
+};
+
+struct imap_search {
+	struct imap_key key[IMAP_KEY_MAX];
+	int	nkey;
+};
+
+struct imap_waiter {
+	TAILQ_ENTRY(imap_waiter) entry;
+	int	fd[2];
+};
+
+static TAILQ_HEAD(, imap_waiter) imap_waiters = TAILQ_HEAD_INITIALIZER(imap_waiters);
+static pthread_mutex_t imap_waiter_mtx = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic int imap_nwaiters;
+static pthread_once_t imap_once = PTHREAD_ONCE_INIT;
+static time_t imap_start;
+
+static const char *imap_month[12] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+};
+
+/*
+ * Wake up all sessions in IDLE. Called with the store locked, each
+ * time a new view of the store is published.
+ */
+void
+am_imap_notify(void)
+{
+	struct imap_waiter *pw;
+
+	if (atomic_load_explicit(&imap_nwaiters, memory_order_relaxed) == 0)
+		return;
+
+	pthread_mutex_lock(&imap_waiter_mtx);
+	TAILQ_FOREACH(pw, &imap_waiters, entry)
+		write(pw->fd[1], "", 1);
+	pthread_mutex_unlock(&imap_waiter_mtx);
+}
+
+static void
+imap_init(void)
+{
+	/* messages have no arrival time, use the time the server started */
+	imap_start = time(NULL);
+}
+
+/* message size, without the zero terminator */
+static int
+imap_size(const struct am_message *pam)
+{
+	return (handle_message_length(pam));
+}
+
+/* split a message into header, including the empty line, and text */
+static size_t
+imap_header_size(const struct am_message *pam)
+{
+	const char *data = handle_message_data(pam);
+	size_t len = imap_size(pam);
+	size_t x;
+
+	for (x = 0; x + 4 <= len; x++) {
+		if (data[x] == '\r' && memcmp(data + x, "\r\n\r\n", 4) == 0)
+			return (x + 4);
+	}
+	return (len);
+}
+
+/* returns the value of a header field, unfolded lines included */
+static const char *
+imap_header_find(const struct am_message *pam, const char *name, size_t *plen)
+{
+	const char *data = handle_message_data(pam);
+	size_t hlen = imap_header_size(pam);
+	size_t nlen = strlen(name);
+	size_t x = 0;
+	size_t y;
+
+	while (x < hlen) {
+		/* find the end of this field */
+		for (y = x; y < hlen; y++) {
+			if (data[y] == '\n' && (y + 1 >= hlen ||
+			    (data[y + 1] != ' ' && data[y + 1] != '\t')))
+				break;
+		}
+		if (y - x > nlen && data[x + nlen] == ':' &&
+		    strncasecmp(data + x, name, nlen) == 0) {
+			x += nlen + 1;
+			while (x < y && (data[x] == ' ' || data[x] == '\t'))
+				x++;
+			while (y > x && (data[y] == '\n' || data[y] == '\r'))
+				y--;
+			*plen = (y >= x && data[y] != '\n' && data[y] != '\r') ? y - x + 1 : 0;
+			return (data + x);
+		}
+		x = y + 1;
+	}
+	return (NULL);
+}
+
+/* case insensitive search for a string in a buffer */
+static int
+imap_contains(const char *data, size_t len, const char *str)
+{
+	size_t slen = strlen(str);
+	size_t x;
+
+	if (slen == 0)
+		return (1);
+	for (x = 0; x + slen <= len; x++) {
+		if (tolower((uint8_t)data[x]) == tolower((uint8_t)str[0]) &&
+		    strncasecmp(data + x, str, slen) == 0)
+			return (1);
+	}
+	return (0);
+}
+
+/* returns non-zero if a header field name is in a parenthesized list */
+static int
+imap_field_match(const char *list, const char *name, size_t len)
+{
+	const char *p = list;
+	size_t x;
+
+	while (*p != 0) {
+		while (*p == '(' || *p == ' ' || *p == ')')
+			p++;
+		for (x = 0; p[x] != 0 && p[x] != ' ' && p[x] != ')'; x++)
+			;
+		if (x == len && strncasecmp(p, name, len) == 0)
+			return (1);
+		p += x;
+	}
+	return (0);
+}
+
+/*
+ * Split off the next argument, which is an atom, a quoted string or a
+ * parenthesized list. Atoms may contain bracketed lists, like
+ * BODY[HEADER.FIELDS (FROM)]. Quoted strings are unescaped in place.
+ */
+static char *
+imap_arg(char **pp)
+{
+	char *p = *pp;
+	char *start;
+	char *out;
+	int depth;
+
+	while (*p == ' ')
+		p++;
+	if (*p == 0)
+		return (NULL);
+
+	if (*p == '"') {
+		start = out = ++p;
+		while (*p != 0 && *p != '"') {
+			if (*p == '\\' && p[1] != 0)
+				p++;
+			*out++ = *p++;
+		}
+		if (*p == '"')
+			p++;
+		*out = 0;
+	} else {
+		start = p;
+		depth = 0;
+		while (*p != 0 && (depth != 0 || *p != ' ')) {
+			if (*p == '(' || *p == '[')
+				depth++;
+			else if ((*p == ')' || *p == ']') && depth != 0)
+				depth--;
+			p++;
+		}
+		if (*p == ' ')
+			*p++ = 0;
+	}
+	*pp = p;
+	return (start);
+}
+
+/* strip the parentheses of a list, in place */
+static char *
+imap_list(char *arg)
+{
+	size_t len = strlen(arg);
+
+	if (len >= 2 && arg[0] == '(' && arg[len - 1] == ')') {
+		arg[len - 1] = 0;
+		return (arg + 1);
+	}
+	return (arg);
+}
+
+static int
+imap_set_valid(const char *set)
+{
+	if (set == NULL || *set == 0)
+		return (0);
+	for (; *set != 0; set++) {
+		if (!isdigit((uint8_t)*set) && *set != '*' &&
+		    *set != ':' && *set != ',')
+			return (0);
+	}
+	return (1);
+}
+
+static uint64_t
+imap_set_value(const char **pp, uint64_t star)
+{
+	const char *p = *pp;
+	uint64_t value;
+
+	if (*p == '*') {
+		*pp = p + 1;
+		return (star);
+	}
+	for (value = 0; isdigit((uint8_t)*p); p++)
+		value = value * 10 + (*p - '0');
+	*pp = p;
+	return (value);
+}
+
+/* returns non-zero if "value" is in the sequence set */
+static int
+imap_set_match(const char *set, uint64_t value, uint64_t star)
+{
+	uint64_t lo;
+	uint64_t hi;
+	uint64_t temp;
+
+	while (*set != 0) {
+		lo = hi = imap_set_value(&set, star);
+		if (*set == ':') {
+			set++;
+			hi = imap_set_value(&set, star);
+		}
+		if (lo > hi) {
+			temp = lo;
+			lo = hi;
+			hi = temp;
+		}
+		if (value >= lo && value <= hi)
+			return (1);
+		if (*set != ',')
+			break;
+		set++;
+	}
+	return (0);
+}
+
+static uint64_t
+imap_key(const struct imap_box *pb, int x, int uid)
+{
+	return (uid ? pb->uid[x] : (uint64_t)(x + 1));
+}
+
+static uint64_t
+imap_star(const struct imap_box *pb, int uid)
+{
+	if (pb->count == 0)
+		return (0);
+	return (uid ? pb->uid[pb->count - 1] : (uint64_t)pb->count);
+}
+
+static int
+imap_box_append(struct imap_box *pb, uint64_t uid, int bytes)
+{
+	void *ptr;
+	int max;
+
+	if (pb->count == pb->max) {
+		max = pb->max ? 2 * pb->max : AM_INDEX_MIN;
+		ptr = realloc(pb->uid, max * sizeof(pb->uid[0]));
+		if (ptr == NULL)
+			return (1);
+		pb->uid = ptr;
+		ptr = realloc(pb->bytes, max * sizeof(pb->bytes[0]));
+		if (ptr == NULL)
+			return (1);
+		pb->bytes = ptr;
+		ptr = realloc(pb->deleted, max * sizeof(pb->deleted[0]));
+		if (ptr == NULL)
+			return (1);
+		pb->deleted = ptr;
+		pb->max = max;
+	}
+	pb->uid[pb->count] = uid;
+	pb->bytes[pb->count] = bytes;
+	pb->deleted[pb->count] = 0;
+	pb->count++;
+	pb->last = uid;
+	return (0);
+}
+
+static void
+imap_box_remove(struct imap_box *pb, int x)
+{
+	int n = pb->count - x - 1;
+
+	memmove(pb->uid + x, pb->uid + x + 1, n * sizeof(pb->uid[0]));
+	memmove(pb->bytes + x, pb->bytes + x + 1, n * sizeof(pb->bytes[0]));
+	memmove(pb->deleted + x, pb->deleted + x + 1, n * sizeof(pb->deleted[0]));
+	pb->count--;
+}
+
+static void
+imap_box_free(struct imap_box *pb)
+{
+	struct am_mailbox *mbox = pb->mbox;
+
+	free(pb->uid);
+	free(pb->bytes);
+	free(pb->deleted);
+	memset(pb, 0, sizeof(*pb));
+	pb->mbox = mbox;
+}
+
+/*
+ * Bring the session view up to date with the message store, and
+ * report the changes.
+ */
+static int
+imap_sync(FILE *io, struct imap_box *pb, int flags)
+{
+	const struct am_snapshot *ps;
+	int count = pb->count;
+	int x;
+	int y;
+
+	ps = handle_mailbox_enter(pb->mbox);
+
+	/* both lists are ordered by unique id */
+	if (flags & IMAP_SYNC_EXPUNGE) {
+		for (x = y = 0; x != pb->count;) {
+			while (y != ps->count && ps->msg[y]->uid < pb->uid[x])
+				y++;
+			if (y != ps->count && ps->msg[y]->uid == pb->uid[x]) {
+				x++;
+				continue;
+			}
+			imap_box_remove(pb, x);
+			fprintf(io, "* %d EXPUNGE\r\n", x + 1);
+		}
+		count = pb->count;
+	}
+
+	/* messages are always appended */
+	for (x = ps->count; x != 0 && ps->msg[x - 1]->uid > pb->last; x--)
+		;
+	for (; x != ps->count; x++) {
+		if (imap_box_append(pb, ps->msg[x]->uid, imap_size(ps->msg[x])) != 0) {
+			handle_snapshot_leave();
+			return (1);
+		}
+	}
+	handle_snapshot_leave();
+
+	if (pb->count != count && (flags & IMAP_SYNC_QUIET) == 0)
+		fprintf(io, "* %d EXISTS\r\n", pb->count);
+	return (0);
+}
+
+/* write a string, quoted if possible */
+static void
+imap_string(FILE *io, const char *str, size_t len)
+{
+	size_t x;
+
+	if (str == NULL) {
+		fprintf(io, "NIL");
+		return;
+	}
+	for (x = 0; x != len; x++) {
+		if ((uint8_t)str[x] >= 0x80 || str[x] == '\r' ||
+		    str[x] == '\n' || str[x] == 0)
+			break;
+	}
+	if (x != len) {
+		fprintf(io, "{%zu}\r\n", len);
+		fwrite(str, 1, len, io);
+		return;
+	}
+	putc('"', io);
+	for (x = 0; x != len; x++) {
+		if (str[x] == '"' || str[x] == '\\')
+			putc('\\', io);
+		putc(str[x], io);
+	}
+	putc('"', io);
+}
+
+static void
+imap_date(FILE *io)
+{
+	struct tm tm;
+
+	gmtime_r(&imap_start, &tm);
+	fprintf(io, "\"%02d-%s-%04d %02d:%02d:%02d +0000\"", tm.tm_mday,
+	    imap_month[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour,
+	    tm.tm_min, tm.tm_sec);
+}
+
+/* write an address list with a single address */
+static void
+imap_address(FILE *io, const char *str, size_t len)
+{
+	const char *addr = str;
+	const char *name = NULL;
+	size_t alen = len;
+	size_t nlen = 0;
+	size_t x;
+
+	if (str == NULL) {
+		fprintf(io, "NIL");
+		return;
+	}
+	for (x = 0; x != len; x++) {
+		if (str[x] == '<')
+			break;
+	}
+	if (x != len) {
+		name = str;
+		nlen = x;
+		addr = str + x + 1;
+		for (alen = 0; addr + alen != str + len && addr[alen] != '>'; alen++)
+			;
+		while (nlen != 0 && (name[nlen - 1] == ' ' || name[nlen - 1] == '"'))
+			nlen--;
+		while (nlen != 0 && (name[0] == ' ' || name[0] == '"')) {
+			name++;
+			nlen--;
+		}
+		if (nlen == 0)
+			name = NULL;
+	}
+	for (x = 0; x != alen; x++) {
+		if (addr[x] == '@')
+			break;
+	}
+	fprintf(io, "((");
+	imap_string(io, name, nlen);
+	fprintf(io, " NIL ");
+	imap_string(io, addr, x);
+	putc(' ', io);
+	if (x != alen)
+		imap_string(io, addr + x + 1, alen - x - 1);
+	else
+		imap_string(io, hostname, strlen(hostname));
+	fprintf(io, "))");
+}
+
+static void
+imap_envelope(FILE *io, const struct am_message *pam)
+{
+	static const char *field[] = { "Date", "Subject" };
+	const char *from;
+	const char *str;
+	size_t flen = 0;
+	size_t len = 0;
+	int x;
+
+	fprintf(io, "ENVELOPE (");
+	for (x = 0; x != 2; x++) {
+		str = imap_header_find(pam, field[x], &len);
+		imap_string(io, str, len);
+		putc(' ', io);
+	}
+	/* from, sender and reply-to */
+	from = imap_header_find(pam, "From", &flen);
+	for (x = 0; x != 3; x++) {
+		imap_address(io, from, flen);
+		putc(' ', io);
+	}
+	str = imap_header_find(pam, "To", &len);
+	imap_address(io, str, len);
+	fprintf(io, " NIL NIL NIL ");
+	str = imap_header_find(pam, "Message-ID", &len);
+	imap_string(io, str, len);
+	putc(')', io);
+}
+
+/* single part body structure, from the Content-Type of the message */
+static void
+imap_structure(FILE *io, const struct am_message *pam, int extended)
+{
+	const char *data = handle_message_data(pam);
+	const char *type;
+	const char *cs;
+	const char *enc;
+	size_t hlen = imap_header_size(pam);
+	size_t size = imap_size(pam);
+	size_t tlen = 0;
+	size_t elen = 0;
+	size_t slen;
+	size_t clen;
+	size_t x;
+	int lines = 0;
+
+	type = imap_header_find(pam, "Content-Type", &tlen);
+	if (type == NULL || strncasecmp(type, "multipart/", 10) == 0) {
+		type = "text/plain";
+		tlen = strlen(type);
+	}
+	for (slen = 0; slen != tlen && type[slen] != '/'; slen++)
+		;
+	for (clen = slen; clen != tlen && type[clen] != ';' && type[clen] != ' '; clen++)
+		;
+
+	fprintf(io, "(");
+	imap_string(io, type, slen);
+	putc(' ', io);
+	if (slen != tlen)
+		imap_string(io, type + slen + 1, clen - slen - 1);
+	else
+		imap_string(io, "plain", 5);
+
+	/* the charset parameter */
+	for (cs = type; cs != type + tlen; cs++) {
+		if ((size_t)(type + tlen - cs) > 8 && strncasecmp(cs, "charset=", 8) == 0)
+			break;
+	}
+	if (cs != type + tlen) {
+		cs += 8;
+		if (*cs == '"')
+			cs++;
+		for (x = 0; cs + x != type + tlen && cs[x] != ';' &&
+		    cs[x] != ' ' && cs[x] != '"'; x++)
+			;
+		fprintf(io, " (\"CHARSET\" ");
+		imap_string(io, cs, x);
+		fprintf(io, ")");
+	} else {
+		fprintf(io, " NIL");
+	}
+
+	enc = imap_header_find(pam, "Content-Transfer-Encoding", &elen);
+	fprintf(io, " NIL NIL ");
+	if (enc != NULL)
+		imap_string(io, enc, elen);
+	else
+		imap_string(io, "7BIT", 4);
+	fprintf(io, " %zu", size - hlen);
+
+	if (slen == 4 && strncasecmp(type, "text", 4) == 0) {
+		for (x = hlen; x != size; x++)
+			lines += (data[x] == '\n');
+		if (size != hlen && data[size - 1] != '\n')
+			lines++;
+		fprintf(io, " %d", lines);
+	}
+	if (extended)
+		fprintf(io, " NIL NIL NIL");
+	fprintf(io, ")");
+}
+
+static void
+imap_flags(FILE *io, const struct imap_box *pb, int x, const struct am_message *pam)
+{
+	const char *sep = "";
+
+	fprintf(io, "FLAGS (");
+	if (pam->flags & AM_MSG_DELIVERED) {
+		fprintf(io, "\\Seen");
+		sep = " ";
+	}
+	if (pb->deleted[x])
+		fprintf(io, "%s\\Deleted", sep);
+	fprintf(io, ")");
+}
+
+/* parse one BODY[...] or RFC822 item */
+static int
+imap_fetch_section(struct imap_fetch *pf, char *item)
+{
+	struct imap_section *psec;
+	char *spec;
+	char *end;
+
+	if (pf->nsection == IMAP_SECTION_MAX)
+		return (1);
+	psec = &pf->section[pf->nsection];
+	memset(psec, 0, sizeof(*psec));
+
+	if (strcasecmp(item, "RFC822") == 0) {
+		psec->label = "RFC822";
+		psec->type = IMAP_SECTION_ALL;
+	} else if (strcasecmp(item, "RFC822.HEADER") == 0) {
+		psec->label = "RFC822.HEADER";
+		psec->type = IMAP_SECTION_HEADER;
+		psec->peek = 1;
+	} else if (strcasecmp(item, "RFC822.TEXT") == 0) {
+		psec->label = "RFC822.TEXT";
+		psec->type = IMAP_SECTION_TEXT;
+	} else {
+		if (strncasecmp(item, "BODY.PEEK[", 10) == 0) {
+			psec->peek = 1;
+			spec = item + 10;
+		} else if (strncasecmp(item, "BODY[", 5) == 0) {
+			spec = item + 5;
+		} else {
+			return (1);
+		}
+		end = strchr(spec, ']');
+		if (end == NULL)
+			return (1);
+		*end++ = 0;
+		psec->label = "BODY";
+		psec->spec = spec;
+
+		if (*spec == 0) {
+			psec->type = IMAP_SECTION_ALL;
+		} else if (strcasecmp(spec, "HEADER") == 0) {
+			psec->type = IMAP_SECTION_HEADER;
+		} else if (strcasecmp(spec, "TEXT") == 0 || strcmp(spec, "1") == 0) {
+			psec->type = IMAP_SECTION_TEXT;
+		} else if (strncasecmp(spec, "HEADER.FIELDS.NOT ", 18) == 0) {
+			psec->type = IMAP_SECTION_FIELDS_NOT;
+			psec->fields = spec + 18;
+		} else if (strncasecmp(spec, "HEADER.FIELDS ", 14) == 0) {
+			psec->type = IMAP_SECTION_FIELDS;
+			psec->fields = spec + 14;
+		} else if (strcasecmp(spec, "MIME") == 0 || strcasecmp(spec, "1.MIME") == 0) {
+			psec->type = IMAP_SECTION_MIME;
+		} else {
+			return (1);
+		}
+
+		/* partial fetch, <start.count> */
+		if (*end == '<') {
+			psec->start = strtoul(end + 1, &end, 10);
+			if (*end != '.')
+				return (1);
+			psec->count = strtoul(end + 1, &end, 10);
+			if (*end != '>')
+				return (1);
+			psec->partial = 1;
+			end++;
+		}
+		if (*end != 0)
+			return (1);
+	}
+	pf->nsection++;
+	return (0);
+}
+
+static int
+imap_fetch_parse(struct imap_fetch *pf, char *arg)
+{
+	char *item;
+
+	memset(pf, 0, sizeof(*pf));
+	arg = imap_list(arg);
+
+	while ((item = imap_arg(&arg)) != NULL) {
+		if (strcasecmp(item, "UID") == 0)
+			pf->items |= IMAP_FETCH_UID;
+		else if (strcasecmp(item, "FLAGS") == 0)
+			pf->items |= IMAP_FETCH_FLAGS;
+		else if (strcasecmp(item, "RFC822.SIZE") == 0)
+			pf->items |= IMAP_FETCH_SIZE;
+		else if (strcasecmp(item, "INTERNALDATE") == 0)
+			pf->items |= IMAP_FETCH_DATE;
+		else if (strcasecmp(item, "ENVELOPE") == 0)
+			pf->items |= IMAP_FETCH_ENVELOPE;
+		else if (strcasecmp(item, "BODY") == 0)
+			pf->items |= IMAP_FETCH_BODY;
+		else if (strcasecmp(item, "BODYSTRUCTURE") == 0)
+			pf->items |= IMAP_FETCH_STRUCTURE;
+		else if (strcasecmp(item, "FAST") == 0)
+			pf->items |= IMAP_FETCH_FLAGS | IMAP_FETCH_DATE | IMAP_FETCH_SIZE;
+		else if (strcasecmp(item, "ALL") == 0)
+			pf->items |= IMAP_FETCH_FLAGS | IMAP_FETCH_DATE |
+			    IMAP_FETCH_SIZE | IMAP_FETCH_ENVELOPE;
+		else if (strcasecmp(item, "FULL") == 0)
+			pf->items |= IMAP_FETCH_FLAGS | IMAP_FETCH_DATE |
+			    IMAP_FETCH_SIZE | IMAP_FETCH_ENVELOPE | IMAP_FETCH_BODY;
+		else if (imap_fetch_section(pf, item) != 0)
+			return (1);
+	}
+	return (pf->items == 0 && pf->nsection == 0);
+}
+
+/* write the header fields selected by a section */
+static void
+imap_fetch_fields(FILE *io, const struct imap_section *psec,
+    const struct am_message *pam, char *buf)
+{
+	const char *data = handle_message_data(pam);
+	size_t hlen = imap_header_size(pam);
+	size_t len = 0;
+	size_t x = 0;
+	size_t y;
+	size_t n;
+	int match;
+
+	while (x < hlen) {
+		for (y = x; y < hlen; y++) {
+			if (data[y] == '\n' && (y + 1 >= hlen ||
+			    (data[y + 1] != ' ' && data[y + 1] != '\t')))
+				break;
+		}
+		if (y < hlen)
+			y++;
+		for (n = x; n != y && data[n] != ':'; n++)
+			;
+		/* the empty line ending the header is not a field */
+		if (n != y && n != x) {
+			match = imap_field_match(psec->fields, data + x, n - x);
+			if (match == (psec->type == IMAP_SECTION_FIELDS)) {
+				memcpy(buf + len, data + x, y - x);
+				len += y - x;
+			}
+		}
+		x = y;
+	}
+	memcpy(buf + len, "\r\n", 2);
+	len += 2;
+
+	fprintf(io, "{%zu}\r\n", len);
+	fwrite(buf, 1, len, io);
+}
+
+static void
+imap_fetch_section_write(FILE *io, const struct imap_section *psec,
+    const struct am_message *pam)
+{
+	const char *data = handle_message_data(pam);
+	size_t hlen = imap_header_size(pam);
+	size_t size = imap_size(pam);
+	size_t off;
+	size_t len;
+	char *buf;
+
+	if (psec->spec != NULL)
+		fprintf(io, "%s[%s]", psec->label, psec->spec);
+	else
+		fprintf(io, "%s", psec->label);
+	if (psec->partial)
+		fprintf(io, "<%u>", psec->start);
+	putc(' ', io);
+
+	switch (psec->type) {
+	case IMAP_SECTION_HEADER:
+		off = 0;
+		len = hlen;
+		break;
+	case IMAP_SECTION_TEXT:
+		off = hlen;
+		len = size - hlen;
+		break;
+	case IMAP_SECTION_FIELDS:
+	case IMAP_SECTION_FIELDS_NOT:
+		buf = malloc(hlen + 2);
+		if (buf == NULL) {
+			fprintf(io, "NIL");
+			return;
+		}
+		imap_fetch_fields(io, psec, pam, buf);
+		free(buf);
+		return;
+	case IMAP_SECTION_MIME:
+		off = 0;
+		len = 0;
+		break;
+	default:
+		off = 0;
+		len = size;
+		break;
+	}
+	if (psec->partial) {
+		if (psec->start >= len) {
+			off = len = 0;
+		} else {
+			off += psec->start;
+			len -= psec->start;
+			if (len > psec->count)
+				len = psec->count;
+		}
+	}
+	fprintf(io, "{%zu}\r\n", len);
+	fwrite(data + off, 1, len, io);
+}
+
+static void
+imap_fetch(FILE *io, const char *tag, struct imap_box *pb, char *args, int uid)
+{
+	const struct am_snapshot *ps;
+	struct imap_fetch fetch;
+	struct am_message *pam;
+	uint64_t star;
+	const char *sep;
+	char *set;
+	int failed = 0;
+	int items;
+	int seen;
+	int x;
+	int y;
+
+	set = imap_arg(&args);
+	while (*args == ' ')
+		args++;
+	if (!imap_set_valid(set) || imap_fetch_parse(&fetch, args) != 0) {
+		fprintf(io, "%s BAD Invalid FETCH arguments\r\n", tag);
+		return;
+	}
+	star = imap_star(pb, uid);
+
+	ps = handle_mailbox_enter(pb->mbox);
+	/* stop when the client went away */
+	for (x = 0; x != pb->count && !ferror(io); x++) {
+		if (!imap_set_match(set, imap_key(pb, x, uid), star))
+			continue;
+		pam = handle_snapshot_lookup(ps, pb->uid[x]);
+		if (pam == NULL)
+			continue;	/* removed by another session */
+
+		/* the data is read once, and kept until the snapshot is left */
+		if (((fetch.items & (IMAP_FETCH_ENVELOPE | IMAP_FETCH_BODY |
+		    IMAP_FETCH_STRUCTURE)) || fetch.nsection != 0) &&
+		    handle_message_data(pam) == NULL) {
+			failed = 1;
+			continue;
+		}
+
+		items = fetch.items;
+		if (uid)
+			items |= IMAP_FETCH_UID;
+
+		/* reading the body sets \Seen, and reports it */
+		seen = 0;
+		for (y = 0; y != fetch.nsection; y++)
+			seen |= !fetch.section[y].peek;
+		if (seen && !pb->readonly &&
+		    (atomic_fetch_or(&pam->flags, AM_MSG_DELIVERED) & AM_MSG_DELIVERED) == 0) {
+			items |= IMAP_FETCH_FLAGS;
+			am_metrics_count(AM_CNT_MESSAGES_RETRIEVED, 1);
+			atomic_fetch_add_explicit(&pb->mbox->retrieved, 1,
+			    memory_order_relaxed);
+		}
+
+		fprintf(io, "* %d FETCH (", x + 1);
+		sep = "";
+		if (items & IMAP_FETCH_UID) {
+			fprintf(io, "%sUID %ju", sep, (uintmax_t)pb->uid[x]);
+			sep = " ";
+		}
+		if (items & IMAP_FETCH_FLAGS) {
+			fprintf(io, "%s", sep);
+			imap_flags(io, pb, x, pam);
+			sep = " ";
+		}
+		if (items & IMAP_FETCH_SIZE) {
+			fprintf(io, "%sRFC822.SIZE %d", sep, imap_size(pam));
+			sep = " ";
+		}
+		if (items & IMAP_FETCH_DATE) {
+			fprintf(io, "%sINTERNALDATE ", sep);
+			imap_date(io);
+			sep = " ";
+		}
+		if (items & IMAP_FETCH_ENVELOPE) {
+			fprintf(io, "%s", sep);
+			imap_envelope(io, pam);
+			sep = " ";
+		}
+		if (items & IMAP_FETCH_BODY) {
+			fprintf(io, "%sBODY ", sep);
+			imap_structure(io, pam, 0);
+			sep = " ";
+		}
+		if (items & IMAP_FETCH_STRUCTURE) {
+			fprintf(io, "%sBODYSTRUCTURE ", sep);
+			imap_structure(io, pam, 1);
+			sep = " ";
+		}
+		for (y = 0; y != fetch.nsection; y++) {
+			fprintf(io, "%s", sep);
+			imap_fetch_section_write(io, &fetch.section[y], pam);
+			sep = " ";
+		}
+		fprintf(io, ")\r\n");
+	}
+	handle_snapshot_leave();
+
+	imap_sync(io, pb, 0);
+	if (failed)
+		fprintf(io, "%s NO Some messages could not be read\r\n", tag);
+	else
+		fprintf(io, "%s OK FETCH completed\r\n", tag);
+}
+
+static time_t
+imap_parse_date(const char *str)
+{
+	struct tm tm;
+	char mon[4];
+	int x;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(str, "%d-%3s-%d", &tm.tm_mday, mon, &tm.tm_year) != 3)
+		return (-1);
+	for (x = 0; x != 12; x++) {
+		if (strcasecmp(mon, imap_month[x]) == 0)
+			break;
+	}
+	if (x == 12)
+		return (-1);
+	tm.tm_mon = x;
+	tm.tm_year -= 1900;
+	return (timegm(&tm));
+}
+
+static struct imap_key *
+imap_search_parse(struct imap_search *psr, char **pp)
+{
+	static const struct {
+		const char *name;
+		int	type;
+	} simple[] = {
+		{ "ALL", IMAP_KEY_ALL },
+		{ "SEEN", IMAP_KEY_SEEN },
+		{ "UNSEEN", IMAP_KEY_UNSEEN },
+		{ "NEW", IMAP_KEY_UNSEEN },
+		{ "OLD", IMAP_KEY_ALL },
+		{ "DELETED", IMAP_KEY_DELETED },
+		{ "UNDELETED", IMAP_KEY_UNDELETED },
+		{ "RECENT", IMAP_KEY_NONE },
+		{ "ANSWERED", IMAP_KEY_NONE },
+		{ "UNANSWERED", IMAP_KEY_ALL },
+		{ "FLAGGED", IMAP_KEY_NONE },
+		{ "UNFLAGGED", IMAP_KEY_ALL },
+		{ "DRAFT", IMAP_KEY_NONE },
+		{ "UNDRAFT", IMAP_KEY_ALL },
+	};
+	static const struct {
+		const char *name;
+		const char *field;
+		int	type;
+	} string[] = {
+		{ "FROM", "From", IMAP_KEY_HEADER },
+		{ "TO", "To", IMAP_KEY_HEADER },
+		{ "CC", "Cc", IMAP_KEY_HEADER },
+		{ "BCC", "Bcc", IMAP_KEY_HEADER },
+		{ "SUBJECT", "Subject", IMAP_KEY_HEADER },
+		{ "BODY", NULL, IMAP_KEY_BODY },
+		{ "TEXT", NULL, IMAP_KEY_TEXT },
+		{ "BEFORE", NULL, IMAP_KEY_BEFORE },
+		{ "ON", NULL, IMAP_KEY_ON },
+		{ "SINCE", NULL, IMAP_KEY_SINCE },
+		{ "SENTBEFORE", NULL, IMAP_KEY_BEFORE },
+		{ "SENTON", NULL, IMAP_KEY_ON },
+		{ "SENTSINCE", NULL, IMAP_KEY_SINCE },
+	};
+	struct imap_key *pk;
+	struct imap_key **ppk;
+	char *tok;
+	char *sub;
+	size_t x;
+
+	tok = imap_arg(pp);
+	if (tok == NULL || psr->nkey == IMAP_KEY_MAX)
+		return (NULL);
+	pk = &psr->key[psr->nkey++];
+	memset(pk, 0, sizeof(*pk));
+
+	if (tok[0] == '(') {
+		pk->type = IMAP_KEY_AND;
+		sub = imap_list(tok);
+		ppk = &pk->a;
+		while (*sub != 0) {
+			*ppk = imap_search_parse(psr, &sub);
+			if (*ppk == NULL)
+				return (NULL);
+			ppk = &(*ppk)->next;
+		}
+		return (pk);
+	}
+	for (x = 0; x != nitems(simple); x++) {
+		if (strcasecmp(tok, simple[x].name) == 0) {
+			pk->type = simple[x].type;
+			return (pk);
+		}
+	}
+	for (x = 0; x != nitems(string); x++) {
+		if (strcasecmp(tok, string[x].name) == 0) {
+			pk->type = string[x].type;
+			pk->field = string[x].field;
+			pk->arg = imap_arg(pp);
+			if (pk->arg == NULL)
+				return (NULL);
+			if (pk->type >= IMAP_KEY_BEFORE) {
+				pk->num = imap_parse_date(pk->arg);
+				if (pk->num == (uint64_t)-1)
+					return (NULL);
+			}
+			return (pk);
+		}
+	}
+	if (strcasecmp(tok, "NOT") == 0) {
+		pk->type = IMAP_KEY_NOT;
+		pk->a = imap_search_parse(psr, pp);
+		return (pk->a != NULL ? pk : NULL);
+	} else if (strcasecmp(tok, "OR") == 0) {
+		pk->type = IMAP_KEY_OR;
+		pk->a = imap_search_parse(psr, pp);
+		pk->b = imap_search_parse(psr, pp);
+		return (pk->a != NULL && pk->b != NULL ? pk : NULL);
+	} else if (strcasecmp(tok, "HEADER") == 0) {
+		pk->type = IMAP_KEY_HEADER;
+		pk->field = imap_arg(pp);
+		pk->arg = imap_arg(pp);
+		return (pk->field != NULL && pk->arg != NULL ? pk : NULL);
+	} else if (strcasecmp(tok, "LARGER") == 0 || strcasecmp(tok, "SMALLER") == 0) {
+		pk->type = (toupper((uint8_t)tok[0]) == 'L') ? IMAP_KEY_LARGER : IMAP_KEY_SMALLER;
+		pk->arg = imap_arg(pp);
+		if (pk->arg == NULL)
+			return (NULL);
+		pk->num = strtoull(pk->arg, NULL, 10);
+		return (pk);
+	} else if (strcasecmp(tok, "UID") == 0) {
+		pk->type = IMAP_KEY_UID;
+		pk->arg = imap_arg(pp);
+		return (imap_set_valid(pk->arg) ? pk : NULL);
+	} else if (strcasecmp(tok, "KEYWORD") == 0 || strcasecmp(tok, "UNKEYWORD") == 0) {
+		pk->type = (toupper((uint8_t)tok[0]) == 'K') ? IMAP_KEY_NONE : IMAP_KEY_ALL;
+		return (imap_arg(pp) != NULL ? pk : NULL);
+	} else if (imap_set_valid(tok)) {
+		pk->type = IMAP_KEY_SEQ;
+		pk->arg = tok;
+		return (pk);
+	}
+	return (NULL);
+}
+
+static int
+imap_search_match(const struct imap_key *pk, const struct imap_box *pb, int x,
+    const struct am_message *pam)
+{
+	const struct imap_key *pc;
+	const char *str;
+	size_t len;
+	time_t day;
+
+	switch (pk->type) {
+	case IMAP_KEY_AND:
+		for (pc = pk->a; pc != NULL; pc = pc->next) {
+			if (!imap_search_match(pc, pb, x, pam))
+				return (0);
+		}
+		return (1);
+	case IMAP_KEY_ALL:
+		return (1);
+	case IMAP_KEY_SEEN:
+		return ((pam->flags & AM_MSG_DELIVERED) != 0);
+	case IMAP_KEY_UNSEEN:
+		return ((pam->flags & AM_MSG_DELIVERED) == 0);
+	case IMAP_KEY_DELETED:
+		return (pb->deleted[x] != 0);
+	case IMAP_KEY_UNDELETED:
+		return (pb->deleted[x] == 0);
+	case IMAP_KEY_NOT:
+		return (!imap_search_match(pk->a, pb, x, pam));
+	case IMAP_KEY_OR:
+		return (imap_search_match(pk->a, pb, x, pam) ||
+		    imap_search_match(pk->b, pb, x, pam));
+	case IMAP_KEY_SEQ:
+		return (imap_set_match(pk->arg, x + 1, pb->count));
+	case IMAP_KEY_UID:
+		return (imap_set_match(pk->arg, pb->uid[x], imap_star(pb, 1)));
+	case IMAP_KEY_LARGER:
+		return ((uint64_t)imap_size(pam) > pk->num);
+	case IMAP_KEY_SMALLER:
+		return ((uint64_t)imap_size(pam) < pk->num);
+	case IMAP_KEY_HEADER:
+		if (handle_message_data(pam) == NULL)
+			return (0);
+		str = imap_header_find(pam, pk->field, &len);
+		return (str != NULL && imap_contains(str, len, pk->arg));
+	case IMAP_KEY_BODY:
+		str = handle_message_data(pam);
+		if (str == NULL)
+			return (0);
+		len = imap_header_size(pam);
+		return (imap_contains(str + len, imap_size(pam) - len, pk->arg));
+	case IMAP_KEY_TEXT:
+		str = handle_message_data(pam);
+		return (str != NULL && imap_contains(str, imap_size(pam), pk->arg));
+	case IMAP_KEY_BEFORE:
+	case IMAP_KEY_ON:
+	case IMAP_KEY_SINCE:
+		/* all messages carry the same internal date */
+		day = imap_start - (imap_start % 86400);
+		if (pk->type == IMAP_KEY_BEFORE)
+			return (day < (time_t)pk->num);
+		if (pk->type == IMAP_KEY_ON)
+			return (day == (time_t)pk->num);
+		return (day >= (time_t)pk->num);
+	default:
+		return (0);
+	}
+}
+
+static void
+imap_search(FILE *io, const char *tag, struct imap_box *pb, char *args, int uid)
+{
+	const struct am_snapshot *ps;
+	struct imap_search search;
+	struct imap_key *pk;
+	struct imap_key **ppk;
+	struct am_message *pam;
+	struct imap_key top;
+	int x;
+
+	/* only US-ASCII and UTF-8 are supported, both match bytewise */
+	if (strncasecmp(args, "CHARSET ", 8) == 0) {
+		args += 8;
+		imap_arg(&args);
+	}
+
+	memset(&top, 0, sizeof(top));
+	top.type = IMAP_KEY_AND;
+	search.nkey = 0;
+	ppk = &top.a;
+	while (*args != 0) {
+		pk = imap_search_parse(&search, &args);
+		if (pk == NULL) {
+			fprintf(io, "%s BAD Invalid SEARCH arguments\r\n", tag);
+			return;
+		}
+		*ppk = pk;
+		ppk = &pk->next;
+		while (*args == ' ')
+			args++;
+	}
+	if (top.a == NULL) {
+		fprintf(io, "%s BAD Missing SEARCH arguments\r\n", tag);
+		return;
+	}
+
+	fprintf(io, "* SEARCH");
+	ps = handle_mailbox_enter(pb->mbox);
+	for (x = 0; x != pb->count; x++) {
+		pam = handle_snapshot_lookup(ps, pb->uid[x]);
+		if (pam == NULL)
+			continue;
+		if (imap_search_match(&top, pb, x, pam))
+			fprintf(io, " %ju", (uintmax_t)imap_key(pb, x, uid));
+	}
+	handle_snapshot_leave();
+	fprintf(io, "\r\n");
+
+	imap_sync(io, pb, 0);
+	fprintf(io, "%s OK SEARCH completed\r\n", tag);
+}
+
+static void
+imap_store(FILE *io, const char *tag, struct imap_box *pb, char *args, int uid)
+{
+	const struct am_snapshot *ps;
+	struct am_message *pam;
+	uint64_t star;
+	char *set;
+	char *op;
+	char *list;
+	char *flag;
+	int silent;
+	int mode;
+	int seen = 0;
+	int deleted = 0;
+	int x;
+
+	set = imap_arg(&args);
+	op = imap_arg(&args);
+	while (*args == ' ')
+		args++;
+	if (!imap_set_valid(set) || op == NULL || *args == 0)
+		goto bad;
+
+	if (*op == '+' || *op == '-')
+		mode = *op++;
+	else
+		mode = 0;
+	if (strcasecmp(op, "FLAGS") == 0)
+		silent = 0;
+	else if (strcasecmp(op, "FLAGS.SILENT") == 0)
+		silent = 1;
+	else
+		goto bad;
+
+	list = imap_list(args);
+	while ((flag = imap_arg(&list)) != NULL) {
+		if (strcasecmp(flag, "\\Seen") == 0)
+			seen = 1;
+		else if (strcasecmp(flag, "\\Deleted") == 0)
+			deleted = 1;
+		/* other flags are not kept */
+	}
+	if (pb->readonly) {
+		fprintf(io, "%s NO Mailbox is read-only\r\n", tag);
+		return;
+	}
+	star = imap_star(pb, uid);
+
+	ps = handle_mailbox_enter(pb->mbox);
+	for (x = 0; x != pb->count; x++) {
+		if (!imap_set_match(set, imap_key(pb, x, uid), star))
+			continue;
+		pam = handle_snapshot_lookup(ps, pb->uid[x]);
+		if (pam == NULL)
+			continue;
+		if (mode == '+') {
+			if (seen)
+				atomic_fetch_or(&pam->flags, AM_MSG_DELIVERED);
+			if (deleted)
+				pb->deleted[x] = 1;
+		} else if (mode == '-') {
+			if (seen)
+				atomic_fetch_and(&pam->flags, ~AM_MSG_DELIVERED);
+			if (deleted)
+				pb->deleted[x] = 0;
+		} else {
+			if (seen)
+				atomic_fetch_or(&pam->flags, AM_MSG_DELIVERED);
+			else
+				atomic_fetch_and(&pam->flags, ~AM_MSG_DELIVERED);
+			pb->deleted[x] = deleted;
+		}
+		if (silent)
+			continue;
+		fprintf(io, "* %d FETCH (", x + 1);
+		if (uid)
+			fprintf(io, "UID %ju ", (uintmax_t)pb->uid[x]);
+		imap_flags(io, pb, x, pam);
+		fprintf(io, ")\r\n");
+	}
+	handle_snapshot_leave();
+
+	imap_sync(io, pb, 0);
+	fprintf(io, "%s OK STORE completed\r\n", tag);
+	return;
+bad:
+	fprintf(io, "%s BAD Invalid STORE arguments\r\n", tag);
+}
+
+/* remove messages flagged \Deleted from the store */
+static int
+imap_expunge(FILE *io, struct imap_box *pb, int quiet)
+{
+	uint64_t *uid;
+	int num;
+	int x;
+
+	uid = malloc((pb->count + 1) * sizeof(uid[0]));
+	if (uid == NULL)
+		return (1);
+	for (num = x = 0; x != pb->count; x++) {
+		if (pb->deleted[x])
+			uid[num++] = pb->uid[x];
+	}
+	handle_remove_messages(uid, num);
+	free(uid);
+
+	for (x = 0; x != pb->count;) {
+		if (pb->deleted[x] == 0) {
+			x++;
+			continue;
+		}
+		imap_box_remove(pb, x);
+		if (!quiet)
+			fprintf(io, "* %d EXPUNGE\r\n", x + 1);
+	}
+	return (0);
+}
+
+static void
+imap_status_counts(const struct am_mailbox *mbox, int *pmessages, int *punseen,
+    uint64_t *puidnext)
+{
+	const struct am_snapshot *ps;
+	int x;
+
+	ps = handle_mailbox_enter(mbox);
+	*pmessages = ps->count;
+	*punseen = 0;
+	for (x = 0; x != ps->count; x++)
+		*punseen += (ps->msg[x]->flags & AM_MSG_DELIVERED) == 0;
+	*puidnext = ps->uidnext ? ps->uidnext : 1;
+	handle_snapshot_leave();
+}
+
+static void
+imap_select(FILE *io, const char *tag, struct imap_box *pb, int readonly)
+{
+	const struct am_snapshot *ps;
+	struct am_message *pam;
+	uint64_t uidnext;
+	int unseen = 0;
+	int x;
+
+	imap_box_free(pb);
+	pb->readonly = readonly;
+	if (imap_sync(io, pb, IMAP_SYNC_QUIET) != 0) {
+		fprintf(io, "%s NO Out of memory\r\n", tag);
+		return;
+	}
+
+	ps = handle_mailbox_enter(pb->mbox);
+	for (x = 0; x != pb->count; x++) {
+		pam = handle_snapshot_lookup(ps, pb->uid[x]);
+		if (pam != NULL && (pam->flags & AM_MSG_DELIVERED) == 0) {
+			unseen = x + 1;
+			break;
+		}
+	}
+	uidnext = ps->uidnext ? ps->uidnext : 1;
+	handle_snapshot_leave();
+
+	fprintf(io, "* FLAGS (\\Seen \\Deleted)\r\n"
+	    "* OK [PERMANENTFLAGS (\\Seen \\Deleted)] Limited\r\n"
+	    "* %d EXISTS\r\n"
+	    "* 0 RECENT\r\n", pb->count);
+	if (unseen != 0)
+		fprintf(io, "* OK [UNSEEN %d] First unseen\r\n", unseen);
+	fprintf(io, "* OK [UIDVALIDITY %ju] UIDs valid\r\n"
+	    "* OK [UIDNEXT %ju] Predicted next UID\r\n"
+	    "%s OK [%s] %s completed\r\n",
+	    (uintmax_t)imap_start, (uintmax_t)uidnext, tag,
+	    readonly ? "READ-ONLY" : "READ-WRITE",
+	    readonly ? "EXAMINE" : "SELECT");
+}
+
+/*
+ * Wait for changes of the store until the client ends IDLE. Returns
+ * non-zero if the connection is gone.
+ */
+static int
+imap_idle(FILE *io, int fd, const char *tag, struct imap_box *pb, struct imap_waiter *pw)
+{
+	struct pollfd pfd[2];
+	const char *line;
+	char buf[64];
+	int retval = 0;
+
+	if (pw->fd[0] < 0) {
+		if (pipe(pw->fd) != 0) {
+			fprintf(io, "%s NO Cannot idle\r\n", tag);
+			return (0);
+		}
+		fcntl(pw->fd[0], F_SETFL, fcntl(pw->fd[0], F_GETFL) | O_NONBLOCK);
+		fcntl(pw->fd[1], F_SETFL, fcntl(pw->fd[1], F_GETFL) | O_NONBLOCK);
+		fcntl(pw->fd[0], F_SETFD, FD_CLOEXEC);
+		fcntl(pw->fd[1], F_SETFD, FD_CLOEXEC);
+	}
+
+	fprintf(io, "+ idling\r\n");
+
+	pthread_mutex_lock(&imap_waiter_mtx);
+	TAILQ_INSERT_TAIL(&imap_waiters, pw, entry);
+	atomic_fetch_add(&imap_nwaiters, 1);
+	pthread_mutex_unlock(&imap_waiter_mtx);
+	am_metrics_gauge(AM_GAUGE_IMAP_IDLE, 1);
+
+	/* an idle client is subject to the idle timeout */
+	am_timer_command(0);
+
+	while (1) {
+		/* changes before the wakeup was armed are not lost */
+		if (imap_sync(io, pb, IMAP_SYNC_EXPUNGE) != 0 ||
+		    handle_flush(io) != 0) {
+			retval = 1;
+			break;
+		}
+		pfd[0].fd = fd;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd = pw->fd[0];
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+			retval = 1;
+			break;
+		}
+		if (pfd[1].revents != 0) {
+			while (read(pw->fd[0], buf, sizeof(buf)) > 0)
+				;
+		}
+		if (pfd[0].revents != 0)
+			break;
+	}
+
+	pthread_mutex_lock(&imap_waiter_mtx);
+	TAILQ_REMOVE(&imap_waiters, pw, entry);
+	atomic_fetch_sub(&imap_nwaiters, 1);
+	pthread_mutex_unlock(&imap_waiter_mtx);
+	am_metrics_gauge(AM_GAUGE_IMAP_IDLE, -1);
+
+	if (retval != 0)
+		return (retval);
+
+	line = handle_read_line(io);
+	if (line == NULL)
+		return (1);
+	if (strcasecmp(line, "DONE") == 0)
+		fprintf(io, "%s OK IDLE terminated\r\n", tag);
+	else
+		fprintf(io, "%s BAD Expected DONE\r\n", tag);
+	return (0);
+}
+
+/*
+ * Read a command, with any literals turned into quoted strings, so
+ * that the arguments can be parsed from a single line.
+ */
+static char *
+imap_read_command(FILE *io, char *cmd, size_t max)
+{
+	const char *line;
+	size_t len = 0;
+	size_t size;
+	size_t n;
+	char *end;
+	char *lit;
+	int ch;
+	int plus;
+
+	while (1) {
+		line = handle_read_line(io);
+		if (line == NULL)
+			return (NULL);
+		n = strlen(line);
+		if (len + n + 1 > max)
+			return (NULL);
+		memcpy(cmd + len, line, n + 1);
+
+		/* check for a literal, {size} or {size+}, at the end */
+		lit = (n != 0 && line[n - 1] == '}') ? strrchr(cmd + len, '{') : NULL;
+		if (lit == NULL)
+			return (cmd);
+		size = strtoul(lit + 1, &end, 10);
+		plus = (*end == '+');
+		if (end == lit + 1 || *(end + plus) != '}')
+			return (cmd);
+
+		len = lit - cmd;
+		if (!plus) {
+			fprintf(io, "+ Ready for literal data\r\n");
+			if (handle_flush(io) != 0)
+				return (NULL);
+		}
+		cmd[len++] = '"';
+		while (size--) {
+			ch = getc(io);
+			if (ch == EOF || len + 3 > max)
+				return (NULL);
+			if (ch == '"' || ch == '\\')
+				cmd[len++] = '\\';
+			cmd[len++] = ch;
+		}
+		cmd[len++] = '"';
+	}
+}
+
+void
+handle_imap_connection(int fd)
+{
+	struct imap_waiter waiter = { .fd = { -1, -1 } };
+	struct imap_box box = {};
+	struct am_arena arena;
+	const char *tag;
+	const char *name;
+	char *cmd;
+	char *args;
+	char *user;
+	char *pass;
+	FILE *io;
+	uint64_t uidnext;
+	int messages;
+	int unseen;
+	int logged_in = 0;
+	int selected = 0;
+	int uid;
+
+	am_metrics_count(AM_CNT_IMAP_CONNECTIONS, 1);
+	AM_TRACE_SESSION("imap");
+	pthread_once(&imap_once, &imap_init);
+
+	am_arena_init(&arena);
+
+	io = handle_fdopen(fd, AM_PROTO_IMAP, &arena);
+	if (io == NULL)
+		goto done;
+
+	args = am_arena_alloc(&arena, 2 * ASTERISKMAIL_LINE_MAX);
+	if (args == NULL)
+		goto done;
+
+	fprintf(io, "* OK [CAPABILITY " IMAP_CAPABILITY "%s] AsteriskMail v1.0 ready\r\n",
+	    am_tls_enabled() ? " STARTTLS" : "");
+
+	while (1) {
+		if (handle_flush(io) != 0)
+			goto done;
+		cmd = imap_read_command(io, args, 2 * ASTERISKMAIL_LINE_MAX);
+		AM_TRACE_BEGIN(dispatch);
+		if (cmd == NULL)
+			goto done;
+		tag = imap_arg(&cmd);
+		name = imap_arg(&cmd);
+		if (tag == NULL || name == NULL) {
+			fprintf(io, "* BAD Missing command\r\n");
+			continue;
+		}
+		uid = 0;
+		if (strcasecmp(name, "UID") == 0) {
+			uid = 1;
+			name = imap_arg(&cmd);
+			if (name == NULL || (strcasecmp(name, "FETCH") != 0 &&
+			    strcasecmp(name, "SEARCH") != 0 &&
+			    strcasecmp(name, "STORE") != 0)) {
+				fprintf(io, "%s BAD Invalid UID command\r\n", tag);
+				continue;
+			}
+		}
+		while (*cmd == ' ')
+			cmd++;
+
+		if (strcasecmp(name, "CAPABILITY") == 0) {
+			fprintf(io, "* CAPABILITY " IMAP_CAPABILITY "%s\r\n"
+			    "%s OK CAPABILITY completed\r\n",
+			    (am_tls_enabled() && !handle_tls_active()) ?
+			    " STARTTLS" : "", tag);
+		} else if (strcasecmp(name, "NOOP") == 0 ||
+		    strcasecmp(name, "CHECK") == 0) {
+			if (selected)
+				imap_sync(io, &box, IMAP_SYNC_EXPUNGE);
+			fprintf(io, "%s OK %s completed\r\n", tag, name);
+		} else if (strcasecmp(name, "LOGOUT") == 0) {
+			fprintf(io, "* BYE AsteriskMail logging out\r\n"
+			    "%s OK LOGOUT completed\r\n", tag);
+			handle_flush(io);
+			goto done;
+		} else if (strcasecmp(name, "STARTTLS") == 0) {
+			if (!am_tls_enabled() || handle_tls_active() || logged_in) {
+				fprintf(io, "%s NO TLS not available\r\n", tag);
+				continue;
+			}
+			fprintf(io, "%s OK Begin TLS negotiation now\r\n", tag);
+			if (handle_flush(io) != 0 || handle_starttls(io) != 0)
+				goto done;
+		} else if (!logged_in) {
+			if (strcasecmp(name, "LOGIN") != 0) {
+				fprintf(io, "%s NO Not logged in yet\r\n", tag);
+				continue;
+			}
+			user = imap_arg(&cmd);
+			pass = imap_arg(&cmd);
+			if (user != NULL && pass != NULL &&
+			    (box.mbox = am_mailbox_login(user, pass)) != NULL) {
+				logged_in = 1;
+				fprintf(io, "%s OK [CAPABILITY " IMAP_CAPABILITY "] "
+				    "LOGIN completed\r\n", tag);
+			} else {
+				fprintf(io, "%s NO [AUTHENTICATIONFAILED] "
+				    "Invalid username or password\r\n", tag);
+			}
+		} else if (strcasecmp(name, "SELECT") == 0 ||
+		    strcasecmp(name, "EXAMINE") == 0) {
+			selected = 0;
+			if (strcasecmp(imap_arg(&cmd) ?: "", "INBOX") != 0) {
+				fprintf(io, "%s NO [NONEXISTENT] No such mailbox\r\n", tag);
+				continue;
+			}
+			/* a replica selects like EXAMINE */
+			imap_select(io, tag, &box, am_read_only ||
+			    toupper((uint8_t)name[0]) == 'E');
+			selected = 1;
+		} else if (strcasecmp(name, "LIST") == 0 ||
+		    strcasecmp(name, "LSUB") == 0) {
+			imap_arg(&cmd);
+			if (*(imap_arg(&cmd) ?: "") == 0) {
+				fprintf(io, "* %s (\\Noselect) \"/\" \"\"\r\n", name);
+			} else {
+				fprintf(io, "* %s (\\HasNoChildren) \"/\" INBOX\r\n", name);
+			}
+			fprintf(io, "%s OK %s completed\r\n", tag, name);
+		} else if (strcasecmp(name, "STATUS") == 0) {
+			if (strcasecmp(imap_arg(&cmd) ?: "", "INBOX") != 0) {
+				fprintf(io, "%s NO [NONEXISTENT] No such mailbox\r\n", tag);
+				continue;
+			}
+			imap_status_counts(box.mbox, &messages, &unseen, &uidnext);
+			fprintf(io, "* STATUS INBOX (MESSAGES %d RECENT 0 UIDNEXT %ju "
+			    "UIDVALIDITY %ju UNSEEN %d)\r\n"
+			    "%s OK STATUS completed\r\n", messages,
+			    (uintmax_t)uidnext, (uintmax_t)imap_start, unseen, tag);
+		} else if (strcasecmp(name, "SUBSCRIBE") == 0 ||
+		    strcasecmp(name, "UNSUBSCRIBE") == 0) {
+			fprintf(io, "%s OK %s completed\r\n", tag, name);
+		} else if (strcasecmp(name, "CREATE") == 0 ||
+		    strcasecmp(name, "DELETE") == 0 ||
+		    strcasecmp(name, "RENAME") == 0 ||
+		    strcasecmp(name, "APPEND") == 0 ||
+		    strcasecmp(name, "COPY") == 0) {
+			fprintf(io, "%s NO Only INBOX is supported\r\n", tag);
+		} else if (strcasecmp(name, "IDLE") == 0) {
+			if (selected == 0) {
+				fprintf(io, "%s NO No mailbox selected\r\n", tag);
+				continue;
+			}
+			if (imap_idle(io, fd, tag, &box, &waiter) != 0)
+				goto done;
+		} else if (!selected) {
+			fprintf(io, "%s BAD Unknown command or no mailbox selected\r\n", tag);
+		} else if (strcasecmp(name, "FETCH") == 0) {
+			imap_fetch(io, tag, &box, cmd, uid);
+		} else if (strcasecmp(name, "SEARCH") == 0) {
+			imap_search(io, tag, &box, cmd, uid);
+		} else if (strcasecmp(name, "STORE") == 0) {
+			imap_store(io, tag, &box, cmd, uid);
+		} else if (strcasecmp(name, "EXPUNGE") == 0) {
+			if (box.readonly) {
+				fprintf(io, "%s NO Mailbox is read-only\r\n", tag);
+				continue;
+			}
+			imap_expunge(io, &box, 0);
+			imap_sync(io, &box, IMAP_SYNC_EXPUNGE);
+			fprintf(io, "%s OK EXPUNGE completed\r\n", tag);
+		} else if (strcasecmp(name, "CLOSE") == 0) {
+			if (!box.readonly)
+				imap_expunge(io, &box, 1);
+			imap_box_free(&box);
+			selected = 0;
+			fprintf(io, "%s OK CLOSE completed\r\n", tag);
+		} else {
+			fprintf(io, "%s BAD Unknown command\r\n", tag);
+		}
+		AM_TRACE_END(AM_TRACE_DISPATCH, dispatch);
+	}
+done:
+	handle_close(io, fd);
+	if (waiter.fd[0] > -1) {
+		close(waiter.fd[0]);
+		close(waiter.fd[1]);
+	}
+	imap_box_free(&box);
+	am_arena_free(&arena);
+}
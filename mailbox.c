@@ -0,0 +1,253 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Mailboxes. Messages are routed at SMTP RCPT TO by the local part of
+ * the recipient address, like the number of a SIM card or the name of
+ * a dongle. The routing table is a hash table which is built from the
+ * command line and never changes afterwards, so that it can be read
+ * without locking. Messages for unknown recipients go to the default
+ * mailbox. POP3, IMAP and HTTP logins select the mailbox by name.
+ */
+
+#include <strings.h>
+#include <ctype.h>
+
+#include "asteriskmail.h"
+
+struct am_mailbox_rcpt {
+	struct am_mailbox_rcpt *next;
+	struct am_mailbox *mbox;
+	uint32_t hash;
+	char	addr[];
+};
+
+static struct am_mailbox am_mailbox[AM_MAILBOX_MAX];
+static int am_mailbox_num = 1;
+static struct am_mailbox_rcpt *am_mailbox_hash[AM_MAILBOX_HASH];
+
+/* FNV-1a of the address, ignoring case */
+static uint32_t
+am_mailbox_hash_key(const char *addr, size_t len)
+{
+	uint32_t hash = 2166136261U;
+
+	while (len--)
+		hash = (hash ^ (uint8_t)tolower((uint8_t)*addr++)) * 16777619U;
+	return (hash);
+}
+
+static struct am_mailbox_rcpt *
+am_mailbox_lookup(const char *addr, size_t len)
+{
+	struct am_mailbox_rcpt *pr;
+	uint32_t hash = am_mailbox_hash_key(addr, len);
+
+	for (pr = am_mailbox_hash[hash % AM_MAILBOX_HASH]; pr != NULL; pr = pr->next) {
+		if (pr->hash == hash && strlen(pr->addr) == len &&
+		    strncasecmp(pr->addr, addr, len) == 0)
+			break;
+	}
+	return (pr);
+}
+
+static int
+am_mailbox_add_rcpt(struct am_mailbox *mbox, const char *addr, size_t len)
+{
+	struct am_mailbox_rcpt *pr;
+
+	if (len == 0 || am_mailbox_lookup(addr, len) != NULL)
+		return (EINVAL);
+	pr = malloc(sizeof(*pr) + len + 1);
+	if (pr == NULL)
+		return (ENOMEM);
+	memcpy(pr->addr, addr, len);
+	pr->addr[len] = 0;
+	pr->mbox = mbox;
+	pr->hash = am_mailbox_hash_key(addr, len);
+	pr->next = am_mailbox_hash[pr->hash % AM_MAILBOX_HASH];
+	am_mailbox_hash[pr->hash % AM_MAILBOX_HASH] = pr;
+	return (0);
+}
+
+/*
+ * Parses "name[:password]=recipient[,recipient...]". The name of the
+ * mailbox is also one of its recipients.
+ */
+int
+am_mailbox_parse(const char *str)
+{
+	struct am_mailbox *mbox;
+	const char *list;
+	char *name;
+	char *pass;
+	size_t len;
+
+	if (am_mailbox_num == AM_MAILBOX_MAX)
+		return (E2BIG);
+	list = strchr(str, '=');
+	if (list == NULL)
+		return (EINVAL);
+	name = strndup(str, list - str);
+	if (name == NULL)
+		return (ENOMEM);
+	pass = strchr(name, ':');
+	if (pass != NULL)
+		*pass++ = 0;
+	if (name[0] == 0 || strpbrk(name, ",@<> ") != NULL ||
+	    (am_username != NULL && strcmp(name, am_username) == 0)) {
+		free(name);
+		return (EINVAL);
+	}
+
+	mbox = &am_mailbox[am_mailbox_num];
+	mbox->name = name;
+	mbox->password = pass;
+	mbox->id = am_mailbox_num;
+	if (am_mailbox_add_rcpt(mbox, name, strlen(name)) != 0)
+		return (EINVAL);
+
+	for (list++; *list != 0; list += len) {
+		if (*list == ',')
+			list++;
+		len = strcspn(list, ",");
+		if (am_mailbox_add_rcpt(mbox, list, len) != 0)
+			return (EINVAL);
+	}
+	am_mailbox_num++;
+	return (0);
+}
+
+struct am_mailbox *
+am_mailbox_default(void)
+{
+	return (&am_mailbox[0]);
+}
+
+/* returns the mailbox with the given number, or NULL */
+struct am_mailbox *
+am_mailbox_get(int id)
+{
+	if (id < 0 || id >= am_mailbox_num)
+		return (NULL);
+	return (&am_mailbox[id]);
+}
+
+int
+am_mailbox_count(void)
+{
+	return (am_mailbox_num);
+}
+
+/*
+ * Returns the mailbox of an SMTP recipient, given as "<local@domain>",
+ * or NULL if the recipient is not known.
+ */
+struct am_mailbox *
+am_mailbox_route(const char *addr)
+{
+	struct am_mailbox_rcpt *pr;
+
+	while (*addr == ' ' || *addr == '<')
+		addr++;
+	pr = am_mailbox_lookup(addr, strcspn(addr, "@> "));
+	return (pr != NULL ? pr->mbox : NULL);
+}
+
+/* returns the mailbox for the given credentials, or NULL */
+struct am_mailbox *
+am_mailbox_login(const char *user, const char *pass)
+{
+	struct am_mailbox *mbox;
+	int x;
+
+	for (x = 1; x != am_mailbox_num; x++) {
+		mbox = &am_mailbox[x];
+		if (strcmp(user, mbox->name) != 0)
+			continue;
+		if (mbox->password != NULL && strcmp(pass, mbox->password) != 0)
+			return (NULL);
+		return (mbox);
+	}
+	if ((am_username == NULL || strcmp(user, am_username) == 0) &&
+	    (am_password == NULL || strcmp(pass, am_password) == 0))
+		return (&am_mailbox[0]);
+	return (NULL);
+}
+
+static const char *
+am_mailbox_name(const struct am_mailbox *mbox)
+{
+	if (mbox->id == 0)
+		return (am_username != NULL ? am_username : "default");
+	return (mbox->name);
+}
+
+void
+am_mailbox_print(FILE *io)
+{
+	const struct am_snapshot *ps;
+	struct am_mailbox *mbox;
+	int x;
+
+	fprintf(io, "# HELP asteriskmail_mailbox_messages Number of messages held per mailbox\n"
+	    "# TYPE asteriskmail_mailbox_messages gauge\n");
+	for (x = 0; x != am_mailbox_num; x++) {
+		mbox = &am_mailbox[x];
+		ps = handle_mailbox_enter(mbox);
+		fprintf(io, "asteriskmail_mailbox_messages{mailbox=\"%s\"} %d\n",
+		    am_mailbox_name(mbox), ps->count);
+		handle_snapshot_leave();
+	}
+
+	fprintf(io, "# HELP asteriskmail_mailbox_bytes Number of bytes held per mailbox\n"
+	    "# TYPE asteriskmail_mailbox_bytes gauge\n");
+	for (x = 0; x != am_mailbox_num; x++) {
+		mbox = &am_mailbox[x];
+		ps = handle_mailbox_enter(mbox);
+		fprintf(io, "asteriskmail_mailbox_bytes{mailbox=\"%s\"} %ju\n",
+		    am_mailbox_name(mbox), (uintmax_t)ps->bytes);
+		handle_snapshot_leave();
+	}
+
+	fprintf(io, "# HELP asteriskmail_mailbox_received_total Number of messages stored per mailbox\n"
+	    "# TYPE asteriskmail_mailbox_received_total counter\n");
+	for (x = 0; x != am_mailbox_num; x++) {
+		mbox = &am_mailbox[x];
+		fprintf(io, "asteriskmail_mailbox_received_total{mailbox=\"%s\"} %ju\n",
+		    am_mailbox_name(mbox), (uintmax_t)atomic_load_explicit(
+		    &mbox->received, memory_order_relaxed));
+	}
+
+	fprintf(io, "# HELP asteriskmail_mailbox_retrieved_total Number of messages retrieved per mailbox\n"
+	    "# TYPE asteriskmail_mailbox_retrieved_total counter\n");
+	for (x = 0; x != am_mailbox_num; x++) {
+		mbox = &am_mailbox[x];
+		fprintf(io, "asteriskmail_mailbox_retrieved_total{mailbox=\"%s\"} %ju\n",
+		    am_mailbox_name(mbox), (uintmax_t)atomic_load_explicit(
+		    &mbox->retrieved, memory_order_relaxed));
+	}
+}
@@ -0,0 +1,270 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdatomic.h>
+#include <time.h>
+
+#include "asteriskmail.h"
+
+/*
+ * Histogram buckets are powers of two in microseconds, so that the
+ * bucket index can be computed using a single bit scan.
+ */
+#define	AM_HIST_BUCKETS 24
+
+struct am_histogram {
+	_Atomic uint64_t bucket[AM_HIST_BUCKETS + 1];
+	_Atomic uint64_t sum_ns;
+};
+
+static _Atomic uint64_t am_counter[AM_CNT_MAX];
+static _Atomic int64_t am_gauge[AM_GAUGE_MAX];
+static struct am_histogram am_histogram[AM_HIST_MAX];
+
+static const struct {
+	const char *name;
+	const char *label;
+	const char *help;
+} am_counter_desc[AM_CNT_MAX] = {
+	[AM_CNT_SMTP_CONNECTIONS] = { "asteriskmail_connections_total",
+	    "protocol=\"smtp\"", "Number of accepted connections" },
+	[AM_CNT_POP3_CONNECTIONS] = { "asteriskmail_connections_total",
+	    "protocol=\"pop3\"", NULL },
+	[AM_CNT_HTTPD_CONNECTIONS] = { "asteriskmail_connections_total",
+	    "protocol=\"http\"", NULL },
+	[AM_CNT_IMAP_CONNECTIONS] = { "asteriskmail_connections_total",
+	    "protocol=\"imap\"", NULL },
+	[AM_CNT_MESSAGES_RECEIVED] = { "asteriskmail_messages_received_total",
+	    NULL, "Number of messages stored from SMTP" },
+	[AM_CNT_BYTES_RECEIVED] = { "asteriskmail_received_bytes_total",
+	    NULL, "Number of message bytes received by SMTP DATA" },
+	[AM_CNT_MESSAGES_REJECTED] = { "asteriskmail_messages_rejected_total",
+	    NULL, "Number of messages rejected due to store limits" },
+	[AM_CNT_MESSAGES_EVICTED] = { "asteriskmail_messages_evicted_total",
+	    NULL, "Number of messages evicted from the store" },
+	[AM_CNT_MESSAGES_RETRIEVED] = { "asteriskmail_messages_retrieved_total",
+	    NULL, "Number of messages retrieved by POP3 RETR or IMAP FETCH" },
+	[AM_CNT_MESSAGES_DUPLICATE] = { "asteriskmail_messages_duplicate_total",
+	    NULL, "Number of messages dropped as delivered before" },
+	[AM_CNT_SMS_SENT] = { "asteriskmail_sms_segments_total",
+	    "result=\"sent\"", "Number of outbound SMS segments" },
+	[AM_CNT_SMS_FAILED] = { "asteriskmail_sms_segments_total",
+	    "result=\"failed\"", NULL },
+	[AM_CNT_REJECTED_GLOBAL] = { "asteriskmail_connections_rejected_total",
+	    "limit=\"global\"", "Number of connections refused by admission control" },
+	[AM_CNT_REJECTED_PER_IP] = { "asteriskmail_connections_rejected_total",
+	    "limit=\"per_ip\"", NULL },
+	[AM_CNT_SESSIONS_TIMED_OUT] = { "asteriskmail_sessions_timed_out_total",
+	    NULL, "Number of sessions closed by a timeout" },
+	[AM_CNT_TLS_FULL] = { "asteriskmail_tls_handshakes_total",
+	    "type=\"full\"", "Number of TLS handshakes" },
+	[AM_CNT_TLS_RESUMED] = { "asteriskmail_tls_handshakes_total",
+	    "type=\"resumed\"", NULL },
+	[AM_CNT_TLS_FAILED] = { "asteriskmail_tls_handshakes_total",
+	    "type=\"failed\"", NULL },
+	[AM_CNT_WEBHOOK_POSTED] = { "asteriskmail_webhook_messages_total",
+	    "result=\"posted\"", "Number of messages handled by the webhook" },
+	[AM_CNT_WEBHOOK_DROPPED] = { "asteriskmail_webhook_messages_total",
+	    "result=\"dropped\"", NULL },
+	[AM_CNT_WEBHOOK_ERRORS] = { "asteriskmail_webhook_errors_total",
+	    NULL, "Number of failed webhook requests" },
+	[AM_CNT_HTTPD_IDENTITY] = { "asteriskmail_http_body_bytes_total",
+	    "encoding=\"identity\"", "Number of HTTP response body bytes sent per content coding" },
+	[AM_CNT_HTTPD_GZIP] = { "asteriskmail_http_body_bytes_total",
+	    "encoding=\"gzip\"", NULL },
+	[AM_CNT_HTTPD_DEFLATE] = { "asteriskmail_http_body_bytes_total",
+	    "encoding=\"deflate\"", NULL },
+	[AM_CNT_INBOX_HIT] = { "asteriskmail_inbox_cache_total",
+	    "result=\"hit\"", "Number of inbox requests by cache result" },
+	[AM_CNT_INBOX_MISS] = { "asteriskmail_inbox_cache_total",
+	    "result=\"miss\"", NULL },
+	[AM_CNT_COLD_HIT] = { "asteriskmail_cold_reads_total",
+	    "result=\"hit\"", "Number of compressed message reads by cache result" },
+	[AM_CNT_COLD_MISS] = { "asteriskmail_cold_reads_total",
+	    "result=\"miss\"", NULL },
+	[AM_CNT_REPLICA_SENT] = { "asteriskmail_replication_records_total",
+	    "direction=\"sent\"", "Number of store changes streamed to or from the replica" },
+	[AM_CNT_REPLICA_APPLIED] = { "asteriskmail_replication_records_total",
+	    "direction=\"applied\"", NULL },
+	[AM_CNT_REPLICA_FULL] = { "asteriskmail_replication_syncs_total",
+	    "type=\"full\"", "Number of replica synchronisations" },
+	[AM_CNT_REPLICA_INCREMENTAL] = { "asteriskmail_replication_syncs_total",
+	    "type=\"incremental\"", NULL },
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} am_gauge_desc[AM_GAUGE_MAX] = {
+	[AM_GAUGE_STORE_BYTES] = { "asteriskmail_store_bytes",
+	    "Number of bytes held by the message store" },
+	[AM_GAUGE_STORE_MESSAGES] = { "asteriskmail_store_messages",
+	    "Number of messages held by the message store" },
+	[AM_GAUGE_OUTBOUND_QUEUE] = { "asteriskmail_outbound_queue_depth",
+	    "Number of outbound SMS segments waiting to be sent" },
+	[AM_GAUGE_SESSIONS] = { "asteriskmail_sessions",
+	    "Number of sessions being served" },
+	[AM_GAUGE_IMAP_IDLE] = { "asteriskmail_imap_idle_sessions",
+	    "Number of IMAP sessions waiting in IDLE" },
+	[AM_GAUGE_WEBHOOK_QUEUE] = { "asteriskmail_webhook_queue_depth",
+	    "Number of messages waiting for the webhook" },
+	[AM_GAUGE_COLD_MESSAGES] = { "asteriskmail_cold_messages",
+	    "Number of stored messages which are compressed" },
+	[AM_GAUGE_COLD_BYTES] = { "asteriskmail_cold_bytes",
+	    "Number of bytes held by compressed messages" },
+	[AM_GAUGE_SEARCH_TERMS] = { "asteriskmail_search_terms",
+	    "Number of distinct words in the search index" },
+	[AM_GAUGE_SEARCH_BYTES] = { "asteriskmail_search_bytes",
+	    "Number of bytes held by the search index" },
+	[AM_GAUGE_REPLICA_CONNECTED] = { "asteriskmail_replication_connected",
+	    "Number of connected replication peers" },
+	[AM_GAUGE_REPLICA_LAG] = { "asteriskmail_replication_lag_records",
+	    "Number of store changes sent but not acknowledged by the replica" },
+	[AM_GAUGE_REPLICA_QUEUE] = { "asteriskmail_replication_queue_bytes",
+	    "Number of bytes waiting to be sent to the replica" },
+	[AM_GAUGE_READ_ONLY] = { "asteriskmail_read_only",
+	    "Whether this instance is a read-only replica" },
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} am_histogram_desc[AM_HIST_MAX] = {
+	[AM_HIST_SMTP_DATA] = { "asteriskmail_smtp_data_seconds",
+	    "Time spent receiving and storing SMTP DATA" },
+	[AM_HIST_IMPORT] = { "asteriskmail_import_seconds",
+	    "Time spent converting GSM messages" },
+	[AM_HIST_POP3_RETR] = { "asteriskmail_pop3_retr_seconds",
+	    "Time spent serving POP3 RETR" },
+	[AM_HIST_INBOX_RENDER] = { "asteriskmail_inbox_render_seconds",
+	    "Time spent rendering and compressing the HTTP inbox" },
+	[AM_HIST_SMS_SEND] = { "asteriskmail_sms_send_seconds",
+	    "Time spent sending one outbound SMS segment" },
+	[AM_HIST_TLS_HANDSHAKE] = { "asteriskmail_tls_handshake_seconds",
+	    "Time spent in successful TLS handshakes" },
+	[AM_HIST_WEBHOOK_POST] = { "asteriskmail_webhook_post_seconds",
+	    "Time spent in successful webhook requests" },
+	[AM_HIST_SEARCH] = { "asteriskmail_search_seconds",
+	    "Time spent answering search queries" },
+};
+
+uint64_t
+am_metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+void
+am_metrics_count(int which, uint64_t value)
+{
+	atomic_fetch_add_explicit(&am_counter[which], value, memory_order_relaxed);
+}
+
+void
+am_metrics_gauge(int which, int64_t value)
+{
+	atomic_fetch_add_explicit(&am_gauge[which], value, memory_order_relaxed);
+}
+
+void
+am_metrics_observe(int which, uint64_t start)
+{
+	struct am_histogram *ph = &am_histogram[which];
+	uint64_t delta = am_metrics_now() - start;
+	uint64_t us = delta / 1000;
+	int index;
+
+	/* compute the first bucket having an upper bound above "us" */
+	index = (us == 0) ? 0 : (64 - __builtin_clzll(us));
+	if (index > AM_HIST_BUCKETS)
+		index = AM_HIST_BUCKETS;
+
+	atomic_fetch_add_explicit(&ph->bucket[index], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&ph->sum_ns, delta, memory_order_relaxed);
+}
+
+void
+am_metrics_print(FILE *io)
+{
+	const char *last = NULL;
+	uint64_t sum;
+	int x;
+	int y;
+
+	for (x = 0; x != AM_CNT_MAX; x++) {
+		if (last == NULL || strcmp(last, am_counter_desc[x].name) != 0) {
+			last = am_counter_desc[x].name;
+			fprintf(io, "# HELP %s %s\n"
+			    "# TYPE %s counter\n", last,
+			    am_counter_desc[x].help, last);
+		}
+		if (am_counter_desc[x].label != NULL)
+			fprintf(io, "%s{%s} ", last, am_counter_desc[x].label);
+		else
+			fprintf(io, "%s ", last);
+		fprintf(io, "%ju\n", (uintmax_t)atomic_load_explicit(
+		    &am_counter[x], memory_order_relaxed));
+	}
+
+	for (x = 0; x != AM_GAUGE_MAX; x++) {
+		fprintf(io, "# HELP %s %s\n"
+		    "# TYPE %s gauge\n"
+		    "%s %jd\n",
+		    am_gauge_desc[x].name, am_gauge_desc[x].help,
+		    am_gauge_desc[x].name, am_gauge_desc[x].name,
+		    (intmax_t)atomic_load_explicit(&am_gauge[x],
+		    memory_order_relaxed));
+	}
+
+	for (x = 0; x != AM_HIST_MAX; x++) {
+		struct am_histogram *ph = &am_histogram[x];
+		const char *name = am_histogram_desc[x].name;
+
+		fprintf(io, "# HELP %s %s\n"
+		    "# TYPE %s histogram\n",
+		    name, am_histogram_desc[x].help, name);
+
+		sum = 0;
+		for (y = 0; y != AM_HIST_BUCKETS; y++) {
+			sum += atomic_load_explicit(&ph->bucket[y], memory_order_relaxed);
+			fprintf(io, "%s_bucket{le=\"%.6f\"} %ju\n", name,
+			    (double)(1ULL << y) / 1000000.0, (uintmax_t)sum);
+		}
+		sum += atomic_load_explicit(&ph->bucket[y], memory_order_relaxed);
+		fprintf(io, "%s_bucket{le=\"+Inf\"} %ju\n"
+		    "%s_sum %.9f\n"
+		    "%s_count %ju\n",
+		    name, (uintmax_t)sum,
+		    name, (double)atomic_load_explicit(&ph->sum_ns,
+		    memory_order_relaxed) / 1000000000.0,
+		    name, (uintmax_t)sum);
+	}
+
+	am_mailbox_print(io);
+	am_dongle_print(io);
+}
@@ -25,16 +25,95 @@
 
 #include "asteriskmail.h"
 
+/*
+ * The maildrop is the list of messages present in the mailbox at
+ * login. Messages keep their number for the whole session, and
+ * deletions are only marked until the session ends with QUIT.
+ */
+struct pop3_drop {
+	struct am_mailbox *mbox;
+	uint64_t *uid;
+	int	*bytes;
+	uint8_t	*deleted;
+	int	count;
+};
+
+static int
+pop3_drop_init(struct pop3_drop *pd, struct am_arena *pa, struct am_mailbox *mbox)
+{
+	const struct am_snapshot *ps;
+	int x;
+
+	ps = handle_mailbox_enter(mbox);
+	pd->mbox = mbox;
+	pd->count = ps->count;
+	pd->uid = am_arena_alloc(pa, pd->count * sizeof(pd->uid[0]));
+	pd->bytes = am_arena_alloc(pa, pd->count * sizeof(pd->bytes[0]));
+	pd->deleted = am_arena_alloc(pa, (pd->count + 7) / 8);
+	if (pd->uid == NULL || pd->bytes == NULL || pd->deleted == NULL) {
+		handle_snapshot_leave();
+		return (1);
+	}
+	for (x = 0; x != pd->count; x++) {
+		pd->uid[x] = ps->msg[x]->uid;
+		pd->bytes[x] = ps->msg[x]->bytes;
+	}
+	handle_snapshot_leave();
+
+	memset(pd->deleted, 0, (pd->count + 7) / 8);
+	return (0);
+}
+
+static int
+pop3_drop_deleted(const struct pop3_drop *pd, int x)
+{
+	return ((pd->deleted[x / 8] >> (x % 8)) & 1);
+}
+
+/* returns the index of the given message number, or -1 */
+static int
+pop3_lookup(const struct pop3_drop *pd, const char *arg)
+{
+	int num = atoi(arg);
+
+	if (num < 1 || num > pd->count || pop3_drop_deleted(pd, num - 1))
+		return (-1);
+	return (num - 1);
+}
+
+/* remove all messages marked as deleted, in one go */
+static void
+pop3_drop_commit(struct pop3_drop *pd)
+{
+	int num;
+	int x;
+
+	/* the ids are increasing, compact them in place */
+	for (x = num = 0; x != pd->count; x++) {
+		if (pop3_drop_deleted(pd, x))
+			pd->uid[num++] = pd->uid[x];
+	}
+	handle_remove_messages(pd->uid, num);
+}
+
 void
 handle_pop3_connection(int fd)
 {
+	struct am_mailbox *mbox;
 	const char *line;
 	char *username = NULL;
 	char *password = NULL;
+	struct pop3_drop drop;
+	struct am_arena arena;
 	FILE *io;
 	int logged_in = 0;
 
-	io = fdopen(fd, "r+");
+	am_metrics_count(AM_CNT_POP3_CONNECTIONS, 1);
+	AM_TRACE_SESSION("pop3");
+
+	am_arena_init(&arena);
+
+	io = handle_fdopen(fd, AM_PROTO_POP3, &arena);
 	if (io == NULL)
 		goto done;
 
@@ -42,29 +121,56 @@ handle_pop3_connection(int fd)
 	    random(), hostname);
 
 	while (1) {
-		fflush(io);
+		if (handle_flush(io) != 0)
+			goto done;
 		line = handle_read_line(io);
+		AM_TRACE_BEGIN(dispatch);
 		if (line == NULL) {
 			goto done;
 		} else if (handle_compare(line, "QUIT") == 0) {
 			fprintf(io, "+OK\r\n");
 			goto done;
 		} else if (handle_compare(line, "USER ") == 0) {
-			free(username);
-			username = strdup(line + 5);
+			if (username == NULL)
+				username = am_arena_alloc(&arena, ASTERISKMAIL_LINE_MAX);
+			if (username == NULL)
+				goto done;
+			strlcpy(username, line + 5, ASTERISKMAIL_LINE_MAX);
 			fprintf(io, "+OK %s selected.\r\n", username);
 		} else if (handle_compare(line, "CAPA") == 0) {
 			fprintf(io,
 			    "+OK List of capabilities follows\r\n"
-			    "PLAIN\r\n.\r\n");
+			    "PLAIN\r\n"
+			    "UIDL\r\n%s.\r\n",
+			    (am_tls_enabled() && !handle_tls_active()) ?
+			    "STLS\r\n" : "");
+		} else if (handle_compare(line, "STLS") == 0) {
+			if (!am_tls_enabled() || handle_tls_active()) {
+				fprintf(io, "-ERR TLS not available\r\n");
+			} else {
+				fprintf(io, "+OK Begin TLS negotiation\r\n");
+				if (handle_flush(io) != 0 ||
+				    handle_starttls(io) != 0)
+					goto done;
+				/* forget anything sent in the clear */
+				username = NULL;
+				password = NULL;
+			}
 		} else if (handle_compare(line, "AUTH PLAIN ") == 0) {
 			fprintf(io, "+OK\r\n");
 		} else if (handle_compare(line, "PASS ") == 0) {
-			free(password);
-			password = strdup(line + 5);
-			if (username != NULL && password != NULL &&
-			    (am_username == NULL || strcmp(username, am_username) == 0) &&
-			    (am_password == NULL || strcmp(password, am_password) == 0)) {
+			if (password == NULL)
+				password = am_arena_alloc(&arena, ASTERISKMAIL_LINE_MAX);
+			if (password == NULL)
+				goto done;
+			strlcpy(password, line + 5, ASTERISKMAIL_LINE_MAX);
+			mbox = (username != NULL) ?
+			    am_mailbox_login(username, password) : NULL;
+			if (mbox != NULL) {
+				if (pop3_drop_init(&drop, &arena, mbox) != 0) {
+					fprintf(io, "-ERR Unable to lock maildrop.\r\n");
+					goto done;
+				}
 				fprintf(io, "+OK Password and username is valid.\r\n");
 				break;
 			} else {
@@ -77,95 +183,129 @@ handle_pop3_connection(int fd)
 		} else {
 			fprintf(io, "-ERR Not logged in yet. Please supply username and password.\r\n");
 		}
+		AM_TRACE_END(AM_TRACE_DISPATCH, dispatch);
 	}
 
 	while (1) {
-		fflush(io);
+		if (handle_flush(io) != 0)
+			goto done;
 		line = handle_read_line(io);
+		AM_TRACE_BEGIN(dispatch);
 		if (line == NULL) {
 			goto done;
 		} else if (handle_compare(line, "QUIT") == 0) {
+			pop3_drop_commit(&drop);
 			fprintf(io, "+OK\r\n");
 			goto done;
 		} else if (handle_compare(line, "STAT") == 0) {
-			struct am_message *pamm;
 			int bytes;
 			int num;
+			int x;
 
-			num = 1;
-			bytes = 0;
-			pamm = NULL;
-			while (handle_foreach_message(&pamm)) {
-				bytes += pamm->bytes;
+			for (bytes = num = x = 0; x != drop.count; x++) {
+				if (pop3_drop_deleted(&drop, x))
+					continue;
+				bytes += drop.bytes[x];
 				num++;
 			}
-			fprintf(io, "+OK %d %d\r\n", num - 1, bytes);
+			fprintf(io, "+OK %d %d\r\n", num, bytes);
 		} else if (handle_compare(line, "LIST") == 0) {
-			struct am_message *pamm;
 			int bytes;
 			int num;
+			int x;
 
 			if (line[4] == 0) {
-				/* give all messages a valid number */
-				num = 1;
-				bytes = 0;
-				pamm = NULL;
-				while (handle_foreach_message(&pamm)) {
-					pamm->message_id = num++;
-					bytes += pamm->bytes;
+				for (bytes = num = x = 0; x != drop.count; x++) {
+					if (pop3_drop_deleted(&drop, x))
+						continue;
+					bytes += drop.bytes[x];
+					num++;
+				}
+				fprintf(io, "+OK %d messages (%d octets)\r\n", num, bytes);
+				for (x = 0; x != drop.count; x++) {
+					if (pop3_drop_deleted(&drop, x) == 0)
+						fprintf(io, "%d %d\r\n", x + 1, drop.bytes[x]);
 				}
-				fprintf(io, "+OK %d messages (%d octets)\r\n", num - 1, bytes);
-				pamm = NULL;
-				while (handle_foreach_message(&pamm))
-					fprintf(io, "%d %d\r\n", pamm->message_id, pamm->bytes);
 				fprintf(io, ".\r\n");
 			} else {
-				num = atoi(line + 5);
-				bytes = 0;
-				pamm = NULL;
-				while (handle_foreach_message(&pamm)) {
-					if (pamm->message_id == num) {
-						bytes = pamm->bytes;
-						fprintf(io, "+OK %d %d\r\n", num, bytes);
-						break;
-					}
+				x = pop3_lookup(&drop, line + 5);
+				if (x < 0)
+					fprintf(io, "-ERR No such message\r\n");
+				else
+					fprintf(io, "+OK %d %d\r\n", x + 1, drop.bytes[x]);
+			}
+		} else if (handle_compare(line, "UIDL") == 0) {
+			int x;
+
+			if (line[4] == 0) {
+				fprintf(io, "+OK\r\n");
+				for (x = 0; x != drop.count; x++) {
+					if (pop3_drop_deleted(&drop, x) == 0)
+						fprintf(io, "%d %ju\r\n", x + 1, (uintmax_t)drop.uid[x]);
 				}
-				if (pamm == NULL)
+				fprintf(io, ".\r\n");
+			} else {
+				x = pop3_lookup(&drop, line + 5);
+				if (x < 0)
 					fprintf(io, "-ERR No such message\r\n");
+				else
+					fprintf(io, "+OK %d %ju\r\n", x + 1, (uintmax_t)drop.uid[x]);
 			}
 		} else if (handle_compare(line, "RETR ") == 0) {
+			const struct am_snapshot *ps;
 			struct am_message *pamm;
-			int num;
+			struct iovec iov[3];
+			const char *data;
+			char status[32];
+			uint64_t start;
+			int x;
 
-			num = atoi(line + 5);
-			pamm = NULL;
-			while (handle_foreach_message(&pamm)) {
-				if (num == pamm->message_id) {
-					fprintf(io, "+OK %d octets\r\n", pamm->bytes);
-					fwrite(pamm->data, 1, pamm->bytes, io);
-					fprintf(io, "\r\n.\r\n");
-					break;
+			start = am_metrics_now();
+			x = pop3_lookup(&drop, line + 5);
+			ps = handle_mailbox_enter(drop.mbox);
+			pamm = (x < 0) ? NULL : handle_snapshot_lookup(ps, drop.uid[x]);
+			data = (pamm != NULL) ? handle_message_data(pamm) : NULL;
+			if (data != NULL) {
+				/* status, message and terminator in one write */
+				iov[0].iov_base = status;
+				iov[0].iov_len = snprintf(status, sizeof(status),
+				    "+OK %d octets\r\n", pamm->bytes);
+				iov[1].iov_base = __DECONST(char *, data);
+				iov[1].iov_len = pamm->bytes;
+				iov[2].iov_base = __DECONST(char *, "\r\n.\r\n");
+				iov[2].iov_len = 5;
+				if (handle_writev(io, iov, 3) != 0) {
+					handle_snapshot_leave();
+					goto done;
 				}
-			}
-			if (pamm == NULL)
+				pamm->flags |= AM_MSG_DELIVERED;
+				am_metrics_count(AM_CNT_MESSAGES_RETRIEVED, 1);
+				atomic_fetch_add_explicit(&drop.mbox->retrieved, 1,
+				    memory_order_relaxed);
+				am_metrics_observe(AM_HIST_POP3_RETR, start);
+			} else if (x < 0) {
 				fprintf(io, "-ERR Non-existing message\r\n");
-
+			} else if (pamm != NULL) {
+				fprintf(io, "-ERR Cannot read message\r\n");
+			} else {
+				/* evicted or deleted by another session */
+				fprintf(io, "-ERR Message was removed\r\n");
+			}
+			handle_snapshot_leave();
 		} else if (handle_compare(line, "DELE ") == 0) {
-			struct am_message *pamm;
-			int num;
+			int x;
 
-			num = atoi(line + 5);
-			pamm = NULL;
-			while (handle_foreach_message(&pamm)) {
-				if (num == pamm->message_id) {
-					fprintf(io, "+OK message %d deleted\r\n", num);
-					handle_delete_message(pamm);
-					break;
-				}
-			}
-			if (pamm == NULL)
+			x = pop3_lookup(&drop, line + 5);
+			if (x < 0) {
 				fprintf(io, "-ERR Non-existing message\r\n");
+			} else if (am_read_only) {
+				fprintf(io, "-ERR Maildrop is read-only\r\n");
+			} else {
+				drop.deleted[x / 8] |= 1 << (x % 8);
+				fprintf(io, "+OK message %d deleted\r\n", x + 1);
+			}
 		} else if (handle_compare(line, "RSET") == 0) {
+			memset(drop.deleted, 0, (drop.count + 7) / 8);
 			fprintf(io, "+OK\r\n");
 		} else if (handle_compare(line, "WHO") == 0) {
 			fprintf(io, "+OK AsteriskMail v1.0\r\n");
@@ -174,10 +314,9 @@ handle_pop3_connection(int fd)
 		} else {
 			fprintf(io, "-ERR Invalid command\r\n");
 		}
+		AM_TRACE_END(AM_TRACE_DISPATCH, dispatch);
 	}
 done:
-	if (io != NULL)
-		fclose(io);
-	free(username);
-	free(password);
+	handle_close(io, fd);
+	am_arena_free(&arena);
 }
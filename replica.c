@@ -0,0 +1,1017 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Asynchronous primary/replica replication of the message store. The
+ * primary listens on its own port, and streams every message stored
+ * and every batch of messages removed to one replica at a time, over
+ * a persistent TCP connection. The changes are queued by the store
+ * while it holds its lock, and a separate thread sends whatever has
+ * piled up in one write, so that storing a message never waits for
+ * the network. Each change carries a sequence number, and the replica
+ * acknowledges the last one applied each time it has drained its
+ * socket, which gives the replication lag.
+ *
+ * A replica runs the same binary, rejects SMTP and all changes by its
+ * own clients, and serves the replicated store to POP3, IMAP and HTTP.
+ * When it connects, it tells the primary which store it follows and
+ * the last message id it has. If the primary still has the same store,
+ * it only sends the ids of the older messages it has kept and the newer
+ * messages; otherwise, like after a restart of the primary, the replica
+ * throws away its store and receives all of it again. SIGUSR1 promotes
+ * the replica to a writable primary; there is no automatic failover.
+ *
+ * All record header fields and ids are little endian.
+ */
+
+#include <sys/endian.h>
+
+#include <time.h>
+
+#include "asteriskmail.h"
+
+#define	AM_REPLICA_MAGIC 0x414d5250U	/* "AMRP" */
+
+enum {
+	AM_REPLICA_HELLO,		/* store followed and last id, from the replica */
+	AM_REPLICA_STORE,		/* store sent, flags tell if in full */
+	AM_REPLICA_SYNC,		/* ids up to the last one which are kept */
+	AM_REPLICA_MESSAGE,		/* one stored message */
+	AM_REPLICA_REMOVE,		/* ids of removed messages */
+	AM_REPLICA_END,			/* end of the store snapshot */
+	AM_REPLICA_ACK,			/* last change applied, from the replica */
+};
+
+struct am_replica_rec {
+	uint32_t magic;
+	uint32_t type;
+	uint32_t length;		/* bytes of data following */
+	uint32_t flags;			/* mailbox in the upper half */
+	uint64_t uid;
+	uint64_t seq;			/* sequence number or store id */
+};
+
+/* a change waiting to be sent */
+struct am_replica_entry {
+	struct am_replica_entry *next;
+	struct am_replica_rec rec;
+	uint8_t	data[];
+};
+
+/* buffered connection to the peer */
+struct am_replica_io {
+	int	fd;
+	uint32_t off;			/* read offset */
+	uint32_t len;			/* bytes buffered */
+	uint8_t	buf[AM_REPLICA_BUF_MAX];
+};
+
+/* primary id to local id of a replicated message */
+struct am_replica_map {
+	uint64_t primary;
+	uint64_t local;
+};
+
+_Atomic int am_read_only;
+uint64_t am_replica_id;			/* this store, kept over upgrades */
+
+static char am_replica_host[NI_MAXHOST];	/* primary followed */
+static char am_replica_port[NI_MAXSERV];
+static const char *am_replica_bind_host;	/* replication listener */
+static const char *am_replica_bind_port;
+static _Atomic int am_replica_stopping;
+static _Atomic int am_replica_threads;
+static _Atomic int am_replica_promoted;
+
+/* state of the primary, the queue is protected by am_replica_mtx */
+static pthread_mutex_t am_replica_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t am_replica_cv = PTHREAD_COND_INITIALIZER;
+static struct am_replica_entry *am_replica_head;
+static struct am_replica_entry **am_replica_tail = &am_replica_head;
+static size_t am_replica_queued;
+static uint64_t am_replica_seq;
+static int am_replica_overflow;
+static _Atomic int am_replica_active;
+
+/* state of the replica, only used by the follower thread */
+static uint64_t am_replica_store;	/* store id of the primary */
+static uint64_t am_replica_last;	/* last primary id received */
+static uint64_t am_replica_applied;	/* last change applied */
+static uint64_t am_replica_acked;	/* last change acknowledged */
+static struct am_replica_map *am_replica_map;	/* ordered by primary id */
+static int am_replica_count;
+static int am_replica_max;
+static int am_replica_dead;		/* removed entries in the map */
+
+/* parse the "host:port" of the primary to follow */
+int
+am_replica_parse(const char *str)
+{
+	const char *port;
+	size_t len;
+
+	if (*str == '[') {
+		/* IPv6 address literal */
+		port = strchr(str, ']');
+		if (port == NULL || port[1] != ':')
+			return (EINVAL);
+		str++;
+		len = port - str;
+		port += 2;
+	} else {
+		port = strrchr(str, ':');
+		if (port == NULL)
+			return (EINVAL);
+		len = port - str;
+		port++;
+	}
+	if (len == 0 || len >= sizeof(am_replica_host) ||
+	    *port == 0 || strlen(port) >= sizeof(am_replica_port))
+		return (EINVAL);
+	memcpy(am_replica_host, str, len);
+	am_replica_host[len] = 0;
+	strlcpy(am_replica_port, port, sizeof(am_replica_port));
+	am_read_only = 1;
+	return (0);
+}
+
+/* set the address replicas connect to */
+int
+am_replica_listen(const char *host, const char *port)
+{
+	if (*port == 0)
+		return (EINVAL);
+	am_replica_bind_host = host;
+	am_replica_bind_port = port;
+	return (0);
+}
+
+static void
+am_replica_encode(struct am_replica_rec *rec, uint32_t type, uint64_t uid,
+    uint32_t flags, uint64_t seq, uint32_t len)
+{
+	rec->magic = htole32(AM_REPLICA_MAGIC);
+	rec->type = htole32(type);
+	rec->length = htole32(len);
+	rec->flags = htole32(flags);
+	rec->uid = htole64(uid);
+	rec->seq = htole64(seq);
+}
+
+static int
+am_replica_decode(struct am_replica_rec *rec)
+{
+	rec->magic = le32toh(rec->magic);
+	rec->type = le32toh(rec->type);
+	rec->length = le32toh(rec->length);
+	rec->flags = le32toh(rec->flags);
+	rec->uid = le64toh(rec->uid);
+	rec->seq = le64toh(rec->seq);
+	return (rec->magic != AM_REPLICA_MAGIC || rec->length > INT_MAX);
+}
+
+static int
+am_replica_flush(struct am_replica_io *pio)
+{
+	const uint8_t *ptr = pio->buf;
+	size_t len = pio->len;
+	ssize_t retval;
+
+	pio->len = 0;
+	while (len != 0) {
+		retval = send(pio->fd, ptr, len, MSG_NOSIGNAL);
+		if (retval < 0) {
+			if (errno == EINTR)
+				continue;
+			return (1);
+		}
+		ptr += retval;
+		len -= retval;
+	}
+	return (0);
+}
+
+static int
+am_replica_write(struct am_replica_io *pio, const void *ptr, size_t len)
+{
+	size_t part;
+
+	while (len != 0) {
+		if (pio->len == sizeof(pio->buf) && am_replica_flush(pio) != 0)
+			return (1);
+		part = sizeof(pio->buf) - pio->len;
+		if (part > len)
+			part = len;
+		memcpy(pio->buf + pio->len, ptr, part);
+		pio->len += part;
+		ptr = (const uint8_t *)ptr + part;
+		len -= part;
+	}
+	return (0);
+}
+
+static int
+am_replica_send(struct am_replica_io *pio, uint32_t type, uint64_t uid,
+    uint32_t flags, uint64_t seq, const void *data, uint32_t len)
+{
+	struct am_replica_rec rec;
+
+	am_replica_encode(&rec, type, uid, flags, seq, len);
+	return (am_replica_write(pio, &rec, sizeof(rec)) ||
+	    am_replica_write(pio, data, len));
+}
+
+/*
+ * Queue one change for the replica. Called with the store locked, so
+ * that the changes are queued in the order they were made.
+ */
+static void
+am_replica_queue(uint32_t type, uint64_t uid, uint32_t flags, const void *data, uint32_t len)
+{
+	struct am_replica_entry *pe;
+
+	pe = malloc(sizeof(*pe) + len);
+	if (pe != NULL && len != 0)
+		memcpy(pe->data, data, len);
+
+	pthread_mutex_lock(&am_replica_mtx);
+	if (am_replica_active == 0) {
+		pthread_mutex_unlock(&am_replica_mtx);
+		free(pe);
+		return;
+	}
+	if (pe == NULL || am_replica_queued + sizeof(*pe) + len > AM_REPLICA_QUEUE_MAX) {
+		/* the replica cannot keep up, it catches up when reconnecting */
+		am_replica_active = 0;
+		am_replica_overflow = 1;
+		pthread_cond_signal(&am_replica_cv);
+		pthread_mutex_unlock(&am_replica_mtx);
+		free(pe);
+		return;
+	}
+	am_replica_encode(&pe->rec, type, uid, flags, ++am_replica_seq, len);
+	pe->next = NULL;
+	*am_replica_tail = pe;
+	am_replica_tail = &pe->next;
+	am_replica_queued += sizeof(*pe) + len;
+	am_metrics_gauge(AM_GAUGE_REPLICA_QUEUE, sizeof(*pe) + len);
+	/* the sender takes the whole queue, wake it up only once */
+	if (am_replica_head == pe)
+		pthread_cond_signal(&am_replica_cv);
+	pthread_mutex_unlock(&am_replica_mtx);
+}
+
+void
+am_replica_message(const struct am_message *pam)
+{
+	void *data;
+	void *copy = NULL;
+
+	if (atomic_load_explicit(&am_replica_active, memory_order_relaxed) == 0)
+		return;
+
+	/* the replica gets the raw data */
+	data = atomic_load(&pam->data);
+	if ((uintptr_t)data & AM_COLD_TAG) {
+		data = copy = am_cold_copy(pam, data);
+		if (data == NULL)
+			return;
+	}
+	am_replica_queue(AM_REPLICA_MESSAGE, pam->uid, pam->mbox->id << 16,
+	    data, pam->bytes);
+	free(copy);
+}
+
+void
+am_replica_remove(const uint64_t *uid, int num)
+{
+	uint64_t *ptr;
+	int x;
+
+	if (atomic_load_explicit(&am_replica_active, memory_order_relaxed) == 0 ||
+	    num == 0)
+		return;
+
+	ptr = malloc(num * sizeof(ptr[0]));
+	if (ptr == NULL)
+		return;
+	for (x = 0; x != num; x++)
+		ptr[x] = htole64(uid[x]);
+	am_replica_queue(AM_REPLICA_REMOVE, 0, 0, ptr, num * sizeof(ptr[0]));
+	free(ptr);
+}
+
+/*
+ * Start queueing changes, called with the store locked by
+ * handle_store_follow(). Returns the sequence number of the last
+ * change before.
+ */
+uint64_t
+am_replica_attach(void)
+{
+	uint64_t seq;
+
+	pthread_mutex_lock(&am_replica_mtx);
+	am_replica_active = 1;
+	am_replica_overflow = 0;
+	seq = am_replica_seq;
+	pthread_mutex_unlock(&am_replica_mtx);
+	return (seq);
+}
+
+/* stop queueing changes and throw the queue away */
+static void
+am_replica_detach(void)
+{
+	struct am_replica_entry *pe;
+
+	pthread_mutex_lock(&am_replica_mtx);
+	am_replica_active = 0;
+	pe = am_replica_head;
+	am_replica_head = NULL;
+	am_replica_tail = &am_replica_head;
+	am_metrics_gauge(AM_GAUGE_REPLICA_QUEUE, -(int64_t)am_replica_queued);
+	am_replica_queued = 0;
+	pthread_mutex_unlock(&am_replica_mtx);
+
+	while (pe != NULL) {
+		struct am_replica_entry *next = pe->next;
+
+		free(pe);
+		pe = next;
+	}
+}
+
+/*
+ * Send the snapshot of the store the replica is missing. Messages
+ * which are cold are sent decompressed.
+ */
+static int
+am_replica_snapshot(struct am_replica_io *pio, const struct am_snapshot *ps,
+    uint64_t last, int full, uint64_t seq)
+{
+	struct am_replica_rec rec;
+	const struct am_message *pam;
+	uint64_t uid;
+	void *data;
+	void *copy;
+	int retval;
+	int num;
+	int x;
+
+	if (am_replica_send(pio, AM_REPLICA_STORE, 0, full, am_replica_id, NULL, 0) != 0)
+		return (1);
+
+	/* the ids are increasing, the kept ones come first */
+	for (num = 0; num != ps->count && ps->msg[num]->uid <= last; num++)
+		;
+	if (full == 0) {
+		am_replica_encode(&rec, AM_REPLICA_SYNC, last, 0, 0, num * sizeof(uid));
+		if (am_replica_write(pio, &rec, sizeof(rec)) != 0)
+			return (1);
+		for (x = 0; x != num; x++) {
+			uid = htole64(ps->msg[x]->uid);
+			if (am_replica_write(pio, &uid, sizeof(uid)) != 0)
+				return (1);
+		}
+	} else {
+		num = 0;
+	}
+
+	for (x = num; x != ps->count; x++) {
+		if (am_replica_stopping)
+			return (1);
+		pam = ps->msg[x];
+		data = atomic_load(&pam->data);
+		copy = NULL;
+		if ((uintptr_t)data & AM_COLD_TAG) {
+			data = copy = am_cold_copy(pam, data);
+			if (data == NULL)
+				return (1);
+		}
+		retval = am_replica_send(pio, AM_REPLICA_MESSAGE, pam->uid,
+		    pam->mbox->id << 16, 0, data, pam->bytes);
+		free(copy);
+		if (retval != 0)
+			return (1);
+		am_metrics_count(AM_CNT_REPLICA_SENT, 1);
+	}
+	return (am_replica_send(pio, AM_REPLICA_END, 0, 0, seq, NULL, 0) ||
+	    am_replica_flush(pio));
+}
+
+/*
+ * Read the acknowledgements which have arrived, without waiting. A
+ * partial record is kept in "prec". Returns non-zero on EOF.
+ */
+static int
+am_replica_acks(int fd, struct am_replica_rec *prec, size_t *poff, uint64_t *packed)
+{
+	ssize_t retval;
+
+	for (;;) {
+		retval = recv(fd, (uint8_t *)prec + *poff,
+		    sizeof(*prec) - *poff, MSG_DONTWAIT);
+		if (retval < 0)
+			return (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+		if (retval == 0)
+			return (1);
+		*poff += retval;
+		if (*poff != sizeof(*prec))
+			continue;
+		*poff = 0;
+		if (am_replica_decode(prec) != 0 ||
+		    prec->type != AM_REPLICA_ACK || prec->length != 0)
+			return (1);
+		*packed = prec->seq;
+	}
+}
+
+/* serve one replica until it disconnects or falls too far behind */
+static void
+am_replica_serve(int fd)
+{
+	struct timeval tv = { .tv_sec = AM_REPLICA_TIMEOUT };
+	struct am_replica_rec hello;
+	struct am_replica_entry *pe;
+	struct am_replica_entry *next;
+	struct am_replica_rec ack;
+	struct am_replica_io *pio;
+	const struct am_snapshot *ps;
+	struct timespec ts;
+	uint64_t seq;
+	uint64_t acked;
+	int64_t lag = 0;
+	size_t bytes;
+	size_t off = 0;
+	int overflow;
+	int flag = 1;
+	int full;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(flag));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (recv(fd, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello) ||
+	    am_replica_decode(&hello) != 0 || hello.type != AM_REPLICA_HELLO)
+		return;
+
+	pio = malloc(sizeof(*pio));
+	if (pio == NULL)
+		return;
+	pio->fd = fd;
+	pio->off = pio->len = 0;
+
+	ps = handle_store_follow(&seq);
+	full = (hello.seq != am_replica_id || hello.uid >= ps->uidnext);
+	am_metrics_count(full ? AM_CNT_REPLICA_FULL : AM_CNT_REPLICA_INCREMENTAL, 1);
+	am_metrics_gauge(AM_GAUGE_REPLICA_CONNECTED, 1);
+	if (am_replica_snapshot(pio, ps, hello.uid, full, seq) != 0) {
+		handle_snapshot_leave();
+		goto done;
+	}
+	handle_snapshot_leave();
+	acked = seq;
+
+	while (am_replica_stopping == 0) {
+		pthread_mutex_lock(&am_replica_mtx);
+		if (am_replica_head == NULL && am_replica_overflow == 0) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += AM_REPLICA_WAIT_MS * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&am_replica_cv, &am_replica_mtx, &ts);
+		}
+		/* send all changes which have piled up in one go */
+		pe = am_replica_head;
+		am_replica_head = NULL;
+		am_replica_tail = &am_replica_head;
+		bytes = am_replica_queued;
+		am_replica_queued = 0;
+		overflow = am_replica_overflow;
+		seq = am_replica_seq;
+		pthread_mutex_unlock(&am_replica_mtx);
+
+		am_metrics_gauge(AM_GAUGE_REPLICA_QUEUE, -(int64_t)bytes);
+
+		for (; pe != NULL; pe = next) {
+			next = pe->next;
+			if (overflow == 0) {
+				overflow = am_replica_write(pio, &pe->rec,
+				    sizeof(pe->rec) + le32toh(pe->rec.length));
+				am_metrics_count(AM_CNT_REPLICA_SENT, 1);
+			}
+			free(pe);
+		}
+		if (overflow != 0 || am_replica_flush(pio) != 0 ||
+		    am_replica_acks(fd, &ack, &off, &acked) != 0)
+			break;
+
+		am_metrics_gauge(AM_GAUGE_REPLICA_LAG, (int64_t)(seq - acked) - lag);
+		lag = seq - acked;
+	}
+done:
+	am_replica_detach();
+	am_metrics_gauge(AM_GAUGE_REPLICA_LAG, -lag);
+	am_metrics_gauge(AM_GAUGE_REPLICA_CONNECTED, -1);
+	free(pio);
+}
+
+static int
+am_replica_bind(void)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *res0;
+	int flag = 1;
+	int s = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+
+	if (getaddrinfo(am_replica_bind_host, am_replica_bind_port, &hints, &res) != 0)
+		return (-1);
+
+	for (res0 = res; res0 != NULL; res0 = res0->ai_next) {
+		s = socket(res0->ai_family, res0->ai_socktype | SOCK_CLOEXEC,
+		    res0->ai_protocol);
+		if (s < 0)
+			continue;
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+		if (bind(s, res0->ai_addr, res0->ai_addrlen) == 0 &&
+		    listen(s, 1) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+	return (s);
+}
+
+/*
+ * Accept one replica at a time. The port is still held by the
+ * previous instance during an upgrade, so binding is retried.
+ */
+static void *
+am_replica_primary_thread(void *arg)
+{
+	struct pollfd pfd = { .fd = -1, .events = POLLIN };
+	int fd;
+
+	while (am_replica_stopping == 0) {
+		if (pfd.fd < 0) {
+			pfd.fd = am_replica_bind();
+			if (pfd.fd < 0) {
+				usleep(AM_REPLICA_RETRY_MS * 1000);
+				continue;
+			}
+		}
+		if (poll(&pfd, 1, AM_REPLICA_RETRY_MS) < 1)
+			continue;
+		fd = accept(pfd.fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		am_replica_serve(fd);
+		close(fd);
+	}
+	if (pfd.fd > -1)
+		close(pfd.fd);
+	am_replica_threads--;
+	return (NULL);
+}
+
+static int
+am_replica_connect(void)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *res0;
+	struct timeval tv = { .tv_sec = AM_REPLICA_TIMEOUT };
+	int flag = 1;
+	int s = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(am_replica_host, am_replica_port, &hints, &res) != 0)
+		return (-1);
+
+	for (res0 = res; res0 != NULL; res0 = res0->ai_next) {
+		s = socket(res0->ai_family, res0->ai_socktype | SOCK_CLOEXEC,
+		    res0->ai_protocol);
+		if (s < 0)
+			continue;
+		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(s, res0->ai_addr, res0->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+
+	if (s < 0)
+		return (-1);
+
+	/* wake up regularly to check for promotion */
+	tv.tv_sec = AM_REPLICA_RETRY_MS / 1000;
+	tv.tv_usec = (AM_REPLICA_RETRY_MS % 1000) * 1000;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(flag));
+	return (s);
+}
+
+/*
+ * Read from the primary. Each time everything received is applied,
+ * the last change is acknowledged before waiting for more.
+ */
+static int
+am_replica_read(struct am_replica_io *pio, void *ptr, size_t len)
+{
+	struct am_replica_rec rec;
+	ssize_t retval;
+	size_t part;
+
+	while (len != 0) {
+		if (pio->off == pio->len) {
+			if (am_replica_promoted != 0 || am_replica_stopping != 0)
+				return (1);
+			if (am_replica_acked != am_replica_applied) {
+				am_replica_acked = am_replica_applied;
+				am_replica_encode(&rec, AM_REPLICA_ACK, 0, 0,
+				    am_replica_acked, 0);
+				if (send(pio->fd, &rec, sizeof(rec), MSG_NOSIGNAL) != sizeof(rec))
+					return (1);
+			}
+			retval = recv(pio->fd, pio->buf, sizeof(pio->buf), 0);
+			if (retval < 0) {
+				if (errno == EINTR || errno == EAGAIN ||
+				    errno == EWOULDBLOCK)
+					continue;
+				return (1);
+			}
+			if (retval == 0)
+				return (1);
+			pio->off = 0;
+			pio->len = retval;
+		}
+		part = pio->len - pio->off;
+		if (part > len)
+			part = len;
+		memcpy(ptr, pio->buf + pio->off, part);
+		pio->off += part;
+		ptr = (uint8_t *)ptr + part;
+		len -= part;
+	}
+	return (0);
+}
+
+static int
+am_replica_map_add(uint64_t primary, uint64_t local)
+{
+	struct am_replica_map *ptr;
+
+	if (am_replica_count == am_replica_max) {
+		am_replica_max = am_replica_max ? 2 * am_replica_max : 64;
+		ptr = realloc(am_replica_map, am_replica_max * sizeof(ptr[0]));
+		if (ptr == NULL)
+			return (1);
+		am_replica_map = ptr;
+	}
+	am_replica_map[am_replica_count].primary = primary;
+	am_replica_map[am_replica_count].local = local;
+	am_replica_count++;
+	return (0);
+}
+
+/* drop removed entries from the map */
+static void
+am_replica_map_compact(void)
+{
+	int x;
+	int y;
+
+	for (x = y = 0; x != am_replica_count; x++) {
+		if (am_replica_map[x].local != 0)
+			am_replica_map[y++] = am_replica_map[x];
+	}
+	am_replica_count = y;
+	am_replica_dead = 0;
+}
+
+/*
+ * Translate the increasing primary ids of removed messages into local
+ * ids in place, and drop them from the map. Returns the number of ids
+ * which are still stored.
+ */
+static int
+am_replica_map_remove(uint64_t *uid, int num)
+{
+	int lo;
+	int hi;
+	int mid;
+	int x;
+	int y;
+
+	for (x = y = 0; x != num; x++) {
+		lo = 0;
+		hi = am_replica_count;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (am_replica_map[mid].primary < uid[x])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == am_replica_count || am_replica_map[lo].primary != uid[x] ||
+		    am_replica_map[lo].local == 0)
+			continue;
+		uid[y++] = am_replica_map[lo].local;
+		am_replica_map[lo].local = 0;
+		am_replica_dead++;
+	}
+	if (am_replica_dead > AM_INDEX_MIN && am_replica_dead > am_replica_count / 2)
+		am_replica_map_compact();
+	return (y);
+}
+
+/*
+ * Remove the messages up to the primary id "last" which the primary
+ * no longer has. The ids it kept are given in increasing order.
+ */
+static int
+am_replica_map_sync(const uint64_t *uid, int num, uint64_t last)
+{
+	uint64_t *local;
+	int x;
+	int y;
+	int n;
+
+	local = malloc((am_replica_count + 1) * sizeof(local[0]));
+	if (local == NULL)
+		return (1);
+
+	for (x = y = n = 0; x != am_replica_count &&
+	    am_replica_map[x].primary <= last; x++) {
+		if (am_replica_map[x].local == 0)
+			continue;
+		while (y != num && uid[y] < am_replica_map[x].primary)
+			y++;
+		if (y != num && uid[y] == am_replica_map[x].primary)
+			continue;
+		local[n++] = am_replica_map[x].local;
+		am_replica_map[x].local = 0;
+	}
+	am_replica_map_compact();
+	handle_remove_messages(local, n);
+	free(local);
+	return (0);
+}
+
+/* remove all messages, before receiving the store of the primary in full */
+static int
+am_replica_clear(void)
+{
+	const struct am_snapshot *ps;
+	uint64_t *uid;
+	int num;
+	int x;
+
+	ps = handle_snapshot_enter();
+	num = ps->count;
+	uid = malloc((num + 1) * sizeof(uid[0]));
+	if (uid != NULL) {
+		for (x = 0; x != num; x++)
+			uid[x] = ps->msg[x]->uid;
+	}
+	handle_snapshot_leave();
+	if (uid == NULL)
+		return (1);
+	handle_remove_messages(uid, num);
+	free(uid);
+	am_replica_count = 0;
+	am_replica_dead = 0;
+	am_replica_last = 0;
+	return (0);
+}
+
+/* read one record and apply it to the message store */
+static int
+am_replica_apply(struct am_replica_io *pio)
+{
+	struct am_replica_rec rec;
+	struct am_message *pam;
+	uint64_t *uid;
+	int retval;
+	int num;
+	int x;
+
+	if (am_replica_read(pio, &rec, sizeof(rec)) != 0 ||
+	    am_replica_decode(&rec) != 0)
+		return (1);
+
+	switch (rec.type) {
+	case AM_REPLICA_STORE:
+		if (rec.length != 0)
+			return (1);
+		if (rec.flags != 0 && am_replica_clear() != 0)
+			return (1);
+		am_replica_store = rec.seq;
+		am_metrics_count(rec.flags ? AM_CNT_REPLICA_FULL :
+		    AM_CNT_REPLICA_INCREMENTAL, 1);
+		break;
+	case AM_REPLICA_MESSAGE:
+		pam = handle_create_message();
+		if (pam == NULL)
+			return (1);
+		pam->data = am_pool_alloc(rec.length);
+		if (pam->data == NULL && rec.length != 0) {
+			handle_delete_message(pam);
+			return (1);
+		}
+		pam->bytes = rec.length;
+		pam->size = am_pool_size(rec.length);
+		if (am_replica_read(pio, pam->data, rec.length) != 0) {
+			handle_delete_message(pam);
+			return (1);
+		}
+		/* the same id as on the primary, unless already taken */
+		pam->uid = rec.uid;
+		pam->mbox = am_mailbox_get(rec.flags >> 16);
+		am_replica_last = rec.uid;
+		am_epoch_enter();
+		if (handle_insert_message(pam) != 0) {
+			am_epoch_leave();
+			am_metrics_count(AM_CNT_MESSAGES_REJECTED, 1);
+			handle_delete_message(pam);
+			break;
+		}
+		retval = am_replica_map_add(rec.uid, pam->uid);
+		am_epoch_leave();
+		if (retval != 0)
+			return (1);
+		am_metrics_count(AM_CNT_REPLICA_APPLIED, 1);
+		break;
+	case AM_REPLICA_SYNC:
+	case AM_REPLICA_REMOVE:
+		if (rec.length % sizeof(uid[0]) != 0)
+			return (1);
+		uid = malloc(rec.length + sizeof(uid[0]));
+		if (uid == NULL)
+			return (1);
+		if (am_replica_read(pio, uid, rec.length) != 0) {
+			free(uid);
+			return (1);
+		}
+		num = rec.length / sizeof(uid[0]);
+		for (x = 0; x != num; x++)
+			uid[x] = le64toh(uid[x]);
+		if (rec.type == AM_REPLICA_SYNC) {
+			retval = am_replica_map_sync(uid, num, rec.uid);
+		} else {
+			handle_remove_messages(uid, am_replica_map_remove(uid, num));
+			am_metrics_count(AM_CNT_REPLICA_APPLIED, 1);
+			retval = 0;
+		}
+		free(uid);
+		if (retval != 0)
+			return (1);
+		break;
+	case AM_REPLICA_END:
+		if (rec.length != 0)
+			return (1);
+		break;
+	default:
+		return (1);
+	}
+	/* the records of the snapshot have no sequence number */
+	if (rec.seq != 0 && rec.type != AM_REPLICA_STORE)
+		am_replica_applied = rec.seq;
+	return (0);
+}
+
+/* follow the primary until promoted */
+static void *
+am_replica_follow_thread(void *arg)
+{
+	struct am_replica_io *pio;
+	struct am_replica_rec hello;
+	int fd;
+
+	pio = malloc(sizeof(*pio));
+	if (pio == NULL)
+		goto done;
+
+	while (am_replica_promoted == 0 && am_replica_stopping == 0) {
+		fd = am_replica_connect();
+		if (fd < 0) {
+			usleep(AM_REPLICA_RETRY_MS * 1000);
+			continue;
+		}
+		pio->fd = fd;
+		pio->off = pio->len = 0;
+		am_replica_acked = am_replica_applied = 0;
+		am_replica_encode(&hello, AM_REPLICA_HELLO, am_replica_last, 0,
+		    am_replica_store, 0);
+		if (send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) == sizeof(hello)) {
+			am_metrics_gauge(AM_GAUGE_REPLICA_CONNECTED, 1);
+			while (am_replica_apply(pio) == 0)
+				;
+			am_metrics_gauge(AM_GAUGE_REPLICA_CONNECTED, -1);
+		}
+		close(fd);
+	}
+	free(pio);
+done:
+	if (am_replica_promoted != 0)
+		am_metrics_gauge(AM_GAUGE_READ_ONLY, -1);
+	am_replica_threads--;
+	return (NULL);
+}
+
+/*
+ * Make a replica writable. It stops following the primary as soon as
+ * the record being applied is done. Called from a signal handler.
+ */
+void
+am_replica_promote(void)
+{
+	if (am_replica_host[0] == 0)
+		return;
+	am_replica_promoted = 1;
+	am_read_only = 0;
+}
+
+/* stop replication, and wait for its threads to finish */
+void
+am_replica_stop(void)
+{
+	am_replica_stopping = 1;
+	pthread_mutex_lock(&am_replica_mtx);
+	pthread_cond_signal(&am_replica_cv);
+	pthread_mutex_unlock(&am_replica_mtx);
+	while (am_replica_threads != 0)
+		usleep(AM_TIMER_TICK_MS * 1000);
+	am_replica_stopping = 0;
+}
+
+int
+am_replica_init(void)
+{
+	pthread_t td;
+
+	if (am_replica_id == 0) {
+		/* a new store, unless handed over by the previous instance */
+		while (am_replica_id == 0)
+			am_replica_id = ((uint64_t)arc4random() << 32) | arc4random();
+		if (am_read_only != 0)
+			am_metrics_gauge(AM_GAUGE_READ_ONLY, 1);
+	}
+	if (am_replica_bind_port != NULL) {
+		am_replica_threads++;
+		if (pthread_create(&td, NULL, &am_replica_primary_thread, NULL) != 0) {
+			am_replica_threads--;
+			return (errno);
+		}
+		pthread_detach(td);
+	}
+	if (am_replica_host[0] != 0 && am_replica_promoted == 0) {
+		am_replica_threads++;
+		if (pthread_create(&td, NULL, &am_replica_follow_thread, NULL) != 0) {
+			am_replica_threads--;
+			return (errno);
+		}
+		pthread_detach(td);
+	}
+	return (0);
+}
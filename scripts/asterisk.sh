@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Stand-in for the Asterisk CLI, to test outbound SMS without modems:
+#
+#	asteriskmail -A scripts/asterisk.sh -d dongle0 -d dongle1 ...
+#
+# Every "asterisk -rx" command is appended to a log file. The
+# environment of asteriskmail controls the behaviour:
+#
+#	ASTERISK_LOG	log file, default /tmp/asterisk.log
+#	ASTERISK_DELAY	seconds each command takes, default 0
+#	ASTERISK_FAIL	dongles whose commands fail, separated by spaces
+#
+
+[ "$1" = "-rx" ] || exit 64
+
+LOG=${ASTERISK_LOG:-/tmp/asterisk.log}
+CMD=$2
+
+# dongle sms <dongle> <phone> "<text>"
+set -- $CMD
+DONGLE=$3
+
+sleep ${ASTERISK_DELAY:-0}
+
+for X in ${ASTERISK_FAIL}; do
+	if [ "$X" = "$DONGLE" ]; then
+		echo "FAIL $CMD" >> "$LOG"
+		exit 1
+	fi
+done
+
+echo "OK $CMD" >> "$LOG"
+exit 0
@@ -0,0 +1,537 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Full text search. Every stored message is split into words, from
+ * its Subject and From headers and its decoded body, and the inverted
+ * index maps each word to the increasing list of the ids of the
+ * messages containing it. The ids are delta encoded as variable length
+ * integers, so that most postings take a single byte. Letters are
+ * folded to lower case and phone numbers are indexed without their
+ * separators, so that "+47 915 12345" finds "+4791512345".
+ *
+ * The index is changed with am_search_mtx held, and read without any
+ * lock from within a store snapshot. New postings are appended beyond
+ * the published length of a list, and lists which are reallocated or
+ * rewritten are retired through the epoch allocator. Removed messages
+ * are remembered, and filtered out of all lists in one pass once they
+ * make up a good part of the index. Until then the ids of removed
+ * messages are simply not found in the snapshot by the reader.
+ */
+
+#include <ctype.h>
+
+#include "asteriskmail.h"
+
+struct am_postings {
+	struct am_retire retire;
+	uint32_t size;			/* bytes allocated for data */
+	_Atomic uint32_t len;		/* bytes visible to readers */
+	uint8_t	data[];
+};
+
+struct am_term {
+	struct am_retire retire;
+	_Atomic(struct am_term *) next;
+	_Atomic(struct am_postings *) post;
+	uint64_t last;			/* last id in the list */
+	uint32_t hash;
+	uint8_t	len;
+	char	name[];
+};
+
+static _Atomic(struct am_term *) am_search_hash[AM_SEARCH_BUCKETS];
+static pthread_mutex_t am_search_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *am_search_dead;	/* ids of removed messages */
+static int am_search_ndead;
+static int am_search_maxdead;
+static int am_search_docs;		/* messages in the index */
+
+/* bytes which are part of a word, UTF-8 sequences included */
+static int
+am_search_char(uint8_t ch)
+{
+	return (isalnum(ch) || ch >= 0x80);
+}
+
+/*
+ * Returns the next word between "ptr" and "end", normalized into
+ * "tok", and the position after it. Returns NULL when there are no
+ * more words.
+ */
+static const char *
+am_search_next(const char *ptr, const char *end, char *tok, size_t *plen)
+{
+	size_t len;
+
+	while (1) {
+		while (ptr < end && !am_search_char(*ptr) &&
+		    !(*ptr == '+' && ptr + 1 < end && isdigit((uint8_t)ptr[1])))
+			ptr++;
+		if (ptr == end)
+			return (NULL);
+
+		len = 0;
+		if (*ptr == '+') {
+			/* a phone number, digit groups are joined */
+			for (ptr++; ptr < end; ptr++) {
+				if (isdigit((uint8_t)*ptr)) {
+					if (len != AM_SEARCH_TOKEN_MAX)
+						tok[len++] = *ptr;
+				} else if ((*ptr != ' ' && *ptr != '-') ||
+				    ptr + 1 == end || !isdigit((uint8_t)ptr[1])) {
+					break;
+				}
+			}
+		} else {
+			for (; ptr < end && am_search_char(*ptr); ptr++) {
+				if (len != AM_SEARCH_TOKEN_MAX)
+					tok[len++] = tolower((uint8_t)*ptr);
+			}
+		}
+		/* single letters and digits are not worth indexing */
+		if (len > 1) {
+			*plen = len;
+			return (ptr);
+		}
+	}
+}
+
+/* FNV-1a of a normalized word */
+static uint32_t
+am_search_hash_key(const char *tok, size_t len)
+{
+	uint32_t hash = 2166136261U;
+
+	while (len--)
+		hash = (hash ^ (uint8_t)*tok++) * 16777619U;
+	return (hash);
+}
+
+static struct am_term *
+am_search_lookup(const char *tok, size_t len, uint32_t hash)
+{
+	struct am_term *pt;
+
+	for (pt = atomic_load(&am_search_hash[hash % AM_SEARCH_BUCKETS]);
+	    pt != NULL; pt = atomic_load(&pt->next)) {
+		if (pt->hash == hash && pt->len == len &&
+		    memcmp(pt->name, tok, len) == 0)
+			break;
+	}
+	return (pt);
+}
+
+static size_t
+am_search_term_size(size_t len)
+{
+	return (sizeof(struct am_term) + len + 1);
+}
+
+static size_t
+am_search_post_size(uint32_t size)
+{
+	return (sizeof(struct am_postings) + size);
+}
+
+static void
+am_search_free_term(struct am_retire *pr)
+{
+	struct am_term *pt = (struct am_term *)pr;
+
+	am_pool_free(pt, am_search_term_size(pt->len));
+}
+
+static void
+am_search_free_post(struct am_retire *pr)
+{
+	struct am_postings *pp = (struct am_postings *)pr;
+
+	am_pool_free(pp, am_search_post_size(pp->size));
+}
+
+/* returns a list with room for at least "size" bytes, or NULL */
+static struct am_postings *
+am_search_post_alloc(uint32_t size)
+{
+	struct am_postings *pp;
+	size_t total;
+
+	total = am_pool_size(am_search_post_size(size));
+	pp = am_pool_alloc(total);
+	if (pp == NULL)
+		return (NULL);
+	pp->size = total - sizeof(*pp);
+	atomic_init(&pp->len, 0);
+	am_metrics_gauge(AM_GAUGE_SEARCH_BYTES, total);
+	return (pp);
+}
+
+static void
+am_search_post_retire(struct am_postings *pp)
+{
+	am_metrics_gauge(AM_GAUGE_SEARCH_BYTES,
+	    -(int64_t)am_pool_size(am_search_post_size(pp->size)));
+	am_epoch_retire(&pp->retire, &am_search_free_post);
+}
+
+static int
+am_search_encode(uint8_t *ptr, uint64_t value)
+{
+	int len = 0;
+
+	while (value >= 0x80) {
+		ptr[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	ptr[len++] = value;
+	return (len);
+}
+
+/* decodes the next id of a list, returns the position after it */
+static uint32_t
+am_search_decode(const uint8_t *data, uint32_t off, uint64_t *pvalue)
+{
+	uint64_t delta = 0;
+	int shift = 0;
+	uint8_t ch;
+
+	do {
+		ch = data[off++];
+		delta |= (uint64_t)(ch & 0x7f) << shift;
+		shift += 7;
+	} while (ch & 0x80);
+	*pvalue += delta;
+	return (off);
+}
+
+/* appends a message id to the list of a word */
+static int
+am_search_add(const char *tok, size_t len, uint64_t uid)
+{
+	_Atomic(struct am_term *) *phead;
+	struct am_postings *pp;
+	struct am_postings *old;
+	struct am_term *pt;
+	uint8_t buffer[10];
+	uint32_t hash = am_search_hash_key(tok, len);
+	uint32_t off;
+	int num;
+
+	pt = am_search_lookup(tok, len, hash);
+	if (pt == NULL) {
+		/* a new word is published together with its first id */
+		num = am_search_encode(buffer, uid);
+		pt = am_pool_alloc(am_search_term_size(len));
+		if (pt == NULL)
+			return (ENOMEM);
+		pp = am_search_post_alloc(num);
+		if (pp == NULL) {
+			am_pool_free(pt, am_search_term_size(len));
+			return (ENOMEM);
+		}
+		memcpy(pp->data, buffer, num);
+		atomic_store(&pp->len, num);
+		atomic_init(&pt->post, pp);
+		pt->last = uid;
+		pt->hash = hash;
+		pt->len = len;
+		memcpy(pt->name, tok, len);
+		pt->name[len] = 0;
+
+		phead = &am_search_hash[hash % AM_SEARCH_BUCKETS];
+		atomic_init(&pt->next, atomic_load(phead));
+		atomic_store(phead, pt);
+		am_metrics_gauge(AM_GAUGE_SEARCH_TERMS, 1);
+		am_metrics_gauge(AM_GAUGE_SEARCH_BYTES,
+		    am_pool_size(am_search_term_size(len)));
+		return (0);
+	}
+	if (pt->last == uid) {
+		/* the word was seen before in this message */
+		return (0);
+	}
+
+	num = am_search_encode(buffer, uid - pt->last);
+	old = atomic_load(&pt->post);
+	off = atomic_load(&old->len);
+
+	if (off + num > old->size) {
+		pp = am_search_post_alloc(2 * old->size);
+		if (pp == NULL)
+			return (ENOMEM);
+		memcpy(pp->data, old->data, off);
+		atomic_store(&pp->len, off);
+		atomic_store(&pt->post, pp);
+		am_search_post_retire(old);
+	} else {
+		pp = old;
+	}
+
+	/* readers only look up to the published length */
+	memcpy(pp->data + off, buffer, num);
+	atomic_store_explicit(&pp->len, off + num, memory_order_release);
+	pt->last = uid;
+	return (0);
+}
+
+static int
+am_search_add_text(const char *ptr, const char *end, uint64_t uid)
+{
+	char tok[AM_SEARCH_TOKEN_MAX];
+	size_t len;
+	int error = 0;
+
+	while ((ptr = am_search_next(ptr, end, tok, &len)) != NULL)
+		error |= am_search_add(tok, len, uid);
+	return (error);
+}
+
+/*
+ * Adds a message which has just been stored to the index. Words which
+ * cannot be added for lack of memory are silently left out.
+ */
+void
+am_search_insert(const struct am_message *pam)
+{
+	const char *data = atomic_load(&__DECONST(struct am_message *, pam)->data);
+	const char *end = data + pam->bytes;
+	const char *body;
+	const char *ptr;
+	size_t len;
+
+	body = memmem(data, pam->bytes, "\r\n\r\n", 4);
+	if (body == NULL)
+		body = end;
+
+	pthread_mutex_lock(&am_search_mtx);
+	ptr = handle_message_header(data, body, "Subject:", &len);
+	if (ptr != NULL)
+		am_search_add_text(ptr, ptr + len, pam->uid);
+	ptr = handle_message_header(data, body, "From:", &len);
+	if (ptr != NULL)
+		am_search_add_text(ptr, ptr + len, pam->uid);
+	if (body != end)
+		am_search_add_text(body + 4, end, pam->uid);
+	am_search_docs++;
+	pthread_mutex_unlock(&am_search_mtx);
+}
+
+static int
+am_search_compare(const void *pa, const void *pb)
+{
+	const uint64_t a = *(const uint64_t *)pa;
+	const uint64_t b = *(const uint64_t *)pb;
+
+	return ((a > b) - (a < b));
+}
+
+static int
+am_search_is_dead(uint64_t uid)
+{
+	return (bsearch(&uid, am_search_dead, am_search_ndead,
+	    sizeof(am_search_dead[0]), &am_search_compare) != NULL);
+}
+
+/*
+ * Rewrites the list of a word without the removed messages. Returns
+ * non-zero if the list became empty.
+ */
+static int
+am_search_filter(struct am_term *pt)
+{
+	struct am_postings *old = atomic_load(&pt->post);
+	struct am_postings *pp;
+	uint64_t uid = 0;
+	uint64_t last = 0;
+	uint32_t len = atomic_load(&old->len);
+	uint32_t off;
+	uint32_t out;
+	int dead = 0;
+
+	/* most lists are not affected */
+	for (off = 0; off != len && dead == 0; ) {
+		off = am_search_decode(old->data, off, &uid);
+		dead = am_search_is_dead(uid);
+	}
+	if (dead == 0)
+		return (0);
+
+	pp = am_search_post_alloc(len);
+	if (pp == NULL)
+		return (0);
+	uid = 0;
+	for (off = out = 0; off != len; ) {
+		off = am_search_decode(old->data, off, &uid);
+		if (am_search_is_dead(uid))
+			continue;
+		out += am_search_encode(pp->data + out, uid - last);
+		last = uid;
+	}
+	atomic_store(&pp->len, out);
+	atomic_store(&pt->post, pp);
+	am_search_post_retire(old);
+	pt->last = last;
+	return (out == 0);
+}
+
+/* filters the removed messages out of the whole index */
+static void
+am_search_compact(void)
+{
+	_Atomic(struct am_term *) *pnext;
+	struct am_term *pt;
+	int x;
+
+	qsort(am_search_dead, am_search_ndead, sizeof(am_search_dead[0]),
+	    &am_search_compare);
+
+	for (x = 0; x != AM_SEARCH_BUCKETS; x++) {
+		pnext = &am_search_hash[x];
+		while ((pt = atomic_load(pnext)) != NULL) {
+			if (am_search_filter(pt) == 0) {
+				pnext = &pt->next;
+				continue;
+			}
+			/* readers still on the word see the rest of the chain */
+			atomic_store(pnext, atomic_load(&pt->next));
+			am_search_post_retire(atomic_load(&pt->post));
+			am_metrics_gauge(AM_GAUGE_SEARCH_TERMS, -1);
+			am_metrics_gauge(AM_GAUGE_SEARCH_BYTES,
+			    -(int64_t)am_pool_size(am_search_term_size(pt->len)));
+			am_epoch_retire(&pt->retire, &am_search_free_term);
+		}
+	}
+	am_search_docs -= am_search_ndead;
+	am_search_ndead = 0;
+}
+
+/*
+ * Forgets a message which was removed from the store. The index is
+ * compacted when enough messages were removed.
+ */
+void
+am_search_remove(uint64_t uid)
+{
+	uint64_t *ptr;
+	int max;
+
+	pthread_mutex_lock(&am_search_mtx);
+	if (am_search_ndead == am_search_maxdead) {
+		max = am_search_maxdead ? 2 * am_search_maxdead : AM_SEARCH_COMPACT_MIN;
+		ptr = realloc(am_search_dead, max * sizeof(ptr[0]));
+		if (ptr == NULL) {
+			/* better to compact early than to forget */
+			am_search_compact();
+		} else {
+			am_search_dead = ptr;
+			am_search_maxdead = max;
+		}
+	}
+	if (am_search_ndead != am_search_maxdead)
+		am_search_dead[am_search_ndead++] = uid;
+	if (am_search_ndead >= AM_SEARCH_COMPACT_MIN &&
+	    am_search_ndead >= am_search_docs / 4)
+		am_search_compact();
+	pthread_mutex_unlock(&am_search_mtx);
+}
+
+/*
+ * Returns the ids of the messages containing all the words of the
+ * query in increasing order, or -1 when out of memory. Ids of removed
+ * messages may be returned too. Must be called within a snapshot,
+ * which keeps the lists valid.
+ */
+int
+am_search_query(struct am_arena *pa, const char *query, uint64_t **puid)
+{
+	struct am_postings *list[AM_SEARCH_QUERY_MAX];
+	struct am_postings *pp;
+	struct am_term *pt;
+	const char *ptr = query;
+	const char *end = query + strlen(query);
+	char tok[AM_SEARCH_TOKEN_MAX];
+	uint64_t *uid;
+	uint64_t value;
+	uint32_t len[AM_SEARCH_QUERY_MAX];
+	uint32_t off;
+	size_t tlen;
+	int num = 0;
+	int count;
+	int found;
+	int x;
+	int y;
+
+	*puid = NULL;
+
+	while (num != AM_SEARCH_QUERY_MAX &&
+	    (ptr = am_search_next(ptr, end, tok, &tlen)) != NULL) {
+		pt = am_search_lookup(tok, tlen, am_search_hash_key(tok, tlen));
+		if (pt == NULL)
+			return (0);
+		pp = atomic_load(&pt->post);
+		list[num] = pp;
+		len[num] = atomic_load_explicit(&pp->len, memory_order_acquire);
+
+		/* keep the lists sorted by length, shortest first */
+		for (x = num++; x != 0 && len[x - 1] > len[x]; x--) {
+			pp = list[x];
+			list[x] = list[x - 1];
+			list[x - 1] = pp;
+			off = len[x];
+			len[x] = len[x - 1];
+			len[x - 1] = off;
+		}
+	}
+	if (num == 0)
+		return (0);
+
+	/* every id takes at least one byte */
+	uid = am_arena_alloc(pa, len[0] * sizeof(uid[0]));
+	if (uid == NULL)
+		return (-1);
+	value = 0;
+	for (off = count = 0; off != len[0]; ) {
+		off = am_search_decode(list[0]->data, off, &value);
+		uid[count++] = value;
+	}
+
+	/* intersect with the longer lists */
+	for (x = 1; x != num && count != 0; x++) {
+		value = 0;
+		off = 0;
+		for (y = found = 0; y != count; y++) {
+			while (value < uid[y] && off != len[x])
+				off = am_search_decode(list[x]->data, off, &value);
+			if (value == uid[y])
+				uid[found++] = uid[y];
+			else if (value < uid[y])
+				break;
+		}
+		count = found;
+	}
+	*puid = uid;
+	return (count);
+}
@@ -25,24 +25,76 @@
 
 #include "asteriskmail.h"
 
+static void
+smtp_hello(FILE *io, const char *line)
+{
+	/* offer STARTTLS to ESMTP clients until the session is protected */
+	if (handle_compare(line, "EHLO ") == 0 &&
+	    am_tls_enabled() && !handle_tls_active()) {
+		fprintf(io, "250-Hello %s\r\n"
+		    "250 STARTTLS\r\n", line + 5);
+	} else {
+		fprintf(io, "250 Hello %s\r\n", line + 5);
+	}
+}
+
+/* returns non-zero if any of the given messages is still stored */
+static int
+smtp_stored(const uint64_t *uid, int num)
+{
+	const struct am_snapshot *ps;
+	int x;
+
+	ps = handle_snapshot_enter();
+	for (x = 0; x != num && handle_snapshot_lookup(ps, uid[x]) == NULL; x++)
+		;
+	handle_snapshot_leave();
+	return (x != num);
+}
+
 void
 handle_smtp_connection(int fd)
 {
+	struct am_mailbox *rcpt[AM_MAILBOX_RCPT_MAX];
+	uint64_t uid[AM_MAILBOX_RCPT_MAX];
+	struct am_mailbox *mbox;
 	struct am_message *pamm = NULL;
+	struct am_message *pam;
 	union {
 		char	e_mail[ASTERISKMAIL_STRING_MAX];
 		char	buffer[128];
 	}     u;
 	const char *line;
+	struct am_arena arena;
 	FILE *io;
 	int logged_in = 0;
+	int overflow;
+	int nrcpt = 0;
+	int nstored;
+	int x;
+	uint64_t start;
+	uint64_t mask;
+	uint64_t fp;
 
-	io = fdopen(fd, "r+");
+	am_metrics_count(AM_CNT_SMTP_CONNECTIONS, 1);
+	AM_TRACE_SESSION("smtp");
+
+	am_arena_init(&arena);
+
+	io = handle_fdopen(fd, AM_PROTO_SMTP, &arena);
 	if (io == NULL)
 		goto done;
 
+	/* a replica only stores what its primary sends */
+	if (am_read_only) {
+		fprintf(io, "421 %s Read-only replica, try again later\r\n", hostname);
+		handle_flush(io);
+		goto done;
+	}
+
 	fprintf(io, "220 %s ESMTP AsteriskMail v1.0\r\n", hostname);
-	fflush(io);
+	if (handle_flush(io) != 0)
+		goto done;
 
 	pamm = handle_create_message();
 	if (pamm == NULL)
@@ -56,36 +108,75 @@ handle_smtp_connection(int fd)
 	    handle_compare(line, "EHLO ") != 0)
 		goto done;
 
-	fprintf(io, "250 Hello %s\r\n", line + 5);
+	smtp_hello(io, line);
 
 	while (1) {
-		fflush(io);
+		if (handle_flush(io) != 0)
+			goto done;
 		line = handle_read_line(io);
+		AM_TRACE_BEGIN(dispatch);
 		if (line == NULL) {
 			goto done;
+		} else if (handle_compare(line, "HELO ") == 0 ||
+		    handle_compare(line, "EHLO ") == 0) {
+			smtp_hello(io, line);
+		} else if (handle_compare(line, "STARTTLS") == 0) {
+			if (!am_tls_enabled() || handle_tls_active()) {
+				fprintf(io, "454 TLS not available\r\n");
+			} else {
+				fprintf(io, "220 Ready to start TLS\r\n");
+				if (handle_flush(io) != 0 ||
+				    handle_starttls(io) != 0)
+					goto done;
+			}
 		} else if (handle_compare(line, "MAIL FROM:") == 0) {
-			fprintf(io, "250 Ok\r\n");
+			/* ask the sender to back off when the store is full */
+			if (handle_store_check(sizeof(*pamm)) != 0)
+				fprintf(io, "452 Insufficient system storage\r\n");
+			else
+				fprintf(io, "250 Ok\r\n");
 		} else if (handle_compare(line, "RCPT TO:") == 0) {
+			/* unknown recipients go to the default mailbox */
+			mbox = am_mailbox_route(line + 8);
+			if (mbox == NULL)
+				mbox = am_mailbox_default();
+			for (x = 0; x != nrcpt && rcpt[x] != mbox; x++)
+				;
 			snprintf(u.e_mail, sizeof(u.e_mail), "<localhost@%s>", hostname);
-			if (strcmp(line + 8, u.e_mail) == 0) {
+			if (x == AM_MAILBOX_RCPT_MAX) {
+				fprintf(io, "452 Too many recipients\r\n");
+			} else if (mbox != am_mailbox_default() ||
+			    strcmp(line + 8, u.e_mail) == 0) {
 				fprintf(io, "250 Ok\r\n");
 			} else {
 				fprintf(io, "251 User not local\r\n");
 			}
+			if (x == nrcpt && x != AM_MAILBOX_RCPT_MAX)
+				rcpt[nrcpt++] = mbox;
 		} else if (handle_compare(line, "DATA") == 0) {
 			fprintf(io, "354 End data with <CR><LF>.<CR><LF>\r\n");
-			fflush(io);
+			if (handle_flush(io) != 0)
+				goto done;
+			start = am_metrics_now();
+			AM_TRACE_BEGIN(append);
 			if (fread(u.buffer, 1, 5, io) != 5)
 				goto done;
+			overflow = 0;
 			while (1) {
 				if (u.buffer[0] == '\r' && u.buffer[1] == '\n' &&
 				    u.buffer[2] == '.' && u.buffer[3] == '\r' &&
 				    u.buffer[4] == '\n')
 					break;
 
-				if (u.buffer[0] != 0 &&
-				    handle_append_message(pamm, u.buffer[0]) != 0)
+				if (u.buffer[0] == 0 || overflow != 0) {
+					/* skip */
+				} else if (am_store_max_bytes != 0 &&
+				    (uint64_t)pamm->bytes >= am_store_max_bytes) {
+					/* consume the rest of the message */
+					overflow = 1;
+				} else if (handle_append_message(pamm, u.buffer[0]) != 0) {
 					goto done;
+				}
 
 				u.buffer[0] = u.buffer[1];
 				u.buffer[1] = u.buffer[2];
@@ -94,14 +185,65 @@ handle_smtp_connection(int fd)
 				if (fread(u.buffer + 4, 1, 1, io) != 1)
 					goto done;
 			}
+			AM_TRACE_END(AM_TRACE_APPEND, append);
+			am_metrics_count(AM_CNT_BYTES_RECEIVED, pamm->bytes);
+			if (overflow != 0) {
+				am_metrics_count(AM_CNT_MESSAGES_REJECTED, 1);
+				fprintf(io, "552 Message exceeds storage allocation\r\n");
+				break;
+			}
 			/* zero terminate message */
 			if (handle_append_message(pamm, 0) != 0)
 				goto done;
 			/* import GSM characters */
 			handle_import(pamm);
-			/* store message */
-			handle_insert_message(pamm);
+			if (nrcpt == 0)
+				rcpt[nrcpt++] = am_mailbox_default();
+			/* a message delivered again is acknowledged and dropped */
+			for (mask = 0, x = 0; x != nrcpt; x++)
+				mask |= 1ULL << rcpt[x]->id;
+			fp = am_dedup_hash(pamm, mask);
+			if (fp != 0 && am_dedup_check(fp) != 0) {
+				am_metrics_count(AM_CNT_MESSAGES_DUPLICATE, 1);
+				fprintf(io, "250 Ok\r\n");
+				break;
+			}
+			/* store one copy per mailbox, the ids are valid while in the epoch */
+			nstored = 0;
+			am_epoch_enter();
+			for (x = nrcpt - 1; x != -1; x--) {
+				pam = (x == 0) ? pamm : handle_copy_message(pamm);
+				if (pam == NULL)
+					break;
+				pam->mbox = rcpt[x];
+				if (handle_insert_message(pam) != 0) {
+					if (pam != pamm)
+						handle_delete_message(pam);
+					break;
+				}
+				/* the ids are increasing */
+				uid[nstored++] = pam->uid;
+			}
+			am_epoch_leave();
+			if (x != -1) {
+				/* all or nothing, the client sends the message again */
+				handle_remove_messages(uid, nstored);
+				/* let the retry through, unless a copy could not be removed */
+				if (fp != 0 && smtp_stored(uid, nstored) == 0)
+					am_dedup_forget(fp);
+				am_metrics_count(AM_CNT_MESSAGES_REJECTED, 1);
+				fprintf(io, "452 Insufficient system storage\r\n");
+				break;
+			}
+			/* the copies were stored from the last recipient on */
+			for (x = 0; x != nstored; x++) {
+				atomic_fetch_add_explicit(&rcpt[nrcpt - 1 - x]->received, 1,
+				    memory_order_relaxed);
+				am_webhook_post(uid[x]);
+			}
 			pamm = NULL;
+			am_metrics_count(AM_CNT_MESSAGES_RECEIVED, 1);
+			am_metrics_observe(AM_HIST_SMTP_DATA, start);
 			fprintf(io, "250 Ok\r\n");
 			break;
 		} else if (handle_compare(line, "QUIT") == 0) {
@@ -109,11 +251,14 @@ handle_smtp_connection(int fd)
 		} else {
 			fprintf(io, "502 Command not implemented\r\n");
 		}
+		AM_TRACE_END(AM_TRACE_DISPATCH, dispatch);
 	}
 
 	while (1) {
-		fflush(io);
+		if (handle_flush(io) != 0)
+			goto done;
 		line = handle_read_line(io);
+		AM_TRACE_BEGIN(dispatch);
 		if (line == NULL) {
 			goto done;
 		} else if (handle_compare(line, "QUIT") == 0) {
@@ -121,11 +266,12 @@ handle_smtp_connection(int fd)
 		} else {
 			fprintf(io, "502 Command not implemented\r\n");
 		}
+		AM_TRACE_END(AM_TRACE_DISPATCH, dispatch);
 	}
 
 done:
-	if (io != NULL)
-		fclose(io);
+	handle_close(io, fd);
 	if (pamm != NULL)
 		handle_delete_message(pamm);
+	am_arena_free(&arena);
 }
@@ -0,0 +1,328 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Session timeouts. A single thread drives a two level timer wheel
+ * with AM_TIMER_TICK_MS resolution. Sessions only record the tick of
+ * their last state change, and the wheel computes the real deadline
+ * lazily when a slot expires, re-inserting the session if it is not
+ * due yet. A session is looked at again at least once per shortest
+ * state limit, so a change to a state with a shorter limit is never
+ * missed. Expired sessions get their socket shut down, which makes any
+ * blocking read or write return at once.
+ *
+ * A session is idle while it waits for a command line, and runs a
+ * command from the moment a line is received until it asks for the
+ * next one. Each state, and the session as a whole, has its own
+ * limit per protocol.
+ */
+
+#include <time.h>
+
+#include "asteriskmail.h"
+
+#define	AM_TIMER_WHEEL 256		/* slots per level */
+
+struct am_timer {
+	TAILQ_ENTRY(am_timer) entry;
+	struct am_timer_head *head;
+	int	fd;
+	int	proto;
+	uint32_t start;
+	_Atomic uint32_t last;		/* tick of last state change */
+	_Atomic int command;		/* set while running a command */
+};
+
+TAILQ_HEAD(am_timer_head, am_timer);
+
+struct am_timeout am_timeout[AM_PROTO_MAX] = {
+	[AM_PROTO_SMTP] = { .idle = 300, .command = 600, .session = 3600 },
+	[AM_PROTO_POP3] = { .idle = 600, .command = 600, .session = 3600 },
+	[AM_PROTO_HTTPD] = { .idle = 10, .command = 300, .session = 600 },
+	[AM_PROTO_IMAP] = { .idle = 1800, .command = 600, .session = 86400 },
+};
+
+static struct am_timer_head am_timer_wheel[2][AM_TIMER_WHEEL];
+static pthread_mutex_t am_timer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic uint32_t am_timer_ticks;
+static int am_timer_running;
+static __thread struct am_timer am_timer_self;
+static __thread struct am_timer *am_timer_curr;
+
+static uint32_t
+am_timer_sec(uint32_t sec)
+{
+	return (sec * (1000 / AM_TIMER_TICK_MS));
+}
+
+static uint32_t
+am_timer_deadline(const struct am_timer *pt)
+{
+	const struct am_timeout *pto = &am_timeout[pt->proto];
+	uint32_t deadline;
+	uint32_t limit;
+
+	/* round up, so that no session gets less than its limit */
+	deadline = pt->start + am_timer_sec(pto->session) + 1;
+	if (atomic_load_explicit(&pt->command, memory_order_relaxed))
+		limit = pto->command;
+	else
+		limit = pto->idle;
+	limit = atomic_load_explicit(&pt->last, memory_order_relaxed) +
+	    am_timer_sec(limit) + 1;
+
+	/* the tick counter wraps */
+	if ((int32_t)(limit - deadline) < 0)
+		deadline = limit;
+	return (deadline);
+}
+
+/*
+ * Returns the tick at which the wheel looks at the session again. A
+ * change of state can move the deadline closer, so that is never later
+ * than the shorter of the idle and command limits from now.
+ */
+static uint32_t
+am_timer_wake(const struct am_timer *pt, uint32_t now)
+{
+	const struct am_timeout *pto = &am_timeout[pt->proto];
+	uint32_t deadline = am_timer_deadline(pt);
+	uint32_t limit;
+
+	limit = (pto->idle < pto->command) ? pto->idle : pto->command;
+	limit = now + am_timer_sec(limit) + 1;
+	if ((int32_t)(limit - deadline) < 0)
+		deadline = limit;
+	return (deadline);
+}
+
+/* must be called with the wheel locked */
+static void
+am_timer_insert(struct am_timer *pt, uint32_t deadline, uint32_t now)
+{
+	uint32_t delta = deadline - now;
+
+	if ((int32_t)delta <= 0) {
+		deadline = now + 1;
+		pt->head = &am_timer_wheel[0][deadline % AM_TIMER_WHEEL];
+	} else if (delta < AM_TIMER_WHEEL) {
+		pt->head = &am_timer_wheel[0][deadline % AM_TIMER_WHEEL];
+	} else {
+		/* too far away, will be looked at again later */
+		if (delta >= AM_TIMER_WHEEL * (AM_TIMER_WHEEL - 1))
+			deadline = now + AM_TIMER_WHEEL * (AM_TIMER_WHEEL - 1);
+		pt->head = &am_timer_wheel[1][(deadline / AM_TIMER_WHEEL) % AM_TIMER_WHEEL];
+	}
+	TAILQ_INSERT_TAIL(pt->head, pt, entry);
+}
+
+/* must be called with the wheel locked */
+static void
+am_timer_run(struct am_timer_head *head, uint32_t now)
+{
+	struct am_timer_head expired;
+	struct am_timer *pt;
+	uint32_t deadline;
+
+	/* take the whole slot at once */
+	TAILQ_INIT(&expired);
+	TAILQ_CONCAT(&expired, head, entry);
+
+	while ((pt = TAILQ_FIRST(&expired)) != NULL) {
+		TAILQ_REMOVE(&expired, pt, entry);
+		deadline = am_timer_deadline(pt);
+		if ((int32_t)(deadline - now) > 0) {
+			am_timer_insert(pt, am_timer_wake(pt, now), now);
+			continue;
+		}
+		pt->head = NULL;
+		shutdown(pt->fd, SHUT_RDWR);
+		am_metrics_count(AM_CNT_SESSIONS_TIMED_OUT, 1);
+	}
+}
+
+static uint32_t
+am_timer_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * (1000 / AM_TIMER_TICK_MS) +
+	    ts.tv_nsec / (AM_TIMER_TICK_MS * 1000000));
+}
+
+static void *
+am_timer_thread(void *arg)
+{
+	const struct timespec ts = { .tv_nsec = AM_TIMER_TICK_MS * 1000000 };
+	uint32_t target;
+	uint32_t now;
+
+	while (1) {
+		nanosleep(&ts, NULL);
+
+		/* catch up if the thread was not scheduled in time */
+		target = am_timer_clock();
+
+		pthread_mutex_lock(&am_timer_mtx);
+		now = atomic_load(&am_timer_ticks);
+		while (now != target) {
+			now++;
+			atomic_store_explicit(&am_timer_ticks, now, memory_order_relaxed);
+			if ((now % AM_TIMER_WHEEL) == 0) {
+				am_timer_run(&am_timer_wheel[1][(now / AM_TIMER_WHEEL) %
+				    AM_TIMER_WHEEL], now);
+			}
+			am_timer_run(&am_timer_wheel[0][now % AM_TIMER_WHEEL], now);
+		}
+		pthread_mutex_unlock(&am_timer_mtx);
+	}
+	return (NULL);
+}
+
+int
+am_timer_init(void)
+{
+	pthread_t td;
+	int x;
+	int y;
+
+	for (x = 0; x != 2; x++) {
+		for (y = 0; y != AM_TIMER_WHEEL; y++)
+			TAILQ_INIT(&am_timer_wheel[x][y]);
+	}
+	atomic_store(&am_timer_ticks, am_timer_clock());
+
+	if (pthread_create(&td, NULL, &am_timer_thread, NULL) != 0)
+		return (errno);
+	pthread_detach(td);
+	am_timer_running = 1;
+	return (0);
+}
+
+/* start the timeouts of the session served by the current thread */
+void
+am_timer_start(int fd, int proto)
+{
+	struct am_timer *pt = &am_timer_self;
+	uint32_t now;
+
+	if (am_timer_running == 0 || am_timer_curr != NULL)
+		return;
+
+	now = atomic_load_explicit(&am_timer_ticks, memory_order_relaxed);
+	pt->fd = fd;
+	pt->proto = proto;
+	pt->start = now;
+	atomic_store_explicit(&pt->last, now, memory_order_relaxed);
+	atomic_store_explicit(&pt->command, 0, memory_order_relaxed);
+
+	pthread_mutex_lock(&am_timer_mtx);
+	am_timer_insert(pt, am_timer_wake(pt, now), now);
+	pthread_mutex_unlock(&am_timer_mtx);
+
+	am_timer_curr = pt;
+}
+
+/* must be called before the socket is closed */
+void
+am_timer_stop(void)
+{
+	struct am_timer *pt = am_timer_curr;
+
+	if (pt == NULL)
+		return;
+
+	pthread_mutex_lock(&am_timer_mtx);
+	if (pt->head != NULL) {
+		TAILQ_REMOVE(pt->head, pt, entry);
+		pt->head = NULL;
+	}
+	pthread_mutex_unlock(&am_timer_mtx);
+
+	am_timer_curr = NULL;
+}
+
+/* shut down all sessions at once, their threads end them as usual */
+void
+am_timer_expire(void)
+{
+	struct am_timer *pt;
+	int x;
+	int y;
+
+	pthread_mutex_lock(&am_timer_mtx);
+	for (x = 0; x != 2; x++) {
+		for (y = 0; y != AM_TIMER_WHEEL; y++) {
+			while ((pt = TAILQ_FIRST(&am_timer_wheel[x][y])) != NULL) {
+				TAILQ_REMOVE(&am_timer_wheel[x][y], pt, entry);
+				pt->head = NULL;
+				shutdown(pt->fd, SHUT_RDWR);
+			}
+		}
+	}
+	pthread_mutex_unlock(&am_timer_mtx);
+}
+
+/* the session waits for a command, or starts running one */
+void
+am_timer_command(int command)
+{
+	struct am_timer *pt = am_timer_curr;
+
+	if (pt == NULL)
+		return;
+	atomic_store_explicit(&pt->last, atomic_load_explicit(&am_timer_ticks,
+	    memory_order_relaxed), memory_order_relaxed);
+	atomic_store_explicit(&pt->command, command, memory_order_relaxed);
+}
+
+int
+am_timer_parse(const char *str)
+{
+	struct am_timeout to;
+	char proto[8];
+	int x;
+
+	if (sscanf(str, "%7[a-z0-9]:%u:%u:%u", proto, &to.idle, &to.command,
+	    &to.session) != 4 || to.idle == 0 || to.command == 0 ||
+	    to.session == 0)
+		return (EINVAL);
+
+	if (strcmp(proto, "smtp") == 0)
+		x = AM_PROTO_SMTP;
+	else if (strcmp(proto, "pop3") == 0)
+		x = AM_PROTO_POP3;
+	else if (strcmp(proto, "http") == 0)
+		x = AM_PROTO_HTTPD;
+	else if (strcmp(proto, "imap") == 0)
+		x = AM_PROTO_IMAP;
+	else
+		return (EINVAL);
+
+	am_timeout[x] = to;
+	return (0);
+}
@@ -0,0 +1,101 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * TLS support. All connections share one server context, so that
+ * session tickets and the session cache let clients which reconnect
+ * often do abbreviated handshakes. Records are encrypted in user space
+ * by SSL_write(), because message bodies live in the message store and
+ * not in files which SSL_sendfile() could hand to kernel TLS.
+ */
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "asteriskmail.h"
+
+static SSL_CTX *am_tls_ctx;
+
+int am_tls_https;
+
+int
+am_tls_init(const char *cert, const char *key)
+{
+	static const unsigned char sid_ctx[] = "asteriskmail";
+	SSL_CTX *ctx;
+
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == NULL)
+		return (ENOMEM);
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(ctx) != 1) {
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(ctx);
+		return (EINVAL);
+	}
+
+	/* resumption, by session id and by ticket */
+	SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, AM_TLS_SESSION_CACHE);
+	SSL_CTX_set_timeout(ctx, AM_TLS_SESSION_TIMEOUT);
+	SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+	SSL_CTX_set_num_tickets(ctx, 1);
+
+	am_tls_ctx = ctx;
+	return (0);
+}
+
+int
+am_tls_enabled(void)
+{
+	return (am_tls_ctx != NULL);
+}
+
+/* run the server side of a TLS handshake on the given socket */
+void *
+am_tls_accept(int fd)
+{
+	uint64_t start = am_metrics_now();
+	SSL *ssl;
+
+	ssl = SSL_new(am_tls_ctx);
+	if (ssl == NULL)
+		return (NULL);
+	if (SSL_set_fd(ssl, fd) != 1 || SSL_accept(ssl) != 1) {
+		am_metrics_count(AM_CNT_TLS_FAILED, 1);
+		SSL_free(ssl);
+		return (NULL);
+	}
+	am_metrics_count(SSL_session_reused(ssl) ?
+	    AM_CNT_TLS_RESUMED : AM_CNT_TLS_FULL, 1);
+	am_metrics_observe(AM_HIST_TLS_HANDSHAKE, start);
+	return (ssl);
+}
@@ -0,0 +1,215 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Hot-path tracing. This file is only built when the WITH_TRACE make
+ * variable is set. Each session thread records its spans into a ring
+ * buffer of its own, without any locking. When the session ends, the
+ * ring is copied into the list of the most recent ones, so that they
+ * can be dumped as Chrome trace JSON from the HTTP listener.
+ */
+
+#include <sys/sysctl.h>
+#include <time.h>
+
+#if defined(__amd64__) || defined(__i386__)
+#include <machine/cpufunc.h>
+#endif
+
+#include "asteriskmail.h"
+
+#define	AM_TRACE_EVENTS 1024		/* must be power of two */
+#define	AM_TRACE_RINGS 8
+
+struct am_trace_event {
+	uint64_t start;
+	uint64_t end;
+	int	id;
+};
+
+struct am_trace_ring {
+	const char *proto;
+	uint32_t session;
+	uint32_t head;
+	struct am_trace_event event[AM_TRACE_EVENTS];
+};
+
+/* rings of ended sessions, protected by am_trace_mtx */
+static pthread_mutex_t am_trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct am_trace_ring am_trace_ring[AM_TRACE_RINGS];
+static uint32_t am_trace_next;
+static __thread struct am_trace_ring am_trace_self;
+static __thread struct am_trace_ring *am_trace_curr;
+static _Atomic uint32_t am_trace_session_id;
+static uint64_t am_trace_tsc_freq;
+
+static const char *am_trace_name[AM_TRACE_MAX] = {
+	[AM_TRACE_READ_LINE] = "handle_read_line",
+	[AM_TRACE_DISPATCH] = "dispatch",
+	[AM_TRACE_APPEND] = "handle_append_message",
+	[AM_TRACE_IMPORT] = "handle_import",
+	[AM_TRACE_BASE64] = "base64_get_utf8",
+	[AM_TRACE_WRITE] = "write",
+};
+
+void
+am_trace_init(void)
+{
+#if defined(__amd64__) || defined(__i386__)
+	uint64_t freq = 0;
+	int invariant = 0;
+	size_t len;
+
+	/* only use the TSC when it is invariant */
+	len = sizeof(invariant);
+	if (sysctlbyname("kern.timecounter.invariant_tsc",
+	    &invariant, &len, NULL, 0) != 0 || invariant == 0)
+		return;
+	len = sizeof(freq);
+	if (sysctlbyname("machdep.tsc_freq", &freq, &len, NULL, 0) != 0)
+		return;
+	am_trace_tsc_freq = freq;
+#endif
+}
+
+uint64_t
+am_trace_now(void)
+{
+	struct timespec ts;
+
+#if defined(__amd64__) || defined(__i386__)
+	if (am_trace_tsc_freq != 0)
+		return (rdtsc());
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+void
+am_trace_session(const char *proto)
+{
+	struct am_trace_ring *ptr = &am_trace_self;
+
+	ptr->proto = proto;
+	ptr->session = am_trace_session_id++;
+	ptr->head = 0;
+
+	am_trace_curr = ptr;
+}
+
+/* publish the ring of the session served by the current thread */
+void
+am_trace_session_end(void)
+{
+	struct am_trace_ring *ptr = am_trace_curr;
+	struct am_trace_ring *dst;
+	uint32_t num;
+
+	if (ptr == NULL)
+		return;
+	num = (ptr->head < AM_TRACE_EVENTS) ? ptr->head : AM_TRACE_EVENTS;
+
+	pthread_mutex_lock(&am_trace_mtx);
+	dst = &am_trace_ring[am_trace_next++ % AM_TRACE_RINGS];
+	dst->proto = ptr->proto;
+	dst->session = ptr->session;
+	dst->head = ptr->head;
+	memcpy(dst->event, ptr->event, num * sizeof(ptr->event[0]));
+	pthread_mutex_unlock(&am_trace_mtx);
+
+	am_trace_curr = NULL;
+}
+
+void
+am_trace_record(int id, uint64_t start)
+{
+	struct am_trace_ring *ptr = am_trace_curr;
+	struct am_trace_event *pev;
+
+	if (ptr == NULL)
+		return;
+	pev = &ptr->event[ptr->head++ & (AM_TRACE_EVENTS - 1)];
+	pev->start = start;
+	pev->end = am_trace_now();
+	pev->id = id;
+}
+
+static double
+am_trace_usec(uint64_t value)
+{
+	if (am_trace_tsc_freq != 0)
+		return ((double)value * 1000000.0 / (double)am_trace_tsc_freq);
+	return ((double)value / 1000.0);
+}
+
+void
+am_trace_print(FILE *io)
+{
+	struct am_trace_ring *ring;
+	struct am_trace_ring *ptr;
+	struct am_trace_event *pev;
+	uint32_t first;
+	uint32_t x;
+	int y;
+	int comma = 0;
+
+	/* a slow client must not hold up the sessions which are ending */
+	ring = malloc(sizeof(am_trace_ring));
+	if (ring == NULL) {
+		fprintf(io, "{\"traceEvents\":[]}\n");
+		return;
+	}
+	pthread_mutex_lock(&am_trace_mtx);
+	memcpy(ring, am_trace_ring, sizeof(am_trace_ring));
+	pthread_mutex_unlock(&am_trace_mtx);
+
+	fprintf(io, "{\"traceEvents\":[");
+
+	for (y = 0; y != AM_TRACE_RINGS; y++) {
+		ptr = &ring[y];
+		if (ptr->proto == NULL)
+			continue;
+
+		fprintf(io, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		    "\"tid\":%u,\"args\":{\"name\":\"%s #%u\"}}",
+		    comma ? "," : "", ptr->session, ptr->proto, ptr->session);
+		comma = 1;
+
+		first = 0;
+		if (ptr->head > AM_TRACE_EVENTS)
+			first = ptr->head - AM_TRACE_EVENTS;
+
+		for (x = first; x != ptr->head; x++) {
+			pev = &ptr->event[x & (AM_TRACE_EVENTS - 1)];
+			fprintf(io, ",{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+			    "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+			    am_trace_name[pev->id], ptr->session,
+			    am_trace_usec(pev->start),
+			    am_trace_usec(pev->end - pev->start));
+		}
+	}
+	fprintf(io, "]}\n");
+	free(ring);
+}
@@ -0,0 +1,678 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Zero downtime upgrade. On SIGUSR2 the running daemon starts a new
+ * instance of its own binary with the same arguments, and talks to it
+ * over a socket pair whose descriptor is given in the environment.
+ *
+ * The old instance first passes its listening sockets with SCM_RIGHTS,
+ * so that no connection is ever refused, and then the message store as
+ * a stream of binary records, ending with an END record. The new
+ * instance acknowledges with a single byte once it has loaded the
+ * store, and starts accepting. The old instance then stops accepting
+ * and lets its sessions run to completion, closing those still running
+ * after AM_UPGRADE_DRAIN seconds. Until the last one is done, it
+ * forwards every message stored and every batch of messages removed to
+ * the new instance, which applies them to its own store. Messages
+ * stored after the snapshot get a new unique id in the new instance,
+ * and removals are translated accordingly. The changes are queued with
+ * the store locked and sent by a thread of their own, so that a slow
+ * new instance never holds up the store.
+ */
+
+#include <spawn.h>
+
+#include "asteriskmail.h"
+
+#define	AM_UPGRADE_ENV "ASTERISKMAIL_UPGRADE_FD"
+#define	AM_UPGRADE_MAGIC 0x414d5550U	/* "AMUP" */
+
+enum {
+	AM_UPGRADE_LISTEN,		/* listener counts, with descriptors */
+	AM_UPGRADE_MESSAGE,		/* one stored message */
+	AM_UPGRADE_REMOVE,		/* unique ids of removed messages */
+	AM_UPGRADE_END,			/* end of the store snapshot */
+};
+
+struct am_upgrade_rec {
+	uint32_t magic;
+	uint32_t type;
+	uint32_t length;		/* bytes of data following */
+	uint32_t flags;			/* message flags, mailbox in the upper half */
+	uint64_t uid;
+};
+
+/* a change waiting to be forwarded */
+struct am_upgrade_entry {
+	struct am_upgrade_entry *next;
+	struct am_upgrade_rec rec;
+	uint8_t	data[];
+};
+
+struct am_upgrade_map {
+	uint64_t old;
+	uint64_t new;
+};
+
+extern char **environ;
+
+/* state of the sending side, the queue is protected by am_upgrade_mtx */
+static pthread_mutex_t am_upgrade_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t am_upgrade_cv = PTHREAD_COND_INITIALIZER;
+static struct am_upgrade_entry *am_upgrade_head;
+static struct am_upgrade_entry **am_upgrade_tail = &am_upgrade_head;
+static size_t am_upgrade_queued;
+static _Atomic int am_upgrade_active;
+static int am_upgrade_stopping;
+static int am_upgrade_failed;
+static int am_upgrade_running;
+static pthread_t am_upgrade_td;
+
+/* state of the receiving side, only used by one thread at a time */
+static uint64_t am_upgrade_last;	/* last id of the snapshot */
+static struct am_upgrade_map *am_upgrade_map;
+static int am_upgrade_count;
+static int am_upgrade_max;
+
+static int
+am_upgrade_write(int fd, const void *ptr, size_t len)
+{
+	ssize_t retval;
+
+	while (len != 0) {
+		retval = send(fd, ptr, len, MSG_NOSIGNAL);
+		if (retval < 0) {
+			if (errno == EINTR)
+				continue;
+			return (1);
+		}
+		ptr = (const uint8_t *)ptr + retval;
+		len -= retval;
+	}
+	return (0);
+}
+
+static int
+am_upgrade_read(int fd, void *ptr, size_t len)
+{
+	ssize_t retval;
+
+	while (len != 0) {
+		retval = read(fd, ptr, len);
+		if (retval < 0) {
+			if (errno == EINTR)
+				continue;
+			return (1);
+		}
+		if (retval == 0)
+			return (1);
+		ptr = (uint8_t *)ptr + retval;
+		len -= retval;
+	}
+	return (0);
+}
+
+static int
+am_upgrade_send(int fd, int type, uint64_t uid, int flags, const void *data, uint32_t len)
+{
+	struct am_upgrade_rec rec = {
+		.magic = AM_UPGRADE_MAGIC,
+		.type = type,
+		.length = len,
+		.flags = flags,
+		.uid = uid,
+	};
+
+	return (am_upgrade_write(fd, &rec, sizeof(rec)) ||
+	    am_upgrade_write(fd, data, len));
+}
+
+int
+am_upgrade_message(int fd, const struct am_message *pam)
+{
+	void *data = atomic_load(&pam->data);
+	void *copy = NULL;
+	int retval;
+
+	/* the new instance gets the raw data */
+	if ((uintptr_t)data & AM_COLD_TAG) {
+		data = copy = am_cold_copy(pam, data);
+		if (data == NULL)
+			return (1);
+	}
+	retval = am_upgrade_send(fd, AM_UPGRADE_MESSAGE, pam->uid,
+	    (pam->flags & AM_MSG_DELIVERED) | (pam->mbox->id << 16),
+	    data, pam->bytes);
+	free(copy);
+	return (retval);
+}
+
+int
+am_upgrade_end(int fd)
+{
+	/* replicas only catch up on the new instance, see replica.c */
+	return (am_upgrade_send(fd, AM_UPGRADE_END, am_replica_id, 0, NULL, 0));
+}
+
+/*
+ * Queue one change for the new instance. Called with the store locked,
+ * so that the changes are queued in the order they were made.
+ */
+static void
+am_upgrade_queue(uint32_t type, uint64_t uid, uint32_t flags, const void *data, uint32_t len)
+{
+	struct am_upgrade_entry *pe;
+
+	pe = malloc(sizeof(*pe) + len);
+	if (pe != NULL && len != 0)
+		memcpy(pe->data, data, len);
+
+	pthread_mutex_lock(&am_upgrade_mtx);
+	if (am_upgrade_active == 0) {
+		pthread_mutex_unlock(&am_upgrade_mtx);
+		free(pe);
+		return;
+	}
+	if (pe == NULL || am_upgrade_queued + sizeof(*pe) + len > AM_UPGRADE_QUEUE_MAX) {
+		/* the new instance would miss this change, stop forwarding */
+		am_upgrade_active = 0;
+		am_upgrade_failed = 1;
+		pthread_cond_signal(&am_upgrade_cv);
+		pthread_mutex_unlock(&am_upgrade_mtx);
+		free(pe);
+		return;
+	}
+	pe->rec.magic = AM_UPGRADE_MAGIC;
+	pe->rec.type = type;
+	pe->rec.length = len;
+	pe->rec.flags = flags;
+	pe->rec.uid = uid;
+	pe->next = NULL;
+	*am_upgrade_tail = pe;
+	am_upgrade_tail = &pe->next;
+	am_upgrade_queued += sizeof(*pe) + len;
+	/* the sender takes the whole queue, wake it up only once */
+	if (am_upgrade_head == pe)
+		pthread_cond_signal(&am_upgrade_cv);
+	pthread_mutex_unlock(&am_upgrade_mtx);
+}
+
+void
+am_upgrade_queue_message(const struct am_message *pam)
+{
+	void *data;
+	void *copy = NULL;
+
+	if (atomic_load_explicit(&am_upgrade_active, memory_order_relaxed) == 0)
+		return;
+
+	data = atomic_load(&pam->data);
+	if ((uintptr_t)data & AM_COLD_TAG) {
+		data = copy = am_cold_copy(pam, data);
+		if (data == NULL)
+			return;
+	}
+	am_upgrade_queue(AM_UPGRADE_MESSAGE, pam->uid,
+	    (pam->flags & AM_MSG_DELIVERED) | (pam->mbox->id << 16),
+	    data, pam->bytes);
+	free(copy);
+}
+
+void
+am_upgrade_queue_remove(const uint64_t *uid, int num)
+{
+	if (atomic_load_explicit(&am_upgrade_active, memory_order_relaxed) == 0 ||
+	    num == 0)
+		return;
+
+	am_upgrade_queue(AM_UPGRADE_REMOVE, 0, 0, uid, num * sizeof(uid[0]));
+}
+
+/*
+ * Start queueing changes, called with the store locked by
+ * handle_store_handoff() when it takes the snapshot.
+ */
+void
+am_upgrade_attach(void)
+{
+	pthread_mutex_lock(&am_upgrade_mtx);
+	am_upgrade_active = 1;
+	am_upgrade_stopping = 0;
+	am_upgrade_failed = 0;
+	pthread_mutex_unlock(&am_upgrade_mtx);
+}
+
+/* send the queued changes until stopped, the rest goes out first */
+static void *
+am_upgrade_forward_thread(void *arg)
+{
+	struct am_upgrade_entry *pe;
+	struct am_upgrade_entry *next;
+	int fd = (int)(intptr_t)arg;
+	int stopping;
+	int failed;
+
+	while (1) {
+		pthread_mutex_lock(&am_upgrade_mtx);
+		while (am_upgrade_head == NULL && am_upgrade_stopping == 0 &&
+		    am_upgrade_failed == 0)
+			pthread_cond_wait(&am_upgrade_cv, &am_upgrade_mtx);
+		pe = am_upgrade_head;
+		am_upgrade_head = NULL;
+		am_upgrade_tail = &am_upgrade_head;
+		am_upgrade_queued = 0;
+		stopping = am_upgrade_stopping;
+		failed = am_upgrade_failed;
+		pthread_mutex_unlock(&am_upgrade_mtx);
+
+		for (; pe != NULL; pe = next) {
+			next = pe->next;
+			if (failed == 0) {
+				failed = am_upgrade_write(fd, &pe->rec,
+				    sizeof(pe->rec) + pe->rec.length);
+			}
+			free(pe);
+		}
+		if (failed != 0) {
+			pthread_mutex_lock(&am_upgrade_mtx);
+			am_upgrade_active = 0;
+			am_upgrade_failed = 1;
+			pthread_mutex_unlock(&am_upgrade_mtx);
+			break;
+		}
+		if (stopping != 0)
+			break;
+	}
+	return (NULL);
+}
+
+/* forward the queued changes to the new instance from now on */
+int
+am_upgrade_forward(int fd)
+{
+	if (pthread_create(&am_upgrade_td, NULL, &am_upgrade_forward_thread,
+	    (void *)(intptr_t)fd) != 0)
+		return (1);
+	am_upgrade_running = 1;
+	return (0);
+}
+
+/*
+ * Stop queueing changes, and wait until the changes queued so far
+ * have been sent. Returns non-zero if the new instance missed any.
+ */
+int
+am_upgrade_detach(void)
+{
+	struct am_upgrade_entry *pe;
+	int retval;
+
+	pthread_mutex_lock(&am_upgrade_mtx);
+	am_upgrade_active = 0;
+	am_upgrade_stopping = 1;
+	pthread_cond_signal(&am_upgrade_cv);
+	pthread_mutex_unlock(&am_upgrade_mtx);
+
+	if (am_upgrade_running != 0) {
+		pthread_join(am_upgrade_td, NULL);
+		am_upgrade_running = 0;
+	}
+
+	/* left over if the thread failed or was never started */
+	pthread_mutex_lock(&am_upgrade_mtx);
+	pe = am_upgrade_head;
+	am_upgrade_head = NULL;
+	am_upgrade_tail = &am_upgrade_head;
+	am_upgrade_queued = 0;
+	retval = am_upgrade_failed;
+	pthread_mutex_unlock(&am_upgrade_mtx);
+
+	while (pe != NULL) {
+		struct am_upgrade_entry *next = pe->next;
+
+		free(pe);
+		pe = next;
+	}
+	return (retval);
+}
+
+/*
+ * Start the new instance and hand over the listening sockets. The
+ * descriptors of each protocol follow each other in "pfd", and "num"
+ * gives their count per protocol. Returns the channel to the new
+ * instance, or -1 on failure.
+ */
+int
+am_upgrade_spawn(const char *path, char **argv, const struct pollfd *pfd, const int *num)
+{
+	union {
+		struct cmsghdr hdr;
+		uint8_t	buf[CMSG_SPACE(sizeof(int) * ASTERISKMAIL_SOCK_MAX)];
+	}     cmsg;
+	struct am_upgrade_rec rec = {
+		.magic = AM_UPGRADE_MAGIC,
+		.type = AM_UPGRADE_LISTEN,
+		.length = sizeof(int) * AM_PROTO_MAX,
+	};
+	struct iovec iov[2];
+	struct msghdr msg;
+	struct cmsghdr *pc;
+	char env[64];
+	char **envp;
+	pid_t pid;
+	int sv[2];
+	int total = 0;
+	int error;
+	int x;
+
+	for (x = 0; x != AM_PROTO_MAX; x++)
+		total += num[x];
+	if (total > ASTERISKMAIL_SOCK_MAX)
+		return (-1);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+		return (-1);
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+	/* the environment, with the channel of the new instance added */
+	for (x = 0; environ[x] != NULL; x++)
+		;
+	envp = malloc((x + 2) * sizeof(envp[0]));
+	if (envp == NULL)
+		goto error;
+	snprintf(env, sizeof(env), AM_UPGRADE_ENV "=%d", sv[1]);
+	envp[0] = env;
+	for (x = 0; environ[x] != NULL; x++)
+		envp[x + 1] = environ[x];
+	envp[x + 1] = NULL;
+
+	error = posix_spawnp(&pid, path, NULL, NULL, argv, envp);
+	free(envp);
+	if (error != 0)
+		goto error;
+	close(sv[1]);
+	sv[1] = -1;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = __DECONST(int *, num);
+	iov[1].iov_len = sizeof(int) * AM_PROTO_MAX;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&cmsg, 0, sizeof(cmsg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * total);
+
+	pc = CMSG_FIRSTHDR(&msg);
+	pc->cmsg_level = SOL_SOCKET;
+	pc->cmsg_type = SCM_RIGHTS;
+	pc->cmsg_len = CMSG_LEN(sizeof(int) * total);
+	for (x = 0; x != total; x++)
+		((int *)CMSG_DATA(pc))[x] = pfd[x].fd;
+
+	if (sendmsg(sv[0], &msg, MSG_NOSIGNAL) != (ssize_t)(iov[0].iov_len + iov[1].iov_len))
+		goto error;
+	return (sv[0]);
+error:
+	close(sv[0]);
+	if (sv[1] > -1)
+		close(sv[1]);
+	return (-1);
+}
+
+/* wait until the new instance has loaded the store */
+int
+am_upgrade_wait(int fd)
+{
+	uint8_t ack;
+
+	return (am_upgrade_read(fd, &ack, 1));
+}
+
+/* returns the channel to the previous instance, if any */
+int
+am_upgrade_fd(void)
+{
+	const char *env = getenv(AM_UPGRADE_ENV);
+	int fd;
+
+	if (env == NULL)
+		return (-1);
+	fd = atoi(env);
+	unsetenv(AM_UPGRADE_ENV);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return (fd);
+}
+
+static int
+am_upgrade_map_add(uint64_t old, uint64_t new)
+{
+	struct am_upgrade_map *ptr;
+
+	if (am_upgrade_count == am_upgrade_max) {
+		am_upgrade_max = am_upgrade_max ? 2 * am_upgrade_max : 64;
+		ptr = realloc(am_upgrade_map, am_upgrade_max * sizeof(ptr[0]));
+		if (ptr == NULL)
+			return (1);
+		am_upgrade_map = ptr;
+	}
+	am_upgrade_map[am_upgrade_count].old = old;
+	am_upgrade_map[am_upgrade_count].new = new;
+	am_upgrade_count++;
+	return (0);
+}
+
+/* translate ids in place, returns the number of ids still valid */
+static int
+am_upgrade_map_translate(uint64_t *uid, int num)
+{
+	int lo;
+	int hi;
+	int mid;
+	int x;
+	int y;
+
+	for (x = y = 0; x != num; x++) {
+		if (uid[x] <= am_upgrade_last) {
+			uid[y++] = uid[x];
+			continue;
+		}
+		/* both old and new ids are increasing */
+		lo = 0;
+		hi = am_upgrade_count;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (am_upgrade_map[mid].old < uid[x])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo != am_upgrade_count && am_upgrade_map[lo].old == uid[x])
+			uid[y++] = am_upgrade_map[lo].new;
+	}
+	return (y);
+}
+
+/* read one record and apply it to the message store */
+static int
+am_upgrade_apply(int fd, int restore, int *end)
+{
+	struct am_upgrade_rec rec;
+	struct am_message *pam;
+	uint64_t *uid;
+	uint64_t new;
+
+	if (am_upgrade_read(fd, &rec, sizeof(rec)) != 0 ||
+	    rec.magic != AM_UPGRADE_MAGIC || rec.length > INT_MAX)
+		return (1);
+
+	switch (rec.type) {
+	case AM_UPGRADE_MESSAGE:
+		pam = handle_create_message();
+		if (pam == NULL)
+			return (1);
+		pam->data = am_pool_alloc(rec.length);
+		if (pam->data == NULL && rec.length != 0) {
+			handle_delete_message(pam);
+			return (1);
+		}
+		pam->bytes = rec.length;
+		pam->size = am_pool_size(rec.length);
+		if (am_upgrade_read(fd, pam->data, rec.length) != 0) {
+			handle_delete_message(pam);
+			return (1);
+		}
+		/* messages stored after the snapshot get a new id */
+		pam->uid = restore ? rec.uid : 0;
+		pam->flags = rec.flags & AM_MSG_DELIVERED;
+		/* the mailboxes are given by the same arguments */
+		pam->mbox = am_mailbox_get(rec.flags >> 16);
+		am_epoch_enter();
+		if (handle_insert_message(pam) != 0) {
+			am_epoch_leave();
+			am_metrics_count(AM_CNT_MESSAGES_REJECTED, 1);
+			handle_delete_message(pam);
+			break;
+		}
+		new = pam->uid;
+		am_epoch_leave();
+		if (restore)
+			am_upgrade_last = rec.uid;
+		else if (am_upgrade_map_add(rec.uid, new) != 0)
+			return (1);
+		break;
+	case AM_UPGRADE_REMOVE:
+		if (rec.length % sizeof(uid[0]) != 0)
+			return (1);
+		uid = malloc(rec.length);
+		if (uid == NULL)
+			return (1);
+		if (am_upgrade_read(fd, uid, rec.length) != 0) {
+			free(uid);
+			return (1);
+		}
+		handle_remove_messages(uid, am_upgrade_map_translate(uid,
+		    rec.length / sizeof(uid[0])));
+		free(uid);
+		break;
+	case AM_UPGRADE_END:
+		if (restore)
+			am_replica_id = rec.uid;
+		*end = 1;
+		break;
+	default:
+		return (1);
+	}
+	return (0);
+}
+
+/* apply what the previous instance forwards until it exits */
+static void *
+am_upgrade_loop(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	int end = 0;
+
+	while (am_upgrade_apply(fd, 0, &end) == 0)
+		;
+	close(fd);
+	free(am_upgrade_map);
+	am_upgrade_map = NULL;
+	am_upgrade_count = am_upgrade_max = 0;
+	return (NULL);
+}
+
+/*
+ * Receive the listening sockets and the message store from the
+ * previous instance. On success the descriptors of each protocol
+ * follow each other in "pfd", and "num" gives their count per
+ * protocol.
+ */
+int
+am_upgrade_receive(int fd, struct pollfd *pfd, int *num)
+{
+	union {
+		struct cmsghdr hdr;
+		uint8_t	buf[CMSG_SPACE(sizeof(int) * ASTERISKMAIL_SOCK_MAX)];
+	}     cmsg;
+	struct am_upgrade_rec rec;
+	struct iovec iov[2];
+	struct msghdr msg;
+	struct cmsghdr *pc;
+	pthread_attr_t attr;
+	pthread_t td;
+	uint8_t ack = 0;
+	int total = 0;
+	int end = 0;
+	int x;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = num;
+	iov[1].iov_len = sizeof(int) * AM_PROTO_MAX;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) !=
+	    (ssize_t)(iov[0].iov_len + iov[1].iov_len) ||
+	    rec.magic != AM_UPGRADE_MAGIC || rec.type != AM_UPGRADE_LISTEN)
+		return (1);
+
+	for (x = 0; x != AM_PROTO_MAX; x++) {
+		/* optional listeners, like IMAP, may have no sockets */
+		if (num[x] < 0 || num[x] > ASTERISKMAIL_SOCK_MAX)
+			return (1);
+		total += num[x];
+	}
+	pc = CMSG_FIRSTHDR(&msg);
+	if (total < 1 || total > ASTERISKMAIL_SOCK_MAX || pc == NULL ||
+	    pc->cmsg_level != SOL_SOCKET || pc->cmsg_type != SCM_RIGHTS ||
+	    pc->cmsg_len != CMSG_LEN(sizeof(int) * total))
+		return (1);
+	for (x = 0; x != total; x++)
+		pfd[x].fd = ((int *)CMSG_DATA(pc))[x];
+
+	while (end == 0) {
+		if (am_upgrade_apply(fd, 1, &end) != 0)
+			return (1);
+	}
+	if (am_upgrade_write(fd, &ack, 1) != 0)
+		return (1);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&td, &attr, &am_upgrade_loop, (void *)(intptr_t)fd) != 0)
+		close(fd);
+	pthread_attr_destroy(&attr);
+	return (0);
+}
@@ -0,0 +1,521 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Webhook delivery. The unique ids of messages received by SMTP are
+ * queued, and a single thread collects them for a short window and
+ * POSTs them as one JSON array to the configured URL, over a
+ * keep-alive connection. A failed batch is retried with a growing
+ * delay. The queue is bounded, and when the receiver falls behind the
+ * oldest ids are dropped. The message data is read from the store
+ * when a batch is built, so the SMTP session never waits for the
+ * receiver, and messages removed in the meantime are not posted.
+ */
+
+#include <time.h>
+
+#include "asteriskmail.h"
+
+struct am_webhook_buf {
+	char   *data;
+	size_t	len;
+	size_t	max;
+};
+
+static char am_webhook_host[ASTERISKMAIL_STRING_MAX];
+static char am_webhook_port[8];
+static char am_webhook_path[ASTERISKMAIL_STRING_MAX];
+static uint64_t am_webhook_queue[AM_WEBHOOK_QUEUE_MAX];
+static int am_webhook_head;
+static int am_webhook_count;
+static int am_webhook_busy;
+static int am_webhook_enabled;
+static pthread_mutex_t am_webhook_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t am_webhook_cv = PTHREAD_COND_INITIALIZER;
+
+unsigned am_webhook_window = AM_WEBHOOK_WINDOW_MS;
+
+/* parse http://host[:port][/path] */
+int
+am_webhook_parse(const char *url)
+{
+	const char *host;
+	const char *path;
+	const char *port;
+	size_t len;
+
+	if (strncmp(url, "http://", 7) != 0)
+		return (EINVAL);
+	host = url + 7;
+	path = strchr(host, '/');
+	if (path == NULL)
+		path = host + strlen(host);
+	if (*host == '[') {
+		/* IPv6 address literal */
+		port = memchr(host, ']', path - host);
+		if (port == NULL)
+			return (EINVAL);
+		host++;
+		len = port - host;
+		port = (port[1] == ':') ? port + 2 : NULL;
+	} else {
+		port = memchr(host, ':', path - host);
+		len = (port != NULL) ? (size_t)(port - host) : (size_t)(path - host);
+		if (port != NULL)
+			port++;
+	}
+	if (len == 0 || len >= sizeof(am_webhook_host) ||
+	    strlen(path) + 1 >= sizeof(am_webhook_path) ||
+	    (port != NULL && ((size_t)(path - port) >= sizeof(am_webhook_port) ||
+	    path == port)))
+		return (EINVAL);
+
+	memcpy(am_webhook_host, host, len);
+	am_webhook_host[len] = 0;
+	if (port != NULL) {
+		memcpy(am_webhook_port, port, path - port);
+		am_webhook_port[path - port] = 0;
+	} else {
+		strlcpy(am_webhook_port, "80", sizeof(am_webhook_port));
+	}
+	strlcpy(am_webhook_path, *path ? path : "/", sizeof(am_webhook_path));
+	am_webhook_enabled = 1;
+	return (0);
+}
+
+/* queue a stored message for delivery, never blocks on the receiver */
+void
+am_webhook_post(uint64_t uid)
+{
+	if (am_webhook_enabled == 0)
+		return;
+
+	pthread_mutex_lock(&am_webhook_mtx);
+	if (am_webhook_count == AM_WEBHOOK_QUEUE_MAX) {
+		am_webhook_head = (am_webhook_head + 1) % AM_WEBHOOK_QUEUE_MAX;
+		am_webhook_count--;
+		am_metrics_count(AM_CNT_WEBHOOK_DROPPED, 1);
+		am_metrics_gauge(AM_GAUGE_WEBHOOK_QUEUE, -1);
+	}
+	am_webhook_queue[(am_webhook_head + am_webhook_count) % AM_WEBHOOK_QUEUE_MAX] = uid;
+	if (am_webhook_count++ == 0)
+		pthread_cond_signal(&am_webhook_cv);
+	pthread_mutex_unlock(&am_webhook_mtx);
+	am_metrics_gauge(AM_GAUGE_WEBHOOK_QUEUE, 1);
+}
+
+static int
+am_webhook_reserve(struct am_webhook_buf *pb, size_t len)
+{
+	size_t max;
+	char *ptr;
+
+	if (pb->len + len <= pb->max)
+		return (0);
+	for (max = pb->max ? pb->max : ASTERISKMAIL_BUF_MAX; max < pb->len + len; max *= 2)
+		;
+	ptr = realloc(pb->data, max);
+	if (ptr == NULL)
+		return (1);
+	pb->data = ptr;
+	pb->max = max;
+	return (0);
+}
+
+static int
+am_webhook_append(struct am_webhook_buf *pb, const char *str, size_t len)
+{
+	if (am_webhook_reserve(pb, len) != 0)
+		return (1);
+	memcpy(pb->data + pb->len, str, len);
+	pb->len += len;
+	return (0);
+}
+
+/* append a JSON string, or null */
+static int
+am_webhook_string(struct am_webhook_buf *pb, const char *str, size_t len)
+{
+	static const char hex[16] = "0123456789abcdef";
+	uint8_t ch;
+	size_t x;
+
+	if (str == NULL)
+		return (am_webhook_append(pb, "null", 4));
+	if (am_webhook_reserve(pb, 6 * len + 2) != 0)
+		return (1);
+	pb->data[pb->len++] = '"';
+	for (x = 0; x != len; x++) {
+		ch = str[x];
+		if (ch == '"' || ch == '\\') {
+			pb->data[pb->len++] = '\\';
+			pb->data[pb->len++] = ch;
+		} else if (ch == '\n') {
+			pb->data[pb->len++] = '\\';
+			pb->data[pb->len++] = 'n';
+		} else if (ch == '\r') {
+			pb->data[pb->len++] = '\\';
+			pb->data[pb->len++] = 'r';
+		} else if (ch < 0x20 || ch == 0x7f) {
+			memcpy(pb->data + pb->len, "\\u00", 4);
+			pb->data[pb->len + 4] = hex[ch >> 4];
+			pb->data[pb->len + 5] = hex[ch & 15];
+			pb->len += 6;
+		} else {
+			pb->data[pb->len++] = ch;
+		}
+	}
+	pb->data[pb->len++] = '"';
+	return (0);
+}
+
+/* returns the value of a header field of a message */
+static const char *
+am_webhook_header(const char *data, size_t hlen, const char *name, size_t *plen)
+{
+	size_t nlen = strlen(name);
+	size_t x;
+	size_t y;
+
+	for (x = 0; x < hlen; x = y + 1) {
+		for (y = x; y < hlen && data[y] != '\n'; y++)
+			;
+		if (y - x <= nlen || data[x + nlen] != ':' ||
+		    strncasecmp(data + x, name, nlen) != 0)
+			continue;
+		x += nlen + 1;
+		while (x < y && data[x] == ' ')
+			x++;
+		*plen = (y > x && data[y - 1] == '\r') ? y - x - 1 : y - x;
+		return (data + x);
+	}
+	return (NULL);
+}
+
+static int
+am_webhook_message(struct am_webhook_buf *pb, const struct am_message *pam)
+{
+	static const char *field[] = { "from", "to", "subject", "date" };
+	static const char *header[] = { "From", "To", "Subject", "Date" };
+	const char *data = handle_message_data(pam);
+	const char *end;
+	const char *str;
+	char buf[64];
+	size_t bytes = pam->bytes;
+	size_t hlen;
+	size_t len = 0;
+	int retval;
+	int x;
+
+	if (data == NULL)
+		return (ENOMEM);
+	/* the zero terminator is not part of the message */
+	if (bytes != 0 && data[bytes - 1] == 0)
+		bytes--;
+	end = memmem(data, bytes, "\r\n\r\n", 4);
+	hlen = (end != NULL) ? (size_t)(end - data) + 2 : bytes;
+
+	len = snprintf(buf, sizeof(buf), "{\"uid\":%ju", (uintmax_t)pam->uid);
+	retval = am_webhook_append(pb, buf, len);
+	for (x = 0; x != 4; x++) {
+		str = am_webhook_header(data, hlen, header[x], &len);
+		retval |= am_webhook_append(pb, ",\"", 2);
+		retval |= am_webhook_append(pb, field[x], strlen(field[x]));
+		retval |= am_webhook_append(pb, "\":", 2);
+		retval |= am_webhook_string(pb, str, len);
+	}
+	retval |= am_webhook_append(pb, ",\"body\":", 8);
+	if (end != NULL)
+		retval |= am_webhook_string(pb, end + 4, data + bytes - end - 4);
+	else
+		retval |= am_webhook_string(pb, "", 0);
+	retval |= am_webhook_append(pb, "}", 1);
+	return (retval);
+}
+
+/* build the JSON array of a batch, returns the number of messages */
+static int
+am_webhook_build(struct am_webhook_buf *pb, const uint64_t *uid, int num)
+{
+	const struct am_snapshot *ps;
+	struct am_message *pam;
+	int count = 0;
+	int x;
+
+	pb->len = 0;
+	am_webhook_append(pb, "[", 1);
+
+	ps = handle_snapshot_enter();
+	for (x = 0; x != num; x++) {
+		pam = handle_snapshot_lookup(ps, uid[x]);
+		if (pam == NULL)
+			continue;
+		if (count != 0)
+			am_webhook_append(pb, ",", 1);
+		if (am_webhook_message(pb, pam) != 0) {
+			count = -1;
+			break;
+		}
+		count++;
+	}
+	handle_snapshot_leave();
+
+	if (count > 0 && am_webhook_append(pb, "]", 1) != 0)
+		count = -1;
+	return (count);
+}
+
+static FILE *
+am_webhook_connect(void)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *res0;
+	struct timeval tv = { .tv_sec = AM_WEBHOOK_TIMEOUT };
+	FILE *io;
+	int flag = 1;
+	int s = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(am_webhook_host, am_webhook_port, &hints, &res) != 0)
+		return (NULL);
+
+	for (res0 = res; res0 != NULL; res0 = res0->ai_next) {
+		s = socket(res0->ai_family, res0->ai_socktype | SOCK_CLOEXEC,
+		    res0->ai_protocol);
+		if (s < 0)
+			continue;
+		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		if (connect(s, res0->ai_addr, res0->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+
+	if (s < 0)
+		return (NULL);
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+	io = fdopen(s, "r+");
+	if (io == NULL)
+		close(s);
+	return (io);
+}
+
+/*
+ * Send one request and read the reply. Returns the HTTP status, or
+ * -1 if the connection failed. "*pkeep" is cleared when the receiver
+ * does not keep the connection open.
+ */
+static int
+am_webhook_request(FILE *io, const struct am_webhook_buf *pb, int *pkeep)
+{
+	char line[ASTERISKMAIL_LINE_MAX];
+	long length = -1;
+	long chunk;
+	int chunked = 0;
+	int status;
+	int minor;
+
+	fprintf(io, "POST %s HTTP/1.1\r\n"
+	    "Host: %s\r\n"
+	    "User-Agent: asteriskmail/1.0\r\n"
+	    "Content-Type: application/json\r\n"
+	    "Content-Length: %zu\r\n"
+	    "\r\n", am_webhook_path, am_webhook_host, pb->len);
+	if (fwrite(pb->data, 1, pb->len, io) != pb->len || fflush(io) != 0)
+		return (-1);
+
+	if (fgets(line, sizeof(line), io) == NULL ||
+	    sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2)
+		return (-1);
+	*pkeep = (minor != 0);
+
+	while (1) {
+		if (fgets(line, sizeof(line), io) == NULL)
+			return (-1);
+		if (line[0] == '\r' || line[0] == '\n')
+			break;
+		if (strncasecmp(line, "Content-Length:", 15) == 0)
+			length = strtol(line + 15, NULL, 10);
+		else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 &&
+		    strcasestr(line, "chunked") != NULL)
+			chunked = 1;
+		else if (strncasecmp(line, "Connection:", 11) == 0)
+			*pkeep = (strcasestr(line, "close") == NULL);
+	}
+
+	/* skip the reply body */
+	if (chunked) {
+		do {
+			if (fgets(line, sizeof(line), io) == NULL)
+				return (-1);
+			chunk = strtol(line, NULL, 16);
+			for (length = 0; length < chunk; length++) {
+				if (getc(io) == EOF)
+					return (-1);
+			}
+			/* the end of the chunk, or of the trailer */
+			if (fgets(line, sizeof(line), io) == NULL)
+				return (-1);
+		} while (chunk > 0);
+	} else if (length > 0) {
+		while (length-- > 0) {
+			if (getc(io) == EOF)
+				return (-1);
+		}
+	} else if (length < 0 && status != 204 && status != 304) {
+		/* the body ends with the connection */
+		while (getc(io) != EOF)
+			;
+		*pkeep = 0;
+	}
+	return (status);
+}
+
+static void *
+am_webhook_thread(void *arg)
+{
+	struct am_webhook_buf buf = {};
+	struct timespec ts;
+	uint64_t uid[AM_WEBHOOK_BATCH_MAX];
+	uint64_t start;
+	unsigned delay;
+	FILE *io = NULL;
+	int status;
+	int retry;
+	int keep;
+	int num;
+	int x;
+
+	while (1) {
+		pthread_mutex_lock(&am_webhook_mtx);
+		while (am_webhook_count == 0)
+			pthread_cond_wait(&am_webhook_cv, &am_webhook_mtx);
+
+		/* let messages arriving close together share a request */
+		if (am_webhook_count < AM_WEBHOOK_BATCH_MAX) {
+			pthread_mutex_unlock(&am_webhook_mtx);
+			ts.tv_sec = am_webhook_window / 1000;
+			ts.tv_nsec = (am_webhook_window % 1000) * 1000000L;
+			nanosleep(&ts, NULL);
+			pthread_mutex_lock(&am_webhook_mtx);
+		}
+		num = am_webhook_count;
+		if (num > AM_WEBHOOK_BATCH_MAX)
+			num = AM_WEBHOOK_BATCH_MAX;
+		for (x = 0; x != num; x++)
+			uid[x] = am_webhook_queue[(am_webhook_head + x) % AM_WEBHOOK_QUEUE_MAX];
+		am_webhook_head = (am_webhook_head + num) % AM_WEBHOOK_QUEUE_MAX;
+		am_webhook_count -= num;
+		am_webhook_busy = 1;
+		pthread_mutex_unlock(&am_webhook_mtx);
+		am_metrics_gauge(AM_GAUGE_WEBHOOK_QUEUE, -num);
+
+		num = am_webhook_build(&buf, uid, num);
+		if (num < 1)
+			goto next;
+
+		delay = AM_WEBHOOK_RETRY_MS;
+		for (retry = 0;; retry++) {
+			start = am_metrics_now();
+			status = -1;
+			keep = 0;
+			/* a kept connection may have been closed by the receiver */
+			if (io != NULL)
+				status = am_webhook_request(io, &buf, &keep);
+			if (status < 0) {
+				if (io != NULL)
+					fclose(io);
+				io = am_webhook_connect();
+				if (io != NULL)
+					status = am_webhook_request(io, &buf, &keep);
+			}
+			if (io != NULL && keep == 0) {
+				fclose(io);
+				io = NULL;
+			}
+			if (status >= 200 && status < 300) {
+				am_metrics_observe(AM_HIST_WEBHOOK_POST, start);
+				am_metrics_count(AM_CNT_WEBHOOK_POSTED, num);
+				break;
+			}
+			am_metrics_count(AM_CNT_WEBHOOK_ERRORS, 1);
+			if (retry == AM_WEBHOOK_RETRY_MAX) {
+				am_metrics_count(AM_CNT_WEBHOOK_DROPPED, num);
+				break;
+			}
+			ts.tv_sec = delay / 1000;
+			ts.tv_nsec = (delay % 1000) * 1000000L;
+			nanosleep(&ts, NULL);
+			if (delay < AM_WEBHOOK_RETRY_MS << 6)
+				delay *= 2;
+		}
+next:
+		pthread_mutex_lock(&am_webhook_mtx);
+		am_webhook_busy = 0;
+		pthread_mutex_unlock(&am_webhook_mtx);
+	}
+	return (NULL);
+}
+
+/* wait a limited time for queued messages to be posted */
+void
+am_webhook_flush(void)
+{
+	uint64_t deadline;
+	int pending;
+
+	if (am_webhook_enabled == 0)
+		return;
+	deadline = am_metrics_now() + AM_WEBHOOK_TIMEOUT * 1000000000ULL;
+	do {
+		pthread_mutex_lock(&am_webhook_mtx);
+		pending = am_webhook_count + am_webhook_busy;
+		pthread_mutex_unlock(&am_webhook_mtx);
+		if (pending == 0)
+			break;
+		usleep(AM_TIMER_TICK_MS * 1000);
+	} while (am_metrics_now() < deadline);
+}
+
+int
+am_webhook_init(void)
+{
+	pthread_t td;
+
+	if (am_webhook_enabled == 0)
+		return (0);
+	if (pthread_create(&td, NULL, &am_webhook_thread, NULL) != 0)
+		return (errno);
+	pthread_detach(td);
+	return (0);
+}